@@ -30,6 +30,9 @@ struct coremap_entry {
 				cme_last : 1,		/* is this the last of a multi-page allocation? */
 				cme_alloc: 1,		/* are we allocated? */
 				cme_wired: 1,		/* are we wired? */
+				cme_shared: 1,		/* may be mapped by several tlbs (not tracked by cme_tlb_ix) */
+				cme_locked: 1,		/* pinned by mlock(), never paged out */
+				cme_reclaim: 1,		/* hinted as a preferred eviction victim */
 				cme_cpu : 5;
 };
 
@@ -38,15 +41,23 @@ void			coremap_wire( paddr_t );
 void			coremap_unwire( paddr_t );
 void			coremap_zero( paddr_t );
 void			coremap_clone( paddr_t, paddr_t );
+bool			coremap_compare( paddr_t, paddr_t );
+uint32_t		coremap_checksum( paddr_t );
 paddr_t			coremap_alloc( struct vm_page *, bool );
 void			coremap_free( paddr_t, bool );
+void			coremap_free_batch( const paddr_t *, unsigned );
+void			coremap_flush_tlbs( void );
 void			mark_pages_as_allocated( int, int, bool, bool);
 bool			coremap_is_wired( paddr_t );
+void			coremap_shootdown( paddr_t );
+void			coremap_share( paddr_t );
+void			coremap_mlock( paddr_t, bool );
+void			coremap_deactivate( paddr_t );
 
 extern struct coremap_entry		*coremap;
 extern struct spinlock			slk_coremap;
-extern struct wchan			*wc_wire;
+extern struct waitq			*wq_wire;
 extern struct coremap_stats		cm_stats;
-extern struct wchan			*wc_shootdown;
+extern struct waitq			*wq_shootdown;
 
 #endif
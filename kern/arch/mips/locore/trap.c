@@ -39,6 +39,7 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
+#include <proc.h>
 
 
 /* in exception.S */
@@ -313,6 +314,14 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/*
+	 * If the out-of-memory killer picked us while we were in here,
+	 * exit now rather than going back to user mode.
+	 */
+	if (!iskern) {
+		proc_check_killed();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
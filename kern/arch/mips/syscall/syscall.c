@@ -110,6 +110,11 @@ syscall(struct trapframe *tf)
 	//award points for the process that just called the systemcall.
 	curthread->td_proc->p_nsyscalls++;
 
+	//let the scheduler see the cpus we may run on, which someone else
+	//may have changed; and let them see how often we moved.
+	curthread->t_affinity = curthread->td_proc->p_affinity;
+	curthread->td_proc->p_migrations = curthread->t_migrations;
+
 	switch (callno) {
 	    case SYS_reboot:
 		err = sys_reboot(tf->tf_a0);
@@ -120,6 +125,11 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 	   case SYS_open:
 		err = sys_open( (userptr_t) tf->tf_a0,
 				tf->tf_a1, &retval);
@@ -189,6 +199,31 @@ syscall(struct trapframe *tf)
 		err = sys_fork( tf, &retval );
 		break;
 
+	  case SYS_vfork:
+		err = sys_vfork( tf, &retval );
+		break;
+
+	  case SYS_sched_setaffinity:
+		err = sys_sched_setaffinity( tf->tf_a0, tf->tf_a1 );
+		break;
+
+	  case SYS_sched_getaffinity:
+		err = sys_sched_getaffinity( tf->tf_a0, (userptr_t)tf->tf_a1 );
+		break;
+
+	  case SYS_futex_wait:
+		err = sys_futex_wait( (userptr_t)tf->tf_a0, tf->tf_a1 );
+		break;
+
+	  case SYS_futex_wake:
+		err = sys_futex_wake( (userptr_t)tf->tf_a0, tf->tf_a1, &retval );
+		break;
+
+	  case SYS_spawn:
+		err = sys_spawn( (userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+				 (userptr_t)tf->tf_a2, tf->tf_a3, &retval );
+		break;
+
 	  case SYS_execv:
 		err = sys_execv( (userptr_t) tf->tf_a0, (userptr_t) tf->tf_a1 );
 		break;
@@ -196,6 +231,49 @@ syscall(struct trapframe *tf)
  	  case SYS_sbrk:
 		err = sys_sbrk( (intptr_t) tf->tf_a0, (void*)&retval );
 		break;
+
+	  case SYS_mmap:
+		//fd lives at sp+16, the 64-bit offset at sp+24.
+		err = copyin( (userptr_t)(tf->tf_sp + 16),
+			      &nextra, sizeof( int ) );
+		if( err )
+			break;
+
+		err = copyin( (userptr_t)(tf->tf_sp + 24),
+			      &retval64, sizeof( int64_t ) );
+		if( err )
+			break;
+
+		err = sys_mmap( 
+			(vaddr_t) tf->tf_a0, 
+			tf->tf_a1, 
+			tf->tf_a2, 
+			tf->tf_a3, 
+			nextra, 
+			retval64, 
+			(void*)&retval 
+		);
+		break;
+
+	  case SYS_munmap:
+		err = sys_munmap( (vaddr_t) tf->tf_a0, tf->tf_a1 );
+		break;
+
+	  case SYS_madvise:
+		err = sys_madvise( (vaddr_t) tf->tf_a0, tf->tf_a1, tf->tf_a2 );
+		break;
+
+	  case SYS_mlock:
+		err = sys_mlock( (vaddr_t) tf->tf_a0, tf->tf_a1 );
+		break;
+
+	  case SYS_munlock:
+		err = sys_munlock( (vaddr_t) tf->tf_a0, tf->tf_a1 );
+		break;
+
+	  case SYS_fsync:
+		err = sys_fsync( tf->tf_a0 );
+		break;
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -1,23 +1,28 @@
 #include <types.h>
 #include <lib.h>
 #include <synch.h>
-#include <wchan.h>
+#include <waitq.h>
 #include <thread.h>
 #include <cpu.h>
 #include <vm.h>
 #include <vm/page.h>
 #include <vm/swap.h>
+#include <vm/vmstat.h>
+#include <vm/objcache.h>
 #include <current.h>
 #include <machine/coremap.h>
 #include <machine/tlb.h>
 
 struct coremap_stats		cm_stats;
 struct coremap_entry		*coremap;
-struct wchan			*wc_wire;
-struct wchan			*wc_shootdown;
-struct spinlock			slk_coremap = SPINLOCK_INITIALIZER;
+struct waitq			*wq_wire;		/* keyed by coremap entry */
+struct waitq			*wq_shootdown;		/* by entry, or &cm_shootdown_cpus */
+struct spinlock			slk_coremap = SPINLOCK_INITIALIZER_NAMED( "slk_coremap" );
 bool				coremap_initialized = false;
 
+//cpus that still owe us a shared-frame shootdown.
+static uint32_t			cm_shootdown_cpus = 0;
+
 
 extern struct spinlock		slk_steal;
 extern paddr_t firstpaddr;
@@ -51,6 +56,9 @@ coremap_init_entry( unsigned int ix ) {
 	coremap[ix].cme_last = 0;
 	coremap[ix].cme_alloc = 0;
 	coremap[ix].cme_wired = 0;
+	coremap[ix].cme_shared = 0;
+	coremap[ix].cme_locked = 0;
+	coremap[ix].cme_reclaim = 0;
 	coremap[ix].cme_tlb_ix = -1;
 	coremap[ix].cme_cpu = 0;
 }
@@ -95,21 +103,21 @@ coremap_bootstrap( void ) {
 	for( i = 0; i < cm_stats.cms_total_frames; ++i ) 
 		coremap_init_entry( i );
 
-	//create the waiting channel for those 
+	//create the wait queues for those 
 	//that are waiting to wire a certain frame.
-	wc_wire = wchan_create( "wc_wire" );
-	if( wc_wire == NULL )
-		panic( "coremap_bootstrap: could not create wc_wire" );
+	wq_wire = waitq_create( "wq_wire" );
+	if( wq_wire == NULL )
+		panic( "coremap_bootstrap: could not create wq_wire" );
 	
-	//create the waiting channel for those
-	//who are waiting for the shootdown to be complete.
-	wc_shootdown = wchan_create( "wc_shootdown" );
-	if( wc_shootdown == NULL )
-		panic( "coremap_bootstrap: could not create wc_shootdown" );
+	//create the wait queues for those
+	//who are waiting for a shootdown to be complete.
+	wq_shootdown = waitq_create( "wq_shootdown" );
+	if( wq_shootdown == NULL )
+		panic( "coremap_bootstrap: could not create wq_shootdown" );
 	
-	wc_transit = wchan_create( "wc_transit" );
-	if( wc_transit == NULL )
-		panic( "coremap_bootstrap: wc_transit." );
+	wq_transit = waitq_create( "wq_transit" );
+	if( wq_transit == NULL )
+		panic( "coremap_bootstrap: wq_transit." );
 
 	//create the giant paging lock.
 	giant_paging_lock = lock_create( "giant_paging_lock" );
@@ -137,6 +145,7 @@ coremap_is_pageable( int ix ) {
 	COREMAP_IS_LOCKED();
 	return 
 		coremap[ix].cme_wired == 0 && 		//must not be wired
+		coremap[ix].cme_locked == 0 &&		//nor mlock()ed
 		coremap[ix].cme_kernel == 0;
 }
 
@@ -200,7 +209,7 @@ find_pageable_without_mapping( void ) {
 
 	COREMAP_IS_LOCKED();
 	for( i = 0; i < cm_stats.cms_total_frames; ++i )
-		if( coremap_is_pageable( i ) && coremap[i].cme_tlb_ix == -1 )
+		if( coremap_is_pageable( i ) && coremap[i].cme_tlb_ix == -1 && !coremap[i].cme_shared )
 			return i;
 
 	return -1;
@@ -218,6 +227,11 @@ find_pageable_page( void ) {
 	int		res;
 
 	COREMAP_IS_LOCKED();
+
+	//frames somebody told us they are done with go first.
+	for( i = 0; i < cm_stats.cms_total_frames; ++i )
+		if( coremap_is_pageable( i ) && coremap[i].cme_reclaim )
+			return i;
 	
 	res = find_pageable_without_mapping();
 	if( res >= 0 )
@@ -235,27 +249,52 @@ find_pageable_page( void ) {
 	return -1;
 }
 
+/**
+ * wait until every cpu answered the broadcast shootdown in flight, if any.
+ */
 static
 void
-coremap_evict( int ix_cme ) {
-	struct vm_page		*victim;
+coremap_wait_broadcast( void ) {
+	COREMAP_IS_LOCKED();
+	while( cm_shootdown_cpus != 0 ) {
+		tlb_shootdown_wait( &cm_shootdown_cpus );
+		vmstat_wakeup( cm_shootdown_cpus != 0 );
+	}
+}
+
+/**
+ * invalidate every tlb mapping of the given wired frame.
+ * a private frame lives in at most one tlb, which the coremap remembers.
+ * a shared frame may live in any of them, so every cpu is asked
+ * to drop it, and we wait for all of them to answer.
+ */
+static
+void
+coremap_shootdown_entry( int ix_cme ) {
 	struct tlbshootdown	tlb_shootdown;
+	uint32_t		mask;
 
 	COREMAP_IS_LOCKED();
-	
-	//the coremap entry must have a virtual page associated with it.
-	KASSERT( coremap[ix_cme].cme_page != NULL );
-	KASSERT( coremap[ix_cme].cme_alloc == 1 );
-	KASSERT( coremap_is_pageable( ix_cme ) );
-	KASSERT( lock_do_i_hold( giant_paging_lock ) );
+	KASSERT( coremap[ix_cme].cme_wired == 1 );
 
-	//get the victim.
-	victim = coremap[ix_cme].cme_page;
-	KASSERT( (victim->vmp_paddr  & PAGE_FRAME ) == COREMAP_TO_PADDR( ix_cme ) );
+	if( coremap[ix_cme].cme_shared ) {
+		//only one broadcast may be in flight.
+		coremap_wait_broadcast();
+
+		//drop our own mapping.
+		tlb_unmap_paddr( COREMAP_TO_PADDR( ix_cme ) );
+
+		//and ask everybody else to drop theirs.
+		tlb_shootdown.ts_tlb_ix = INVALID_TLB_IX;
+		tlb_shootdown.ts_cme_ix = ix_cme;
+		cm_shootdown_cpus = ipi_tlbshootdown_broadcast( &tlb_shootdown );
+		for( mask = cm_shootdown_cpus; mask != 0; mask &= mask - 1 )
+			vmstat_inc( VMSTAT_SHOOTDOWNS );
+
+		coremap_wait_broadcast();
+		return;
+	}
 
-	//wire the frame.
-	coremap[ix_cme].cme_wired = 1;
-	
 	//if there's a live tlb mapping ...
 	if( coremap[ix_cme].cme_tlb_ix != -1 ) {
 		//if it is outside of our jurisdiction ...
@@ -266,16 +305,44 @@ coremap_evict( int ix_cme ) {
 
 			//send the shootdown.
 			ipi_tlbshootdown_by_num( coremap[ix_cme].cme_cpu, &tlb_shootdown );
+			vmstat_inc( VMSTAT_SHOOTDOWNS );
 			
 			//wait until the shootdown is complete.
-			while( coremap[ix_cme].cme_tlb_ix != -1 )
-				tlb_shootdown_wait();
+			while( coremap[ix_cme].cme_tlb_ix != -1 ) {
+				tlb_shootdown_wait( &coremap[ix_cme] );
+				vmstat_wakeup( coremap[ix_cme].cme_tlb_ix != -1 );
+			}
 		}
 		else {
 			//we can just handle the request ourselves.
 			tlb_invalidate( coremap[ix_cme].cme_tlb_ix );
 		}
 	}
+}
+
+static
+void
+coremap_evict( int ix_cme ) {
+	struct vm_page		*victim;
+
+	COREMAP_IS_LOCKED();
+	
+	//the coremap entry must have a virtual page associated with it.
+	KASSERT( coremap[ix_cme].cme_page != NULL );
+	KASSERT( coremap[ix_cme].cme_alloc == 1 );
+	KASSERT( coremap_is_pageable( ix_cme ) );
+	KASSERT( lock_do_i_hold( giant_paging_lock ) );
+
+	//get the victim.
+	victim = coremap[ix_cme].cme_page;
+	KASSERT( (victim->vmp_paddr  & PAGE_FRAME ) == COREMAP_TO_PADDR( ix_cme ) );
+
+	//wire the frame.
+	coremap[ix_cme].cme_wired = 1;
+	
+	//get rid of any live tlb mapping.
+	coremap_shootdown_entry( ix_cme );
+	vmstat_inc( VMSTAT_EVICTIONS );
 
 	KASSERT( coremap[ix_cme].cme_wired == 1 );
 	KASSERT( coremap[ix_cme].cme_tlb_ix == -1 );
@@ -299,7 +366,7 @@ coremap_evict( int ix_cme ) {
 	coremap[ix_cme].cme_page = NULL;
 	coremap[ix_cme].cme_alloc = 0;
 	
-	wchan_wakeall( wc_wire );
+	waitq_wakeall( wq_wire, &coremap[ix_cme] );
 
 	//update the stats.
 	--cm_stats.cms_upages;
@@ -309,6 +376,80 @@ coremap_evict( int ix_cme ) {
 	coremap_ensure_integrity();
 }
 
+/**
+ * find a free frame outside of [base, base + npages).
+ * we go top-down, like coremap_alloc_single(), so that user pages
+ * keep moving away from the bottom, where kernel runs are carved out.
+ */
+static
+int
+find_free_outside( int base, int npages ) {
+	int			i;
+
+	COREMAP_IS_LOCKED();
+	for( i = cm_stats.cms_total_frames - 1; i >= 0; --i )
+		if( coremap_is_free( i ) && ( i < base || i >= base + npages ) )
+			return i;
+
+	return -1;
+}
+
+/**
+ * move the user page in frame ix_src into the free frame ix_dst.
+ * unlike coremap_evict(), no I/O is needed and the page stays in core.
+ * like it, we drop the coremap lock while the contents are copied.
+ */
+static
+void
+coremap_migrate( int ix_src, int ix_dst ) {
+	struct vm_page		*vmp;
+
+	COREMAP_IS_LOCKED();
+	KASSERT( lock_do_i_hold( giant_paging_lock ) );
+	KASSERT( coremap[ix_src].cme_alloc == 1 );
+	KASSERT( coremap[ix_src].cme_page != NULL );
+	KASSERT( coremap_is_pageable( ix_src ) );
+	KASSERT( coremap_is_free( ix_dst ) );
+
+	vmp = coremap[ix_src].cme_page;
+
+	//wire both frames, the new one belongs to the page from now on.
+	coremap[ix_src].cme_wired = 1;
+	mark_pages_as_allocated( ix_dst, 1, true, false );
+	coremap[ix_dst].cme_page = vmp;
+	coremap[ix_dst].cme_shared = coremap[ix_src].cme_shared;
+
+	//nobody may write to the old frame while we copy it.
+	coremap_shootdown_entry( ix_src );
+	vmstat_inc( VMSTAT_MIGRATIONS );
+
+	UNLOCK_COREMAP();
+	vm_page_migrate( vmp, COREMAP_TO_PADDR( ix_src ), COREMAP_TO_PADDR( ix_dst ) );
+	LOCK_COREMAP();
+
+	KASSERT( coremap[ix_src].cme_wired == 1 );
+	KASSERT( coremap[ix_src].cme_page == vmp );
+	KASSERT( coremap[ix_dst].cme_page == vmp );
+
+	//give up the old frame, and let go of the new one.
+	coremap[ix_src].cme_wired = 0;
+	coremap[ix_src].cme_page = NULL;
+	coremap[ix_src].cme_alloc = 0;
+	coremap[ix_src].cme_last = 0;
+	coremap[ix_src].cme_shared = 0;
+	coremap[ix_src].cme_reclaim = 0;
+	coremap[ix_dst].cme_wired = 0;
+
+	waitq_wakeall( wq_wire, &coremap[ix_src] );
+	waitq_wakeall( wq_wire, &coremap[ix_dst] );
+
+	//update the stats.
+	--cm_stats.cms_upages;
+	++cm_stats.cms_free;
+
+	//ensure coremap integrity.
+	coremap_ensure_integrity();
+}
 
 static
 int
@@ -334,14 +475,22 @@ coremap_page_replace( void ) {
 	return ix;	
 }
 
+/**
+ * wait until nobody has frame ix wired.
+ */
 static
 void
-coremap_wire_wait( ) {
+coremap_wait_unwired( int ix ) {
+	COREMAP_IS_LOCKED();
 	KASSERT( curthread->t_vmp_count == 0 );
-	wchan_lock( wc_wire );
-	UNLOCK_COREMAP();
-	wchan_sleep( wc_wire );
-	LOCK_COREMAP();
+
+	while( coremap[ix].cme_wired ) {
+		waitq_lock( wq_wire, &coremap[ix] );
+		UNLOCK_COREMAP();
+		waitq_sleep( wq_wire, &coremap[ix] );
+		LOCK_COREMAP();
+		vmstat_wakeup( coremap[ix].cme_wired );
+	}
 }
 
 static
@@ -394,6 +543,7 @@ coremap_alloc_single( struct vm_page *vmp, bool wired ) {
 	mark_pages_as_allocated( ix, 1, wired, ( vmp == NULL ) );
 	KASSERT( coremap[ix].cme_page == NULL );
 	coremap[ix].cme_page = vmp;
+	coremap[ix].cme_shared = ( vmp != NULL && (VM_PAGE_FLAGS( vmp ) & VM_PAGE_SHARED) ) ? 1 : 0;
 
 	//unlock and return
 	UNLOCK_COREMAP();
@@ -428,6 +578,46 @@ coremap_clone( paddr_t source, paddr_t target ) {
 	memmove( (void*)vtarget, (const void*)vsource, PAGE_SIZE );
 }
 
+/**
+ * tell whether two wired frames hold the same bytes.
+ */
+bool
+coremap_compare( paddr_t a, paddr_t b ) {
+	const uint32_t	*wa;
+	const uint32_t	*wb;
+	unsigned	i;
+
+	KASSERT( coremap_is_wired( a ) );
+	KASSERT( coremap_is_wired( b ) );
+
+	wa = (const uint32_t *)PADDR_TO_KVADDR( a );
+	wb = (const uint32_t *)PADDR_TO_KVADDR( b );
+	for( i = 0; i < PAGE_SIZE / sizeof( uint32_t ); ++i )
+		if( wa[i] != wb[i] )
+			return false;
+
+	return true;
+}
+
+/**
+ * a cheap hash (fnv-1a, a word at a time) of the contents of a wired frame.
+ */
+uint32_t
+coremap_checksum( paddr_t paddr ) {
+	const uint32_t	*w;
+	uint32_t	sum;
+	unsigned	i;
+
+	KASSERT( coremap_is_wired( paddr ) );
+
+	w = (const uint32_t *)PADDR_TO_KVADDR( paddr );
+	sum = 2166136261U;
+	for( i = 0; i < PAGE_SIZE / sizeof( uint32_t ); ++i )
+		sum = ( sum ^ w[i] ) * 16777619U;
+
+	return sum;
+}
+
 /**
  * Mark pages as allocated.
  * Coremap must already be locked.
@@ -445,7 +635,11 @@ mark_pages_as_allocated( int start, int num, bool wired, bool is_kernel ) {
 		KASSERT( coremap[i].cme_wired == 0 );
 
 		coremap[i].cme_alloc = 1;
+		coremap[i].cme_last = 0;
 		coremap[i].cme_wired = ( wired ) ? 1 : 0;
+		coremap[i].cme_shared = 0;
+		coremap[i].cme_locked = 0;
+		coremap[i].cme_reclaim = 0;
 		coremap[i].cme_kernel = ( is_kernel ) ? 1 : 0;
 	}
 	
@@ -466,11 +660,52 @@ mark_pages_as_allocated( int start, int num, bool wired, bool is_kernel ) {
 	
 }
 
+/**
+ * empty the frames [ix, ix + npages) for a kernel allocation.
+ * user pages in the way are moved to free frames elsewhere, so that
+ * the range is assembled without any I/O. we only fall back to
+ * evicting them when there is no free frame left to move to.
+ * interrupt handlers cannot wait for either, so they only get
+ * ranges that are free already.
+ */
+static
+bool
+coremap_compact( int ix, int npages ) {
+	int			i;
+	int			dst;
+
+	COREMAP_IS_LOCKED();
+
+	for( i = ix; i < ix + npages; ++i ) {
+		if( !coremap[i].cme_alloc )
+			continue;
+
+		if( curthread == NULL || curthread->t_in_interrupt )
+			return false;
+
+		//somebody is working on the page, let them finish.
+		coremap_wait_unwired( i );
+		if( !coremap[i].cme_alloc )
+			continue;
+
+		//it may have been pinned meanwhile.
+		if( !coremap_is_pageable( i ) )
+			return false;
+
+		dst = find_free_outside( ix, npages );
+		if( dst >= 0 )
+			coremap_migrate( i, dst );
+		else
+			coremap_evict( i );
+	}
+
+	return true;
+}
+
 static
 paddr_t
 coremap_alloc_multipages( int npages ) {
 	int			ix;
-	int			i;
 
 	//lock the coremap for atomicity.
 	LOCK_PAGING_IF_POSSIBLE();
@@ -490,18 +725,11 @@ coremap_alloc_multipages( int npages ) {
 		return INVALID_PADDR;
 	}
 
-	//now, we evict those pages that need to be evicted.
-	for( i = ix; i < ix + npages; ++i ) {
-		if( coremap[i].cme_alloc ) {
-			//if we can evict, oh well, then just do it.
-			if( curthread != NULL && !curthread->t_in_interrupt )
-				coremap_evict( i );
-			else {
-				UNLOCK_COREMAP();
-				UNLOCK_PAGING_IF_POSSIBLE();
-				return INVALID_PADDR;
-			}
-		}	
+	//clear the range out.
+	if( !coremap_compact( ix, npages ) ) {
+		UNLOCK_COREMAP();
+		UNLOCK_PAGING_IF_POSSIBLE();
+		return INVALID_PADDR;
 	}
 
 	//at this point, the entire range we choose is ours.
@@ -551,6 +779,12 @@ alloc_kpages( int npages ) {
 	paddr = ( npages > 1 ) ? 
 			coremap_alloc_multipages( npages ) : 
 			coremap_alloc_single( NULL, 0 );
+
+	//objects cached but not in use may be just what we are missing.
+	if( paddr == INVALID_PADDR && objcache_reap() > 0 )
+		paddr = ( npages > 1 ) ? 
+				coremap_alloc_multipages( npages ) : 
+				coremap_alloc_single( NULL, 0 );
 	
 	//if we have an invalid physical address
 	//return 0 as a virtual address, which is not possible.
@@ -569,6 +803,48 @@ free_kpages( vaddr_t vaddr ) {
 	coremap_free( KVADDR_TO_PADDR( vaddr ), true );
 }
 
+/**
+ * release the frame at ix, dropping whatever tlb mappings it has.
+ * returns true if it was the last of its allocation.
+ */
+static
+bool
+coremap_free_entry( int ix, bool is_kernel ) {
+	bool			last;
+
+	COREMAP_IS_LOCKED();
+
+	//make sure the page is actually allocated.
+	//further, make sure it is wired or is a kernel page.
+	KASSERT( coremap[ix].cme_alloc == 1 );
+	KASSERT( coremap[ix].cme_wired || is_kernel );
+	
+	//invalidate the given c
+	if( coremap[ix].cme_shared )
+		coremap_shootdown_entry( ix );
+	else if( coremap[ix].cme_tlb_ix >= 0 )
+		tlb_invalidate( coremap[ix].cme_tlb_ix );
+		
+	//mark it as deallocated and update stats.
+	coremap[ix].cme_alloc = 0;
+	coremap[ix].cme_kernel ? --cm_stats.cms_kpages : --cm_stats.cms_upages;
+	coremap[ix].cme_page = NULL;
+	coremap[ix].cme_wired = 0;
+	coremap[ix].cme_shared = 0;
+	coremap[ix].cme_locked = 0;
+	coremap[ix].cme_reclaim = 0;
+
+	//just released a wire.
+	waitq_wakeall( wq_wire, &coremap[ix] );
+
+	//one extra free page.
+	++cm_stats.cms_free;
+
+	last = coremap[ix].cme_last;
+	coremap[ix].cme_last = 0;
+	return last;
+}
+
 /**
  * free a kernel coremap allocation.
  */
@@ -586,37 +862,60 @@ coremap_free( paddr_t paddr, bool is_kernel ) {
 	LOCK_COREMAP();
 
 	//we loop over starting from ix, until possibly the end.
+	//if we are the last in a series of allocations, bail.
 	for( i = ix; i < cm_stats.cms_total_frames; ++i ) {
-		//make sure the page is actually allocated.
-		//further, make sure it is wired or is a kernel page.
-		KASSERT( coremap[i].cme_alloc == 1 );
-		KASSERT( coremap[i].cme_wired || is_kernel );
-		
-		//invalidate the given c
-		if( coremap[i].cme_tlb_ix >= 0 )
-			tlb_invalidate( coremap[i].cme_tlb_ix );
-			
-		//mark it as deallocated and update stats.
-		coremap[i].cme_alloc = 0;
-		coremap[i].cme_kernel ? --cm_stats.cms_kpages : --cm_stats.cms_upages;
-		coremap[i].cme_page = NULL;
-		coremap[i].cme_wired = 0;
+		if( coremap_free_entry( i, is_kernel ) )
+			break;
+	}
+
+	//paranoia.
+	coremap_ensure_integrity();
+	UNLOCK_COREMAP();
+}
 
-		//just released a wire.
-		wchan_wakeall( wc_wire );
+/**
+ * free npages wired, single-page user frames at once.
+ * the coremap is locked only once for the lot.
+ */
+void
+coremap_free_batch( const paddr_t *paddrs, unsigned npages ) {
+	unsigned		i;
+	bool			last;
 
-		//one extra free page.
-		++cm_stats.cms_free;
-	
-		//paranoia.
-		coremap_ensure_integrity();
+	if( npages == 0 )
+		return;
 
-		//if we are the last in a series of allocations, bail.
-		if( coremap[i].cme_last ) {
-			coremap[i].cme_last = 0;
-			break;
-		}
+	LOCK_COREMAP();
+	for( i = 0; i < npages; ++i ) {
+		KASSERT( (paddrs[i] & PAGE_FRAME) == paddrs[i] );
+		last = coremap_free_entry( PADDR_TO_COREMAP( paddrs[i] ), false );
+		KASSERT( last );
 	}
+
+	coremap_ensure_integrity();
+	UNLOCK_COREMAP();
+}
+
+/**
+ * drop every tlb entry of every cpu, and wait until all of them did.
+ * a dead addrspace is unmapped this way in one go, instead of page by page.
+ */
+void
+coremap_flush_tlbs( void ) {
+	uint32_t		mask;
+
+	LOCK_COREMAP();
+
+	//only one broadcast may be in flight.
+	coremap_wait_broadcast();
+
+	tlb_clear();
+	cm_shootdown_cpus = ipi_tlbflush_broadcast();
+	for( mask = cm_shootdown_cpus; mask != 0; mask &= mask - 1 )
+		vmstat_inc( VMSTAT_SHOOTDOWNS );
+
+	coremap_wait_broadcast();
+
 	UNLOCK_COREMAP();
 }
 
@@ -630,10 +929,21 @@ vm_tlbshootdown( const struct tlbshootdown *ts ) {
 	cme_ix = ts->ts_cme_ix;
 	tlb_ix = ts->ts_tlb_ix;
 
-	if( coremap[cme_ix].cme_cpu == curcpu->c_number && coremap[cme_ix].cme_tlb_ix == tlb_ix )
+	//a shared frame, which may be anywhere in our tlb.
+	if( tlb_ix == INVALID_TLB_IX ) {
+		tlb_unmap_paddr( COREMAP_TO_PADDR( cme_ix ) );
+		cm_shootdown_cpus &= ~( (uint32_t)1 << curcpu->c_number );
+	}
+	else if( coremap[cme_ix].cme_cpu == curcpu->c_number && coremap[cme_ix].cme_tlb_ix == tlb_ix )
 		tlb_invalidate( tlb_ix );
 
-	wchan_wakeall( wc_shootdown );
+	//the broadcast is done once the last cpu answered it.
+	if( tlb_ix == INVALID_TLB_IX ) {
+		if( cm_shootdown_cpus == 0 )
+			waitq_wakeall( wq_shootdown, &cm_shootdown_cpus );
+	}
+	else
+		waitq_wakeall( wq_shootdown, &coremap[cme_ix] );
 	UNLOCK_COREMAP();
 }
 
@@ -641,7 +951,81 @@ void
 vm_tlbshootdown_all( void ) {
 	LOCK_COREMAP();
 	tlb_clear();
-	wchan_wakeall( wc_shootdown );
+	cm_shootdown_cpus &= ~( (uint32_t)1 << curcpu->c_number );
+
+	//this may stand in for single shootdowns that did not fit in
+	//c_shootdown, so we cannot tell whom we answered. wake them all.
+	waitq_wakeall_keys( wq_shootdown );
+	UNLOCK_COREMAP();
+}
+
+/**
+ * invalidate every tlb mapping of a wired user frame.
+ */
+void
+coremap_shootdown( paddr_t paddr ) {
+	KASSERT( (paddr & PAGE_FRAME) == paddr );
+	KASSERT( coremap_is_wired( paddr ) );
+
+	LOCK_COREMAP();
+	coremap_shootdown_entry( PADDR_TO_COREMAP( paddr ) );
+	UNLOCK_COREMAP();
+}
+
+/**
+ * turn a wired user frame into a shared one, which may from now on
+ * be mapped by several address spaces at once. whatever mappings it
+ * has are revoked, so the next access from anywhere faults.
+ */
+void
+coremap_share( paddr_t paddr ) {
+	unsigned		cix;
+
+	KASSERT( (paddr & PAGE_FRAME) == paddr );
+	KASSERT( coremap_is_wired( paddr ) );
+	cix = PADDR_TO_COREMAP( paddr );
+
+	LOCK_COREMAP();
+	coremap_shootdown_entry( cix );
+	KASSERT( coremap[cix].cme_tlb_ix == -1 );
+	coremap[cix].cme_shared = 1;
+	UNLOCK_COREMAP();
+}
+
+/**
+ * pin (or unpin) a user frame for mlock().
+ * unlike cme_wired, which is held only while a frame is being worked on,
+ * this just keeps the frame from being chosen for eviction.
+ */
+void
+coremap_mlock( paddr_t paddr, bool locked ) {
+	unsigned		cix;
+
+	KASSERT( (paddr & PAGE_FRAME) == paddr );
+	cix = PADDR_TO_COREMAP( paddr );
+
+	LOCK_COREMAP();
+	KASSERT( coremap[cix].cme_alloc == 1 );
+	KASSERT( coremap[cix].cme_kernel == 0 );
+	coremap[cix].cme_locked = ( locked ) ? 1 : 0;
+	coremap[cix].cme_reclaim = 0;
+	UNLOCK_COREMAP();
+}
+
+/**
+ * hint that the frame will not be needed soon,
+ * making it the first candidate for eviction.
+ */
+void
+coremap_deactivate( paddr_t paddr ) {
+	unsigned		cix;
+
+	KASSERT( (paddr & PAGE_FRAME) == paddr );
+	cix = PADDR_TO_COREMAP( paddr );
+
+	LOCK_COREMAP();
+	if( coremap[cix].cme_alloc && !coremap[cix].cme_kernel && !coremap[cix].cme_locked )
+		coremap[cix].cme_reclaim = 1;
 	UNLOCK_COREMAP();
 }
 
@@ -655,8 +1039,7 @@ coremap_wire( paddr_t paddr ) {
 	LOCK_COREMAP();
 	
 	//while the page is already wired
-	while( coremap[cix].cme_wired != 0 )
-		coremap_wire_wait();
+	coremap_wait_unwired( cix );
 	
 	KASSERT( coremap[cix].cme_wired == 0 );
 	coremap[cix].cme_wired = 1;
@@ -674,7 +1057,7 @@ coremap_unwire( paddr_t	paddr ) {
 
 	KASSERT( coremap[cix].cme_wired == 1 );
 	coremap[cix].cme_wired = 0;
-	wchan_wakeall( wc_wire );
+	waitq_wakeall( wq_wire, &coremap[cix] );
 
 	UNLOCK_COREMAP();
 }
@@ -5,12 +5,13 @@
 #include <thread.h>
 #include <cpu.h>
 #include <spl.h>
-#include <wchan.h>
+#include <waitq.h>
 #include <current.h>
 #include <machine/coremap.h>
 #include <vm.h>
 #include <addrspace.h>
 #include <machine/tlb.h>
+#include <vm/vmstat.h>
 
 int
 tlb_get_free_slot() {
@@ -65,6 +66,24 @@ tlb_unmap( vaddr_t vaddr ) {
 	tlb_invalidate( ix_tlb );
 }
 
+/**
+ * drop every entry of the current tlb that maps the given frame.
+ */
+void
+tlb_unmap_paddr( paddr_t paddr ) {
+	int		i;
+	uint32_t	tlb_hi;
+	uint32_t	tlb_lo;
+
+	COREMAP_IS_LOCKED();
+
+	for( i = 0; i < NUM_TLB; ++i ) {
+		tlb_read( &tlb_hi, &tlb_lo, i );
+		if( (tlb_lo & TLBLO_VALID) && (tlb_lo & TLBLO_PPAGE) == paddr )
+			tlb_invalidate( i );
+	}
+}
+
 void
 tlb_invalidate( int ix_tlb ) {
 	uint32_t		tlb_lo;
@@ -86,13 +105,16 @@ tlb_invalidate( int ix_tlb ) {
 	
 		//convert to coremap index.
 		ix_cme = PADDR_TO_COREMAP( paddr );
-		
-		KASSERT(coremap[ix_cme].cme_tlb_ix == ix_tlb);
-		KASSERT(coremap[ix_cme].cme_cpu == curcpu->c_number);
 
-		//invalidate it.a
-		coremap[ix_cme].cme_tlb_ix = -1;
-		coremap[ix_cme].cme_cpu = 0;
+		//shared frames are not tracked by the coremap.
+		if( !coremap[ix_cme].cme_shared ) {
+			KASSERT(coremap[ix_cme].cme_tlb_ix == ix_tlb);
+			KASSERT(coremap[ix_cme].cme_cpu == curcpu->c_number);
+
+			//invalidate it.a
+			coremap[ix_cme].cme_tlb_ix = -1;
+			coremap[ix_cme].cme_cpu = 0;
+		}
 
 		tlb_write( TLBHI_INVALID( ix_tlb ), TLBLO_INVALID() , ix_tlb );
 	}
@@ -122,17 +144,20 @@ tlb_evict( void ) {
 	COREMAP_IS_LOCKED();
 	tlb_victim = random() % NUM_TLB;
 	tlb_invalidate( tlb_victim );
+	vmstat_inc( VMSTAT_TLB_EVICTIONS );
 	
 	return tlb_victim;
 }
 
 /**
- * go to sleep in wc_shootdown until someone wakes us up.
+ * go to sleep in wq_shootdown until someone wakes up key: the coremap
+ * entry whose mapping is being shot down, or cm_shootdown_cpus for a
+ * broadcast.
  */
 void
-tlb_shootdown_wait( ) {
-	wchan_lock( wc_shootdown );
+tlb_shootdown_wait( const void *key ) {
+	waitq_lock( wq_shootdown, key );
 	UNLOCK_COREMAP();
-	wchan_sleep( wc_shootdown );
+	waitq_sleep( wq_shootdown, key );
 	LOCK_COREMAP();
 }
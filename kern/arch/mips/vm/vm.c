@@ -11,10 +11,14 @@
 #include <vm.h>
 #include <vm/swap.h>
 #include <vm/page.h>
+#include <vm/oom.h>
+#include <vm/vmstat.h>
+#include <vm/ksm.h>
+#include <proc.h>
 #include <addrspace.h>
 #include <machine/tlb.h>
 
-struct spinlock			slk_steal = SPINLOCK_INITIALIZER;
+struct spinlock			slk_steal = SPINLOCK_INITIALIZER_NAMED( "slk_steal" );
 
 /**
  * kickstart the virtual memory system.
@@ -22,11 +26,23 @@ struct spinlock			slk_steal = SPINLOCK_INITIALIZER;
  */
 void
 vm_bootstrap( void ) {
+	//set up the page locks.
+	vm_page_bootstrap();
+
 	//botstrap the coremap.
 	coremap_bootstrap();
 	
 	//make sure to bootstrap our swap.
 	swap_bootstrap();
+
+	//and expose the paging statistics.
+	vmstat_bootstrap();
+
+	//the page merger sits idle until turned on.
+	ksm_bootstrap();
+
+	//dead addrspaces are torn down in the background.
+	as_bootstrap();
 }
 
 int
@@ -42,9 +58,15 @@ vm_fault( int fault_type, vaddr_t fault_addr ) {
 	if( as == NULL ) 
 		return EFAULT;
 
+	vmstat_inc( VMSTAT_FAULTS );
+
 	//delegate the fault to the address space.
 	res = as_fault( as, fault_type, fault_addr );
 	KASSERT( !lock_do_i_hold( giant_paging_lock ) );
+
+	//let the oom killer know how big we are.
+	if( res == 0 )
+		vm_oom_update();
 	return res;
 }
 
@@ -78,12 +100,15 @@ vm_map( vaddr_t vaddr, paddr_t paddr, int writeable ) {
 		//get a free tlb slot.
 		ix_tlb = tlb_get_free_slot();
 		KASSERT( ix_tlb >= 0 && ix_tlb < NUM_TLB );
+		vmstat_inc( VMSTAT_TLB_REFILLS );
 
-		//update the coremap entry.
-		coremap[ix].cme_tlb_ix = ix_tlb;
-		coremap[ix].cme_cpu = curcpu->c_number;
+		//update the coremap entry, unless several tlbs may hold it.
+		if( !coremap[ix].cme_shared ) {
+			coremap[ix].cme_tlb_ix = ix_tlb;
+			coremap[ix].cme_cpu = curcpu->c_number;
+		}
 	}
-	else {	
+	else if( !coremap[ix].cme_shared ) {	
 		//make sure it reflects the stats we have in the coremap.
 		KASSERT( coremap[ix].cme_tlb_ix == ix_tlb );
 		KASSERT( coremap[ix].cme_cpu == curcpu->c_number );
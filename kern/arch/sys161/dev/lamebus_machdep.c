@@ -73,6 +73,24 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read the cycle counter. ($9 == c0_count.)
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* get it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -242,6 +260,30 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Tickless idle. The count register goes back to zero each time it
+ * reaches the compare register, so setting the compare register
+ * ahead of the count delays the next interrupt, and setting it back
+ * to the hardclock period afterwards restores the normal rate.
+ */
+void
+mainbus_timer_defer(uint64_t nsecs)
+{
+	uint64_t cycles;
+
+	cycles = nsecs / (1000000000 / CPU_FREQUENCY);
+	if (cycles > 0x7fffffff) {
+		cycles = 0x7fffffff;
+	}
+	mips_timer_set(mips_timer_get() + (uint32_t)cycles);
+}
+
+void
+mainbus_timer_resume(void)
+{
+	mips_timer_set(mips_timer_get() + CPU_FREQUENCY / HZ);
+}
+
 /*
  * Interrupt dispatcher.
  */
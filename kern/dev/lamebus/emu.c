@@ -836,14 +836,14 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 }
 
 /*
- * VOP_MMAP
+ * VOP_MMAP - files can be mapped; the VM system does the I/O.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
@@ -1110,14 +1110,15 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any sfs file can be mapped; the VM system
+ * does the actual I/O through VOP_READ and VOP_WRITE.
  */
 static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
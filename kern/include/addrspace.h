@@ -59,12 +59,24 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-	struct vm_region_array		*as_regions;
+	struct vm_region_array		*as_regions;	/* sorted by vmr_base */
+	struct vm_region		*as_last_hit;	/* where the last lookup landed */
 	vaddr_t				as_heap_start;
 	vaddr_t				as_heap_end;
+	unsigned			as_nlocked;	/* pages pinned by mlock() */
+	struct lock			*as_lk;		/* keeps the page merger out while we change */
+	struct addrspace		*as_reap_next;	/* next dead addrspace waiting for the reaper */
 #endif
 };
 
+/*
+ * The regions and their page tables are only changed by the owning
+ * process, and by the ksm scanner (see vm/ksm.c), which replaces
+ * identical pages. Both hold as_lk while doing so.
+ */
+#define AS_LOCK(as) (lock_acquire( (as)->as_lk ))
+#define AS_UNLOCK(as) (lock_release( (as)->as_lk ))
+
 /*
  * Functions in addrspace.c:
  *
@@ -85,6 +97,10 @@ struct addrspace {
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_destroy_deferred - like as_destroy, but the work is left to a
+ *                kernel thread, which frees the pages of many dead
+ *                address spaces at once.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
@@ -103,6 +119,8 @@ struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(struct addrspace *);
 void              as_destroy(struct addrspace *);
+void              as_destroy_deferred(struct addrspace *);
+void              as_bootstrap(void);
 
 int               as_define_region(struct addrspace *as, 
                                    vaddr_t vaddr, size_t sz,
@@ -114,6 +132,12 @@ int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 int		  as_fault( struct addrspace *, int, vaddr_t );
+int		  as_define_mapping( struct addrspace *, vaddr_t, size_t, int, int,
+				     struct vnode *, off_t, vaddr_t * );
+int		  as_remove_mapping( struct addrspace *, vaddr_t, size_t );
+int		  as_sync_vnode( struct addrspace *, struct vnode * );
+int		  as_advise( struct addrspace *, vaddr_t, size_t, int );
+int		  as_mlock( struct addrspace *, vaddr_t, size_t, bool );
 
 
 /*
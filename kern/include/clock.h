@@ -30,6 +30,7 @@
 #ifndef _CLOCK_H_
 #define _CLOCK_H_
 
+#include <spinlock.h>
 #include "opt-synchprobs.h"
 
 /*
@@ -73,5 +74,95 @@ void getinterval(time_t secs1, uint32_t nsecs,
  */
 void clocksleep(int seconds);
 
+/*
+ * Timers.
+ *
+ * A timer calls tm_func(tm_arg) once the time, in nanoseconds as
+ * returned by clock_now(), reaches its deadline. Timers are kept on
+ * a per-cpu hierarchical timer wheel: TIMER_WHEEL_LEVELS wheels of
+ * TIMER_WHEEL_SIZE slots, each slot of a wheel spanning a whole turn
+ * of the wheel below. A timer goes in the lowest wheel its deadline
+ * fits in, and moves down a wheel each time the wheel below comes
+ * round to it, so adding and cancelling are O(1) and each timer is
+ * moved at most TIMER_WHEEL_LEVELS-1 times. hardclock() turns the
+ * wheel of its cpu, and runs the timers that are due in interrupt
+ * context, so their functions must not sleep.
+ *
+ * Deadlines are rounded up to the hardclock; an idle cpu, however,
+ * sets its clock for its next deadline itself and so wakes up on
+ * time (see clock_idle).
+ *
+ * timer_init	Set up a timer to call FUNC(ARG).
+ * timer_add	Start the timer, on the current cpu's wheel. It must not
+ *		be pending already.
+ * timer_cancel	Stop the timer if pending, returning true if so. If it
+ *		is already running, waits until it has finished, so
+ *		afterwards the timer and its argument may go away.
+ */
+#define CLOCK_TICK_NS		(1000000000 / HZ)
+
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS	4
+
+struct cpu;
+
+struct timer {
+	struct timer *tm_next;		/* slot of the wheel it's on */
+	struct timer **tm_pprev;	/* what points to it there */
+	uint64_t tm_deadline;		/* clock_now() to go off at */
+	void (*tm_func)(void *);
+	void *tm_arg;
+	struct cpu *tm_cpu;		/* wheel it was added to */
+	bool tm_pending;
+};
+
+struct timerwheel {
+	struct spinlock tw_lock;
+	uint64_t tw_tick;		/* next tick to run */
+	unsigned tw_count;		/* timers pending */
+	struct timer *tw_running;	/* timer whose function is running */
+	struct timer *tw_slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+void timerwheel_init(struct timerwheel *tw);
+
+uint64_t clock_now(void);
+
+void timer_init(struct timer *tm, void (*func)(void *), void *arg);
+void timer_add(struct timer *tm, uint64_t deadline);
+bool timer_cancel(struct timer *tm);
+
+/*
+ * Timed sleeps.
+ *
+ * thread_sleep_until() suspends the current thread until clock_now()
+ * reaches DEADLINE. (cv_timedwait, in <synch.h>, waits for a condition
+ * with a deadline.) It returns false if it gave up early because the
+ * process was killed; thread_sleep_interrupt() makes every sleeper
+ * look.
+ */
+bool thread_sleep_until(uint64_t deadline);
+void thread_sleep_interrupt(void);
+
+/*
+ * Tickless idle.
+ *
+ * clock_idle() is called by an idle cpu, with interrupts off, just
+ * before it waits for an interrupt. Instead of taking every hardclock
+ * while it has nothing to do, the cpu sets its clock to go off at the
+ * next deadline on its timer wheel, or CLOCK_IDLE_MAX_NS from now if
+ * none is sooner. clock_unidle() is called once it wakes up, however
+ * it was woken; it puts the hardclock back, and accounts for the
+ * hardclocks that were skipped. Clearing clock_tickless makes idle
+ * cpus take every hardclock again.
+ */
+#define CLOCK_IDLE_MAX_NS	1000000000ULL
+
+extern bool clock_tickless;
+
+void clock_idle(void);
+void clock_unidle(void);
+
 
 #endif /* _CLOCK_H_ */
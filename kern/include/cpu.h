@@ -33,9 +33,13 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <clock.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/* Priority levels of each run queue; 0 is the highest. See schedule(). */
+#define SCHED_NLEVELS 4
+
 /*
  * Per-cpu structure
  *
@@ -59,7 +63,19 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_freethreads; /* Exited threads kept for reuse */
+	struct thread *c_evicted;	/* Thread switched off this cpu for
+					   good; see thread_evicted() */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_lastboost;		/* c_hardclocks at last priority boost */
+	unsigned c_busyclocks;		/* hardclock() calls while running... */
+	unsigned c_idleclocks;		/* ...and while idle, since reset */
+	unsigned c_steals;		/* Threads taken from other cpus */
+	unsigned c_pushes;		/* Threads pushed to other cpus */
+	unsigned c_clockirqs;		/* Clock interrupts taken... */
+	unsigned c_idleirqs;		/* ...and those while idle */
+	uint64_t c_tickless;		/* clock_now() when hardclocks were
+					   stopped for idling; 0 if not */
 
 	/**
  	 * ASST3 related
@@ -71,9 +87,16 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queue, by level */
+	unsigned c_runcount;		/* Threads on all levels of c_runqueue */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus.
+	 * Protected by tw_lock.
+	 */
+	struct timerwheel c_timers;	/* Timers added on this cpu */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -114,6 +137,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Print or reset the utilization and load balancing counters of all
+ * CPUs.
+ */
+void cpu_printstats(void);
+void cpu_resetstats(void);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -174,4 +204,6 @@ void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
 void interprocessor_interrupt(void);
 
 void	ipi_tlbshootdown_by_num( unsigned, const struct tlbshootdown *);
+uint32_t	ipi_tlbshootdown_broadcast( const struct tlbshootdown * );
+uint32_t	ipi_tlbflush_broadcast( void );
 #endif /* _CPU_H_ */
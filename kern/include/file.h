@@ -24,10 +24,13 @@ int		file_create( struct vnode *, int, struct file ** );
 bool		file_descriptor_exists( struct proc *, int );
 void		file_destroy( struct file * );
 int		file_close_all( struct proc * );
+void		file_bootstrap( void );
 
 
 //helper function to open() files from inside the kernel.
 int		___open( struct proc *, char *, int, int *);
+//and dup2().
+int		___dup2( struct proc *, int, int );
 
 #define F_LOCK(x) (lock_acquire((x)->f_lk))
 #define F_UNLOCK(x) (lock_release((x)->f_lk))
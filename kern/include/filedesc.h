@@ -8,7 +8,7 @@
 
 struct filedesc {
 	struct file		*fd_ofiles[MAX_OPEN_FILES];	/* array of open files */
-	struct lock		*fd_lk;				/* a lock protecting the file descriptor table */
+	struct rwlock		*fd_lk;				/* a lock protecting the file descriptor table */
 	uint16_t		fd_nfiles;			/* how many open files we have */
 };
 
@@ -19,7 +19,10 @@ int			fd_attach( struct filedesc *, struct file *, int * );
 void			fd_detach( struct filedesc *, int );
 int			fd_attach_into( struct filedesc *, struct file *, int );
 
-#define FD_LOCK(x) (lock_acquire((x)->fd_lk))
-#define FD_UNLOCK(x) (lock_release((x)->fd_lk))
+//lookups only read the table, so they share it.
+#define FD_LOCK(x) (rwlock_acquire_write((x)->fd_lk))
+#define FD_UNLOCK(x) (rwlock_release_write((x)->fd_lk))
+#define FD_RLOCK(x) (rwlock_acquire_read((x)->fd_lk))
+#define FD_RUNLOCK(x) (rwlock_release_read((x)->fd_lk))
 
 #endif
@@ -0,0 +1,26 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), munmap() and friends, for <sys/mman.h>.
+ */
+
+/* Page protection (the PROT argument to mmap). */
+#define PROT_NONE     0x0    /* Pages may not be accessed */
+#define PROT_READ     0x1    /* Pages may be read */
+#define PROT_WRITE    0x2    /* Pages may be written */
+#define PROT_EXEC     0x4    /* Pages may be executed */
+
+/* Mapping flags (the FLAGS argument to mmap). */
+#define MAP_SHARED    0x0001 /* Changes are shared with others */
+#define MAP_PRIVATE   0x0002 /* Changes are private (copy-on-fault) */
+#define MAP_ANON      0x1000 /* Not backed by a file; zero-filled */
+
+/* Access pattern advice (the ADVICE argument to madvise). */
+#define MADV_NORMAL      0   /* No particular pattern */
+#define MADV_RANDOM      1   /* Random access; no read-ahead */
+#define MADV_SEQUENTIAL  2   /* Sequential access; read ahead, drop behind */
+#define MADV_WILLNEED    3   /* Will be needed soon; bring it in now */
+#define MADV_DONTNEED    4   /* Not needed anymore; discard it */
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,24 @@
+#ifndef _KERN_SPAWN_H_
+#define _KERN_SPAWN_H_
+
+/*
+ * File actions for spawn(). They are applied in order to the child's
+ * copy of the caller's descriptor table before the program is loaded.
+ */
+
+#define SPAWN_CLOSE	0	/* close sa_fd */
+#define SPAWN_DUP2	1	/* make sa_newfd a copy of sa_fd */
+#define SPAWN_OPEN	2	/* open sa_path with sa_flags as sa_newfd */
+
+/* at most this many actions per spawn() */
+#define SPAWN_MAX_ACTIONS 16
+
+struct spawn_action {
+	int sa_op;		/* SPAWN_* */
+	int sa_fd;		/* descriptor acted on */
+	int sa_newfd;		/* target descriptor for DUP2 and OPEN */
+	int sa_flags;		/* open flags for OPEN */
+	const char *sa_path;	/* path for OPEN */
+};
+
+#endif /* _KERN_SPAWN_H_ */
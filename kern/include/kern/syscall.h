@@ -59,10 +59,10 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
+#define SYS_madvise      11
 //#define SYS_mincore    12
-//#define SYS_mlock      13
-//#define SYS_munlock    14
+#define SYS_mlock        13
+#define SYS_munlock      14
 //#define SYS_munlockall 15
 //#define SYS_minherit   16
 //                              (security/credentials)
@@ -196,6 +196,11 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+#define SYS_spawn        121
+#define SYS_sched_setaffinity 122
+#define SYS_sched_getaffinity 123
+#define SYS_futex_wait   124
+#define SYS_futex_wake   125
 
 /*CALLEND*/
 
@@ -0,0 +1,42 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * Paging statistics, as read from the "vmstat:" device.
+ *
+ * The global counters are indexed by the VMSTAT_* constants below.
+ * They count events since boot (or since the last reset from the
+ * kernel menu) and are updated without locking, so they are exact
+ * only when the system is quiet. VMSTAT_META_BYTES and
+ * VMSTAT_KSM_SHARING are levels rather than counts, and survive resets.
+ */
+
+#define VMSTAT_FAULTS		0	/* calls to vm_fault */
+#define VMSTAT_FAULTS_MINOR	1	/* faults served without I/O */
+#define VMSTAT_FAULTS_MAJOR	2	/* faults that had to swap in */
+#define VMSTAT_ZEROFILLS	3	/* pages created zero-filled */
+#define VMSTAT_FILEFILLS	4	/* pages read in from a mapped file */
+#define VMSTAT_EVICTIONS	5	/* frames taken from a page */
+#define VMSTAT_SWAPINS		6	/* pages read from swap */
+#define VMSTAT_SWAPOUTS		7	/* pages written to swap */
+#define VMSTAT_TLB_REFILLS	8	/* tlb entries written by a fault */
+#define VMSTAT_TLB_EVICTIONS	9	/* tlb entries thrown out to make room */
+#define VMSTAT_SHOOTDOWNS	10	/* tlb shootdowns sent to other cpus */
+#define VMSTAT_PAGING_USEC	11	/* time spent waiting for swap I/O */
+#define VMSTAT_META_BYTES	12	/* kernel heap used by page descriptors and tables */
+#define VMSTAT_KSM_SCANNED	13	/* pages checksummed by the merge scanner */
+#define VMSTAT_KSM_MERGES	14	/* pages folded into an identical one */
+#define VMSTAT_KSM_BREAKS	15	/* merged pages copied for a writer */
+#define VMSTAT_KSM_SHARING	16	/* frames saved by merging */
+#define VMSTAT_MIGRATIONS	17	/* pages moved to another frame, without I/O */
+#define VMSTAT_WAKEUPS		18	/* waits for a page or frame that were woken up */
+#define VMSTAT_SPURIOUS		19	/* ...only to find they still had to wait */
+#define VMSTAT_NCOUNTERS	20
+
+struct vmstat {
+	__u64 vs_counters[VMSTAT_NCOUNTERS];	/* system-wide, summed over cpus */
+	__u64 vs_minflt;			/* minor faults of the reader */
+	__u64 vs_majflt;			/* major faults of the reader */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
@@ -125,6 +125,15 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+bool kheap_owns(const void *ptr);
+
+/*
+ * kmalloc profiling by call site, in kernels built with
+ * "options kmprof".
+ */
+void kheap_profile_enable(bool enable);
+void kheap_profile_reset(void);
+void kheap_profile_print(unsigned max);
 
 /*
  * C string functions. 
@@ -0,0 +1,83 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+#include "opt-lockprof.h"
+
+/**
+ * lock contention profiling.
+ * with the lockprof option, every spinlock, lock and semaphore carries
+ * a struct lockprof. while profiling is turned on, each acquisition is
+ * counted, and so is the time spent waiting for the lock, the time it
+ * was held, and the call sites that had to wait the most. a lock joins
+ * the registry the first time it is acquired with profiling on, and
+ * leaves it when it is destroyed; "lockprof" in the kernel menu prints
+ * the locks of the registry that were waited for the longest.
+ *
+ * the counters of a lock are only updated by whoever holds it, so the
+ * lock protects its own statistics. semaphores have no holder, so for
+ * them only the waiting is measured.
+ */
+
+#define LOCKPROF_SPINLOCK	0
+#define LOCKPROF_LOCK		1
+#define LOCKPROF_SEM		2
+
+#define LOCKPROF_NSITES		4	/* contending call sites kept per lock */
+
+#if OPT_LOCKPROF
+
+struct lockprof_site {
+	vaddr_t			ls_site;	/* return address; 0 if unused */
+	uint32_t		ls_count;	/* contended acquisitions from here */
+	uint64_t		ls_waitns;	/* time they waited */
+};
+
+struct lockprof {
+	const char		*lp_name;	/* not copied; NULL for none */
+	bool			lp_untracked;	/* the profiler's own lock */
+	bool			lp_registered;
+	unsigned char		lp_kind;
+	struct lockprof		*lp_prev;	/* registry */
+	struct lockprof		*lp_next;
+
+	uint32_t		lp_acquires;
+	uint32_t		lp_contended;
+	uint64_t		lp_waitns;
+	uint64_t		lp_maxwaitns;
+	uint64_t		lp_holdns;
+	uint64_t		lp_maxholdns;
+	uint64_t		lp_since;	/* when the holder got it; 0 if untimed */
+	struct lockprof_site	lp_sites[LOCKPROF_NSITES];
+};
+
+/**
+ * static initializers, the rest is zero.
+ */
+#define LOCKPROF_INITIALIZER(name)	{ .lp_name = (name), .lp_untracked = false }
+#define LOCKPROF_UNTRACKED		{ .lp_name = "lockprof", .lp_untracked = true }
+
+extern volatile bool	lockprof_enabled;
+
+/**
+ * hooks for the lock primitives, called holding the lock.
+ * start is lockprof_now() from when the acquisition began.
+ */
+uint64_t	lockprof_now( void );
+void		lockprof_acquired( struct lockprof *, unsigned, uint64_t, bool, vaddr_t );
+void		lockprof_released( struct lockprof * );
+void		lockprof_forget( struct lockprof * );
+
+#define LOCKPROF_RELEASED(lp) \
+	do { if( (lp)->lp_since != 0 ) lockprof_released( lp ); } while( 0 )
+
+/**
+ * turn profiling on or off, zero all counters, and print the max locks
+ * waited for the longest.
+ */
+void		lockprof_enable( bool );
+void		lockprof_reset( void );
+void		lockprof_print( unsigned );
+
+#endif /* OPT_LOCKPROF */
+
+#endif
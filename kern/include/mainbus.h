@@ -55,6 +55,14 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Make the current cpu's next clock interrupt come NSECS from now
+ * instead of at the next hardclock, or go back to interrupting every
+ * hardclock. For tickless idle; see clock_idle().
+ */
+void mainbus_timer_defer(uint64_t nsecs);
+void mainbus_timer_resume(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -8,6 +8,7 @@
 #define MAX_PROCESSES 32
 #define PROC_RESERVED_SPOT 0xcafebabe
 #define PROC_MAX_HEAP_PAGES 2048
+#define PROC_MAX_LOCKED_PAGES 64
 
 struct proc {
 	pid_t			p_pid;		/* pid of the process */
@@ -23,10 +24,24 @@ struct proc {
 	/* scheduler related */
 	uint64_t		p_nsyscalls;	/* how many system calls we called? */
 	int			p_nice;		/* our nice value */
+	uint32_t		p_affinity;	/* cpus our thread may run on */
+	unsigned		p_migrations;	/* cpu changes of our thread, as last seen */
+
+	/* out-of-memory handling */
+	unsigned		p_npages;	/* pages in use (in core or swapped), as last seen */
+	volatile bool		p_killed;	/* chosen by the oom killer, must exit */
+	uint64_t		p_killtime;	/* clock_now() when it was chosen */
+
+	/* paging statistics */
+	uint64_t		p_minflt;	/* faults resolved without I/O */
+	uint64_t		p_majflt;	/* faults that waited for swap or a file */
+
+	/* vfork() */
+	struct semaphore	*p_vfork_sem;	/* parent sleeps here while we borrow its addrspace */
 };
 
 extern struct proc *allproc[MAX_PROCESSES];
-extern struct lock *lk_allproc;
+extern struct rwlock *lk_allproc;
 extern struct lock *lk_exec;
 
 int		proc_create( struct proc ** );
@@ -34,6 +49,10 @@ int	 	proc_clone(struct proc *, struct proc ** );
 void 		proc_destroy(struct proc *);
 int	 	proc_get( pid_t, struct proc ** );
 void		proc_system_init(void);
+void		proc_check_killed(void);
+bool		proc_killed(void);
+void		proc_vfork_done( struct proc * );
+void		proc_printsched( void );
 
 //tests.
 void		proc_test_pid_allocation(void);
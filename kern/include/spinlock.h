@@ -45,6 +45,9 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/* Contention statistics, if compiled in. */
+#include <lockprof.h>
+
 /*
  * Basic spinlock.
  *
@@ -57,12 +60,32 @@
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKPROF
+	struct lockprof lk_prof;	/* Contention statistics. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
+ * The named version gives the lock a name for the lock profiler; the
+ * name is not copied. The untracked one is for the profiler itself.
+ * They are designated so that members left out are zero without
+ * upsetting -Wmissing-field-initializers.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKPROF
+#define SPINLOCK_INITIALIZER_NAMED(name) \
+	{ .lk_lock = SPINLOCK_DATA_INITIALIZER, .lk_holder = NULL, \
+	  .lk_prof = LOCKPROF_INITIALIZER(name) }
+#define SPINLOCK_INITIALIZER	SPINLOCK_INITIALIZER_NAMED(NULL)
+#define SPINLOCK_INITIALIZER_UNTRACKED \
+	{ .lk_lock = SPINLOCK_DATA_INITIALIZER, .lk_holder = NULL, \
+	  .lk_prof = LOCKPROF_UNTRACKED }
+#else
+#define SPINLOCK_INITIALIZER \
+	{ .lk_lock = SPINLOCK_DATA_INITIALIZER, .lk_holder = NULL }
+#define SPINLOCK_INITIALIZER_NAMED(name)	SPINLOCK_INITIALIZER
+#define SPINLOCK_INITIALIZER_UNTRACKED		SPINLOCK_INITIALIZER
+#endif
 
 /*
  * Spinlock functions.
@@ -74,6 +97,9 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Name the lock for the lock profiler, after init. The name
+ *		is not copied.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +110,11 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_LOCKPROF
+#define spinlock_setname(lk, name)	((lk)->lk_prof.lp_name = (name))
+#else
+#define spinlock_setname(lk, name)	((void)(name))
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
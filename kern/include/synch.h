@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <cpu.h>		/* for SCHED_NLEVELS */
 
 /*
  * Dijkstra-style semaphore.
@@ -48,6 +49,9 @@ struct semaphore {
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
         volatile int sem_count;
+#if OPT_LOCKPROF
+        struct lockprof sem_prof;
+#endif
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
@@ -79,7 +83,14 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         volatile struct thread *lk_holder;
+        struct cpu *lk_holdercpu;       /* where it got the lock; a hint */
+        struct lock *lk_nextheld;       /* next on the holder's t_heldlocks */
+        unsigned lk_nwaiting;           /* sleepers; under lk_lock */
+        unsigned lk_waiters[SCHED_NLEVELS]; /* same, by level; lock_pilock */
         // END SOLUTION
+#if OPT_LOCKPROF
+        struct lockprof lk_prof;
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -100,6 +111,25 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+ * Locks are adaptive: lock_acquire spins rather than sleeps while the
+ * holder is running on another cpu, and lock_release hands the lock
+ * directly to the thread that slept longest. Clearing lock_adaptive
+ * turns both off, so the old behavior can be benchmarked against.
+ */
+extern bool lock_adaptive;
+
+/*
+ * Locks do priority inheritance: a thread holding a lock runs at the
+ * level of the best placed thread sleeping for it, if that's better
+ * than its own, so that threads on the levels in between can't keep
+ * it (and thus the sleeper) from running. Inherited levels are passed
+ * on along chains of holders themselves waiting for locks, and given
+ * up as the locks are released. Clearing lock_inherit stops threads
+ * from inheriting anything new.
+ */
+extern bool lock_inherit;
+
 
 /*
  * Condition variable.
@@ -132,8 +162,12 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_timedwait - cv_wait, but give up waiting at DEADLINE (in
+ *                   nanoseconds; see clock_now) and return ETIMEDOUT.
+ *                   Returns 0 if woken before then. Either way the
+ *                   lock is held again on return.
  *
- * For all three operations, the current thread must hold the lock passed 
+ * For all of these operations, the current thread must hold the lock passed 
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
@@ -142,21 +176,51 @@ void cv_destroy(struct cv *);
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, uint64_t deadline);
 
 /*
  * 13 Feb 2012 : GWA : Reader-writer locks.
+ *
+ * Any number of readers or one writer may hold the lock. Writers are
+ * preferred: once one is waiting, new readers wait too. When a writer
+ * releases the lock, every reader waiting at that moment is admitted
+ * together, as one batch, before the next writer; so neither side can
+ * starve the other. Both the batch and the next writer are handed the
+ * lock directly, like lock_release does.
  */
 
 struct rwlock {
         char *rwlock_name;
+
+        struct spinlock rw_lock;
+        struct wchan *rw_rwchan;        /* readers wait here */
+        struct wchan *rw_wwchan;        /* writers wait here */
+        volatile struct thread *rw_writer; /* writer holding it, if any */
+        unsigned rw_readers;            /* readers holding it */
+        unsigned rw_rwaiting;           /* readers waiting for a batch */
+        unsigned rw_wwaiting;           /* writers waiting */
+        unsigned rw_batch;              /* batches admitted so far */
 };
 
 struct rwlock * rwlock_create(const char *);
 void rwlock_destroy(struct rwlock *);
 
+/*
+ * Operations:
+ *    rwlock_acquire_read   - Get the lock shared with other readers.
+ *    rwlock_release_read   - Give up a read hold.
+ *    rwlock_acquire_write  - Get the lock exclusively.
+ *    rwlock_release_write  - Give it up; only the writer may do this.
+ *    rwlock_do_i_write     - Return true if the current thread holds
+ *                            the lock for writing.
+ *
+ * Reading is not recursive: a reader must not ask for a second read
+ * hold, as a writer may have queued up in between.
+ */
 void rwlock_acquire_read(struct rwlock *);
 void rwlock_release_read(struct rwlock *);
 void rwlock_acquire_write(struct rwlock *);
 void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_write(struct rwlock *);
 
 #endif /* _SYNCH_H_ */
@@ -32,6 +32,7 @@
 
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct addrspace; /* from <addrspace.h> */
 
 /*
  * The system call dispatcher.
@@ -50,6 +51,10 @@ void enter_forked_process(struct trapframe *tf);
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
 
+/* Set up the futex table and wait queues; wake up every futex waiter. */
+void futex_bootstrap(void);
+void futex_interrupt(void);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -57,6 +62,7 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_remainder);
 
 /*
  * I/O syscalls
@@ -70,6 +76,7 @@ int	sys___getcwd( userptr_t, size_t, int * );
 int	sys_lseek( int, off_t, int, int64_t * );
 int	sys_dup2( int, int, int * );
 int	sys_chdir( userptr_t );
+int	sys_fsync( int );
 
 /**
  * Process System Calls
@@ -79,8 +86,20 @@ int	sys_getpid( int * );
 void	sys__exit( int );
 int	sys_waitpid( int, userptr_t, int, int * );
 int	sys_fork( struct trapframe *, int * );
+int	sys_vfork( struct trapframe *, int * );
 int	sys_execv( userptr_t, userptr_t );
+int	sys_spawn( userptr_t, userptr_t, userptr_t, int, int * );
+int	exec_load( userptr_t, userptr_t, struct addrspace **, vaddr_t *, vaddr_t *, int * );
 int	sys_sbrk( intptr_t, void ** );
+int	sys_mmap( vaddr_t, size_t, int, int, int, off_t, void ** );
+int	sys_munmap( vaddr_t, size_t );
+int	sys_madvise( vaddr_t, size_t, int );
+int	sys_mlock( vaddr_t, size_t );
+int	sys_munlock( vaddr_t, size_t );
+int	sys_sched_setaffinity( pid_t, uint32_t );
+int	sys_sched_getaffinity( pid_t, userptr_t );
+int	sys_futex_wait( userptr_t, int );
+int	sys_futex_wake( userptr_t, int, int * );
 
 /**
  * Kernel versions of the system calls.
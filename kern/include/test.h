@@ -90,6 +90,10 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int lockbench(int, char **);
+int rwlockbench(int, char **);
+int pitest(int, char **);
+int clocktest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -102,6 +106,8 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
+int objcachebench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
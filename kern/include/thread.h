@@ -42,6 +42,7 @@
 
 struct addrspace;
 struct cpu;
+struct lock;
 struct vnode;
 
 /* get machine-dependent defs */
@@ -57,6 +58,15 @@ struct vnode;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/* Names shorter than this are kept in the thread itself */
+#define THREAD_NAMELEN 32
+
+/* Exited threads kept per cpu, stacks and all, for thread_fork */
+#define THREAD_CACHE_MAX 8
+
+/* Affinity mask allowing every cpu; bit N stands for cpu N */
+#define THREAD_AFFINITY_ALL 0xffffffff
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -73,7 +83,9 @@ struct thread {
 	 * debugger is messed up.
 	 */
 	char *t_name;			/* Name of this thread */
+	char t_namebuf[THREAD_NAMELEN];	/* t_name, unless it's longer */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
+	const void *t_wchan_key;	/* What it waits for; see wchan_sleep_key */
 	threadstate_t t_state;		/* State this thread is in */
 
 	/*
@@ -85,6 +97,26 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 
+	/*
+	 * Scheduler fields. See schedule().
+	 */
+	unsigned t_prio;		/* Run queue level; 0 is the highest */
+	unsigned t_ticks;		/* Hardclocks used of this level's quantum */
+	int t_nice;			/* Copy of td_proc->p_nice */
+	unsigned t_sincemove;		/* Hardclocks run since changing cpus */
+	uint32_t t_affinity;		/* CPUs it may run on, one bit each */
+	unsigned t_migrations;		/* Times it changed cpus */
+
+	/*
+	 * Priority inheritance; see lock_inherit in synch.h. All but
+	 * t_heldlocks, which only the thread itself uses, are
+	 * protected by lock_pilock in synch.c.
+	 */
+	unsigned t_inherit;		/* Level inherited; SCHED_NLEVELS if none */
+	struct lock *t_blocked;		/* Lock it sleeps for, if any */
+	unsigned t_waitlevel;		/* Level it's counted at there */
+	struct lock *t_heldlocks;	/* Locks it holds */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -162,6 +194,31 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for a hardclock. Returns true if it
+ * should yield. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
+/*
+ * Restrict the current thread to the CPUs in an affinity mask.
+ * thread_affinity_valid checks that the mask names a CPU that
+ * exists; thread_setaffinity requires that it does. The thread
+ * moves off a CPU it may no longer use the next time it yields to
+ * another thread or wakes up from sleep.
+ */
+bool thread_affinity_valid(uint32_t mask);
+void thread_setaffinity(uint32_t mask);
+
+/*
+ * thread_level returns the run queue level T runs at: its own, or
+ * one it inherited through a lock (see synch.h), whichever is better.
+ * thread_inherit sets the level T inherits, SCHED_NLEVELS for none,
+ * and moves it to its new level if it's waiting to run.
+ */
+unsigned thread_level(struct thread *t);
+void thread_inherit(struct thread *t, unsigned level);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -0,0 +1,26 @@
+#ifndef _VM_KSM_H
+#define _VM_KSM_H
+
+struct addrspace;
+
+/**
+ * kernel same-page merging.
+ * once enabled, a kernel thread wakes up every ksm_secs seconds and
+ * checksums the next ksm_pages resident pages of private anonymous
+ * regions, in every address space. pages that turn out to be identical
+ * are folded into one read-only page, until somebody writes to them.
+ */
+#define KSM_NSLOTS		1024		/* candidates remembered, a power of two */
+#define KSM_DEFAULT_PAGES	64
+#define KSM_DEFAULT_SECS	1
+#define KSM_MAX_PAGES		1024		/* pages checksummed per pass, at most */
+#define KSM_MAX_SECS		60
+
+void		ksm_bootstrap( void );
+int		ksm_register( struct addrspace * );
+void		ksm_unregister( struct addrspace * );
+int		ksm_set_enabled( bool );
+int		ksm_set_rate( unsigned, unsigned );
+void		ksm_print( void );
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _VM_OBJCACHE_H
+#define _VM_OBJCACHE_H
+
+/**
+ * caches of constructed objects of one type.
+ * objects are carved out of whole kernel pages, and the constructor
+ * runs once per object when its page is added to the cache, not on
+ * every allocation: whatever the constructor set up (locks, semaphores)
+ * is still there when the object is handed out again, so it must be
+ * back in that state when it is freed. the destructor runs only when
+ * the page goes back to the coremap.
+ *
+ * pages whose objects are all free are kept around, a few per cache,
+ * and given back by objcache_reap() once the coremap runs out.
+ */
+#define OBJCACHE_MAXCACHES	32		/* caches in the system, at most */
+#define OBJCACHE_MAXSIZE	(PAGE_SIZE / 16)	/* so that a page holds 15 at least */
+#define OBJCACHE_MAXEMPTY	2		/* free pages kept per cache without pressure */
+
+struct objcache;
+
+/**
+ * with objcache_bypass set, objects come straight from kmalloc and are
+ * constructed on every allocation, as they were before there were
+ * object caches; this is only there to measure what the caches save.
+ * objects go back to wherever they came from, so it may be flipped
+ * at any time.
+ */
+extern bool	objcache_bypass;
+
+typedef int (*objcache_ctor_t)( void * );
+typedef void (*objcache_dtor_t)( void * );
+
+struct objcache	*objcache_create( const char *, size_t, objcache_ctor_t, objcache_dtor_t );
+void		*objcache_alloc( struct objcache * );
+void		objcache_free( struct objcache *, void * );
+unsigned	objcache_reap( void );
+void		objcache_printstats( void );
+
+#endif
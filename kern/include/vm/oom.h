@@ -0,0 +1,13 @@
+#ifndef _VM_OOM_H
+#define _VM_OOM_H
+
+/* how many times an allocation waits for a victim to go away */
+#define OOM_RETRIES 3
+
+/* how long a victim has to go away before another one is chosen, in nsec */
+#define OOM_GRACE_NS (2 * 1000000000ULL)
+
+bool		vm_oom_kill( void );
+void		vm_oom_update( void );
+
+#endif
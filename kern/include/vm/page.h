@@ -2,34 +2,82 @@
 #define _VM_PAGE_H
 
 struct lock;
+struct vnode;
 
 /**
  * this struct represents a logical page.
- * it is the basic object that the vm system manages.
+ * it is the basic object that the vm system manages, and there is one for
+ * every instantiated user page, so it is kept down to two words:
+ * the frame number shares a word with the VM_PAGE_* flags, and the swap
+ * address is stored as a slot number, next to the reference count.
+ * the members are protected by a spinlock picked from a hashed table,
+ * see vm_page_lock().
+ *
+ * a page normally belongs to a single region. identical private pages
+ * merged by the ksm scanner are referenced by several regions, and are
+ * only ever mapped read-only until a writer gets a copy of its own.
  */
 struct vm_page {
-	volatile paddr_t		vmp_paddr;	/* the current physical address of this page */
-	off_t				vmp_swapaddr;	/* offset into the swap partition */
-	struct spinlock			vmp_lk;		/* spinlock protecting the members */
-	bool				vmp_in_transit;	
+	volatile paddr_t		vmp_paddr;	/* physical address of the frame | VM_PAGE_* flags */
+	uint32_t			vmp_swapslot : 24;	/* page-sized slot in the swap partition */
+	uint32_t			vmp_refcount : 8;	/* regions referencing the page */
 };
 
-#define VM_PAGE_IN_CORE(vmp) (((vmp)->vmp_paddr & PAGE_FRAME) != INVALID_PADDR)
-#define VM_PAGE_IN_BACKING(vmp) ((vmp)->vmp_swapaddr != INVLALID_SWAPADDR)
-#define VM_PAGE_IS_LOCKED(vmp) (KASSERT(lock_do_i_hold((vmp)->vmp_lk)))
+#define VM_PAGE_MAXSLOTS (1 << 24)
+#define VM_PAGE_MAXREFS 255
 
-#define VM_PAGE_DIRTY 0x01
+#define VM_PAGE_PADDR(vmp) ((vmp)->vmp_paddr & PAGE_FRAME)
+#define VM_PAGE_FLAGS(vmp) ((vmp)->vmp_paddr & ~PAGE_FRAME)
+#define VM_PAGE_SWAPADDR(vmp) ((off_t)(vmp)->vmp_swapslot * PAGE_SIZE)
+#define VM_PAGE_IN_CORE(vmp) (VM_PAGE_PADDR(vmp) != INVALID_PADDR)
+#define VM_PAGE_IN_BACKING(vmp) ((vmp)->vmp_swapslot != INVALID_SWAPADDR)
+#define VM_PAGE_MERGED(vmp) ((vmp)->vmp_refcount > 1)
 
+#define VM_PAGE_DIRTY 0x01		/* written since last written back to its file */
+#define VM_PAGE_SHARED 0x02		/* may be mapped by several address spaces */
+#define VM_PAGE_LOCKED 0x04		/* pinned in core by mlock() */
+#define VM_PAGE_TRANSIT 0x08		/* being written out to or read in from swap */
+
+/**
+ * frames and swap slots of destroyed pages, waiting to be freed together.
+ * see vm_page_release(). the frames stay wired until the batch is flushed.
+ */
+#define VM_PAGE_BATCH 32
+
+struct vm_page_batch {
+	paddr_t				vpb_frames[VM_PAGE_BATCH];
+	off_t				vpb_slots[VM_PAGE_BATCH];
+	unsigned			vpb_nframes;
+	unsigned			vpb_nslots;
+};
+
+/* size of the hashed table of page locks, a power of two */
+#define VM_PAGE_NLOCKS 64
+
+void			vm_page_bootstrap( void );
 struct vm_page 		*vm_page_create( void );
-void			vm_page_destroy( struct vm_page * );
+bool			vm_page_destroy( struct vm_page * );
+void			vm_page_release( struct vm_page *, struct vm_page_batch * );
+void			vm_page_batch_init( struct vm_page_batch * );
+void			vm_page_batch_flush( struct vm_page_batch * );
 void			vm_page_lock( struct vm_page * );
 void			vm_page_unlock( struct vm_page * );
 void			vm_page_wire( struct vm_page * );
 int			vm_page_clone( struct vm_page *, struct vm_page ** );
-int			vm_page_new_blank( struct vm_page ** );
-int			vm_page_fault( struct vm_page *, struct addrspace *, int fault_type, vaddr_t );
+int			vm_page_new_blank( struct vm_page **, unsigned );
+int			vm_page_new_from_vnode( struct vm_page **, unsigned, struct vnode *, off_t );
+int			vm_page_writeback( struct vm_page *, struct vnode *, off_t, size_t );
+int			vm_page_fault( struct vm_page *, struct addrspace *, int fault_type, vaddr_t, bool * );
 void			vm_page_evict( struct vm_page * );
+void			vm_page_migrate( struct vm_page *, paddr_t, paddr_t );
+int			vm_page_prefetch( struct vm_page * );
+void			vm_page_deactivate( struct vm_page * );
+int			vm_page_mlock( struct vm_page *, bool * );
+void			vm_page_munlock( struct vm_page *, bool * );
+int			vm_page_checksum( struct vm_page *, uint32_t * );
+int			vm_page_ksm_hold( struct vm_page * );
+int			vm_page_ksm_same( struct vm_page *, struct vm_page * );
 
-extern struct wchan	*wc_transit;
+extern struct waitq	*wq_transit;
 
 #endif
@@ -0,0 +1,48 @@
+#ifndef _VM_PAGETABLE_H
+#define _VM_PAGETABLE_H
+
+struct vm_page;
+
+/**
+ * a sparse, two-level table holding the pages of a region.
+ * the directory has one slot per VM_PT_LEAF_PAGES pages, and a leaf is
+ * only allocated once one of its pages is instantiated. it is freed again
+ * when its last page goes away, so untouched ranges cost a directory slot.
+ */
+#define VM_PT_LEAF_SHIFT	5
+#define VM_PT_LEAF_PAGES	(1 << VM_PT_LEAF_SHIFT)
+#define VM_PT_LEAF_MASK		(VM_PT_LEAF_PAGES - 1)
+
+struct vm_pt_dirent {
+	struct vm_page			**vpd_leaf;	/* VM_PT_LEAF_PAGES pages, or NULL */
+	unsigned			vpd_nused;	/* non-NULL pages in the leaf */
+};
+
+struct vm_pagetable {
+	struct vm_pt_dirent		*vpt_dir;
+	unsigned			vpt_ndir;	/* entries allocated in vpt_dir */
+	unsigned			vpt_npages;	/* how many pages the table covers */
+};
+
+struct vm_pagetable		*vm_pagetable_create( void );
+void				vm_pagetable_destroy( struct vm_pagetable * );
+int				vm_pagetable_setsize( struct vm_pagetable *, unsigned );
+int				vm_pagetable_set( struct vm_pagetable *, unsigned, struct vm_page * );
+
+static inline
+unsigned
+vm_pagetable_num( const struct vm_pagetable *vpt ) {
+	return vpt->vpt_npages;
+}
+
+static inline
+struct vm_page *
+vm_pagetable_get( const struct vm_pagetable *vpt, unsigned ix ) {
+	struct vm_page		**leaf;
+
+	KASSERT( ix < vpt->vpt_npages );
+	leaf = vpt->vpt_dir[ix >> VM_PT_LEAF_SHIFT].vpd_leaf;
+	return ( leaf == NULL ) ? NULL : leaf[ix & VM_PT_LEAF_MASK];
+}
+
+#endif
@@ -3,25 +3,66 @@
 
 #include <array.h>
 #include <spinlock.h>
+#include <vm/pagetable.h>
 
 struct addrspace; /* opaque */
+struct vnode;
+struct lock;
+struct bitmap;
 
 /**
- * using the built-in array data-structure instead of a linked list
- * to hold each vm_page that belongs to a vm_region
+ * the pages of a MAP_SHARED region are shared by every address space
+ * that maps it (e.g., a parent and its children after fork()), so they
+ * live here instead of inside the region itself.
  */
-DECLARRAY_BYTYPE( vm_page_array, struct vm_page );
+struct vm_share {
+	struct vm_pagetable		*vms_pages;	/* the shared pages */
+	struct lock			*vms_lk;	/* protects the members and page instantiation */
+	unsigned			vms_refcount;	/* how many regions use this */
+	unsigned			*vms_pins;	/* per page, regions that mlock()ed it; NULL if none ever did */
+};
+
+/* region types */
+#define VMR_ANON	0		/* zero-filled, backed by swap */
+#define VMR_FILE	1		/* filled from vmr_vnode */
 
 struct vm_region {
-	struct vm_page_array		*vmr_pages;
+	struct vm_pagetable		*vmr_pages;	/* sparse table of the pages */
 	vaddr_t				vmr_base;
+	int				vmr_type;	/* VMR_ANON or VMR_FILE */
+	int				vmr_prot;	/* PROT_* allowed on the region */
+	int				vmr_flags;	/* MAP_* the region was mmap()ed with, 0 otherwise */
+	struct vnode			*vmr_vnode;	/* backing object for VMR_FILE */
+	off_t				vmr_offset;	/* file offset of vmr_base */
+	struct vm_share			*vmr_share;	/* non-NULL for MAP_SHARED regions */
+	int				vmr_advice;	/* MADV_* access pattern */
+	unsigned			vmr_nused;	/* pages instantiated, in core or swapped */
+	struct bitmap			*vmr_pinned;	/* shared pages this region mlock()ed; NULL if none */
 };
 
+/* how far MADV_SEQUENTIAL regions read ahead and drop behind */
+#define VMR_READAHEAD	4
+#define VMR_DROPBEHIND	8
+
 DECLARRAY_BYTYPE( vm_region_array, struct vm_region );
 
 struct vm_region		*vm_region_create( size_t );
 void				vm_region_destroy( struct vm_region * );
+void				vm_region_reap( struct vm_region * );
 int				vm_region_clone( struct vm_region *, struct vm_region ** );
 int				vm_region_resize( struct vm_region *, unsigned );
+int				vm_region_share( struct vm_region * );
+int				vm_region_new_page( struct vm_region *, unsigned, struct vm_page ** );
+int				vm_region_writeback( struct vm_region * );
+int				vm_region_get_page( struct vm_region *, unsigned, struct vm_page ** );
+int				vm_region_unmerge( struct vm_region *, unsigned, struct vm_page ** );
+void				vm_region_prefetch( struct vm_region *, unsigned, unsigned );
+void				vm_region_deactivate( struct vm_region *, unsigned, unsigned );
+int				vm_region_discard( struct vm_region *, unsigned, unsigned );
+int				vm_region_mlock( struct vm_region *, unsigned, unsigned, unsigned * );
+unsigned			vm_region_munlock( struct vm_region *, unsigned, unsigned );
 struct vm_region		*vm_region_find_responsible( struct addrspace *, vaddr_t );
+struct vm_region		*vm_region_find_overlap( struct addrspace *, vaddr_t, size_t );
+int				vm_region_insert( struct addrspace *, struct vm_region * );
+void				vm_region_remove( struct addrspace *, unsigned );
 #endif
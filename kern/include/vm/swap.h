@@ -7,6 +7,11 @@
 #define SWAP_DEVICE "lhd0raw:"
 #define SWAP_MIN_FACTOR 40
 
+/* overcommit policies for swap_reserve() */
+#define SWAP_OVERCOMMIT_STRICT		0	/* every reservation is backed by swap */
+#define SWAP_OVERCOMMIT_HEURISTIC	1	/* refuse only what could never fit */
+#define SWAP_OVERCOMMIT_ALWAYS		2	/* never refuse */
+
 #define LOCK_SWAP() (lock_acquire(lk_sw))
 #define UNLOCK_SWAP() (lock_release(lk_sw))
 
@@ -19,7 +24,8 @@
  * holds statistics regarding swapping.
  * ss_total: total number of pages we can hold.
  * ss_free: free pages count.
- * ss_reserved: how many of them are reserved.
+ * ss_reserved: how many pages are promised but not yet allocated.
+ * unless we are strict, ss_reserved may exceed ss_free.
  */
 struct swap_stats {
 	unsigned int		ss_total;
@@ -33,9 +39,14 @@ off_t		swap_alloc(void);
 void		swap_in( paddr_t, off_t );
 void		swap_out( paddr_t, off_t );
 void		swap_dealloc( off_t );
+void		swap_dealloc_batch( const off_t *, unsigned );
 int		swap_reserve(unsigned);
 void		swap_unreserve(unsigned);
+void		swap_recommit(unsigned);
+int		swap_set_overcommit( int );
 
 extern struct lock	*giant_paging_lock;
+extern int		swap_overcommit;
+extern struct swap_stats	ss_sw;
 
 #endif
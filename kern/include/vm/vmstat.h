@@ -0,0 +1,38 @@
+#ifndef _VM_VMSTAT_H
+#define _VM_VMSTAT_H
+
+#include <kern/vmstat.h>
+
+/**
+ * every cpu bumps its own row of counters, so the hot paths never
+ * share a cache line or take a lock; readers sum the rows.
+ */
+#define VMSTAT_MAXCPUS 32
+
+struct vmstat_cpu {
+	uint64_t		vc_counters[VMSTAT_NCOUNTERS];
+};
+
+extern struct vmstat_cpu	vmstat_cpus[VMSTAT_MAXCPUS];
+
+void			vmstat_add( unsigned, uint64_t );
+void			vmstat_fault( bool );
+void			vmstat_snapshot( struct vmstat * );
+void			vmstat_reset( void );
+void			vmstat_print( void );
+void			vmstat_bootstrap( void );
+
+#define vmstat_inc(ix) vmstat_add( (ix), 1 )
+
+/**
+ * account for a waiter that was woken up, and still has to wait
+ * if still_waiting.
+ */
+#define vmstat_wakeup(still_waiting) do { \
+	vmstat_inc( VMSTAT_WAKEUPS ); \
+	if( still_waiting ) \
+		vmstat_inc( VMSTAT_SPURIOUS ); \
+} while( 0 )
+#define vmstat_sub(ix, n) vmstat_add( (ix), -(uint64_t)(n) )
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _WAITQ_H_
+#define _WAITQ_H_
+
+/**
+ * hashed wait queues.
+ * a waitq lets threads wait for events on many objects at once, keyed
+ * by the address of the object, without a wait channel per object.
+ * the keys are hashed onto a fixed number of wait channels, and a
+ * wakeup for a key wakes only the threads that waited for that key,
+ * not everybody else who hashed onto the same channel.
+ *
+ * the protocol is the one of wait channels: lock the key with
+ * waitq_lock() while still holding whatever protects the condition,
+ * release that, then call waitq_sleep(), which returns with the
+ * key unlocked. wakers call waitq_wakeall() holding the same
+ * condition lock, so no wakeup can slip in between. waitq_wakeone()
+ * wakes the longest waiter for the key only, and tells if there was one.
+ */
+#define WAITQ_HASHBITS		5
+#define WAITQ_NBUCKETS		(1 << WAITQ_HASHBITS)
+
+struct waitq;
+
+struct waitq	*waitq_create( const char * );
+void		waitq_lock( struct waitq *, const void * );
+void		waitq_sleep( struct waitq *, const void * );
+bool		waitq_wakeone( struct waitq *, const void * );
+void		waitq_wakeall( struct waitq *, const void * );
+void		waitq_wakeall_keys( struct waitq * );
+
+/**
+ * when set, waitq_wakeall() wakes the waiters for every key, as a
+ * single wait channel did; for comparing the two.
+ */
+void		waitq_set_herd( bool );
+bool		waitq_get_herd( void );
+
+#endif
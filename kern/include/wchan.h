@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct thread; /* from <thread.h> */
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -71,15 +72,37 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Same as wchan_sleep, but wake up on our own at DEADLINE (in
+ * nanoseconds, as returned by clock_now) if nobody has woken us by
+ * then. Returns true if the deadline passed, false if woken.
+ */
+bool wchan_sleep_until(struct wchan *wc, uint64_t deadline);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
+ *
+ * wchan_wakeone returns the thread it woke, or NULL if there was
+ * none. It may already be running by then; the pointer is only good
+ * for telling who it was.
  */
-void wchan_wakeone(struct wchan *wc);
+struct thread *wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Keyed sleeping, for channels shared by waiters for different
+ * things (see waitq.h). wchan_sleep_key is wchan_sleep remembering
+ * KEY; wchan_wakeone_key and wchan_wakeall_key wake only threads that
+ * slept with the same KEY. Plain wchan_sleep sleeps with a NULL key,
+ * which plain wakeups ignore anyway.
+ */
+void wchan_sleep_key(struct wchan *wc, const void *key);
+struct thread *wchan_wakeone_key(struct wchan *wc, const void *key);
+void wchan_wakeall_key(struct wchan *wc, const void *key);
+
 
 #endif /* _WCHAN_H_ */
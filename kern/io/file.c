@@ -3,6 +3,34 @@
 #include <kern/errno.h>
 #include <file.h>
 #include <vfs.h>
+#include <vm/objcache.h>
+
+//files come with their lock already made.
+static struct objcache	*file_cache;
+
+static
+int
+file_ctor( void *obj ) {
+	struct file *f = obj;
+
+	f->f_lk = lock_create( "f_lk" );
+	return ( f->f_lk == NULL ) ? ENOMEM : 0;
+}
+
+static
+void
+file_dtor( void *obj ) {
+	struct file *f = obj;
+
+	lock_destroy( f->f_lk );
+}
+
+void
+file_bootstrap( void ) {
+	file_cache = objcache_create( "file", sizeof( struct file ), file_ctor, file_dtor );
+	if( file_cache == NULL )
+		panic( "file_bootstrap: could not create file_cache." );
+}
 
 /*
  * create a new file associated with the given vnode/flags
@@ -11,7 +39,8 @@ int
 file_create( struct vnode *vn, int flags, struct file **f ) {
 	struct file *res;
 
-	res = kmalloc( sizeof( struct file ) );
+	//the lock comes with it.
+	res = objcache_alloc( file_cache );
 	if( res == NULL )
 		return ENOMEM;
 
@@ -21,13 +50,6 @@ file_create( struct vnode *vn, int flags, struct file **f ) {
 	res->f_vnode = vn;
 	res->f_offset = 0;
 
-	//attempt to create the lock
-	res->f_lk = lock_create( "f_lk" );
-	if( res->f_lk == NULL ) {
-		kfree( res );
-		return ENOMEM;
-	}
-
 	*f = res;
 	return 0;
 }
@@ -44,11 +66,11 @@ file_destroy( struct file *f ) {
 	//close the associated vnode
 	vfs_close( f->f_vnode );
 	
-	//release and destroy the lock
-	lock_destroy( f->f_lk );
+	//the lock stays with the structure, for the next one.
+	KASSERT( !lock_do_i_hold( f->f_lk ) );
 
 	//free the memory
-	kfree( f );
+	objcache_free( file_cache, f );
 }
 
 /**
@@ -95,15 +117,15 @@ file_get(struct proc *p, int fd, struct file **f ) {
 	if( fd >= MAX_OPEN_FILES || fd < 0 )
 		return EBADF;
 
-	FD_LOCK( p->p_fd );
+	FD_RLOCK( p->p_fd );
 	if( p->p_fd->fd_ofiles[fd] != NULL ) { 
 		*f = p->p_fd->fd_ofiles[fd];
 		F_LOCK( *f );
-		FD_UNLOCK( p->p_fd );
+		FD_RUNLOCK( p->p_fd );
 		return 0;
 	}
 	
-	FD_UNLOCK( p->p_fd );
+	FD_RUNLOCK( p->p_fd );
 	return EBADF;
 }
 
@@ -114,10 +136,10 @@ bool
 file_descriptor_exists( struct proc *p, int fd ) {
 	bool 		exists = false;
 
-	FD_LOCK( p->p_fd );
+	FD_RLOCK( p->p_fd );
 	if( p->p_fd->fd_ofiles[fd] != NULL )
 		exists = true;
-	FD_UNLOCK( p->p_fd );
+	FD_RUNLOCK( p->p_fd );
 	
 	return exists;
 }
@@ -130,16 +152,16 @@ file_close_all( struct proc *p ) {
 	int		i = 0;
 	int		err;
 
-	FD_LOCK( p->p_fd );
+	FD_RLOCK( p->p_fd );
 	for( i = 0; i < MAX_OPEN_FILES; ++i ) {
 		if( p->p_fd->fd_ofiles[i] != NULL ) {
-			FD_UNLOCK( p->p_fd );
+			FD_RUNLOCK( p->p_fd );
 			err = file_close_descriptor( p, i );
 			if( err )
 				return -1;
-			FD_LOCK( p->p_fd );
+			FD_RLOCK( p->p_fd );
 		}
 	}
-	FD_UNLOCK( p->p_fd );
+	FD_RUNLOCK( p->p_fd );
 	return 0;
 }
@@ -39,7 +39,7 @@ fd_detach( struct filedesc *fdesc, int fd ) {
 void
 fd_destroy( struct filedesc *fdesc ) {
 	KASSERT( fdesc->fd_nfiles == 0 );
-	lock_destroy( fdesc->fd_lk );
+	rwlock_destroy( fdesc->fd_lk );
 	kfree( fdesc );
 }
 
@@ -54,7 +54,7 @@ fd_create( struct filedesc **fdesc ) {
 		return ENOMEM;
 
 	//create the lock
-	fd->fd_lk = lock_create( "fd_lk" );
+	fd->fd_lk = rwlock_create( "fd_lk" );
 	if( fd->fd_lk == NULL ) {
 		kfree( fd );
 		return ENOMEM;
@@ -102,9 +102,9 @@ fd_clone( struct filedesc *source, struct filedesc *fdesc ) {
 	struct file		*f = NULL;
 	int			i = 0;
 
-	//lock the source file-descriptor table.
+	//lock the source file-descriptor table; we only read it.
 	//and for each file, we copy its pointer into the new table.
-	FD_LOCK( source );
+	FD_RLOCK( source );
 	for( i = 0; i < MAX_OPEN_FILES; ++i ) {
 		if(  source->fd_ofiles[i] != NULL ) {
 			//lock the file for atomicity.
@@ -129,5 +129,5 @@ fd_clone( struct filedesc *source, struct filedesc *fdesc ) {
 	KASSERT( source->fd_nfiles == fdesc->fd_nfiles );
 	
 	//unlock.
-	FD_UNLOCK( source );
+	FD_RUNLOCK( source );
 }
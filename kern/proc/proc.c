@@ -2,23 +2,59 @@
 #include <lib.h>
 #include <kern/errno.h>
 #include <proc.h>
+#include <file.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <syscall.h>
+#include <vm/objcache.h>
 
 struct proc 		*allproc[MAX_PROCESSES];
-struct lock 		*lk_allproc;
+struct rwlock		*lk_allproc;
 struct lock		*lk_exec;
 int			next_pid;
 
+//procs come with their lock and semaphore already made.
+static struct objcache	*proc_cache;
+
+static
+int
+proc_ctor( void *obj ) {
+	struct proc	*p = obj;
+
+	p->p_lk = lock_create( "p_lk" );
+	if( p->p_lk == NULL )
+		return ENOMEM;
+
+	p->p_sem = sem_create( "p_sem", 0 );
+	if( p->p_sem == NULL ) {
+		lock_destroy( p->p_lk );
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+static
+void
+proc_dtor( void *obj ) {
+	struct proc	*p = obj;
+
+	sem_destroy( p->p_sem );
+	lock_destroy( p->p_lk );
+}
+
 /**
  * add the given function to the allproc array.
  */
 static
 void
 proc_add_to_allproc( struct proc *p, int spot ) {
-	lock_acquire( lk_allproc );
+	rwlock_acquire_write( lk_allproc );
 
 	KASSERT( allproc[spot] == (void *)PROC_RESERVED_SPOT );
 	allproc[spot] = p;
-	lock_release( lk_allproc );
+	rwlock_release_write( lk_allproc );
 }
 
 /**
@@ -40,7 +76,7 @@ proc_found_spot( pid_t *pid, int spot ) {
 	next_pid = spot + 1;
 
 	//release the lock
-	lock_release( lk_allproc );
+	rwlock_release_write( lk_allproc );
 }
 
 /**
@@ -54,7 +90,7 @@ proc_alloc_pid( pid_t *pid ) {
 	int		i = 0;
 
 	//lock allproc, to guarantee atomicity
-	lock_acquire( lk_allproc );
+	rwlock_acquire_write( lk_allproc );
 	
 	//if the next_pid is greater than the maximum number of processes
 	//we need to start failing pid allocations.
@@ -79,7 +115,7 @@ proc_alloc_pid( pid_t *pid ) {
 	}
 
 	//we couldn't find a spot, so we have to fail.
-	lock_release( lk_allproc );
+	rwlock_release_write( lk_allproc );
 	return ENPROC;
 }
 
@@ -90,14 +126,14 @@ static
 void
 proc_dealloc_pid( pid_t pid ) {
 	//lock for atomicity.
-	lock_acquire( lk_allproc );
+	rwlock_acquire_write( lk_allproc );
 
 	//it cannot be null, it must be either reserved or fulfilled.
 	KASSERT( allproc[pid] != NULL );
 	allproc[pid] = NULL;
 	
 	//unlock and be done.
-	lock_release( lk_allproc );
+	rwlock_release_write( lk_allproc );
 }
 
 int
@@ -111,8 +147,8 @@ proc_create( struct proc **res ) {
 	if( err )
 		return err;
 
-	//alloc memory for the structure
-	p = kmalloc( sizeof( struct proc ) );
+	//get a structure, lock and semaphore included.
+	p = objcache_alloc( proc_cache );
 	if( p == NULL ) {
 		proc_dealloc_pid( pid );
 		return ENOMEM;
@@ -124,36 +160,25 @@ proc_create( struct proc **res ) {
 	//create the filedescriptor table
 	err = fd_create( &p->p_fd );
 	if( err ) {
-		kfree( p );
+		objcache_free( proc_cache, p );
 		proc_dealloc_pid( pid );
 		return err;
 	}
 
-	//create the lock
-	p->p_lk = lock_create( "p_lk" );
-	if( p->p_lk == NULL ) {
-		fd_destroy( p->p_fd );
-		kfree( p );
-		proc_dealloc_pid( pid );
-		return ENOMEM;
-	}
-
-	//create the semaphore
-	p->p_sem = sem_create( "p_sem", 0 );
-	if( p->p_sem == NULL ) {
-		lock_destroy( p->p_lk );
-		fd_destroy( p->p_fd );
-		kfree( p );
-		proc_dealloc_pid( pid );
-		return ENOMEM;
-	}
-
 	//adjust static information
 	p->p_retval = 0;
 	p->p_is_dead = false;
 	p->p_nsyscalls = 0;
 	p->p_nice = 0;
+	p->p_affinity = THREAD_AFFINITY_ALL;
+	p->p_migrations = 0;
 	p->p_proc = NULL;
+	p->p_npages = 0;
+	p->p_killed = false;
+	p->p_killtime = 0;
+	p->p_minflt = 0;
+	p->p_majflt = 0;
+	p->p_vfork_sem = NULL;
 
 	//add to the list of allproc
 	proc_add_to_allproc( p, pid );
@@ -178,6 +203,9 @@ proc_clone( struct proc *source, struct proc **target ) {
 	//clone all the files from the source file-descriptor table
 	//into the childs file-descriptor table.
 	fd_clone( source->p_fd, p->p_fd );
+
+	//the child runs where we may.
+	p->p_affinity = source->p_affinity;
 	
 	//we are done, simply copy the new proc 
 	//into the given pointer.
@@ -194,21 +222,20 @@ proc_destroy( struct proc *p ) {
 
 	//copy the pid for later used.
 	pid = p->p_pid;
-	
-	//destroy the cv
-	sem_destroy( p->p_sem );
 
-	//destroy the lock associated with it.
-	lock_destroy( p->p_lk );
+	//deallocate the pid first, so nobody can find us while we go away.
+	proc_dealloc_pid( pid );
+	
+	//the lock and semaphore stay with the structure, so they
+	//must be as proc_ctor() left them.
+	KASSERT( !lock_do_i_hold( p->p_lk ) );
+	KASSERT( p->p_sem->sem_count == 0 );
 
 	//destroy the filedescriptor table
 	fd_destroy( p->p_fd );
 
-	//free the memory.
-	kfree( p );
-
-	//deallocate the pid.
-	proc_dealloc_pid( pid );
+	//give the structure back.
+	objcache_free( proc_cache, p );
 }
 
 /**
@@ -223,17 +250,24 @@ proc_system_init( void ) {
 		allproc[i] = NULL;
 	}
 
-	//create the lock
-	lk_allproc = lock_create( "lk_allproc" );
+	//create the lock; lookups far outnumber pid changes, so readers share it.
+	lk_allproc = rwlock_create( "lk_allproc" );
 	if( lk_allproc == NULL ) 
 		panic( "could not initialize proc system." );
 
 	//create the lock protecting exec args
 	lk_exec = lock_create( "lk_exec" );
 	if( lk_exec == NULL ) {
-		lock_destroy( lk_allproc );
+		rwlock_destroy( lk_allproc );
 		panic( "could not create lk_exec." );
 	}
+
+	proc_cache = objcache_create( "proc", sizeof( struct proc ), proc_ctor, proc_dtor );
+	if( proc_cache == NULL )
+		panic( "could not create proc_cache." );
+
+	//processes open files, so those are set up here, too.
+	file_bootstrap();
 	//set last pid to be 0.
 	next_pid = 0;
 }
@@ -248,22 +282,83 @@ proc_get( pid_t pid, struct proc **res ) {
 	if( pid >= MAX_PROCESSES || pid <= 0 )
 		return EINVAL;
 
-	//lock allproc.
-	lock_acquire( lk_allproc );
+	//lock allproc for reading, other lookups may go on alongside.
+	rwlock_acquire_read( lk_allproc );
 	
 	//if the requested pid is associated with a valid process
 	if( allproc[pid] != NULL && allproc[pid] != (void *)PROC_RESERVED_SPOT ) {
 		PROC_LOCK( allproc[pid] );
 		*res = allproc[pid];
-		lock_release( lk_allproc );
+		rwlock_release_read( lk_allproc );
 		return 0;
 	}
 	
 	//the requested pid is actually invalid.
-	lock_release( lk_allproc );
+	rwlock_release_read( lk_allproc );
 	return ESRCH;
 		
 }
+/**
+ * exit if the oom killer chose the current process.
+ * must be called where it is safe to exit, i.e. holding nothing.
+ */
+void
+proc_check_killed( void ) {
+	if( proc_killed() )
+		sys__exit( -1 );
+}
+
+/**
+ * was the current process chosen by the oom killer?
+ * long sleeps check this to give up early.
+ */
+bool
+proc_killed( void ) {
+	return curthread->td_proc != NULL && curthread->td_proc->p_killed;
+}
+
+/**
+ * a vfork()ed child is done with the addrspace of its parent,
+ * so the parent may run again.
+ */
+void
+proc_vfork_done( struct proc *p ) {
+	struct semaphore	*sem;
+
+	PROC_LOCK( p );
+	sem = p->p_vfork_sem;
+	p->p_vfork_sem = NULL;
+	PROC_UNLOCK( p );
+
+	//the parent destroys the semaphore once it wakes up.
+	if( sem != NULL )
+		V( sem );
+}
+
+/**
+ * print the scheduling state of every process: its nice value, the cpus
+ * it may run on, and how often its thread changed cpus.
+ * the migration counts are as of each process' last system call.
+ */
+void
+proc_printsched( void ) {
+	struct proc		*p;
+	int			i;
+
+	kprintf( "%5s %5s %10s %10s\n", "pid", "nice", "affinity", "migrations" );
+
+	rwlock_acquire_read( lk_allproc );
+	for( i = 0; i < MAX_PROCESSES; ++i ) {
+		p = allproc[i];
+		if( p == NULL || p == (void *)PROC_RESERVED_SPOT )
+			continue;
+
+		kprintf( "%5d %5d 0x%08x %10u\n", p->p_pid, p->p_nice,
+			p->p_affinity, p->p_migrations );
+	}
+	rwlock_release_read( lk_allproc );
+}
+
 /** 
  * stress tests.
  */
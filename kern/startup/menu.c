@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <vfs.h>
 #include <sfs.h>
@@ -44,10 +45,18 @@
 #include <proc.h>
 #include <file.h>
 #include <current.h>
+#include <vm/swap.h>
+#include <vm/vmstat.h>
+#include <vm/ksm.h>
+#include <vm/objcache.h>
+#include <waitq.h>
+#include <lockprof.h>
 
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-kmprof.h"
+#include "opt-lockprof.h"
 
 struct	proc		*p0;
 
@@ -469,14 +478,224 @@ static
 int
 cmd_kheapstats(int nargs, char **args)
 {
-	(void)nargs;
-	(void)args;
+	if (nargs == 3 && !strcmp(args[1], "objcache")) {
+		if (!strcmp(args[2], "on")) {
+			objcache_bypass = false;
+		}
+		else if (!strcmp(args[2], "off")) {
+			objcache_bypass = true;
+		}
+		else {
+			kprintf("Usage: kh objcache on|off\n");
+			return EINVAL;
+		}
+		return 0;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: kh [objcache on|off]\n");
+		return EINVAL;
+	}
 
 	kheap_printstats();
+	objcache_printstats();
 	
 	return 0;
 }
 
+static const char *overcommit_names[] = { "strict", "heuristic", "always" };
+
+/*
+ * Command to show or change the swap overcommit policy.
+ */
+static
+int
+cmd_overcommit(int nargs, char **args)
+{
+	int i;
+
+	if (nargs == 2) {
+		for (i=0; i<3; i++) {
+			if (!strcmp(args[1], overcommit_names[i])) {
+				break;
+			}
+		}
+		if (swap_set_overcommit(i)) {
+			kprintf("Usage: oc [strict|heuristic|always]\n");
+			return EINVAL;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: oc [strict|heuristic|always]\n");
+		return EINVAL;
+	}
+
+	kprintf("overcommit: %s\n", overcommit_names[swap_overcommit]);
+	kprintf("swap: %u total, %u free, %u reserved\n",
+		ss_sw.ss_total, ss_sw.ss_free, ss_sw.ss_reserved);
+	return 0;
+}
+
+/*
+ * Command to show (or clear) the paging statistics. "vm herd on"
+ * makes every VM wakeup wake all the waiters of its kind, as a
+ * single wait channel did, to compare the spurious wakeup counts.
+ */
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vmstat_reset();
+		return 0;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "herd") &&
+		 (!strcmp(args[2], "on") || !strcmp(args[2], "off"))) {
+		waitq_set_herd(!strcmp(args[2], "on"));
+		return 0;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vm [reset|herd on|herd off]\n");
+		return EINVAL;
+	}
+
+	vmstat_print();
+	return 0;
+}
+
+/*
+ * Command to show (or clear) the per-cpu scheduling statistics,
+ * followed by the affinity and migrations of each process.
+ */
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		cpu_resetstats();
+		return 0;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "tickless")) {
+		if (!strcmp(args[2], "on")) {
+			clock_tickless = true;
+		}
+		else if (!strcmp(args[2], "off")) {
+			clock_tickless = false;
+		}
+		else {
+			kprintf("Usage: cpu tickless on|off\n");
+			return EINVAL;
+		}
+		return 0;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: cpu [reset | tickless on|off]\n");
+		return EINVAL;
+	}
+
+	cpu_printstats();
+	kprintf("\n");
+	proc_printsched();
+	return 0;
+}
+
+/*
+ * Command to control the page merger.
+ */
+static
+int
+cmd_ksm(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = ksm_set_enabled(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		result = ksm_set_enabled(false);
+	}
+	else if (nargs == 4 && !strcmp(args[1], "rate")) {
+		result = ksm_set_rate(atoi(args[2]), atoi(args[3]));
+	}
+	else if (nargs == 1) {
+		result = 0;
+	}
+	else {
+		kprintf("Usage: ksm [on|off|rate pages seconds]\n");
+		return EINVAL;
+	}
+
+	if (result) {
+		return result;
+	}
+
+	ksm_print();
+	return 0;
+}
+
+#if OPT_KMPROF
+/*
+ * Command for kmalloc profiling.
+ */
+static
+int
+cmd_kmprof(int nargs, char **args)
+{
+	unsigned max = 20;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		kheap_profile_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kheap_profile_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kheap_profile_reset();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		max = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: kmprof [on|off|reset|count]\n");
+		return EINVAL;
+	}
+
+	kheap_profile_print(max);
+	return 0;
+}
+#endif
+
+#if OPT_LOCKPROF
+/*
+ * Command for lock contention profiling.
+ */
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	unsigned max = 10;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockprof_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockprof_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		max = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: lockprof [on|off|reset|count]\n");
+		return EINVAL;
+	}
+
+	lockprof_print(max);
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -537,6 +756,8 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc benchmark             ",
+	"[km4] Object cache benchmark        ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -547,6 +768,10 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy5] CV test 2             (1)     ",
+	"[sy6] Lock benchmark                ",
+	"[sy7] Reader-writer lock benchmark  ",
+	"[sy8] Priority inversion test       ",
+	"[tm1] Timer and timed sleep test    ",
 	"[sp1] Whalematching Driver  (1)     ",
 	"[sp2] Stoplight Driver      (1)     ",
 	"[fs1] Filesystem test               ",
@@ -578,6 +803,16 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[oc] Show/set swap overcommit       ",
+	"[vm] Show/reset paging statistics   ",
+	"[cpu] Show/reset cpu statistics     ",
+	"[ksm] Control same-page merging     ",
+#if OPT_KMPROF
+	"[kmprof] kmalloc profile by caller  ",
+#endif
+#if OPT_LOCKPROF
+	"[lockprof] Lock contention profile  ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -626,12 +861,24 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "oc",		cmd_overcommit },
+	{ "vm",		cmd_vmstat },
+	{ "cpu",	cmd_cpustats },
+	{ "ksm",	cmd_ksm },
+#if OPT_KMPROF
+	{ "kmprof",	cmd_kmprof },
+#endif
+#if OPT_LOCKPROF
+	{ "lockprof",	cmd_lockprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbench },
+	{ "km4",	objcachebench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -644,6 +891,10 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy5",	cvtest2 },
+	{ "sy6",	lockbench },
+	{ "sy7",	rwlockbench },
+	{ "sy8",	pitest },
+	{ "tm1",	clocktest },
 	
 #if OPT_SYNCHPROBS
   /* synchronization problem tests */
@@ -5,6 +5,7 @@
 #include <filedesc.h>
 #include <thread.h>
 #include <current.h>
+#include <addrspace.h>
 #include <syscall.h>
 
 /**
@@ -15,10 +16,14 @@
  * 4. if orphan, will destroy the proc associated with the current thread.
  * 4.1 if not orphan, will signal the parent regarding our death.
  * 5. call thread_exit() so we become a zombie.
+ * a vfork()ed child first hands the addrspace back to its parent.
+ * anybody else hands it to the reaper, so that neither we nor a parent
+ * in waitpid() wait for its pages to be freed.
  */
 void
 sys__exit( int code ) {
 	struct proc		*p = NULL;
+	struct addrspace	*as;
 	int			err;
 
 	KASSERT( curthread != NULL );
@@ -26,15 +31,34 @@ sys__exit( int code ) {
 	
 	p = curthread->td_proc;
 
+	//the addrspace is not ours to destroy in thread_exit().
+	if( p->p_vfork_sem != NULL ) {
+		curthread->t_addrspace = NULL;
+		proc_vfork_done( p );
+	}
+
+	//nothing runs in it anymore, so thread_exit() will not see it.
+	as = curthread->t_addrspace;
+	if( as != NULL ) {
+		curthread->t_addrspace = NULL;
+		as_activate( NULL );
+		as_destroy_deferred( as );
+	}
+
 	//close all open files.
 	err = file_close_all( p );
 	if( err ) 
 		panic( "problem closing a file." );
 
+	//the proc may be freed from here on, so thread_tick() must not
+	//look at it anymore.
+	curthread->td_proc = NULL;
+
 	//lock so we can adjust the return value.
 	PROC_LOCK( p );
 	p->p_retval = code;
 	p->p_is_dead = true;
+	p->p_migrations = curthread->t_migrations;
 
 	//if we are orphans ourselves, no one is interested
 	//in our return code, so we simply destroy ourselves.
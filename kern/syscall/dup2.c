@@ -6,18 +6,13 @@
 #include <current.h>
 #include <syscall.h>
 
-int	
-sys_dup2( int oldfd, int newfd, int *retval ) {
-	struct proc		*p = NULL;
+//kernel version of the dup2() systemcall.
+int
+___dup2( struct proc *p, int oldfd, int newfd ) {
 	struct file		*f_old = NULL;
 	struct file		*f_new = NULL;
 	int			err;
 
-	KASSERT( curthread != NULL );
-	KASSERT( curthread->td_proc != NULL );
-
-	p = curthread->td_proc;
-	
 	//make sure both file handles are valid
 	if( (oldfd < 0 || newfd < 0) || (newfd >= MAX_OPEN_FILES) )
 		return EBADF;
@@ -55,7 +50,20 @@ sys_dup2( int oldfd, int newfd, int *retval ) {
 
 	//unlock and return
 	F_UNLOCK( f_old );
-	*retval = newfd;
+	return 0;
+}
 
+int	
+sys_dup2( int oldfd, int newfd, int *retval ) {
+	int			err;
+
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->td_proc != NULL );
+
+	err = ___dup2( curthread->td_proc, oldfd, newfd );
+	if( err )
+		return err;
+
+	*retval = newfd;
 	return 0;
 }	
@@ -174,8 +174,32 @@ adjust_kargbuf( int nparams, vaddr_t stack_ptr ) {
 	return 0;
 }
 
-int	
-sys_execv( userptr_t upname, userptr_t uargs ) {
+/**
+ * give up on loading a new image: go back to the old addrspace,
+ * and release everything exec_load() acquired.
+ */
+static
+void
+exec_abort( struct addrspace *as_old, struct addrspace *as_new, struct vnode *vn ) {
+	curthread->t_addrspace = as_old;
+	as_activate( as_old );
+
+	as_destroy( as_new );
+	vfs_close( vn );
+	lock_release( lk_exec );
+}
+
+/**
+ * load the program named by upname into a brand new addrspace, and set up
+ * its stack with the arguments in uargs, both read from the current one.
+ * the current thread is back on its own addrspace when we return.
+ * on success, the new addrspace, the program entry point, the initial stack
+ * pointer and argc are returned.
+ */
+int
+exec_load( userptr_t upname, userptr_t uargs, struct addrspace **as_ret, 
+	vaddr_t *entry_ret, vaddr_t *stack_ret, int *argc_ret ) 
+{
 	struct addrspace		*as_new = NULL;
 	struct addrspace		*as_old = NULL;
 	struct vnode			*vn = NULL;
@@ -189,12 +213,10 @@ sys_execv( userptr_t upname, userptr_t uargs ) {
 	KASSERT( curthread != NULL );
 	KASSERT( curthread->td_proc != NULL );
 	
-	(void)uargs;
-	
 	//lock the execv args
 	lock_acquire( lk_exec );
 
-	//copy the old addrspace just in case.
+	//remember the current addrspace.
 	as_old = curthread->t_addrspace;
 
 	//copyin the program name.
@@ -227,33 +249,21 @@ sys_execv( userptr_t upname, userptr_t uargs ) {
 		return ENOMEM;
 	}
 	
-	//activate the new addrspace.
-	as_activate( as_new );
-
 	//temporarily switch the addrspaces.
 	curthread->t_addrspace = as_new;
+	as_activate( as_new );
 
 	//load the elf executable.
 	err = load_elf( vn, &entry_ptr );
 	if( err ) {
-		curthread->t_addrspace = as_old;
-		as_activate( as_old );
-	
-		as_destroy( as_new );
-		vfs_close( vn );
-		lock_release( lk_exec );
+		exec_abort( as_old, as_new, vn );
 		return err;
 	}
 
 	//create a stack for the new addrspace.
 	err = as_define_stack( as_new, &stack_ptr );
 	if( err ) {
-		curthread->t_addrspace = as_old;
-		as_activate( as_old );
-
-		as_destroy( as_new );
-		vfs_close( vn );
-		lock_release( lk_exec );
+		exec_abort( as_old, as_new, vn );
 		return err;
 	}
 	
@@ -261,37 +271,68 @@ sys_execv( userptr_t upname, userptr_t uargs ) {
 	stack_ptr -= buflen;
 	err = adjust_kargbuf( nargs, stack_ptr );
 	if( err ) {
-		curthread->t_addrspace = as_old;
-		as_activate( as_old );
-
-		as_destroy( as_new );
-		vfs_close( vn );
-		lock_release( lk_exec );
+		exec_abort( as_old, as_new, vn );
 		return err;
 	}
 
 	//copy the arguments into the new user stack.
 	err = copyout( kargbuf, (userptr_t)stack_ptr, buflen );
 	if( err ) {
-		curthread->t_addrspace = as_old;
-		as_activate( as_old );
-		as_destroy( as_new );
-		vfs_close( vn );
-		lock_release( lk_exec );
+		exec_abort( as_old, as_new, vn );
 		return err;
 	}
 
+	//switch back.
+	curthread->t_addrspace = as_old;
+	as_activate( as_old );
+
 	//reelase lk_exec
 	lock_release( lk_exec );
 
 	//no need for it anymore.
 	vfs_close( vn );
 
-	//we are good to go.
-	as_destroy( as_old );
+	*as_ret = as_new;
+	*entry_ret = entry_ptr;
+	*stack_ret = stack_ptr;
+	*argc_ret = nargs - 1;
+	return 0;
+}
+
+int	
+sys_execv( userptr_t upname, userptr_t uargs ) {
+	struct addrspace		*as_new = NULL;
+	struct addrspace		*as_old = NULL;
+	struct proc			*p = NULL;
+	vaddr_t				entry_ptr;
+	vaddr_t				stack_ptr;
+	int				argc;
+	int				err;
+
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->td_proc != NULL );
+
+	p = curthread->td_proc;
+
+	//build the new image.
+	err = exec_load( upname, uargs, &as_new, &entry_ptr, &stack_ptr, &argc );
+	if( err )
+		return err;
+
+	//switch over to it for good.
+	as_old = curthread->t_addrspace;
+	curthread->t_addrspace = as_new;
+	as_activate( as_new );
+
+	//a vfork()ed child gives the addrspace back to its parent,
+	//everybody else is done with theirs.
+	if( p->p_vfork_sem != NULL )
+		proc_vfork_done( p );
+	else
+		as_destroy_deferred( as_old );
 	
 	//off we go to userland.
-	enter_new_process( nargs-1, (userptr_t)stack_ptr, stack_ptr, entry_ptr );
+	enter_new_process( argc, (userptr_t)stack_ptr, stack_ptr, entry_ptr );
 	
 	panic( "execv: we should not be here." );
 	return EINVAL;
@@ -79,10 +79,17 @@ trapframe_clone( struct trapframe *tf, struct trapframe **newtf ) {
 	return 0;
 }
 
+/**
+ * create a child running on a copy of the trapframe.
+ * a fork()ed child gets a copy of our addrspace, while a vfork()ed one
+ * borrows it, and we sleep until it is done with it.
+ */
+static
 int
-sys_fork( struct trapframe *tf, int *retval ) {
+fork_common( struct trapframe *tf, bool borrow, int *retval ) {
 	struct proc		*p_new = NULL;
 	struct trapframe	*tf_new = NULL;
+	struct semaphore	*sem = NULL;
 	int			err;
 	struct child_fork_args	*args;
 	pid_t			pid;
@@ -101,10 +108,23 @@ sys_fork( struct trapframe *tf, int *retval ) {
 
 	//set the parent process of the new process to be us.
 	p_new->p_proc = curthread->td_proc;
+
+	//the child tells us through this when it lets go of our addrspace.
+	if( borrow ) {
+		sem = sem_create( "vfork", 0 );
+		if( sem == NULL ) {
+			file_close_all( p_new );
+			proc_destroy( p_new );
+			return ENOMEM;
+		}
+		p_new->p_vfork_sem = sem;
+	}
 	
 	//clone the trapframe.
 	err = trapframe_clone( tf, &tf_new );
 	if( err ) {	
+		if( sem != NULL )
+			sem_destroy( sem );
 		file_close_all( p_new );
 		proc_destroy( p_new );
 		return err;
@@ -114,6 +134,8 @@ sys_fork( struct trapframe *tf, int *retval ) {
 	args = kmalloc( sizeof( struct child_fork_args ) );
 	if( args == NULL ) {
 		kfree( tf_new );
+		if( sem != NULL )
+			sem_destroy( sem );
 		file_close_all( p_new );
 		proc_destroy( p_new );
 		return ENOMEM;
@@ -124,8 +146,12 @@ sys_fork( struct trapframe *tf, int *retval ) {
 	args->tf = tf_new;
 	args->td_proc = p_new;
 
-	//copy the addresspace.
-	err = as_copy( curthread->t_addrspace, &args->as_source );
+	//copy the addresspace, unless the child borrows ours.
+	if( borrow )
+		args->as_source = curthread->t_addrspace;
+	else
+		err = as_copy( curthread->t_addrspace, &args->as_source );
+
 	if( err ) {
 		//clean after ourselves.
 		kfree( args->tf );
@@ -148,18 +174,38 @@ sys_fork( struct trapframe *tf, int *retval ) {
 	//oh well, thread creation failed.
 	//make sure we clean-up after ourselves.
 	if( err ) {
-		as_destroy( args->as_source );
+		if( !borrow )
+			as_destroy( args->as_source );
 		kfree( args->tf );
 		kfree( args );
 
+		if( sem != NULL )
+			sem_destroy( sem );
+
 		//close all possible files open by the proc.
 		file_close_all( p_new );
 		proc_destroy( p_new );
 		return err;
 	}
-	
+
+	//wait until the child calls execv() or _exit().
+	//it cleared p_vfork_sem by then, and may even be gone.
+	if( sem != NULL ) {
+		P( sem );
+		sem_destroy( sem );
+	}
 
 	//parent returns with no errors.
 	*retval = pid;
 	return 0;	
 }
+
+int
+sys_fork( struct trapframe *tf, int *retval ) {
+	return fork_common( tf, false, retval );
+}
+
+int
+sys_vfork( struct trapframe *tf, int *retval ) {
+	return fork_common( tf, true, retval );
+}
@@ -0,0 +1,40 @@
+#include <types.h>
+#include <lib.h>
+#include <proc.h>
+#include <file.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <kern/errno.h>
+#include <current.h>
+#include <syscall.h>
+
+/**
+ * fsync() system call.
+ * flushes the shared mappings of the file we have, then the file itself.
+ */
+int
+sys_fsync( int fd ) {
+	struct proc		*p = NULL;
+	struct file		*f = NULL;
+	int			err;
+
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->td_proc != NULL );
+
+	p = curthread->td_proc;
+
+	err = file_get( p, fd, &f );
+	if( err )
+		return err;
+
+	//push dirty mapped pages into the file.
+	err = as_sync_vnode( curthread->t_addrspace, f->f_vnode );
+	if( err ) {
+		F_UNLOCK( f );
+		return err;
+	}
+
+	err = VOP_FSYNC( f->f_vnode );
+	F_UNLOCK( f );
+	return err;
+}
@@ -0,0 +1,295 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <waitq.h>
+#include <addrspace.h>
+#include <vm/region.h>
+#include <kern/errno.h>
+#include <copyinout.h>
+#include <current.h>
+#include <syscall.h>
+
+/**
+ * futexes.
+ * a futex is any aligned int in user memory that threads wait on.
+ * futex_wait sleeps as long as the int holds the value the caller
+ * expects, and futex_wake wakes up sleepers; everything else, such as
+ * what the int means, is up to user space (see umutex.h).
+ *
+ * the int is known by its key: the address space and the address for
+ * private memory, or the shared pages and the offset into them for a
+ * MAP_SHARED region, so that processes sharing it after fork() meet on
+ * the same futex. for each key somebody waits on there is a struct
+ * futex, found through a hash table, and the threads sleep on a waitq
+ * keyed by it. nothing but the bucket's spinlock is held between
+ * reading the int and going to sleep; the address space is only
+ * locked for a moment to work out the key.
+ */
+#define FUTEX_HASHBITS		6
+#define FUTEX_NBUCKETS		(1 << FUTEX_HASHBITS)
+
+struct futex {
+	const void			*fx_obj;	/* addrspace or vm_share */
+	vaddr_t				fx_off;		/* address, or offset into the share */
+	unsigned			fx_refs;	/* threads in futex_wait */
+	unsigned			fx_seq;		/* wakeups so far */
+	struct futex			*fx_next;	/* hash chain */
+};
+
+struct futex_bucket {
+	struct spinlock			fb_lock;
+	struct futex			*fb_head;
+};
+
+static struct futex_bucket		futex_table[FUTEX_NBUCKETS];
+static struct waitq			*futex_wq;
+
+void
+futex_bootstrap( void ) {
+	unsigned			i;
+
+	for( i = 0; i < FUTEX_NBUCKETS; ++i ) {
+		spinlock_init( &futex_table[i].fb_lock );
+		spinlock_setname( &futex_table[i].fb_lock, "futex" );
+		futex_table[i].fb_head = NULL;
+	}
+
+	futex_wq = waitq_create( "futex" );
+	if( futex_wq == NULL )
+		panic( "futex_bootstrap: out of memory\n" );
+}
+
+/**
+ * wake up every thread in futex_wait, e.g. for the oom killer; spurious
+ * returns are allowed, so the others just wait again. as in futex_wake,
+ * bumping fx_seq sends back those about to sleep.
+ */
+void
+futex_interrupt( void ) {
+	struct futex			*fx;
+	unsigned			i;
+
+	if( futex_wq == NULL )
+		return;
+
+	for( i = 0; i < FUTEX_NBUCKETS; ++i ) {
+		spinlock_acquire( &futex_table[i].fb_lock );
+		for( fx = futex_table[i].fb_head; fx != NULL; fx = fx->fx_next )
+			fx->fx_seq++;
+		spinlock_release( &futex_table[i].fb_lock );
+	}
+
+	waitq_wakeall_keys( futex_wq );
+}
+
+static inline
+struct futex_bucket *
+futex_bucket( const void *obj, vaddr_t off ) {
+	uint32_t			h;
+
+	h = ( ( (vaddr_t)obj >> 4 ) ^ ( off >> 2 ) ) * 2654435761U;
+	return &futex_table[h >> ( 32 - FUTEX_HASHBITS )];
+}
+
+/**
+ * work out the key of the int at uaddr.
+ */
+static
+int
+futex_key( userptr_t uaddr, const void **obj, vaddr_t *off ) {
+	struct addrspace		*as;
+	struct vm_region		*vmr;
+	vaddr_t				vaddr;
+
+	vaddr = (vaddr_t)uaddr;
+	if( ( vaddr & ( sizeof( int ) - 1 ) ) != 0 )
+		return EINVAL;
+
+	as = curthread->t_addrspace;
+	AS_LOCK( as );
+	vmr = vm_region_find_responsible( as, vaddr );
+	if( vmr == NULL ) {
+		AS_UNLOCK( as );
+		return EFAULT;
+	}
+
+	if( vmr->vmr_share != NULL ) {
+		*obj = vmr->vmr_share;
+		*off = vaddr - vmr->vmr_base;
+	}
+	else {
+		*obj = as;
+		*off = vaddr;
+	}
+	AS_UNLOCK( as );
+
+	return 0;
+}
+
+/**
+ * the futex for a key, if anybody waits on it. the bucket must be locked.
+ */
+static
+struct futex *
+futex_find( struct futex_bucket *fb, const void *obj, vaddr_t off ) {
+	struct futex			*fx;
+
+	for( fx = fb->fb_head; fx != NULL; fx = fx->fx_next )
+		if( fx->fx_obj == obj && fx->fx_off == off )
+			return fx;
+
+	return NULL;
+}
+
+/**
+ * find or make the futex for a key, and count ourselves in.
+ * *seq tells how many wakeups there had been by then.
+ */
+static
+struct futex *
+futex_get( struct futex_bucket *fb, const void *obj, vaddr_t off, unsigned *seq ) {
+	struct futex			*fx;
+	struct futex			*fresh;
+
+	//we can't allocate holding the bucket, so look first.
+	spinlock_acquire( &fb->fb_lock );
+	fx = futex_find( fb, obj, off );
+	if( fx != NULL ) {
+		fx->fx_refs++;
+		*seq = fx->fx_seq;
+		spinlock_release( &fb->fb_lock );
+		return fx;
+	}
+	spinlock_release( &fb->fb_lock );
+
+	fresh = kmalloc( sizeof( struct futex ) );
+	if( fresh == NULL )
+		return NULL;
+
+	spinlock_acquire( &fb->fb_lock );
+	fx = futex_find( fb, obj, off );
+	if( fx == NULL ) {
+		fx = fresh;
+		fresh = NULL;
+		fx->fx_obj = obj;
+		fx->fx_off = off;
+		fx->fx_refs = 0;
+		fx->fx_seq = 0;
+		fx->fx_next = fb->fb_head;
+		fb->fb_head = fx;
+	}
+	fx->fx_refs++;
+	*seq = fx->fx_seq;
+	spinlock_release( &fb->fb_lock );
+
+	//somebody else made it meanwhile.
+	if( fresh != NULL )
+		kfree( fresh );
+
+	return fx;
+}
+
+/**
+ * count ourselves out; the last one out frees the futex.
+ */
+static
+void
+futex_put( struct futex_bucket *fb, struct futex *fx ) {
+	struct futex			**pp;
+
+	spinlock_acquire( &fb->fb_lock );
+	KASSERT( fx->fx_refs > 0 );
+	if( --fx->fx_refs > 0 ) {
+		spinlock_release( &fb->fb_lock );
+		return;
+	}
+
+	for( pp = &fb->fb_head; *pp != fx; pp = &(*pp)->fx_next )
+		KASSERT( *pp != NULL );
+	*pp = fx->fx_next;
+	spinlock_release( &fb->fb_lock );
+
+	kfree( fx );
+}
+
+/**
+ * sleep as long as the int at uaddr holds val, until futex_wake.
+ * the int is read after we are counted in; if a wakeup comes before
+ * we are asleep, fx_seq tells us, and we return as if woken.
+ * a return does not mean the int has changed; the caller looks again.
+ */
+int
+sys_futex_wait( userptr_t uaddr, int val ) {
+	struct futex_bucket		*fb;
+	struct futex			*fx;
+	const void			*obj;
+	vaddr_t				off;
+	unsigned			seq;
+	int				cur;
+	int				err;
+
+	err = futex_key( uaddr, &obj, &off );
+	if( err )
+		return err;
+
+	fb = futex_bucket( obj, off );
+	fx = futex_get( fb, obj, off, &seq );
+	if( fx == NULL )
+		return ENOMEM;
+
+	//may fault, so nothing is locked.
+	err = copyin( uaddr, &cur, sizeof( cur ) );
+	if( !err && cur != val )
+		err = EAGAIN;
+
+	if( !err ) {
+		spinlock_acquire( &fb->fb_lock );
+		if( fx->fx_seq == seq ) {
+			//wakers need the bucket, so they find us asleep.
+			waitq_lock( futex_wq, fx );
+			spinlock_release( &fb->fb_lock );
+			waitq_sleep( futex_wq, fx );
+		}
+		else {
+			spinlock_release( &fb->fb_lock );
+		}
+	}
+
+	futex_put( fb, fx );
+	return err;
+}
+
+/**
+ * wake up to n threads sleeping on the int at uaddr, and tell how many
+ * there were. threads about to sleep are sent back as well, uncounted.
+ */
+int
+sys_futex_wake( userptr_t uaddr, int n, int *retval ) {
+	struct futex_bucket		*fb;
+	struct futex			*fx;
+	const void			*obj;
+	vaddr_t				off;
+	int				woken;
+	int				err;
+
+	if( n < 0 )
+		return EINVAL;
+
+	err = futex_key( uaddr, &obj, &off );
+	if( err )
+		return err;
+
+	woken = 0;
+	fb = futex_bucket( obj, off );
+	spinlock_acquire( &fb->fb_lock );
+	fx = futex_find( fb, obj, off );
+	if( fx != NULL ) {
+		fx->fx_seq++;
+		while( woken < n && waitq_wakeone( futex_wq, fx ) )
+			woken++;
+	}
+	spinlock_release( &fb->fb_lock );
+
+	*retval = woken;
+	return 0;
+}
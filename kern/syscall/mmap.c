@@ -0,0 +1,131 @@
+#include <types.h>
+#include <lib.h>
+#include <proc.h>
+#include <file.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/errno.h>
+#include <current.h>
+#include <syscall.h>
+
+#define PROT_ALL (PROT_READ | PROT_WRITE | PROT_EXEC)
+
+/**
+ * mmap() system call.
+ * maps len bytes of the file fd, starting at offset, or anonymous memory
+ * if MAP_ANON is given. addr is only used as a hint.
+ */
+int
+sys_mmap( vaddr_t addr, size_t len, int prot, int flags, int fd, off_t offset, void **retval ) {
+	struct proc		*p = NULL;
+	struct file		*f = NULL;
+	struct addrspace	*as;
+	vaddr_t			vaddr;
+	int			share;
+	int			err;
+
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->td_proc != NULL );
+
+	p = curthread->td_proc;
+	as = curthread->t_addrspace;
+
+	//exactly one of MAP_SHARED and MAP_PRIVATE.
+	share = flags & (MAP_SHARED | MAP_PRIVATE);
+	if( share != MAP_SHARED && share != MAP_PRIVATE )
+		return EINVAL;
+
+	//reject unknown bits.
+	if( (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON)) != 0 || (prot & ~PROT_ALL) != 0 )
+		return EINVAL;
+
+	if( len == 0 || (offset & ~(off_t)PAGE_FRAME) != 0 || offset < 0 )
+		return EINVAL;
+
+	//anonymous memory needs no file.
+	if( flags & MAP_ANON ) {
+		err = as_define_mapping( as, addr, len, prot, flags, NULL, 0, &vaddr );
+		if( err )
+			return err;
+
+		*retval = (void *)vaddr;
+		return 0;
+	}
+
+	//get the file, it comes back locked.
+	err = file_get( p, fd, &f );
+	if( err )
+		return err;
+
+	//we must be able to read the file to fill the pages,
+	//and writing through a shared mapping writes the file.
+	if( (f->f_oflags & O_ACCMODE) == O_WRONLY ||
+	    ( share == MAP_SHARED && (prot & PROT_WRITE) && (f->f_oflags & O_ACCMODE) != O_RDWR ) ) {
+		F_UNLOCK( f );
+		return EACCES;
+	}
+
+	//ask the file whether it can be mapped at all.
+	err = VOP_MMAP( f->f_vnode );
+	if( err ) {
+		F_UNLOCK( f );
+		return ( err == EUNIMP ) ? ENODEV : err;
+	}
+
+	err = as_define_mapping( as, addr, len, prot, flags, f->f_vnode, offset, &vaddr );
+	F_UNLOCK( f );
+	if( err )
+		return err;
+
+	*retval = (void *)vaddr;
+	return 0;
+}
+
+/**
+ * munmap() system call.
+ */
+int
+sys_munmap( vaddr_t addr, size_t len ) {
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->t_addrspace != NULL );
+
+	if( (addr & PAGE_FRAME) != addr || len == 0 )
+		return EINVAL;
+
+	return as_remove_mapping( curthread->t_addrspace, addr, len );
+}
+
+/**
+ * madvise() system call.
+ */
+int
+sys_madvise( vaddr_t addr, size_t len, int advice ) {
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->t_addrspace != NULL );
+
+	return as_advise( curthread->t_addrspace, addr, len, advice );
+}
+
+/**
+ * mlock() system call.
+ */
+int
+sys_mlock( vaddr_t addr, size_t len ) {
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->t_addrspace != NULL );
+
+	return as_mlock( curthread->t_addrspace, addr, len, true );
+}
+
+/**
+ * munlock() system call.
+ */
+int
+sys_munlock( vaddr_t addr, size_t len ) {
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->t_addrspace != NULL );
+
+	return as_mlock( curthread->t_addrspace, addr, len, false );
+}
@@ -13,10 +13,10 @@
 #include <synch.h>
 #include <syscall.h>
 
-int	
-sys_sbrk( intptr_t inc, void **ptr ) {
+static
+int
+___sbrk( struct addrspace *as, intptr_t inc, void **ptr ) {
 	struct vm_region		*vmr_heap;
-	struct addrspace		*as;
 	vaddr_t				heap_end;
 	vaddr_t				heap_start;
 	unsigned			new_pages;
@@ -24,9 +24,6 @@ sys_sbrk( intptr_t inc, void **ptr ) {
 	unsigned			covered_range;
 	int				res;
 
-	KASSERT( curthread != NULL && curthread->td_proc != NULL );
-
-	as = curthread->t_addrspace;
 	heap_start = as->as_heap_start;
 
 	if( inc == 0 ) {
@@ -46,7 +43,7 @@ sys_sbrk( intptr_t inc, void **ptr ) {
 	KASSERT( vmr_heap->vmr_base == heap_start );
 	
 	//calculate the end of the heap.
-	current_pages = vm_page_array_num( vmr_heap->vmr_pages );
+	current_pages = vm_pagetable_num( vmr_heap->vmr_pages );
 	heap_end = as->as_heap_end;
 	covered_range = heap_start + current_pages * PAGE_SIZE;
 
@@ -79,4 +76,18 @@ sys_sbrk( intptr_t inc, void **ptr ) {
 	as->as_heap_end += inc;
 	return 0;
 }
-	
+
+int	
+sys_sbrk( intptr_t inc, void **ptr ) {
+	struct addrspace		*as;
+	int				res;
+
+	KASSERT( curthread != NULL && curthread->td_proc != NULL );
+
+	//the heap region changes size under the addrspace lock.
+	as = curthread->t_addrspace;
+	AS_LOCK( as );
+	res = ___sbrk( as, inc, ptr );
+	AS_UNLOCK( as );
+	return res;
+}
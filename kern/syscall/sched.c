@@ -0,0 +1,76 @@
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <thread.h>
+#include <current.h>
+#include <syscall.h>
+
+/**
+ * find the process a scheduling call is about, locked.
+ * pid 0 stands for the caller.
+ */
+static
+int
+sched_getproc( pid_t pid, struct proc **res ) {
+	if( pid == 0 ) {
+		*res = curthread->td_proc;
+		PROC_LOCK( *res );
+		return 0;
+	}
+
+	return proc_get( pid, res );
+}
+
+/**
+ * restrict the process pid to the cpus in mask, bit n standing for cpu n.
+ * our own thread is restricted at once, anybody else's on its next
+ * system call. either moves off a cpu it may no longer use the next time
+ * it yields or wakes up.
+ */
+int
+sys_sched_setaffinity( pid_t pid, uint32_t mask ) {
+	struct proc		*p;
+	int			err;
+
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->td_proc != NULL );
+
+	//there must be at least one cpu left to run on.
+	if( !thread_affinity_valid( mask ) )
+		return EINVAL;
+
+	err = sched_getproc( pid, &p );
+	if( err )
+		return err;
+
+	p->p_affinity = mask;
+	if( p == curthread->td_proc )
+		thread_setaffinity( mask );
+	PROC_UNLOCK( p );
+
+	return 0;
+}
+
+/**
+ * copy the affinity mask of the process pid out to umask.
+ */
+int
+sys_sched_getaffinity( pid_t pid, userptr_t umask ) {
+	struct proc		*p;
+	uint32_t		mask;
+	int			err;
+
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->td_proc != NULL );
+
+	err = sched_getproc( pid, &p );
+	if( err )
+		return err;
+
+	mask = p->p_affinity;
+	PROC_UNLOCK( p );
+
+	return copyout( &mask, umask, sizeof( mask ) );
+}
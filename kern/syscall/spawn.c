@@ -0,0 +1,173 @@
+#include <types.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <thread.h>
+#include <current.h>
+#include <filedesc.h>
+#include <file.h>
+#include <addrspace.h>
+#include <kern/errno.h>
+#include <kern/spawn.h>
+#include <synch.h>
+#include <syscall.h>
+
+/**
+ * everything the child thread needs to start running the new program.
+ */
+struct spawn_child_args {
+	struct proc		*td_proc;
+	struct addrspace	*as;
+	vaddr_t			entry_ptr;
+	vaddr_t			stack_ptr;
+	int			argc;
+};
+
+/**
+ * the first function that gets executed by the spawned thread.
+ * the addrspace is fully built, so we go straight to usermode.
+ */
+static
+void
+spawn_child_start( void *v_args, unsigned long not_used ) {
+	struct spawn_child_args		*args;
+	vaddr_t				entry_ptr;
+	vaddr_t				stack_ptr;
+	int				argc;
+
+	(void)not_used;
+	args = v_args;
+
+	//become part of the new process.
+	curthread->td_proc = args->td_proc;
+
+	KASSERT( curthread->t_addrspace == NULL );
+	curthread->t_addrspace = args->as;
+	as_activate( curthread->t_addrspace );
+
+	entry_ptr = args->entry_ptr;
+	stack_ptr = args->stack_ptr;
+	argc = args->argc;
+	kfree( args );
+
+	enter_new_process( argc, (userptr_t)stack_ptr, stack_ptr, entry_ptr );
+	panic( "spawn: we should not be here." );
+}
+
+/**
+ * apply a single file action to the descriptor table of p.
+ */
+static
+int
+spawn_apply( struct proc *p, const struct spawn_action *sa ) {
+	char			kpath[MAX_FILE_NAME];
+	int			fd;
+	int			err;
+
+	if( sa->sa_fd < 0 || sa->sa_fd >= MAX_OPEN_FILES )
+		return EBADF;
+
+	switch( sa->sa_op ) {
+		case SPAWN_CLOSE:
+			return file_close_descriptor( p, sa->sa_fd );
+
+		case SPAWN_DUP2:
+			return ___dup2( p, sa->sa_fd, sa->sa_newfd );
+
+		case SPAWN_OPEN:
+			if( sa->sa_newfd < 0 || sa->sa_newfd >= MAX_OPEN_FILES )
+				return EBADF;
+
+			err = copyinstr( (userptr_t)sa->sa_path, kpath, sizeof( kpath ), NULL );
+			if( err )
+				return err;
+
+			err = ___open( p, kpath, sa->sa_flags, &fd );
+			if( err )
+				return err;
+
+			//move it where it was asked for.
+			if( fd != sa->sa_newfd ) {
+				err = ___dup2( p, fd, sa->sa_newfd );
+				file_close_descriptor( p, fd );
+			}
+			return err;
+
+		default:
+			return EINVAL;
+	}
+}
+
+/**
+ * create a child process running the program upname with the arguments
+ * uargs. unlike fork() followed by execv(), our addrspace is never copied:
+ * the new image is built directly, and the child starts out inside it.
+ */
+int
+sys_spawn( userptr_t upname, userptr_t uargs, userptr_t uactions, int nactions, int *retval ) {
+	struct spawn_action		actions[SPAWN_MAX_ACTIONS];
+	struct spawn_child_args		*args;
+	struct proc			*p_new;
+	int				err;
+	int				i;
+
+	KASSERT( curthread != NULL );
+	KASSERT( curthread->td_proc != NULL );
+
+	if( nactions < 0 || nactions > SPAWN_MAX_ACTIONS )
+		return EINVAL;
+
+	//get the file actions.
+	if( nactions > 0 ) {
+		err = copyin( uactions, actions, nactions * sizeof( struct spawn_action ) );
+		if( err )
+			return err;
+	}
+
+	args = kmalloc( sizeof( struct spawn_child_args ) );
+	if( args == NULL )
+		return ENOMEM;
+
+	//the child starts out with our files.
+	err = proc_clone( curthread->td_proc, &p_new );
+	if( err ) {
+		kfree( args );
+		return err;
+	}
+
+	//set up its descriptors as asked.
+	for( i = 0; i < nactions; ++i ) {
+		err = spawn_apply( p_new, &actions[i] );
+		if( err ) {
+			kfree( args );
+			file_close_all( p_new );
+			proc_destroy( p_new );
+			return err;
+		}
+	}
+
+	//build the new image.
+	err = exec_load( upname, uargs, &args->as, &args->entry_ptr, &args->stack_ptr, &args->argc );
+	if( err ) {
+		kfree( args );
+		file_close_all( p_new );
+		proc_destroy( p_new );
+		return err;
+	}
+
+	//we are its parent.
+	p_new->p_proc = curthread->td_proc;
+	args->td_proc = p_new;
+	*retval = p_new->p_pid;
+
+	err = thread_fork( curthread->t_name, spawn_child_start, args, 0, NULL );
+	if( err ) {
+		as_destroy( args->as );
+		kfree( args );
+		file_close_all( p_new );
+		proc_destroy( p_new );
+		return err;
+	}
+
+	return 0;
+}
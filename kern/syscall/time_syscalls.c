@@ -28,6 +28,8 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +58,34 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the time in the struct timespec at USER_REQ. Only the oom
+ * killer interrupts a sleep, and then the process never sees the
+ * time left, so nothing is stored at USER_REMAINDER.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_remainder)
+{
+	struct timespec req;
+	uint64_t deadline;
+	int result;
+
+	(void)user_remainder;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	deadline = clock_now() + (uint64_t)req.tv_sec * 1000000000ULL +
+		req.tv_nsec;
+	if (!thread_sleep_until(deadline)) {
+		return EINTR;
+	}
+
+	return 0;
+}
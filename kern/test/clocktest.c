@@ -0,0 +1,199 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define MSEC			1000000ULL
+#define CLOCKTEST_NTIMERS	16
+#define CLOCKTEST_IDLESECS	2
+
+//how long each sleep asks for, in msec; most aren't whole hardclocks.
+static const unsigned clocktest_sleeps[] = { 1, 5, 10, 25, 50, 100, 250 };
+
+static struct semaphore		*clocktest_sem;
+static struct lock		*clocktest_lock;
+static struct cv		*clocktest_cv;
+static volatile unsigned	clocktest_fired;
+static volatile uint64_t	clocktest_last;
+static volatile bool		clocktest_order;
+
+/**
+ * timer function: count, check they go off in order, and never early.
+ * timers due in the same hardclock go off together, in no particular
+ * order.
+ */
+static
+void
+clocktest_timer( void *arg ) {
+	struct timer		*tm = arg;
+	uint64_t		tick;
+
+	tick = ( tm->tm_deadline + CLOCK_TICK_NS - 1 ) / CLOCK_TICK_NS;
+	if( clock_now() < tm->tm_deadline || tick < clocktest_last )
+		clocktest_order = false;
+	clocktest_last = tick;
+
+	if( ++clocktest_fired == CLOCKTEST_NTIMERS )
+		V( clocktest_sem );
+}
+
+static
+void
+clocktest_timers( void ) {
+	struct timer		timers[CLOCKTEST_NTIMERS];
+	struct timer		never;
+	uint64_t		start;
+	unsigned		i;
+	int			spl;
+
+	clocktest_fired = 0;
+	clocktest_last = 0;
+	clocktest_order = true;
+
+	//added out of order, some sharing a tick, one far enough out to
+	//go on a higher wheel; all on one cpu, so they go off one by one.
+	spl = splhigh();
+	start = clock_now();
+	for( i = 0; i < CLOCKTEST_NTIMERS; ++i ) {
+		timer_init( &timers[i], clocktest_timer, &timers[i] );
+		timer_add( &timers[i], start + ( ( i * 7 ) % CLOCKTEST_NTIMERS ) * 3 * MSEC +
+			( i == 5 ? 900 * MSEC : 0 ) );
+	}
+	splx( spl );
+
+	timer_init( &never, clocktest_timer, &never );
+	timer_add( &never, start + 3600 * 1000 * MSEC );
+	if( !timer_cancel( &never ) )
+		panic( "clocktest: pending timer could not be cancelled\n" );
+	if( timer_cancel( &never ) )
+		panic( "clocktest: timer cancelled twice\n" );
+
+	P( clocktest_sem );
+	for( i = 0; i < CLOCKTEST_NTIMERS; ++i ) {
+		//all done; cancelling must find them gone.
+		if( timer_cancel( &timers[i] ) )
+			panic( "clocktest: timer %u still pending after firing\n", i );
+	}
+	if( !clocktest_order )
+		panic( "clocktest: timers went off early or out of order\n" );
+	kprintf( "timers: %u went off in order, in %llu msec\n", CLOCKTEST_NTIMERS,
+		( clock_now() - start ) / MSEC );
+}
+
+/**
+ * how far past the deadline thread_sleep_until wakes up.
+ */
+static
+void
+clocktest_sleeptest( void ) {
+	uint64_t		deadline, now, late;
+	unsigned		i, n;
+
+	n = sizeof( clocktest_sleeps ) / sizeof( clocktest_sleeps[0] );
+	for( i = 0; i < n; ++i ) {
+		deadline = clock_now() + clocktest_sleeps[i] * MSEC;
+		thread_sleep_until( deadline );
+		now = clock_now();
+
+		if( now < deadline )
+			panic( "clocktest: woke up %llu nsec early\n", deadline - now );
+		late = now - deadline;
+		kprintf( "sleep %3u msec: %6llu usec late\n", clocktest_sleeps[i], late / 1000 );
+	}
+
+	//one hardclock, in the worst case, unless the cpu was idle.
+	kprintf( "(up to %u usec late is expected)\n", CLOCK_TICK_NS / 1000 );
+}
+
+static
+void
+clocktest_signaller( void *junk, unsigned long msecs ) {
+	(void)junk;
+
+	thread_sleep_until( clock_now() + msecs * MSEC );
+	lock_acquire( clocktest_lock );
+	cv_signal( clocktest_cv, clocktest_lock );
+	lock_release( clocktest_lock );
+}
+
+static
+void
+clocktest_cvtest( void ) {
+	uint64_t		start, deadline, now;
+	int			err;
+
+	//nobody signals.
+	lock_acquire( clocktest_lock );
+	start = clock_now();
+	deadline = start + 50 * MSEC;
+	err = cv_timedwait( clocktest_cv, clocktest_lock, deadline );
+	now = clock_now();
+	if( err != ETIMEDOUT )
+		panic( "clocktest: cv_timedwait returned %d, expected ETIMEDOUT\n", err );
+	if( now < deadline )
+		panic( "clocktest: cv_timedwait timed out early\n" );
+	if( !lock_do_i_hold( clocktest_lock ) )
+		panic( "clocktest: cv_timedwait came back without the lock\n" );
+	kprintf( "cv_timedwait, no signal: timed out after %llu msec\n", ( now - start ) / MSEC );
+
+	//signalled well before the deadline.
+	err = thread_fork( "clocktest", clocktest_signaller, NULL, 20, NULL );
+	if( err )
+		panic( "clocktest: thread_fork failed: %s\n", strerror( err ) );
+	start = clock_now();
+	deadline = start + 5000 * MSEC;
+	err = cv_timedwait( clocktest_cv, clocktest_lock, deadline );
+	now = clock_now();
+	if( err != 0 )
+		panic( "clocktest: signalled cv_timedwait returned %d\n", err );
+	lock_release( clocktest_lock );
+	kprintf( "cv_timedwait, signalled: woken after %llu msec\n", ( now - start ) / MSEC );
+}
+
+/**
+ * with nothing to do, how often do the cpus take clock interrupts.
+ */
+static
+void
+clocktest_idle( bool tickless ) {
+	bool			saved;
+
+	saved = clock_tickless;
+	clock_tickless = tickless;
+
+	cpu_resetstats();
+	thread_sleep_until( clock_now() + CLOCKTEST_IDLESECS * 1000 * MSEC );
+	kprintf( "\nidle for %u seconds, tickless %s:\n", CLOCKTEST_IDLESECS, tickless ? "on" : "off" );
+	cpu_printstats();
+
+	clock_tickless = saved;
+}
+
+int
+clocktest( int nargs, char **args ) {
+	(void)nargs;
+	(void)args;
+
+	if( clocktest_sem == NULL ) {
+		clocktest_sem = sem_create( "clocktest", 0 );
+		clocktest_lock = lock_create( "clocktest" );
+		clocktest_cv = cv_create( "clocktest" );
+		if( clocktest_sem == NULL || clocktest_lock == NULL || clocktest_cv == NULL )
+			panic( "clocktest: out of memory\n" );
+	}
+
+	kprintf( "Starting clock test...\n" );
+	clocktest_timers();
+	clocktest_sleeptest();
+	clocktest_cvtest();
+	clocktest_idle( false );
+	clocktest_idle( true );
+	kprintf( "Clock test done.\n" );
+
+	return 0;
+}
@@ -32,8 +32,11 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
+#include <vm/objcache.h>
 #include <test.h>
 
 /*
@@ -138,3 +141,258 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * mallocbench: time kmalloc/kfree pairs of assorted small sizes, from
+ * 1, 2, 4, ... up to NTHREADS threads at once, and print the rate.
+ * Each thread keeps BENCHLIVE blocks around and replaces them in
+ * turn, so that blocks come and go as they would in real use.
+ */
+
+#define BENCHOPS   20000
+#define BENCHLIVE  32
+
+static const size_t benchsizes[] = { 16, 24, 48, 64, 100, 128, 250, 512 };
+#define NBENCHSIZES (sizeof(benchsizes) / sizeof(benchsizes[0]))
+
+static
+void
+benchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *live[BENCHLIVE];
+	unsigned i, slot;
+
+	for (i=0; i<BENCHLIVE; i++) {
+		live[i] = NULL;
+	}
+
+	for (i=0; i<BENCHOPS; i++) {
+		slot = i % BENCHLIVE;
+		if (live[slot] != NULL) {
+			kfree(live[slot]);
+		}
+		live[slot] = kmalloc(benchsizes[(i + num) % NBENCHSIZES]);
+		if (live[slot] == NULL) {
+			kprintf("thread %lu: kmalloc returned NULL\n", num);
+			break;
+		}
+	}
+
+	for (i=0; i<BENCHLIVE; i++) {
+		if (live[i] != NULL) {
+			kfree(live[i]);
+		}
+	}
+	V(sem);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	uint64_t usecs, ops;
+	unsigned i, nthreads;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("mallocbench", 0);
+	if (sem == NULL) {
+		panic("mallocbench: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc benchmark...\n");
+
+	for (nthreads=1; nthreads<=NTHREADS; nthreads*=2) {
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("mallocbench",
+					     benchthread, sem, i,
+					     NULL);
+			if (result) {
+				panic("mallocbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(sem);
+		}
+		gettime(&secs2, &nsecs2);
+
+		getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+		usecs = (uint64_t)rsecs * 1000000 + rnsecs / 1000;
+		ops = (uint64_t)nthreads * BENCHOPS;
+		kprintf("%u threads: %llu ops in %llu usec, %llu ops/sec\n",
+			nthreads, ops, usecs,
+			usecs ? ops * 1000000 / usecs : 0);
+	}
+
+	sem_destroy(sem);
+	kprintf("kmalloc benchmark done\n");
+
+	return 0;
+}
+
+/*
+ * objcachebench: compare getting and releasing objects from an object
+ * cache against kmalloc plus initialization, for a small object like
+ * struct vm_page and for one that carries a lock and a semaphore like
+ * struct proc. BENCHLIVE objects are taken, then all given back.
+ */
+
+#define OCBENCHROUNDS  500
+
+struct benchobj {
+	struct lock *bo_lock;
+	struct semaphore *bo_sem;
+	int bo_data[8];
+};
+
+static struct objcache *bench_small_cache;
+static struct objcache *bench_obj_cache;
+
+static
+int
+benchobj_ctor(void *obj)
+{
+	struct benchobj *bo = obj;
+
+	bo->bo_lock = lock_create("benchobj");
+	if (bo->bo_lock == NULL) {
+		return ENOMEM;
+	}
+	bo->bo_sem = sem_create("benchobj", 0);
+	if (bo->bo_sem == NULL) {
+		lock_destroy(bo->bo_lock);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+benchobj_dtor(void *obj)
+{
+	struct benchobj *bo = obj;
+
+	sem_destroy(bo->bo_sem);
+	lock_destroy(bo->bo_lock);
+}
+
+static
+struct benchobj *
+benchobj_create(void)
+{
+	struct benchobj *bo;
+
+	bo = kmalloc(sizeof(struct benchobj));
+	if (bo == NULL) {
+		return NULL;
+	}
+	if (benchobj_ctor(bo)) {
+		kfree(bo);
+		return NULL;
+	}
+	return bo;
+}
+
+static
+void
+benchobj_destroy(struct benchobj *bo)
+{
+	benchobj_dtor(bo);
+	kfree(bo);
+}
+
+/*
+ * Run OCBENCHROUNDS rounds of BENCHLIVE gets and puts, using
+ * the cache oc if it's not NULL and kmalloc/kfree otherwise.
+ */
+static
+uint64_t
+ocbench_run(struct objcache *oc, bool withlock)
+{
+	void *live[BENCHLIVE];
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	unsigned r, i;
+
+	gettime(&secs1, &nsecs1);
+	for (r=0; r<OCBENCHROUNDS; r++) {
+		for (i=0; i<BENCHLIVE; i++) {
+			if (oc != NULL) {
+				live[i] = objcache_alloc(oc);
+			}
+			else if (withlock) {
+				live[i] = benchobj_create();
+			}
+			else {
+				live[i] = kmalloc(8);
+			}
+			if (live[i] == NULL) {
+				panic("objcachebench: out of memory\n");
+			}
+		}
+		for (i=0; i<BENCHLIVE; i++) {
+			if (oc != NULL) {
+				objcache_free(oc, live[i]);
+			}
+			else if (withlock) {
+				benchobj_destroy(live[i]);
+			}
+			else {
+				kfree(live[i]);
+			}
+		}
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+	return (uint64_t)rsecs * 1000000 + rnsecs / 1000;
+}
+
+int
+objcachebench(int nargs, char **args)
+{
+	uint64_t ops, usecs;
+
+	(void)nargs;
+	(void)args;
+
+	/* The caches live on; make them once. */
+	if (bench_small_cache == NULL) {
+		bench_small_cache = objcache_create("bench8", 8,
+						    NULL, NULL);
+		bench_obj_cache = objcache_create("benchobj",
+						  sizeof(struct benchobj),
+						  benchobj_ctor,
+						  benchobj_dtor);
+		if (bench_small_cache == NULL || bench_obj_cache == NULL) {
+			panic("objcachebench: objcache_create failed\n");
+		}
+	}
+
+	kprintf("Starting object cache benchmark...\n");
+	ops = (uint64_t)OCBENCHROUNDS * BENCHLIVE;
+
+	usecs = ocbench_run(NULL, false);
+	kprintf("8 bytes, kmalloc:              %llu ops in %llu usec\n",
+		ops, usecs);
+	usecs = ocbench_run(bench_small_cache, false);
+	kprintf("8 bytes, object cache:         %llu ops in %llu usec\n",
+		ops, usecs);
+	usecs = ocbench_run(NULL, true);
+	kprintf("lock+sem, kmalloc and create:  %llu ops in %llu usec\n",
+		ops, usecs);
+	usecs = ocbench_run(bench_obj_cache, true);
+	kprintf("lock+sem, object cache:        %llu ops in %llu usec\n",
+		ops, usecs);
+
+	kprintf("object cache benchmark done\n");
+
+	return 0;
+}
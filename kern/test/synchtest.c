@@ -33,8 +33,11 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
 #include <synch.h>
 #include <test.h>
 
@@ -49,6 +52,7 @@ static volatile unsigned long testval3;
 static struct semaphore *testsem;
 static struct lock *testlock;
 static struct cv *testcv;
+static struct rwlock *testrwlock;
 static struct semaphore *donesem;
 
 static
@@ -73,6 +77,12 @@ inititems(void)
 			panic("synchtest: cv_create failed\n");
 		}
 	}
+	if (testrwlock==NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
 	if (donesem==NULL) {
 		donesem = sem_create("donesem", 0);
 		if (donesem == NULL) {
@@ -357,3 +367,578 @@ cvtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Lock benchmark: threads take turns in a short critical section on
+ * one lock, with a little work outside it, the way the VM and file
+ * code use their locks. Each thread count is run with adaptive locks
+ * off and then on, so the two can be compared on the same kernel.
+ */
+
+#define BENCHOPS	5000
+#define BENCHHOLD	20	/* busy loops inside the lock */
+#define BENCHWORK	100	/* busy loops outside it */
+#define BENCHTHREADS	8
+
+static volatile unsigned long benchcount;
+
+static
+void
+busyloop(unsigned n)
+{
+	volatile unsigned i;
+
+	for (i=0; i<n; i++) {
+		/* nothing */
+	}
+}
+
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<BENCHOPS; i++) {
+		lock_acquire(testlock);
+		benchcount++;
+		busyloop(BENCHHOLD);
+		lock_release(testlock);
+		busyloop(BENCHWORK);
+	}
+	V(donesem);
+}
+
+static
+void
+lockbenchrun(unsigned nthreads, bool adaptive)
+{
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	uint64_t usecs, ops;
+	unsigned i;
+	int result;
+
+	lock_adaptive = adaptive;
+	benchcount = 0;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("lockbench", lockbenchthread, NULL, i,
+				     NULL);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	ops = (uint64_t)nthreads * BENCHOPS;
+	if (benchcount != ops) {
+		panic("lockbench: %lu acquisitions counted, expected %llu\n",
+		      benchcount, ops);
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+	usecs = (uint64_t)rsecs * 1000000 + rnsecs / 1000;
+	kprintf("%u threads, %-8s: %llu ops in %llu usec, %llu ops/sec\n",
+		nthreads, adaptive ? "adaptive" : "sleeping", ops, usecs,
+		usecs ? ops * 1000000 / usecs : 0);
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	unsigned nthreads;
+	bool saved;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting lock benchmark...\n");
+
+	saved = lock_adaptive;
+	for (nthreads=1; nthreads<=BENCHTHREADS; nthreads*=2) {
+		lockbenchrun(nthreads, false);
+		lockbenchrun(nthreads, true);
+	}
+	lock_adaptive = saved;
+
+	kprintf("Lock benchmark done.\n");
+
+	return 0;
+}
+
+/*
+ * Reader-writer lock benchmark. Threads look things up in a small
+ * table, and once in a while one of them updates it, as happens with
+ * the process table or a file descriptor table. Each lookup checks
+ * that it never sees an update half done. With an exclusive lock the
+ * lookups go one at a time however many cpus there are; with the
+ * reader-writer lock they should go faster as threads are added, up
+ * to the number of cpus.
+ */
+
+#define RWTABLE		16
+#define RWWRITEEVERY	64	/* one update per this many operations */
+
+static volatile unsigned long rwtable[RWTABLE];
+
+static
+void
+rwlookup(void)
+{
+	unsigned i;
+
+	for (i=1; i<RWTABLE; i++) {
+		if (rwtable[i] != rwtable[0]) {
+			panic("rwbench: saw a half-done update\n");
+		}
+		busyloop(BENCHHOLD / RWTABLE + 1);
+	}
+}
+
+static
+void
+rwupdate(void)
+{
+	unsigned i;
+
+	for (i=0; i<RWTABLE; i++) {
+		rwtable[i]++;
+	}
+	benchcount++;
+}
+
+static
+void
+rwbenchthread(void *junk, unsigned long shared)
+{
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<BENCHOPS; i++) {
+		if (i % RWWRITEEVERY == 0) {
+			if (shared) {
+				rwlock_acquire_write(testrwlock);
+				rwupdate();
+				rwlock_release_write(testrwlock);
+			}
+			else {
+				lock_acquire(testlock);
+				rwupdate();
+				lock_release(testlock);
+			}
+		}
+		else if (shared) {
+			rwlock_acquire_read(testrwlock);
+			rwlookup();
+			rwlock_release_read(testrwlock);
+		}
+		else {
+			lock_acquire(testlock);
+			rwlookup();
+			lock_release(testlock);
+		}
+		busyloop(BENCHWORK);
+	}
+	V(donesem);
+}
+
+static
+void
+rwbenchrun(unsigned nthreads, bool shared)
+{
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	uint64_t usecs, ops;
+	unsigned long updates;
+	unsigned i;
+	int result;
+
+	benchcount = 0;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwbench", rwbenchthread, NULL, shared,
+				     NULL);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	ops = (uint64_t)nthreads * BENCHOPS;
+	updates = nthreads * ((BENCHOPS + RWWRITEEVERY - 1) / RWWRITEEVERY);
+	if (benchcount != updates) {
+		panic("rwbench: %lu updates counted, expected %lu\n",
+		      benchcount, updates);
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+	usecs = (uint64_t)rsecs * 1000000 + rnsecs / 1000;
+	kprintf("%u threads, %-9s: %llu ops in %llu usec, %llu ops/sec\n",
+		nthreads, shared ? "rwlock" : "exclusive", ops, usecs,
+		usecs ? ops * 1000000 / usecs : 0);
+}
+
+int
+rwlockbench(int nargs, char **args)
+{
+	unsigned nthreads;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting reader-writer lock benchmark...\n");
+
+	for (nthreads=1; nthreads<=BENCHTHREADS; nthreads*=2) {
+		rwbenchrun(nthreads, false);
+		rwbenchrun(nthreads, true);
+	}
+
+	kprintf("Reader-writer lock benchmark done.\n");
+
+	return 0;
+}
+
+/*
+ * Priority inversion test. A low-priority thread holds lock A, a
+ * medium-priority one holds lock B and waits for A, and then the
+ * test thread, at high priority, waits for B, all on one cpu that
+ * some CPU hogs, placed in between, keep busy. Without inheritance
+ * the low thread shares the cpu with the hogs while everyone else
+ * waits for it; with it, the low thread runs at the test thread's
+ * level, passed down the chain through the medium one, and the wait
+ * is about as long as what remains of its critical section. The run
+ * with inheritance checks that the low thread was boosted, that it
+ * gave the boost up with the lock, and that the wait was bounded: at
+ * most twice the critical section run alone, plus a few hardclocks,
+ * and shorter than without inheritance.
+ *
+ * Then a lock with two sleepers: the medium thread, which slept first
+ * and so gets the lock handed to it, and the test thread. The medium
+ * thread must run at the test thread's level from the handoff on,
+ * not only once it gets around to taking the lock over.
+ */
+
+#define PINICE_LOW	15	/* nice values; see thread_toplevel */
+#define PINICE_MID	10
+#define PINICE_HOG	5
+#define PIHOGS		4
+#define PICHUNK		10000	/* busy loops between looks around */
+#define PIWORK		200	/* chunks in the critical section */
+#define PISLACK		4	/* hardclocks allowed on top of the bound */
+
+static struct lock *pilocka, *pilockb, *pilockc;
+static struct semaphore *pisem;
+static struct thread *pihigh;
+static struct thread *volatile pimid;
+static volatile bool pistop;
+static volatile unsigned pilowbase, pilowlevel, piafter, pihandoff;
+
+static
+void
+pihogthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	curthread->t_nice = PINICE_HOG;
+	while (!pistop) {
+		busyloop(PICHUNK);
+	}
+	V(donesem);
+}
+
+static
+void
+pilowthread(void *junk, unsigned long num)
+{
+	unsigned i, level;
+
+	(void)junk;
+	(void)num;
+
+	curthread->t_nice = PINICE_LOW;
+	thread_yield();
+
+	lock_acquire(pilocka);
+	pilowbase = thread_level(curthread);
+	pilowlevel = pilowbase;
+	V(pisem);
+
+	/* Hold on until the test thread is stuck behind us... */
+	while (pihigh->t_blocked != pilockb) {
+		busyloop(PICHUNK);
+	}
+	/* ...and then do our bit, noting the best level we ran at. */
+	for (i=0; i<PIWORK; i++) {
+		busyloop(PICHUNK);
+		level = thread_level(curthread);
+		if (level < pilowlevel) {
+			pilowlevel = level;
+		}
+	}
+
+	lock_release(pilocka);
+	piafter = curthread->t_inherit;
+	V(donesem);
+}
+
+static
+void
+pimidthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	curthread->t_nice = PINICE_MID;
+	thread_yield();
+
+	lock_acquire(pilockb);
+	pimid = curthread;
+	V(pisem);
+
+	lock_acquire(pilocka);
+	lock_release(pilocka);
+	lock_release(pilockb);
+	V(donesem);
+}
+
+static
+void
+pihandlowthread(void *junk, unsigned long num)
+{
+	int spl;
+
+	(void)junk;
+	(void)num;
+
+	curthread->t_nice = PINICE_LOW;
+	thread_yield();
+
+	lock_acquire(pilockc);
+	V(pisem);
+	while (pihigh->t_blocked != pilockc) {
+		busyloop(PICHUNK);
+	}
+
+	/* See what the new holder got before anybody else runs. */
+	spl = splhigh();
+	lock_release(pilockc);
+	pihandoff = pimid->t_inherit;
+	splx(spl);
+	V(donesem);
+}
+
+static
+void
+pihandmidthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	curthread->t_nice = PINICE_MID;
+	thread_yield();
+
+	pimid = curthread;
+	lock_acquire(pilockc);
+	lock_release(pilockc);
+	V(donesem);
+}
+
+static
+void
+pihandrun(void)
+{
+	unsigned highlevel;
+	bool adaptive;
+	int result;
+
+	adaptive = lock_adaptive;
+	lock_adaptive = true;
+	lock_inherit = true;
+	pimid = NULL;
+	pihigh = curthread;
+
+	result = thread_fork("pilow", pihandlowthread, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pisem);
+	result = thread_fork("pimid", pihandmidthread, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	/* The medium thread sleeps first, so it is handed the lock. */
+	while (pimid == NULL || pimid->t_blocked != pilockc) {
+		thread_sleep_until(clock_now() + CLOCK_TICK_NS);
+	}
+
+	highlevel = thread_level(curthread);
+	lock_acquire(pilockc);
+	lock_release(pilockc);
+	P(donesem);
+	P(donesem);
+	lock_adaptive = adaptive;
+
+	kprintf("handoff: new holder at level %u, waiter at %u\n",
+		pihandoff, highlevel);
+	if (pihandoff > highlevel) {
+		panic("pitest: lock handed off at level %u, not %u\n",
+		      pihandoff, highlevel);
+	}
+}
+
+/*
+ * How long the critical section of the low thread takes with the cpu
+ * to itself.
+ */
+static
+uint64_t
+piworktime(void)
+{
+	uint64_t start;
+	unsigned i;
+
+	start = clock_now();
+	for (i=0; i<PIWORK; i++) {
+		busyloop(PICHUNK);
+	}
+	return clock_now() - start;
+}
+
+static
+uint64_t
+pirun(bool inherit)
+{
+	uint64_t start, waited;
+	unsigned i, highlevel;
+	int result;
+
+	lock_inherit = inherit;
+	pistop = false;
+	pimid = NULL;
+	pihigh = curthread;
+
+	for (i=0; i<PIHOGS; i++) {
+		result = thread_fork("pihog", pihogthread, NULL, i, NULL);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("pilow", pilowthread, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pisem);
+	result = thread_fork("pimid", pimidthread, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pisem);
+
+	/* Let the medium thread get stuck on A. */
+	while (pimid->t_blocked == NULL) {
+		thread_sleep_until(clock_now() + CLOCK_TICK_NS);
+	}
+
+	highlevel = thread_level(curthread);
+	start = clock_now();
+	lock_acquire(pilockb);
+	waited = clock_now() - start;
+	lock_release(pilockb);
+
+	pistop = true;
+	for (i=0; i<PIHOGS + 2; i++) {
+		P(donesem);
+	}
+
+	kprintf("inheritance %-3s: waited %llu msec; low thread ran at "
+		"level %u, %s after\n", inherit ? "on" : "off",
+		waited / 1000000, pilowlevel,
+		piafter < SCHED_NLEVELS ? "boosted" : "unboosted");
+
+	if (inherit && pilowlevel > highlevel) {
+		panic("pitest: low thread ran at level %u, not %u\n",
+		      pilowlevel, highlevel);
+	}
+	if (!inherit && pilowlevel != pilowbase) {
+		panic("pitest: low thread ran at level %u without "
+		      "inheritance\n", pilowlevel);
+	}
+	if (piafter != SCHED_NLEVELS) {
+		panic("pitest: low thread kept level %u after release\n",
+		      piafter);
+	}
+	return waited;
+}
+
+int
+pitest(int nargs, char **args)
+{
+	uint64_t work, bound, without, with;
+	uint32_t affinity;
+	bool saved;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (pilocka == NULL) {
+		pilocka = lock_create("pilocka");
+		pilockb = lock_create("pilockb");
+		pilockc = lock_create("pilockc");
+		pisem = sem_create("pisem", 0);
+		if (pilocka == NULL || pilockb == NULL || pilockc == NULL ||
+		    pisem == NULL) {
+			panic("pitest: out of memory\n");
+		}
+	}
+	kprintf("Starting priority inversion test...\n");
+
+	/* Everybody shares this cpu; the threads inherit the mask. */
+	affinity = curthread->t_affinity;
+	thread_setaffinity(1U << (curcpu->c_number % 32));
+	saved = lock_inherit;
+
+	work = piworktime();
+	bound = 2 * work + PISLACK * (uint64_t)CLOCK_TICK_NS;
+
+	without = pirun(false);
+	with = pirun(true);
+	kprintf("critical section alone: %llu msec, bound %llu msec\n",
+		work / 1000000, bound / 1000000);
+	if (with > bound) {
+		panic("pitest: waited %llu usec with inheritance, over the "
+		      "bound of %llu\n", with / 1000, bound / 1000);
+	}
+	if (with >= without) {
+		panic("pitest: waited %llu usec with inheritance, no shorter "
+		      "than %llu without\n", with / 1000, without / 1000);
+	}
+	pihandrun();
+
+	lock_inherit = saved;
+	thread_setaffinity(affinity);
+
+	kprintf("Priority inversion test done.\n");
+
+	return 0;
+}
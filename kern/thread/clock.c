@@ -29,11 +29,14 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
+#include <proc.h>
 
 /*
  * Time handling.
@@ -51,13 +54,23 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define MIGRATE_HARDCLOCKS	64	/* Migrate every 64 hardclocks. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
 static struct wchan *lbolt;
 
+/*
+ * Threads in thread_sleep_until wait here, each woken by its own timer.
+ */
+static struct wchan *sleepers;
+
+/*
+ * Whether idle cpus stop taking hardclocks.
+ */
+bool clock_tickless = true;
+
 /*
  * Setup.
  */
@@ -68,6 +81,319 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	sleepers = wchan_create("sleepers");
+	if (sleepers == NULL) {
+		panic("Couldn't create sleepers\n");
+	}
+}
+
+/*
+ * The time, in nanoseconds.
+ */
+uint64_t
+clock_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000ULL + nsecs;
+}
+
+////////////////////////////////////////////////////////////
+// Timer wheel
+
+void
+timerwheel_init(struct timerwheel *tw)
+{
+	unsigned i, j;
+
+	spinlock_init(&tw->tw_lock);
+	spinlock_setname(&tw->tw_lock, "timerwheel");
+	tw->tw_tick = 0;
+	tw->tw_count = 0;
+	tw->tw_running = NULL;
+	for (i=0; i<TIMER_WHEEL_LEVELS; i++) {
+		for (j=0; j<TIMER_WHEEL_SIZE; j++) {
+			tw->tw_slots[i][j] = NULL;
+		}
+	}
+}
+
+/*
+ * Put a timer on the slot its deadline falls into, counting from the
+ * next tick to run. A deadline that has passed goes on the slot for
+ * that tick; one beyond the top wheel goes as far out as the top wheel
+ * reaches, and is put back when it comes round. The wheel must be
+ * locked.
+ */
+static
+void
+timerwheel_insert(struct timerwheel *tw, struct timer *tm)
+{
+	uint64_t tick, delta;
+	unsigned level, shift;
+	struct timer **slot;
+
+	/* Round up, so the timer doesn't run before its deadline. */
+	tick = (tm->tm_deadline + CLOCK_TICK_NS - 1) / CLOCK_TICK_NS;
+	if (tick < tw->tw_tick) {
+		tick = tw->tw_tick;
+	}
+	delta = tick - tw->tw_tick;
+
+	for (level=0; level<TIMER_WHEEL_LEVELS-1; level++) {
+		if (delta < (1ULL << (TIMER_WHEEL_BITS * (level+1)))) {
+			break;
+		}
+	}
+	shift = TIMER_WHEEL_BITS * level;
+	if (delta >= (1ULL << (shift + TIMER_WHEEL_BITS))) {
+		tick = tw->tw_tick + (1ULL << (shift + TIMER_WHEEL_BITS)) - 1;
+	}
+
+	slot = &tw->tw_slots[level][(tick >> shift) & (TIMER_WHEEL_SIZE-1)];
+	tm->tm_next = *slot;
+	tm->tm_pprev = slot;
+	if (*slot != NULL) {
+		(*slot)->tm_pprev = &tm->tm_next;
+	}
+	*slot = tm;
+}
+
+static
+void
+timerwheel_unlink(struct timer *tm)
+{
+	*tm->tm_pprev = tm->tm_next;
+	if (tm->tm_next != NULL) {
+		tm->tm_next->tm_pprev = tm->tm_pprev;
+	}
+	tm->tm_next = NULL;
+	tm->tm_pprev = NULL;
+}
+
+/*
+ * Move the timers of one slot of a higher wheel down to where they
+ * belong now.
+ */
+static
+void
+timerwheel_cascade(struct timerwheel *tw, unsigned level, unsigned index)
+{
+	struct timer *tm, *next;
+
+	tm = tw->tw_slots[level][index];
+	tw->tw_slots[level][index] = NULL;
+	for (; tm != NULL; tm = next) {
+		next = tm->tm_next;
+		timerwheel_insert(tw, tm);
+	}
+}
+
+/*
+ * Run the ticks up to and including NOW, calling the timers that are
+ * due. Their functions are called with the wheel unlocked; tw_running
+ * lets timer_cancel wait for them.
+ */
+static
+void
+timerwheel_run(struct timerwheel *tw, uint64_t now)
+{
+	struct timer *tm;
+	unsigned index, level;
+
+	while (tw->tw_count > 0 && tw->tw_tick <= now) {
+		index = tw->tw_tick & (TIMER_WHEEL_SIZE-1);
+
+		/* Each time a wheel comes round, refill it from above. */
+		if (index == 0) {
+			for (level=1; level<TIMER_WHEEL_LEVELS; level++) {
+				index = (tw->tw_tick >>
+					 (TIMER_WHEEL_BITS * level)) &
+					(TIMER_WHEEL_SIZE-1);
+				timerwheel_cascade(tw, level, index);
+				if (index != 0) {
+					break;
+				}
+			}
+			index = 0;
+		}
+
+		while ((tm = tw->tw_slots[0][index]) != NULL) {
+			timerwheel_unlink(tm);
+			tm->tm_pending = false;
+			tw->tw_count--;
+			tw->tw_running = tm;
+			spinlock_release(&tw->tw_lock);
+
+			tm->tm_func(tm->tm_arg);
+
+			spinlock_acquire(&tw->tw_lock);
+			tw->tw_running = NULL;
+		}
+		tw->tw_tick++;
+	}
+}
+
+/*
+ * The earliest deadline on the wheel, which must be locked and not
+ * empty. Only idle cpus ask, so looking through it all is fine.
+ */
+static
+uint64_t
+timerwheel_earliest(struct timerwheel *tw)
+{
+	struct timer *tm;
+	uint64_t earliest;
+	unsigned i, j;
+
+	earliest = ~0ULL;
+	for (i=0; i<TIMER_WHEEL_LEVELS; i++) {
+		for (j=0; j<TIMER_WHEEL_SIZE; j++) {
+			for (tm = tw->tw_slots[i][j]; tm != NULL;
+			     tm = tm->tm_next) {
+				if (tm->tm_deadline < earliest) {
+					earliest = tm->tm_deadline;
+				}
+			}
+		}
+	}
+	return earliest;
+}
+
+void
+timer_init(struct timer *tm, void (*func)(void *), void *arg)
+{
+	tm->tm_next = NULL;
+	tm->tm_pprev = NULL;
+	tm->tm_deadline = 0;
+	tm->tm_func = func;
+	tm->tm_arg = arg;
+	tm->tm_cpu = NULL;
+	tm->tm_pending = false;
+}
+
+void
+timer_add(struct timer *tm, uint64_t deadline)
+{
+	struct timerwheel *tw;
+	int spl;
+
+	KASSERT(!tm->tm_pending);
+
+	/* Stay on this cpu while we pick its wheel. */
+	spl = splhigh();
+	tm->tm_cpu = curcpu->c_self;
+	tw = &tm->tm_cpu->c_timers;
+
+	spinlock_acquire(&tw->tw_lock);
+	if (tw->tw_count == 0 && tw->tw_running == NULL) {
+		/* Nothing to catch up on; start turning from now. */
+		tw->tw_tick = clock_now() / CLOCK_TICK_NS;
+	}
+	tm->tm_deadline = deadline;
+	tm->tm_pending = true;
+	timerwheel_insert(tw, tm);
+	tw->tw_count++;
+	spinlock_release(&tw->tw_lock);
+
+	splx(spl);
+}
+
+bool
+timer_cancel(struct timer *tm)
+{
+	struct timerwheel *tw;
+
+	if (tm->tm_cpu == NULL) {
+		/* Never added. */
+		return false;
+	}
+	tw = &tm->tm_cpu->c_timers;
+
+	spinlock_acquire(&tw->tw_lock);
+	if (tm->tm_pending) {
+		timerwheel_unlink(tm);
+		tm->tm_pending = false;
+		tw->tw_count--;
+		spinlock_release(&tw->tw_lock);
+		return true;
+	}
+	while (tw->tw_running == tm) {
+		spinlock_release(&tw->tw_lock);
+		spinlock_acquire(&tw->tw_lock);
+	}
+	spinlock_release(&tw->tw_lock);
+	return false;
+}
+
+/*
+ * Run this cpu's timers that are due. Only this cpu adds to its
+ * wheel, and it has interrupts off, so an empty wheel stays empty.
+ */
+static
+void
+clock_runtimers(void)
+{
+	struct timerwheel *tw = &curcpu->c_timers;
+
+	if (tw->tw_count == 0) {
+		return;
+	}
+	spinlock_acquire(&tw->tw_lock);
+	timerwheel_run(tw, clock_now() / CLOCK_TICK_NS);
+	spinlock_release(&tw->tw_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Tickless idle
+
+void
+clock_idle(void)
+{
+	struct timerwheel *tw = &curcpu->c_timers;
+	uint64_t now, next, earliest;
+
+	if (!clock_tickless) {
+		return;
+	}
+
+	now = clock_now();
+	next = now + CLOCK_IDLE_MAX_NS;
+	spinlock_acquire(&tw->tw_lock);
+	if (tw->tw_count > 0) {
+		earliest = timerwheel_earliest(tw);
+		if (earliest < next) {
+			next = earliest;
+		}
+	}
+	spinlock_release(&tw->tw_lock);
+
+	/* Not worth it for less than a couple of hardclocks. */
+	if (next < now + 2 * CLOCK_TICK_NS) {
+		return;
+	}
+
+	curcpu->c_tickless = now;
+	mainbus_timer_defer(next - now);
+}
+
+void
+clock_unidle(void)
+{
+	struct cpu *c = curcpu->c_self;
+	uint64_t skipped;
+
+	if (c->c_tickless == 0) {
+		return;
+	}
+	mainbus_timer_resume();
+
+	skipped = (clock_now() - c->c_tickless) / CLOCK_TICK_NS;
+	c->c_tickless = 0;
+	c->c_hardclocks += skipped;
+	c->c_idleclocks += skipped;
 }
 
 /*
@@ -92,14 +418,30 @@ hardclock(void)
 	 * Collect statistics here as desired.
 	 */
 
+	curcpu->c_clockirqs++;
+	if (curcpu->c_tickless != 0) {
+		/* Woken up by the deadline clock_idle set. */
+		clock_unidle();
+	}
+
 	curcpu->c_hardclocks++;
+	if (curcpu->c_isidle) {
+		curcpu->c_idleclocks++;
+		curcpu->c_idleirqs++;
+	}
+	else {
+		curcpu->c_busyclocks++;
+	}
+	clock_runtimers();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
 }
 
 /*
@@ -114,3 +456,33 @@ clocksleep(int num_secs)
 		num_secs--;
 	}
 }
+
+/*
+ * Suspend execution until DEADLINE, in nanoseconds. A process chosen
+ * by the oom killer stops sleeping early, so it can go away; returns
+ * false in that case.
+ */
+bool
+thread_sleep_until(uint64_t deadline)
+{
+	while (clock_now() < deadline) {
+		/* Look holding the channel, so the wakeup can't slip by */
+		wchan_lock(sleepers);
+		if (proc_killed()) {
+			wchan_unlock(sleepers);
+			return false;
+		}
+		wchan_sleep_until(sleepers, deadline);
+	}
+	return true;
+}
+
+/*
+ * Wake up everybody in thread_sleep_until, to look again whether they
+ * should still be sleeping.
+ */
+void
+thread_sleep_interrupt(void)
+{
+	wchan_wakeall(sleepers);
+}
@@ -0,0 +1,291 @@
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <lockprof.h>
+
+#define LOCKPROF_MAXPRINT	32
+#define LOCKPROF_NAMELEN	20
+
+/**
+ * a copy of the statistics of one lock, for printing once the registry
+ * is unlocked; by then the lock, and its name, may be gone.
+ */
+struct lockprof_snap {
+	char			ls_name[LOCKPROF_NAMELEN];
+	const void		*ls_addr;
+	unsigned		ls_kind;
+	uint32_t		ls_acquires;
+	uint32_t		ls_contended;
+	uint64_t		ls_waitns;
+	uint64_t		ls_maxwaitns;
+	uint64_t		ls_holdns;
+	uint64_t		ls_maxholdns;
+	struct lockprof_site	ls_sites[LOCKPROF_NSITES];
+};
+
+//the registry lock is a leaf, and never profiled itself.
+static struct spinlock		lockprof_lk = SPINLOCK_INITIALIZER_UNTRACKED;
+static struct lockprof		*lockprof_head = NULL;
+static unsigned			lockprof_nlocks = 0;
+volatile bool			lockprof_enabled = false;
+
+//filled under lockprof_lk by lockprof_print.
+static struct lockprof_snap	lockprof_snaps[LOCKPROF_MAXPRINT];
+
+static const char *lockprof_kinds[] = { "spin", "lock", "sem" };
+
+static
+void
+lockprof_clear( struct lockprof *lp ) {
+	unsigned		i;
+
+	lp->lp_acquires = 0;
+	lp->lp_contended = 0;
+	lp->lp_waitns = 0;
+	lp->lp_maxwaitns = 0;
+	lp->lp_holdns = 0;
+	lp->lp_maxholdns = 0;
+	for( i = 0; i < LOCKPROF_NSITES; ++i ) {
+		lp->lp_sites[i].ls_site = 0;
+		lp->lp_sites[i].ls_count = 0;
+		lp->lp_sites[i].ls_waitns = 0;
+	}
+}
+
+/**
+ * the first profiled acquisition of a lock puts it on the registry.
+ */
+static
+void
+lockprof_register( struct lockprof *lp, unsigned kind ) {
+	lockprof_clear( lp );
+	lp->lp_kind = kind;
+
+	spinlock_acquire( &lockprof_lk );
+	lp->lp_prev = NULL;
+	lp->lp_next = lockprof_head;
+	if( lockprof_head != NULL )
+		lockprof_head->lp_prev = lp;
+	lockprof_head = lp;
+	lockprof_nlocks++;
+	lp->lp_registered = true;
+	spinlock_release( &lockprof_lk );
+}
+
+/**
+ * credit a contended acquisition to its call site. when all the slots
+ * are taken, the site seen least often so far gives up its slot, and the
+ * newcomer inherits its count; so a site that keeps contending always
+ * makes it in, at the cost of overstating sites seen only lately.
+ */
+static
+void
+lockprof_site( struct lockprof *lp, vaddr_t site, uint64_t waitns ) {
+	struct lockprof_site	*ls;
+	struct lockprof_site	*min;
+	unsigned		i;
+
+	min = &lp->lp_sites[0];
+	for( i = 0; i < LOCKPROF_NSITES; ++i ) {
+		ls = &lp->lp_sites[i];
+		if( ls->ls_site == site || ls->ls_site == 0 ) {
+			ls->ls_site = site;
+			ls->ls_count++;
+			ls->ls_waitns += waitns;
+			return;
+		}
+		if( ls->ls_count < min->ls_count )
+			min = ls;
+	}
+
+	min->ls_site = site;
+	min->ls_count++;
+	min->ls_waitns = waitns;
+}
+
+/**
+ * current time, in nanoseconds.
+ */
+uint64_t
+lockprof_now( void ) {
+	time_t			secs;
+	uint32_t		nsecs;
+
+	gettime( &secs, &nsecs );
+	return (uint64_t)secs * 1000000000ULL + nsecs;
+}
+
+/**
+ * a lock was acquired, having waited for it if contended.
+ * the caller holds it, which protects its statistics.
+ */
+void
+lockprof_acquired( struct lockprof *lp, unsigned kind, uint64_t start, bool contended, vaddr_t site ) {
+	uint64_t		now;
+	uint64_t		wait;
+
+	if( !lp->lp_registered )
+		lockprof_register( lp, kind );
+
+	now = start;
+	lp->lp_acquires++;
+	if( contended ) {
+		now = lockprof_now();
+		wait = now - start;
+
+		lp->lp_contended++;
+		lp->lp_waitns += wait;
+		if( wait > lp->lp_maxwaitns )
+			lp->lp_maxwaitns = wait;
+		lockprof_site( lp, site, wait );
+	}
+
+	//semaphores are not held by anybody in particular.
+	if( kind != LOCKPROF_SEM )
+		lp->lp_since = now;
+}
+
+/**
+ * the holder is letting go of a lock that was timed since acquired.
+ */
+void
+lockprof_released( struct lockprof *lp ) {
+	uint64_t		hold;
+
+	hold = lockprof_now() - lp->lp_since;
+	lp->lp_since = 0;
+
+	lp->lp_holdns += hold;
+	if( hold > lp->lp_maxholdns )
+		lp->lp_maxholdns = hold;
+}
+
+/**
+ * a lock is being destroyed; take it off the registry.
+ */
+void
+lockprof_forget( struct lockprof *lp ) {
+	if( !lp->lp_registered )
+		return;
+
+	spinlock_acquire( &lockprof_lk );
+	if( lp->lp_prev != NULL )
+		lp->lp_prev->lp_next = lp->lp_next;
+	else
+		lockprof_head = lp->lp_next;
+
+	if( lp->lp_next != NULL )
+		lp->lp_next->lp_prev = lp->lp_prev;
+
+	lockprof_nlocks--;
+	lp->lp_registered = false;
+	spinlock_release( &lockprof_lk );
+}
+
+/**
+ * turn profiling on or off. locks stay on the registry either way,
+ * so turning it back on continues the counts.
+ */
+void
+lockprof_enable( bool enable ) {
+	lockprof_enabled = enable;
+}
+
+/**
+ * start over.
+ * counters being updated meanwhile may survive; they are only counters.
+ */
+void
+lockprof_reset( void ) {
+	struct lockprof		*lp;
+
+	spinlock_acquire( &lockprof_lk );
+	for( lp = lockprof_head; lp != NULL; lp = lp->lp_next )
+		lockprof_clear( lp );
+	spinlock_release( &lockprof_lk );
+}
+
+static
+void
+lockprof_snap( struct lockprof_snap *snap, struct lockprof *lp ) {
+	unsigned		i;
+
+	if( lp->lp_name != NULL )
+		snprintf( snap->ls_name, sizeof( snap->ls_name ), "%s", lp->lp_name );
+	else
+		snap->ls_name[0] = '\0';
+
+	snap->ls_addr = lp;
+	snap->ls_kind = lp->lp_kind;
+	snap->ls_acquires = lp->lp_acquires;
+	snap->ls_contended = lp->lp_contended;
+	snap->ls_waitns = lp->lp_waitns;
+	snap->ls_maxwaitns = lp->lp_maxwaitns;
+	snap->ls_holdns = lp->lp_holdns;
+	snap->ls_maxholdns = lp->lp_maxholdns;
+	for( i = 0; i < LOCKPROF_NSITES; ++i )
+		snap->ls_sites[i] = lp->lp_sites[i];
+}
+
+/**
+ * print the max locks waited for the longest, and where they were
+ * waited for. look up the call sites with addr2line or in nm output.
+ */
+void
+lockprof_print( unsigned max ) {
+	struct lockprof		*lp;
+	struct lockprof_site	tmp;
+	struct lockprof_snap	*snap;
+	unsigned		n, nlocks, i, j, k;
+
+	if( max > LOCKPROF_MAXPRINT )
+		max = LOCKPROF_MAXPRINT;
+
+	//keep the top max, by total wait, sorted as we go.
+	n = 0;
+	spinlock_acquire( &lockprof_lk );
+	for( lp = lockprof_head; lp != NULL; lp = lp->lp_next ) {
+		if( lp->lp_contended == 0 )
+			continue;
+		if( n == max && ( n == 0 || lp->lp_waitns <= lockprof_snaps[n - 1].ls_waitns ) )
+			continue;
+
+		j = ( n < max ) ? n++ : n - 1;
+		for( ; j > 0 && lockprof_snaps[j - 1].ls_waitns < lp->lp_waitns; --j )
+			lockprof_snaps[j] = lockprof_snaps[j - 1];
+		lockprof_snap( &lockprof_snaps[j], lp );
+	}
+	nlocks = lockprof_nlocks;
+	spinlock_release( &lockprof_lk );
+
+	kprintf( "lock profiling %s: %u locks tracked, top %u by wait time\n",
+		lockprof_enabled ? "on" : "off", nlocks, n );
+	kprintf( "%-20s %4s %10s %10s %11s %9s %11s %9s\n", "name", "kind",
+		"acquires", "contended", "wait usec", "max wait", "hold usec", "max hold" );
+
+	for( i = 0; i < n; ++i ) {
+		snap = &lockprof_snaps[i];
+		if( snap->ls_name[0] != '\0' )
+			kprintf( "%-20s", snap->ls_name );
+		else
+			kprintf( "%-20p", snap->ls_addr );
+
+		kprintf( " %4s %10u %10u %11llu %9llu %11llu %9llu\n",
+			lockprof_kinds[snap->ls_kind], snap->ls_acquires, snap->ls_contended,
+			snap->ls_waitns / 1000, snap->ls_maxwaitns / 1000,
+			snap->ls_holdns / 1000, snap->ls_maxholdns / 1000 );
+
+		//the call sites, most contending first.
+		for( j = 1; j < LOCKPROF_NSITES; ++j ) {
+			tmp = snap->ls_sites[j];
+			for( k = j; k > 0 && snap->ls_sites[k - 1].ls_count < tmp.ls_count; --k )
+				snap->ls_sites[k] = snap->ls_sites[k - 1];
+			snap->ls_sites[k] = tmp;
+		}
+		for( j = 0; j < LOCKPROF_NSITES && snap->ls_sites[j].ls_site != 0; ++j )
+			kprintf( "    from 0x%08lx: %u times, %llu usec\n",
+				(unsigned long)snap->ls_sites[j].ls_site,
+				snap->ls_sites[j].ls_count, snap->ls_sites[j].ls_waitns / 1000 );
+	}
+}
@@ -50,6 +50,12 @@ spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKPROF
+	lk->lk_prof.lp_name = NULL;
+	lk->lk_prof.lp_untracked = false;
+	lk->lk_prof.lp_registered = false;
+	lk->lk_prof.lp_since = 0;
+#endif
 }
 
 /*
@@ -60,6 +66,9 @@ spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
 	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+#if OPT_LOCKPROF
+	lockprof_forget(&lk->lk_prof);
+#endif
 }
 
 /*
@@ -73,6 +82,10 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+#if OPT_LOCKPROF
+	bool profiling, contended = false;
+	uint64_t start = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,6 +100,14 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
+#if OPT_LOCKPROF
+	profiling = lockprof_enabled && mycpu != NULL &&
+		!lk->lk_prof.lp_untracked;
+	if (profiling) {
+		start = lockprof_now();
+	}
+#endif
+
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -99,15 +120,29 @@ spinlock_acquire(struct spinlock *lk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&lk->lk_lock) != 0) {
+#if OPT_LOCKPROF
+			contended = true;
+#endif
 			continue;
 		}
 		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+#if OPT_LOCKPROF
+			contended = true;
+#endif
 			continue;
 		}
 		break;
 	}
 
 	lk->lk_holder = mycpu;
+
+#if OPT_LOCKPROF
+	if (profiling) {
+		lockprof_acquired(&lk->lk_prof, LOCKPROF_SPINLOCK, start,
+				  contended,
+				  (vaddr_t)__builtin_return_address(0));
+	}
+#endif
 }
 
 /*
@@ -121,6 +156,10 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKPROF
+	LOCKPROF_RELEASED(&lk->lk_prof);
+#endif
+
 	lk->lk_holder = NULL;
 	spinlock_data_set(&lk->lk_lock, 0);
 	spllower(IPL_HIGH, IPL_NONE);
@@ -33,9 +33,11 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -70,7 +72,14 @@ sem_create(const char *name, int initial_count)
 	}
 
 	spinlock_init(&sem->sem_lock);
+        spinlock_setname(&sem->sem_lock, sem->sem_name);
         sem->sem_count = initial_count;
+#if OPT_LOCKPROF
+        sem->sem_prof.lp_name = sem->sem_name;
+        sem->sem_prof.lp_untracked = false;
+        sem->sem_prof.lp_registered = false;
+        sem->sem_prof.lp_since = 0;
+#endif
 
         return sem;
 }
@@ -82,6 +91,9 @@ sem_destroy(struct semaphore *sem)
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
 	spinlock_cleanup(&sem->sem_lock);
+#if OPT_LOCKPROF
+	lockprof_forget(&sem->sem_prof);
+#endif
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
         kfree(sem);
@@ -100,8 +112,17 @@ P(struct semaphore *sem)
          */
         KASSERT(curthread->t_in_interrupt == false);
 
+#if OPT_LOCKPROF
+        bool profiling = lockprof_enabled;
+        uint64_t start = profiling ? lockprof_now() : 0;
+        bool contended = false;
+#endif
+
 	spinlock_acquire(&sem->sem_lock);
         while (sem->sem_count == 0) {
+#if OPT_LOCKPROF
+                contended = true;
+#endif
 		/*
 		 * Bridge to the wchan lock, so if someone else comes
 		 * along in V right this instant the wakeup can't go
@@ -126,6 +147,13 @@ P(struct semaphore *sem)
         }
         KASSERT(sem->sem_count > 0);
         sem->sem_count--;
+#if OPT_LOCKPROF
+        if (profiling) {
+                lockprof_acquired(&sem->sem_prof, LOCKPROF_SEM, start,
+                                  contended,
+                                  (vaddr_t)__builtin_return_address(0));
+        }
+#endif
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -147,10 +175,153 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * A thread that finds a lock held by a thread running on another cpu
+ * spins, since the holder will probably let go before a sleep and a
+ * wakeup would be done with; at most LOCK_SPIN_MAX rounds, though,
+ * in case the critical section is a long one. Once the holder is off
+ * its cpu the waiter sleeps, and lock_release then gives the lock to
+ * the first sleeper outright, so that a stream of spinners can't keep
+ * taking it first (and a woken sleeper doesn't wake only to find the
+ * lock gone and go back to sleep).
+ */
+#define LOCK_SPIN_MAX 10000
+
+bool lock_adaptive = true;
+
+/*
+ * Priority inheritance (see synch.h). The levels sleepers are counted
+ * at in lk_waiters, and the t_inherit, t_blocked and t_waitlevel of
+ * every thread, are protected by lock_pilock, which covers all locks
+ * so that a chain of them can be followed safely. It is only taken
+ * when a thread goes to sleep for a lock, and when a lock with
+ * sleepers changes hands, which lk_nwaiting tells under lk_lock; as
+ * long as a thread sleeps for a lock, lk_nwaiting counts it.
+ */
+static struct spinlock lock_pilock = SPINLOCK_INITIALIZER_NAMED("lock_pilock");
+
+bool lock_inherit = true;
+
+/*
+ * The best level of the threads sleeping for LOCK, or SCHED_NLEVELS
+ * if none. Call with lock_pilock held.
+ */
+static
+unsigned
+lock_waitlevel(struct lock *lock)
+{
+        unsigned i;
+
+        for (i=0; i<SCHED_NLEVELS; i++) {
+                if (lock->lk_waiters[i] > 0) {
+                        break;
+                }
+        }
+        return i;
+}
+
+/*
+ * The current thread is about to sleep for LOCK: count it among the
+ * sleepers, and have the holder run at our level if that's better
+ * than its own; and if the holder is itself asleep for another lock,
+ * that lock's holder, and so on. Call with lk_lock held.
+ */
+static
+void
+lock_block(struct lock *lock)
+{
+        struct thread *t;
+        struct lock *l;
+        unsigned level;
+
+        lock->lk_nwaiting++;
+
+        spinlock_acquire(&lock_pilock);
+        level = thread_level(curthread);
+        curthread->t_blocked = lock;
+        curthread->t_waitlevel = level;
+        lock->lk_waiters[level]++;
+
+        t = (struct thread *)lock->lk_holder;
+        while (lock_inherit && t != NULL && level < thread_level(t)) {
+                thread_inherit(t, level);
+
+                l = t->t_blocked;
+                if (l == NULL) {
+                        break;
+                }
+                /* Recount it among that lock's sleepers at its new level */
+                l->lk_waiters[t->t_waitlevel]--;
+                l->lk_waiters[level]++;
+                t->t_waitlevel = level;
+                t = (struct thread *)l->lk_holder;
+        }
+        spinlock_release(&lock_pilock);
+}
+
+/*
+ * The current thread is done sleeping for LOCK, whether it got it or
+ * not. Call with lk_lock held.
+ */
+static
+void
+lock_unblock(struct lock *lock)
+{
+        spinlock_acquire(&lock_pilock);
+        KASSERT(curthread->t_blocked == lock);
+        lock->lk_waiters[curthread->t_waitlevel]--;
+        curthread->t_blocked = NULL;
+        spinlock_release(&lock_pilock);
+
+        KASSERT(lock->lk_nwaiting > 0);
+        lock->lk_nwaiting--;
+}
+
+/*
+ * Recompute what the current thread inherits from the locks it still
+ * holds, after giving one up. Call with lock_pilock held.
+ */
+static
+void
+lock_reinherit(void)
+{
+        struct lock *l;
+        unsigned level, best;
+
+        best = SCHED_NLEVELS;
+        for (l = curthread->t_heldlocks; l != NULL; l = l->lk_nextheld) {
+                level = lock_waitlevel(l);
+                if (level < best) {
+                        best = level;
+                }
+        }
+        if (!lock_inherit) {
+                best = SCHED_NLEVELS;
+        }
+        if (best != curthread->t_inherit) {
+                thread_inherit(curthread, best);
+        }
+}
+
+/*
+ * Check if the holder of a lock is running on the cpu it took the lock
+ * on. Only a hint: it may be switched out the next moment. Spinners
+ * call this without lk_lock, when the holder may have let go of the
+ * lock and exited, so the holder is only compared, never looked at;
+ * cpus never go away.
+ */
+static
+bool
+lock_holder_running(struct cpu *c, volatile struct thread *holder)
+{
+        return c != NULL && c->c_curthread == holder;
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
+        unsigned i;
 
         lock = kmalloc(sizeof(struct lock));
         if (lock == NULL) {
@@ -170,7 +341,20 @@ lock_create(const char *name)
                 return NULL;
         }
         spinlock_init(&lock->lk_lock);
+        spinlock_setname(&lock->lk_lock, lock->lk_name);
         lock->lk_holder = NULL;
+        lock->lk_holdercpu = NULL;
+        lock->lk_nextheld = NULL;
+        lock->lk_nwaiting = 0;
+        for (i=0; i<SCHED_NLEVELS; i++) {
+                lock->lk_waiters[i] = 0;
+        }
+#if OPT_LOCKPROF
+        lock->lk_prof.lp_name = lock->lk_name;
+        lock->lk_prof.lp_untracked = false;
+        lock->lk_prof.lp_registered = false;
+        lock->lk_prof.lp_since = 0;
+#endif
         
         return lock;
 }
@@ -180,8 +364,12 @@ lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
         KASSERT(lock->lk_holder == NULL);
+        KASSERT(lock->lk_nwaiting == 0);
 
         spinlock_cleanup(&lock->lk_lock);
+#if OPT_LOCKPROF
+        lockprof_forget(&lock->lk_prof);
+#endif
         wchan_destroy(lock->lk_wchan);
         
         kfree(lock->lk_name);
@@ -195,26 +383,125 @@ lock_acquire(struct lock *lock)
         KASSERT(!(lock_do_i_hold(lock)));
         KASSERT(curthread->t_in_interrupt == false);
  
+        volatile struct thread *holder;
+        struct cpu *holdercpu;
+        unsigned spins = 0;
+#if OPT_LOCKPROF
+        bool profiling = lockprof_enabled;
+        uint64_t start = profiling ? lockprof_now() : 0;
+        bool contended = false;
+#endif
+
         spinlock_acquire(&lock->lk_lock);
         while (lock->lk_holder != NULL) {
+#if OPT_LOCKPROF
+                contended = true;
+#endif
+                holder = lock->lk_holder;
+                holdercpu = lock->lk_holdercpu;
+                if (lock_adaptive && spins < LOCK_SPIN_MAX &&
+                    lock_holder_running(holdercpu, holder)) {
+                        /* Wait for it to change hands, unlocked */
+                        spinlock_release(&lock->lk_lock);
+                        while (lock->lk_holder == holder &&
+                               spins < LOCK_SPIN_MAX &&
+                               lock_holder_running(holdercpu, holder)) {
+                                spins++;
+                        }
+                        spinlock_acquire(&lock->lk_lock);
+                        continue;
+                }
+
+                lock_block(lock);
                 wchan_lock(lock->lk_wchan);
                 spinlock_release(&lock->lk_lock);
                 wchan_sleep(lock->lk_wchan);
                 spinlock_acquire(&lock->lk_lock);
+                lock_unblock(lock);
+
+                if (lock->lk_holder == curthread) {
+                        /* lock_release handed it to us */
+                        break;
+                }
         }
 
-        lock->lk_holder = curthread;
+        if (lock->lk_nwaiting > 0) {
+                /* Take over from whoever held it for them */
+                spinlock_acquire(&lock_pilock);
+                lock->lk_holder = curthread;
+                if (lock_inherit &&
+                    lock_waitlevel(lock) < thread_level(curthread)) {
+                        thread_inherit(curthread, lock_waitlevel(lock));
+                }
+                spinlock_release(&lock_pilock);
+        }
+        else {
+                lock->lk_holder = curthread;
+        }
+        lock->lk_holdercpu = curcpu;
+        lock->lk_nextheld = curthread->t_heldlocks;
+        curthread->t_heldlocks = lock;
+#if OPT_LOCKPROF
+        if (profiling) {
+                lockprof_acquired(&lock->lk_prof, LOCKPROF_LOCK, start,
+                                  contended,
+                                  (vaddr_t)__builtin_return_address(0));
+        }
+#endif
         spinlock_release(&lock->lk_lock);
 }
 
 void
 lock_release(struct lock *lock)
 {
+        struct lock **lp;
+        struct thread *newholder;
+        bool waiters;
+
         KASSERT(lock_do_i_hold(lock));
 
+        /* Usually the last one taken */
+        for (lp = &curthread->t_heldlocks; *lp != lock;
+             lp = &(*lp)->lk_nextheld) {
+                KASSERT(*lp != NULL);
+        }
+        *lp = lock->lk_nextheld;
+        lock->lk_nextheld = NULL;
+
         spinlock_acquire(&lock->lk_lock);
-        lock->lk_holder = NULL;
-        wchan_wakeone(lock->lk_wchan);
+#if OPT_LOCKPROF
+        LOCKPROF_RELEASED(&lock->lk_prof);
+#endif
+        waiters = lock->lk_nwaiting > 0;
+        if (waiters) {
+                /* Somebody may be following the chain through it */
+                spinlock_acquire(&lock_pilock);
+        }
+        if (lock_adaptive) {
+                /* The first sleeper, if any, owns it from now on */
+                newholder = wchan_wakeone(lock->lk_wchan);
+                lock->lk_holder = newholder;
+                /*
+                 * It is on a run queue at its own level until it gets
+                 * back to lock_acquire; have it run for the others it
+                 * keeps waiting from the start.
+                 */
+                if (newholder != NULL && lock_inherit &&
+                    lock_waitlevel(lock) < thread_level(newholder)) {
+                        thread_inherit(newholder, lock_waitlevel(lock));
+                }
+        }
+        else {
+                lock->lk_holder = NULL;
+                wchan_wakeone(lock->lk_wchan);
+        }
+        /* Not running anywhere until it comes back to lock_acquire */
+        lock->lk_holdercpu = NULL;
+        if (waiters) {
+                /* Give up what they lent us */
+                lock_reinherit();
+                spinlock_release(&lock_pilock);
+        }
         spinlock_release(&lock->lk_lock);
 }
 
@@ -282,6 +569,21 @@ cv_wait(struct cv *cv, struct lock *lock)
         wchan_sleep(cv->cv_wchan);
         lock_acquire(lock);
 }
+
+int
+cv_timedwait(struct cv *cv, struct lock *lock, uint64_t deadline)
+{
+        bool expired;
+
+        KASSERT(lock_do_i_hold(lock));
+
+        wchan_lock(cv->cv_wchan);
+        lock_release(lock);
+        expired = wchan_sleep_until(cv->cv_wchan, deadline);
+        lock_acquire(lock);
+
+        return expired ? ETIMEDOUT : 0;
+}
  
 void
 cv_signal(struct cv *cv, struct lock *lock)
@@ -298,3 +600,189 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 
         wchan_wakeall(cv->cv_wchan);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+        struct rwlock *rw;
+
+        rw = kmalloc(sizeof(struct rwlock));
+        if (rw == NULL) {
+                return NULL;
+        }
+
+        rw->rwlock_name = kstrdup(name);
+        if (rw->rwlock_name == NULL) {
+                kfree(rw);
+                return NULL;
+        }
+
+        rw->rw_rwchan = wchan_create(rw->rwlock_name);
+        if (rw->rw_rwchan == NULL) {
+                kfree(rw->rwlock_name);
+                kfree(rw);
+                return NULL;
+        }
+
+        rw->rw_wwchan = wchan_create(rw->rwlock_name);
+        if (rw->rw_wwchan == NULL) {
+                wchan_destroy(rw->rw_rwchan);
+                kfree(rw->rwlock_name);
+                kfree(rw);
+                return NULL;
+        }
+
+        spinlock_init(&rw->rw_lock);
+        spinlock_setname(&rw->rw_lock, rw->rwlock_name);
+        rw->rw_writer = NULL;
+        rw->rw_readers = 0;
+        rw->rw_rwaiting = 0;
+        rw->rw_wwaiting = 0;
+        rw->rw_batch = 0;
+
+        return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rw_writer == NULL);
+        KASSERT(rw->rw_readers == 0);
+        KASSERT(rw->rw_rwaiting == 0 && rw->rw_wwaiting == 0);
+
+        spinlock_cleanup(&rw->rw_lock);
+        wchan_destroy(rw->rw_wwchan);
+        wchan_destroy(rw->rw_rwchan);
+
+        kfree(rw->rwlock_name);
+        kfree(rw);
+}
+
+/*
+ * Hand the lock, just given up by its last holder, to whoever waits:
+ * all waiting readers at once if there are any, else one writer.
+ * Readers go first after a writer so that a stream of writers cannot
+ * starve them; a writer goes first after readers because new readers
+ * already queue up behind it. Call with rw_lock held.
+ */
+static
+void
+rwlock_handoff(struct rwlock *rw, bool from_writer)
+{
+        KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+        KASSERT(rw->rw_writer == NULL && rw->rw_readers == 0);
+
+        if (rw->rw_rwaiting > 0 && (from_writer || rw->rw_wwaiting == 0)) {
+                rw->rw_readers = rw->rw_rwaiting;
+                rw->rw_rwaiting = 0;
+                rw->rw_batch++;
+                wchan_wakeall(rw->rw_rwchan);
+        }
+        else if (rw->rw_wwaiting > 0) {
+                rw->rw_wwaiting--;
+                rw->rw_writer = wchan_wakeone(rw->rw_wwchan);
+                KASSERT(rw->rw_writer != NULL);
+        }
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+        unsigned batch;
+
+        KASSERT(rw != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer != curthread);
+
+        if (rw->rw_writer == NULL && rw->rw_wwaiting == 0) {
+                rw->rw_readers++;
+                spinlock_release(&rw->rw_lock);
+                return;
+        }
+
+        /* Wait to be admitted with the next batch */
+        batch = rw->rw_batch;
+        rw->rw_rwaiting++;
+        while (rw->rw_batch == batch) {
+                wchan_lock(rw->rw_rwchan);
+                spinlock_release(&rw->rw_lock);
+                wchan_sleep(rw->rw_rwchan);
+                spinlock_acquire(&rw->rw_lock);
+        }
+        /* rwlock_handoff counted us in rw_readers already */
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer == NULL);
+        KASSERT(rw->rw_readers > 0);
+
+        rw->rw_readers--;
+        if (rw->rw_readers == 0) {
+                rwlock_handoff(rw, false);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer != curthread);
+
+        if (rw->rw_writer == NULL && rw->rw_readers == 0) {
+                KASSERT(rw->rw_rwaiting == 0 && rw->rw_wwaiting == 0);
+                rw->rw_writer = curthread;
+                spinlock_release(&rw->rw_lock);
+                return;
+        }
+
+        rw->rw_wwaiting++;
+        while (rw->rw_writer != curthread) {
+                wchan_lock(rw->rw_wwchan);
+                spinlock_release(&rw->rw_lock);
+                wchan_sleep(rw->rw_wwchan);
+                spinlock_acquire(&rw->rw_lock);
+        }
+        /* rwlock_handoff took us off rw_wwaiting already */
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+        KASSERT(rwlock_do_i_write(rw));
+
+        spinlock_acquire(&rw->rw_lock);
+        rw->rw_writer = NULL;
+        rwlock_handoff(rw, true);
+        spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_write(struct rwlock *rw)
+{
+        bool ret;
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        ret = (rw->rw_writer == curthread);
+        spinlock_release(&rw->rw_lock);
+
+        return ret;
+}
@@ -47,6 +47,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
 
 #include "opt-synchprobs.h"
 #include "opt-defaultscheduler.h"
@@ -55,11 +56,18 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Hardclocks a thread runs before it may change cpus again; see thread_steal */
+#define SCHED_STEAL_HYST 2
+
+/* Threads waiting on a cpu it still counts as lightly loaded; see thread_place */
+#define SCHED_LIGHT_LOAD 1
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
 	struct threadlist wc_threads;	/* list of waiting threads */
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
+	volatile unsigned wc_ntimed;	/* threads in wchan_sleep_until */
 };
 
 /* Master array of CPUs. */
@@ -110,36 +118,66 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Give a thread its name. Short names go in t_namebuf, so that
+ * most threads need no separate allocation for it.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_setname(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	if (strlen(name) < THREAD_NAMELEN) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+		return 0;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
+	return 0;
+}
+
+static
+void
+thread_freename(struct thread *thread)
+{
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+	}
+	thread->t_name = NULL;
+}
+
+/*
+ * Set up the fields of a new or recycled thread, other than its
+ * name and stack.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
+	thread->t_wchan_key = NULL;
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	/* Scheduler fields; new threads start at the top */
+	thread->t_prio = 0;
+	thread->t_ticks = 0;
+	thread->t_nice = 0;
+	thread->t_sincemove = SCHED_STEAL_HYST;
+	thread->t_affinity = THREAD_AFFINITY_ALL;
+	thread->t_migrations = 0;
+	thread->t_inherit = SCHED_NLEVELS;
+	thread->t_blocked = NULL;
+	thread->t_waitlevel = 0;
+	thread->t_heldlocks = NULL;
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -153,7 +191,33 @@ thread_create(const char *name)
 	/* VFS fields */
 	thread->t_cwd = NULL;
 
+	/* ASST2 fields; set by whoever attaches the thread to a process */
+	thread->td_proc = NULL;
+
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_setname(thread, name)) {
+		kfree(thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	thread_init(thread);
 
 	return thread;
 }
@@ -171,6 +235,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -183,15 +248,31 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_freethreads);
 	c->c_hardclocks = 0;
+	c->c_lastboost = 0;
+	c->c_evicted = NULL;
+	c->c_busyclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_steals = 0;
+	c->c_pushes = 0;
+	c->c_clockirqs = 0;
+	c->c_idleirqs = 0;
+	c->c_tickless = 0;
+	timerwheel_init(&c->c_timers);
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "c_runqueue_lock");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
+	spinlock_setname(&c->c_ipi_lock, "c_ipi_lock");
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -263,15 +344,88 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
+	thread_freename(thread);
 	kfree(thread);
 }
 
+/*
+ * Keep a dead thread and its stack on this cpu's free list, for
+ * thread_fork to reuse, instead of destroying it. Returns false if
+ * there's no room, or if it has no stack of its own (boot threads).
+ *
+ * Like thread_destroy, this cannot be called on a running thread.
+ */
+static
+bool
+thread_recycle(struct thread *thread)
+{
+	KASSERT(thread != curthread);
+	KASSERT(thread->t_state != S_RUN);
+	KASSERT(curthread->t_curspl > 0);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_freethreads.tl_count >= THREAD_CACHE_MAX) {
+		return false;
+	}
+
+	/* Same as thread_destroy, except the stack stays. */
+	KASSERT(thread->t_cwd == NULL);
+	KASSERT(thread->t_addrspace == NULL);
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread->t_wchan_name = "FREE";
+	thread_freename(thread);
+
+	threadlist_addhead(&curcpu->c_freethreads, thread);
+	return true;
+}
+
+/*
+ * Get a thread and stack for thread_fork, from this cpu's free
+ * list if possible.
+ */
+static
+struct thread *
+thread_reuse(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_freethreads);
+	splx(spl);
+
+	if (thread == NULL) {
+		thread = thread_create(name);
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = kmalloc(STACK_SIZE);
+		if (thread->t_stack == NULL) {
+			thread_destroy(thread);
+			return NULL;
+		}
+		return thread;
+	}
+
+	KASSERT(thread->t_stack != NULL);
+	if (thread_setname(thread, name)) {
+		/* The stack's no good without a name; let it go. */
+		kfree(thread->t_stack);
+		thread->t_stack = NULL;
+		kfree(thread);
+		return NULL;
+	}
+	thread_init(thread);
+
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Up to THREAD_CACHE_MAX
+ * of them are kept for reuse instead.
  *
- * The list of zombies is per-cpu.
+ * The lists of zombies and of reusable threads are per-cpu.
  */
 static
 void
@@ -282,7 +436,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_recycle(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -294,6 +450,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -308,9 +466,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -428,10 +589,347 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Per-cpu utilization and load balancing statistics, for the "cpu"
+ * menu command. The busy percentage of each cpu and the time since
+ * the last reset give the utilization and makespan of whatever was
+ * run in between. The counters are read without locking, so they
+ * may be a tick off.
+ */
+static time_t cpustats_secs;
+static uint32_t cpustats_nsecs;
+
+void
+cpu_resetstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		c->c_busyclocks = 0;
+		c->c_idleclocks = 0;
+		c->c_steals = 0;
+		c->c_pushes = 0;
+		c->c_clockirqs = 0;
+		c->c_idleirqs = 0;
+	}
+	gettime(&cpustats_secs, &cpustats_nsecs);
+}
+
+void
+cpu_printstats(void)
+{
+	struct cpu *c;
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i, ticks, busy, totbusy, totticks;
+
+	gettime(&secs, &nsecs);
+	getinterval(cpustats_secs, cpustats_nsecs, secs, nsecs,
+		    &secs, &nsecs);
+
+	kprintf("%lu.%03lu seconds since reset\n",
+		(unsigned long)secs, (unsigned long)(nsecs / 1000000));
+	kprintf("cpu   busy  idle  busy%%  steals  pushes   irqs  idle irq/s\n");
+
+	totbusy = totticks = 0;
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		busy = c->c_busyclocks;
+		ticks = busy + c->c_idleclocks;
+		/* Clock interrupts per second of idle time. */
+		kprintf("%3u %6u %5u %5u%% %7u %7u %6u %11u\n", c->c_number,
+			busy, c->c_idleclocks,
+			ticks ? busy * 100 / ticks : 0,
+			c->c_steals, c->c_pushes, c->c_clockirqs,
+			c->c_idleclocks ?
+			c->c_idleirqs * HZ / c->c_idleclocks : 0);
+		totbusy += busy;
+		totticks += ticks;
+	}
+	kprintf("all %6u %5u %5u%%\n", totbusy, totticks - totbusy,
+		totticks ? totbusy * 100 / totticks : 0);
+}
+
+/*
+ * Run queue levels.
+ *
+ * A positive nice value keeps a thread out of the top levels, one
+ * level per SCHED_NICE_PER_LEVEL; a negative one stretches its
+ * quanta by as much (see thread_quantum).
+ */
+#define SCHED_NICE_PER_LEVEL	5
+
+static
+unsigned
+thread_toplevel(struct thread *t)
+{
+	unsigned level;
+
+	if (t->t_nice <= 0) {
+		return 0;
+	}
+	level = t->t_nice / SCHED_NICE_PER_LEVEL;
+	return (level < SCHED_NLEVELS) ? level : SCHED_NLEVELS - 1;
+}
+
+unsigned
+thread_level(struct thread *t)
+{
+	return (t->t_inherit < t->t_prio) ? t->t_inherit : t->t_prio;
+}
+
+/*
+ * Put T on the run queue of C, at its level. C's run queue must be
+ * locked.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	unsigned top;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	top = thread_toplevel(t);
+	if (t->t_prio < top) {
+		t->t_prio = top;
+	}
+	KASSERT(t->t_prio < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[thread_level(t)], t);
+	c->c_runcount++;
+}
+
+/*
+ * Take the thread that should run next off the run queue of C,
+ * which must be locked.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take the thread that would run last off the run queue of C,
+ * which must be locked.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Check if an affinity mask lets a thread run on cpu C. CPUs past
+ * the width of the mask are only allowed by THREAD_AFFINITY_ALL.
+ */
+static
+bool
+affinity_allows(uint32_t mask, const struct cpu *c)
+{
+	if (c->c_number >= 32) {
+		return mask == THREAD_AFFINITY_ALL;
+	}
+	return (mask & ((uint32_t)1 << c->c_number)) != 0;
+}
+
+/*
+ * Work stealing.
+ *
+ * A cpu that runs out of threads in thread_switch takes one from the
+ * peer with the most threads waiting, instead of idling until that
+ * peer pushes some over in thread_consider_migration, which is now
+ * only a slow fallback. The peers are looked at starting from a
+ * different one each time, so that idle cpus don't all go after the
+ * same victim when there's a tie. A thread must have run for
+ * SCHED_STEAL_HYST hardclocks since it last changed cpus before it
+ * can be taken again, so that it doesn't bounce back and forth and
+ * lose its cache each time.
+ */
+
+/*
+ * Take a thread off the run queue of C, which must be locked, for
+ * cpu THIEF. The lowest levels go first; they'd wait longest here.
+ */
+static
+struct thread *
+runqueue_steal(struct cpu *c, struct cpu *thief)
+{
+	struct threadlistnode *tln;
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		for (tln = c->c_runqueue[i].tl_head.tln_next;
+		     tln->tln_next != NULL; tln = tln->tln_next) {
+			t = tln->tln_self;
+			/*
+			 * The cpu's own curthread can be on its run queue
+			 * if it woke up while the cpu idled; see the
+			 * comments in thread_consider_migration.
+			 */
+			if (t == c->c_curthread ||
+			    t->t_sincemove < SCHED_STEAL_HYST ||
+			    !affinity_allows(t->t_affinity, thief)) {
+				continue;
+			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find a thread for the current cpu to run on some other cpu's run
+ * queue. Called with interrupts off and no run queue locked.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, start, numcpus, most;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 2) {
+		return NULL;
+	}
+
+	/* Find the busiest peer. The counts are only a hint. */
+	victim = NULL;
+	most = 0;
+	start = curcpu->c_hardclocks * 7 + curcpu->c_number;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c != curcpu->c_self && c->c_runcount > most) {
+			most = c->c_runcount;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_steal(victim, curcpu->c_self);
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+		t->t_sincemove = 0;
+		t->t_migrations++;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		curcpu->c_steals++;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
+/*
+ * Wakeup placement.
+ *
+ * Pick the cpu for a thread that's about to go on a run queue, and
+ * return it with its run queue locked. The cpu it last ran on keeps
+ * it if that's allowed and idle or lightly loaded, since its cache
+ * may still be warm there. Otherwise an idle cpu takes it, failing
+ * that the last one does anyway, and if the thread may not use that
+ * one, the least loaded cpu it may use. The loads of the other cpus
+ * are read without locking them, as hints.
+ *
+ * While the thread is still the curthread of its last cpu, that cpu
+ * is idling (or about to) on its stack, so it has to stay put.
+ */
+static
+struct cpu *
+thread_place(struct thread *t)
+{
+	struct cpu *last, *c, *idle, *best;
+	unsigned i, numcpus;
+
+	last = t->t_cpu;
+	spinlock_acquire(&last->c_runqueue_lock);
+	if (last->c_curthread == t) {
+		return last;
+	}
+	if (affinity_allows(t->t_affinity, last) &&
+	    (last->c_isidle || last->c_runcount <= SCHED_LIGHT_LOAD)) {
+		return last;
+	}
+	spinlock_release(&last->c_runqueue_lock);
+
+	idle = best = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (last->c_number + 1 + i) % numcpus);
+		if (!affinity_allows(t->t_affinity, c)) {
+			continue;
+		}
+		if (c->c_isidle) {
+			idle = c;
+			break;
+		}
+		if (best == NULL || c->c_runcount < best->c_runcount) {
+			best = c;
+		}
+	}
+	if (idle != NULL) {
+		best = idle;
+	}
+	else if (affinity_allows(t->t_affinity, last)) {
+		best = last;
+	}
+	KASSERT(best != NULL);
+
+	spinlock_acquire(&best->c_runqueue_lock);
+	if (best != last) {
+		t->t_cpu = best;
+		t->t_sincemove = 0;
+		t->t_migrations++;
+	}
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * targetcpu might be curcpu; it might not be, too. Unless the caller
+ * already holds the run queue lock of the thread's cpu, where it
+ * goes is up to thread_place.
  */
 static
 void
@@ -440,19 +938,29 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	struct cpu *targetcpu;
 	bool isidle;
 
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
-
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
+		targetcpu = target->t_cpu;
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		/* Choose a cpu and lock its run queue. */
+		targetcpu = thread_place(target);
+	}
+
+	/*
+	 * A thread waking up from sleep gave up the cpu before its
+	 * quantum ran out; move it up a level and give it a fresh one.
+	 */
+	if (target->t_state == S_SLEEP) {
+		if (target->t_prio > 0) {
+			target->t_prio--;
+		}
+		target->t_ticks = 0;
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -485,17 +993,13 @@ thread_fork(const char *name,
 {
 	struct thread *newthread;
 
-	newthread = thread_create(name);
+	/* Get a thread and stack, recycled ones if we have any */
+	newthread = thread_reuse(name);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
+	/* A recycled stack was checked on exit; mark it afresh anyway */
 	thread_checkstack_init(newthread);
 
 	/*
@@ -504,6 +1008,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
 
 	/* VM fields */
 	/* do not clone address space -- let caller decide on that */
@@ -540,6 +1045,24 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Put the thread thread_switch just switched away from on a cpu it
+ * may use, if it had to leave this one. Called by the thread
+ * switched to, once off the old one's stack, with interrupts off.
+ */
+static
+void
+thread_evicted(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_evicted;
+	if (t != NULL) {
+		curcpu->c_evicted = NULL;
+		thread_make_runnable(t, false);
+	}
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -580,7 +1103,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -591,6 +1114,17 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+		if (!affinity_allows(cur->t_affinity, curcpu)) {
+			/*
+			 * It may not run here any more. It can't go on
+			 * another cpu's run queue while we're still on
+			 * its stack, so leave it to the thread we switch
+			 * to. There is one, as the run queue isn't empty.
+			 */
+			KASSERT(curcpu->c_evicted == NULL);
+			curcpu->c_evicted = cur;
+			break;
+		}
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
@@ -638,10 +1172,17 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Look for work elsewhere before idling. */
+			next = thread_steal();
+			if (next == NULL) {
+				/* Stop the hardclock while we wait. */
+				clock_idle();
+				cpu_idle();
+				clock_unidle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -714,6 +1255,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Place the thread we switched from if it had to leave. */
+	thread_evicted();
+
 	/* If we have an address space, activate it in the MMU. */
 	if (cur->t_addrspace != NULL) {
 		as_activate(cur->t_addrspace);
@@ -749,6 +1293,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Place the thread we switched from if it had to leave. */
+	thread_evicted();
+
 	/* If we have an address space, activate it in the MMU. */
 	if (cur->t_addrspace != NULL) {
 		as_activate(cur->t_addrspace);
@@ -839,23 +1386,210 @@ thread_yield(void)
  *
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
+ *
+ * Each run queue is a multi-level feedback queue. Threads run from
+ * the top level (0) down, round-robin within a level. A thread that
+ * runs for a whole quantum drops a level (see thread_tick), and lower
+ * levels have longer quanta, so CPU hogs sink and get longer, rarer
+ * turns. A thread that sleeps, which is what threads waiting for I/O
+ * or for the user do, moves up a level when it wakes up (see
+ * thread_make_runnable). To keep the hogs from starving, every
+ * SCHED_BOOST_HARDCLOCKS this puts everything back at the top.
  */
 
+#define SCHED_BOOST_HARDCLOCKS	HZ	/* once a second */
+
 #if OPT_DEFAULTSCHEDULER
 void
 schedule(void)
 {
   // 28 Feb 2012 : GWA : Leave the default scheduler alone!
 }
+
+bool
+thread_tick(void)
+{
+	if (!curcpu->c_isidle) {
+		curthread->t_sincemove++;
+	}
+
+	/* Plain round-robin, one hardclock each. */
+	return true;
+}
 #else
+/* Quantum at each level, in hardclocks */
+static const unsigned sched_quantum[SCHED_NLEVELS] = { 1, 2, 4, 8 };
+
+static
+unsigned
+thread_quantum(struct thread *t)
+{
+	unsigned q;
+
+	q = sched_quantum[t->t_prio];
+	if (t->t_nice < 0) {
+		q += q * (unsigned)(-t->t_nice) / SCHED_NICE_PER_LEVEL;
+	}
+	return q;
+}
+
 void
 schedule(void)
 {
-	
+	struct threadlist boosted;
+	struct thread *t;
+
+	if (curcpu->c_hardclocks - curcpu->c_lastboost <
+	    SCHED_BOOST_HARDCLOCKS) {
+		return;
+	}
+	curcpu->c_lastboost = curcpu->c_hardclocks;
+
+	threadlist_init(&boosted);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = runqueue_remhead(curcpu)) != NULL) {
+		threadlist_addtail(&boosted, t);
+	}
+	while ((t = threadlist_remhead(&boosted)) != NULL) {
+		t->t_prio = 0;
+		t->t_ticks = 0;
+		runqueue_add(curcpu, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&boosted);
+
+	if (!curcpu->c_isidle) {
+		curthread->t_prio = thread_toplevel(curthread);
+		curthread->t_ticks = 0;
+	}
 }
 
+bool
+thread_tick(void)
+{
+	struct thread *cur;
+	unsigned i;
+	bool preempt;
+
+	/* Nobody to charge while the cpu idles. */
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	cur = curthread;
+	cur->t_sincemove++;
+
+	/*
+	 * Pick up the nice value of our process, in case it changed. A
+	 * thread that never makes a system call only notices it here.
+	 * sys__exit clears td_proc before the process may go away.
+	 */
+	if (cur->td_proc != NULL) {
+		cur->t_nice = cur->td_proc->p_nice;
+	}
+
+	/* On a cpu it may not use; leave as soon as something else can run. */
+	if (!affinity_allows(cur->t_affinity, curcpu)) {
+		return true;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= thread_quantum(cur)) {
+		/* Used up its quantum; drop a level. */
+		if (cur->t_prio < SCHED_NLEVELS - 1) {
+			cur->t_prio++;
+		}
+		cur->t_ticks = 0;
+		return true;
+	}
+
+	/* Otherwise, give way only to a thread on a higher level. */
+	preempt = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=0; i<thread_level(cur); i++) {
+		if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+			preempt = true;
+			break;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return preempt;
+}
 #endif
 
+/*
+ * Affinity. See thread.h.
+ */
+bool
+thread_affinity_valid(uint32_t mask)
+{
+	unsigned i;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		if (affinity_allows(mask, cpuarray_get(&allcpus, i))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+thread_setaffinity(uint32_t mask)
+{
+	KASSERT(thread_affinity_valid(mask));
+	curthread->t_affinity = mask;
+}
+
+/*
+ * Priority inheritance. See thread.h.
+ *
+ * T may be on a run queue, and then it has to move to the level it
+ * runs at now. Its cpu can change under us until that cpu's run
+ * queue is locked; a thread being placed on a cpu meanwhile isn't on
+ * any run queue yet, and goes where its new level says.
+ */
+void
+thread_inherit(struct thread *t, unsigned level)
+{
+	struct threadlistnode *tln;
+	struct cpu *c;
+	unsigned i;
+	bool queued;
+
+	KASSERT(level <= SCHED_NLEVELS);
+
+	for (;;) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	/* Take it off the run queue, if it's on one... */
+	queued = false;
+	for (i=0; i<SCHED_NLEVELS && !queued; i++) {
+		for (tln = c->c_runqueue[i].tl_head.tln_next;
+		     tln->tln_next != NULL; tln = tln->tln_next) {
+			if (tln->tln_self == t) {
+				threadlist_remove(&c->c_runqueue[i], t);
+				c->c_runcount--;
+				queued = true;
+				break;
+			}
+		}
+	}
+
+	/* ...and put it back at its new level. */
+	t->t_inherit = level;
+	if (queued) {
+		runqueue_add(c, t);
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
 /*
  * Thread migration.
  *
@@ -872,11 +1606,15 @@ schedule(void)
  * For here and now, because we know we're running on System/161 and
  * System/161 does not (yet) model such cache effects, we'll be very
  * aggressive.
+ *
+ * Idle cpus now pull work for themselves in thread_steal, so this
+ * only runs every MIGRATE_HARDCLOCKS as a fallback for cpus that
+ * are busy but less so than their peers.
  */
 void
 thread_consider_migration(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
+	unsigned my_count, total_count, one_share, to_send, skipped;
 	unsigned i, numcpus;
 	struct cpu *c;
 	struct threadlist victims;
@@ -887,9 +1625,9 @@ thread_consider_migration(void)
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_runcount;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_runcount;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -903,7 +1641,7 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(curcpu);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -914,7 +1652,8 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		skipped = 0;
+		while (c->c_runcount < one_share && to_send > skipped) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -944,8 +1683,18 @@ thread_consider_migration(void)
 				continue;
 			}
 
+			/* Leave threads that may not run there for the next cpu. */
+			if (!affinity_allows(t->t_affinity, c)) {
+				threadlist_addtail(&victims, t);
+				skipped++;
+				continue;
+			}
+
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			t->t_sincemove = 0;
+			t->t_migrations++;
+			runqueue_add(c, t);
+			curcpu->c_pushes++;
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -969,7 +1718,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1002,8 +1751,10 @@ wchan_create(const char *name)
 		return NULL;
 	}
 	spinlock_init(&wc->wc_lock);
+	spinlock_setname(&wc->wc_lock, name);
 	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
+	wc->wc_ntimed = 0;
 	return wc;
 }
 
@@ -1014,6 +1765,14 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
+	/*
+	 * A thread that was woken from wchan_sleep_until still looks
+	 * at the channel on its way out; wait for it.
+	 */
+	while (wc->wc_ntimed > 0) {
+		thread_yield();
+	}
+
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
 	kfree(wc);
@@ -1046,13 +1805,103 @@ wchan_sleep(struct wchan *wc)
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
+	curthread->t_wchan_key = NULL;
+	thread_switch(S_SLEEP, wc);
+}
+
+/*
+ * Same as wchan_sleep, but only wchan_wakeall_key with the same KEY
+ * (or a plain wakeup) will wake the thread up.
+ */
+void
+wchan_sleep_key(struct wchan *wc, const void *key)
+{
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	curthread->t_wchan_key = key;
 	thread_switch(S_SLEEP, wc);
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * Timeout for wchan_sleep_until: if the thread is still asleep on
+ * the channel, take it off and wake it up, and tell it so.
  */
+struct wchan_timeout {
+	struct wchan *wt_wchan;
+	struct thread *wt_thread;
+	bool wt_expired;
+};
+
+static
 void
+wchan_timeout(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct wchan *wc = wt->wt_wchan;
+	struct threadlistnode *tln;
+
+	spinlock_acquire(&wc->wc_lock);
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self == wt->wt_thread) {
+			threadlist_remove(&wc->wc_threads, wt->wt_thread);
+			wt->wt_expired = true;
+			break;
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	if (wt->wt_expired) {
+		/* As in wchan_wakeone, nobody else can wake it now. */
+		thread_make_runnable(wt->wt_thread, false);
+	}
+}
+
+/*
+ * Same as wchan_sleep, but if nobody wakes the thread up by DEADLINE
+ * (in nanoseconds; see clock_now), it wakes up anyway. Returns true
+ * in that case.
+ */
+bool
+wchan_sleep_until(struct wchan *wc, uint64_t deadline)
+{
+	struct wchan_timeout wt;
+	struct timer tm;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	wt.wt_wchan = wc;
+	wt.wt_thread = curthread;
+	wt.wt_expired = false;
+
+	/*
+	 * Start the timer holding the channel lock, so it can't find
+	 * us until we are on the channel.
+	 */
+	wc->wc_ntimed++;
+	timer_init(&tm, wchan_timeout, &wt);
+	timer_add(&tm, deadline);
+
+	curthread->t_wchan_key = NULL;
+	thread_switch(S_SLEEP, wc);
+
+	/* Woken up one way or the other; the timer is on our stack. */
+	timer_cancel(&tm);
+
+	spinlock_acquire(&wc->wc_lock);
+	wc->wc_ntimed--;
+	spinlock_release(&wc->wc_lock);
+
+	return wt.wt_expired;
+}
+
+/*
+ * Wake up one thread sleeping on a wait channel, and return it.
+ */
+struct thread *
 wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
@@ -1068,10 +1917,11 @@ wchan_wakeone(struct wchan *wc)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
 
 	thread_make_runnable(target, false);
+	return target;
 }
 
 /*
@@ -1111,6 +1961,66 @@ wchan_wakeall(struct wchan *wc)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake up the first thread sleeping on a wait channel for KEY, and
+ * return it, or NULL if there was none.
+ */
+struct thread *
+wchan_wakeone_key(struct wchan *wc, const void *key)
+{
+	struct threadlistnode *tln;
+	struct thread *target;
+
+	spinlock_acquire(&wc->wc_lock);
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		target = tln->tln_self;
+		if (target->t_wchan_key == key) {
+			threadlist_remove(&wc->wc_threads, target);
+			spinlock_release(&wc->wc_lock);
+			/* As in wchan_wakeone, nobody else can wake it now. */
+			thread_make_runnable(target, false);
+			return target;
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	return NULL;
+}
+
+/*
+ * Wake up the threads sleeping on a wait channel for KEY, and leave
+ * the others be.
+ */
+void
+wchan_wakeall_key(struct wchan *wc, const void *key)
+{
+	struct threadlistnode *tln;
+	struct thread *target;
+	struct threadlist list;
+
+	threadlist_init(&list);
+
+	/* Move the matching threads to a private list, as wchan_wakeall does */
+	spinlock_acquire(&wc->wc_lock);
+	tln = wc->wc_threads.tl_head.tln_next;
+	while (tln->tln_next != NULL) {
+		target = tln->tln_self;
+		tln = tln->tln_next;
+		if (target->t_wchan_key == key) {
+			threadlist_remove(&wc->wc_threads, target);
+			threadlist_addtail(&list, target);
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_make_runnable(target, false);
+	}
+
+	threadlist_cleanup(&list);
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1169,6 +2079,56 @@ ipi_tlbshootdown_by_num( unsigned cpunum, const struct tlbshootdown *mapping ) {
 	ipi_tlbshootdown( target, mapping );
 }
 
+/**
+ * send the shootdown to every other cpu.
+ * returns a mask with the bit of each cpu that was signalled.
+ */
+uint32_t
+ipi_tlbshootdown_broadcast( const struct tlbshootdown *mapping ) {
+	unsigned	i;
+	struct cpu	*c;
+	uint32_t	mask;
+
+	mask = 0;
+	for( i = 0; i < cpuarray_num( &allcpus ); ++i ) {
+		c = cpuarray_get( &allcpus, i );
+		if( c != curcpu->c_self ) {
+			ipi_tlbshootdown( c, mapping );
+			mask |= (uint32_t)1 << c->c_number;
+		}
+	}
+
+	return mask;
+}
+
+/**
+ * ask every other cpu to drop its whole tlb.
+ * returns a mask with the bit of each cpu that was signalled.
+ */
+uint32_t
+ipi_tlbflush_broadcast( void ) {
+	unsigned	i;
+	struct cpu	*c;
+	uint32_t	mask;
+
+	mask = 0;
+	for( i = 0; i < cpuarray_num( &allcpus ); ++i ) {
+		c = cpuarray_get( &allcpus, i );
+		if( c == curcpu->c_self )
+			continue;
+
+		spinlock_acquire( &c->c_ipi_lock );
+		c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi( c );
+		spinlock_release( &c->c_ipi_lock );
+
+		mask |= (uint32_t)1 << c->c_number;
+	}
+
+	return mask;
+}
+
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
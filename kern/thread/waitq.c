@@ -0,0 +1,98 @@
+#include <types.h>
+#include <lib.h>
+#include <wchan.h>
+#include <waitq.h>
+
+struct waitq {
+	const char			*wq_name;
+	struct wchan			*wq_buckets[WAITQ_NBUCKETS];
+};
+
+static bool			waitq_herd = false;
+
+static inline
+struct wchan *
+waitq_bucket( struct waitq *wq, const void *key ) {
+	return wq->wq_buckets[(((vaddr_t)key >> 3) * 2654435761U) >> (32 - WAITQ_HASHBITS)];
+}
+
+/**
+ * create a waitq. name is not copied.
+ */
+struct waitq *
+waitq_create( const char *name ) {
+	struct waitq		*wq;
+	unsigned		i;
+
+	wq = kmalloc( sizeof( struct waitq ) );
+	if( wq == NULL )
+		return NULL;
+
+	wq->wq_name = name;
+	for( i = 0; i < WAITQ_NBUCKETS; ++i ) {
+		wq->wq_buckets[i] = wchan_create( name );
+		if( wq->wq_buckets[i] == NULL ) {
+			while( i-- > 0 )
+				wchan_destroy( wq->wq_buckets[i] );
+			kfree( wq );
+			return NULL;
+		}
+	}
+
+	return wq;
+}
+
+void
+waitq_lock( struct waitq *wq, const void *key ) {
+	wchan_lock( waitq_bucket( wq, key ) );
+}
+
+/**
+ * sleep until somebody wakes up key. the key must be locked,
+ * and is unlocked upon return.
+ */
+void
+waitq_sleep( struct waitq *wq, const void *key ) {
+	wchan_sleep_key( waitq_bucket( wq, key ), key );
+}
+
+/**
+ * wake up one thread waiting for key, if there is any.
+ * herding makes no sense for one thread, so it is always keyed.
+ */
+bool
+waitq_wakeone( struct waitq *wq, const void *key ) {
+	return wchan_wakeone_key( waitq_bucket( wq, key ), key ) != NULL;
+}
+
+/**
+ * wake up every thread waiting for key.
+ */
+void
+waitq_wakeall( struct waitq *wq, const void *key ) {
+	if( waitq_herd )
+		waitq_wakeall_keys( wq );
+	else
+		wchan_wakeall_key( waitq_bucket( wq, key ), key );
+}
+
+/**
+ * wake up every thread waiting on wq, whatever it waits for.
+ */
+void
+waitq_wakeall_keys( struct waitq *wq ) {
+	unsigned		i;
+
+	for( i = 0; i < WAITQ_NBUCKETS; ++i )
+		wchan_wakeall( wq->wq_buckets[i] );
+}
+
+void
+waitq_set_herd( bool herd ) {
+	waitq_herd = herd;
+}
+
+bool
+waitq_get_herd( void ) {
+	return waitq_herd;
+}
@@ -36,11 +36,16 @@
 #include <vm/region.h>
 #include <vm/page.h>
 #include <vm/swap.h>
+#include <vm/vmstat.h>
+#include <vm/ksm.h>
 #include <array.h>
 #include <cpu.h>
 #include <machine/coremap.h>
 #include <machine/tlb.h>
 #include <current.h>
+#include <kern/mman.h>
+#include <synch.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -50,6 +55,26 @@
 
 DEFARRAY_BYTYPE( vm_region_array ,struct vm_region, /* ... */);
 
+/**
+ * dead addrspaces waiting to be torn down by the reaper thread,
+ * so that exiting does not have to wait for every page to be freed.
+ */
+static struct lock		*as_reap_lk;
+static struct cv		*as_reap_cv;
+static struct addrspace		*as_reap_list = NULL;
+static bool			as_reaper_started = false;
+
+void
+as_bootstrap( void ) {
+	as_reap_lk = lock_create( "as_reap_lk" );
+	if( as_reap_lk == NULL )
+		panic( "as_bootstrap: could not create as_reap_lk." );
+
+	as_reap_cv = cv_create( "as_reap_cv" );
+	if( as_reap_cv == NULL )
+		panic( "as_bootstrap: could not create as_reap_cv." );
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -67,9 +92,27 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_lk = lock_create( "as_lk" );
+	if( as->as_lk == NULL ) {
+		vm_region_array_destroy( as->as_regions );
+		kfree( as );
+		return NULL;
+	}
+
 	//set the heap start.
 	as->as_heap_start = 0;
 	as->as_heap_end = 0;
+	as->as_nlocked = 0;
+	as->as_reap_next = NULL;
+	as->as_last_hit = NULL;
+
+	//let the page merger find us.
+	if( ksm_register( as ) ) {
+		lock_destroy( as->as_lk );
+		vm_region_array_destroy( as->as_regions );
+		kfree( as );
+		return NULL;
+	}
 
 	return as;
 }
@@ -88,40 +131,61 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
+	//the scanner may already be looking at newas.
+	AS_LOCK( old );
+	AS_LOCK( newas );
+
 	//copy all vm regions that reside in the old addrspace.
+	result = 0;
 	for( i = 0; i < vm_region_array_num( old->as_regions ); ++i ) {
 		vmr = vm_region_array_get( old->as_regions, i );
 
 		//if clone fails, we simply return the reason
 		//it failed, after destroying newas.
 		result = vm_region_clone( vmr, &newvmr );
-		if( result ) {
-			as_destroy( newas );
-			return result;
-		}
+		if( result )
+			break;
 
+		//old is sorted, so appending keeps newas sorted as well.
 		result = vm_region_array_add( newas->as_regions, newvmr, NULL );
 		if( result ) {
 			vm_region_destroy( newvmr );
-			as_destroy( newas );
-			return result;
+			break;
 		}
 	}
+
+	AS_UNLOCK( newas );
+	AS_UNLOCK( old );
+
+	if( result ) {
+		as_destroy( newas );
+		return result;
+	}
 	
 	*ret = newas;
 	return 0;
 }
 
+/**
+ * tear down an addrspace the page merger has already forgotten about.
+ * unless flushed is set, each page is unmapped on its own.
+ */
+static
 void
-as_destroy(struct addrspace *as)
-{
+as_teardown( struct addrspace *as, bool flushed ) {
 	struct vm_region		*vmr;
 	unsigned			i;
 
+	//the scanner may still be busy with us.
+	AS_LOCK( as );
+
 	//destroy each vm region associated with this addrspace.
 	for( i = 0; i < vm_region_array_num( as->as_regions ); ++i ) {
 		vmr = vm_region_array_get( as->as_regions, i );
-		vm_region_destroy( vmr );
+		if( flushed )
+			vm_region_reap( vmr );
+		else
+			vm_region_destroy( vmr );
 	}
 
 	//reside the regions array to 0, and
@@ -129,9 +193,77 @@ as_destroy(struct addrspace *as)
 	vm_region_array_setsize( as->as_regions, 0 );
 	vm_region_array_destroy( as->as_regions );
 
+	AS_UNLOCK( as );
+	lock_destroy( as->as_lk );
 	kfree( as );
 }
 
+void
+as_destroy(struct addrspace *as)
+{
+	//nobody finds us anymore.
+	ksm_unregister( as );
+	as_teardown( as, false );
+}
+
+/**
+ * take whatever died since the last round, flush every tlb once
+ * for all of them, and free their pages without unmapping any.
+ */
+static
+void
+as_reaper( void *unused1, unsigned long unused2 ) {
+	struct addrspace		*as;
+	struct addrspace		*next;
+
+	(void)unused1;
+	(void)unused2;
+
+	for( ;; ) {
+		lock_acquire( as_reap_lk );
+		while( as_reap_list == NULL )
+			cv_wait( as_reap_cv, as_reap_lk );
+		as = as_reap_list;
+		as_reap_list = NULL;
+		lock_release( as_reap_lk );
+
+		coremap_flush_tlbs();
+		for( ; as != NULL; as = next ) {
+			next = as->as_reap_next;
+			as_teardown( as, true );
+		}
+	}
+}
+
+/**
+ * hand a dead addrspace to the reaper, which is started the first
+ * time it is needed. nobody may use as anymore, and it must not be
+ * active on this cpu. if the reaper cannot be started, we do the
+ * work ourselves.
+ */
+void
+as_destroy_deferred( struct addrspace *as ) {
+	KASSERT( as != curcpu->c_lastas );
+
+	//nobody finds us anymore.
+	ksm_unregister( as );
+
+	lock_acquire( as_reap_lk );
+	if( !as_reaper_started ) {
+		if( thread_fork( "as_reaper", as_reaper, NULL, 0, NULL ) ) {
+			lock_release( as_reap_lk );
+			as_teardown( as, false );
+			return;
+		}
+		as_reaper_started = true;
+	}
+
+	as->as_reap_next = as_reap_list;
+	as_reap_list = as;
+	cv_signal( as_reap_cv, as_reap_lk );
+	lock_release( as_reap_lk );
+}
+
 void
 as_activate(struct addrspace *as)
 {
@@ -151,27 +283,7 @@ as_activate(struct addrspace *as)
 static 
 bool
 as_overlaps_region( struct addrspace *as, size_t sz, vaddr_t vaddr ) {
-	unsigned		i;
-	vaddr_t			bottom;
-	vaddr_t			top;
-	struct vm_region	*vmr;
-
-	//loop over all regions.
-	for( i = 0; i <  vm_region_array_num( as->as_regions ); ++i ) {
-		//get the current region.
-		vmr = vm_region_array_get( as->as_regions, i );
-
-		//calculate bottom and top virtual addresses.
-		bottom = vmr->vmr_base;
-		top = bottom + vm_page_array_num( vmr->vmr_pages ) * PAGE_SIZE;
-
-		//if the tail & head of the new vm_region are inside
-		//the current address space block,then we have an overlap.
-		if( vaddr + sz > bottom && vaddr < top )
-			return true;
-	}
-
-	return false;
+	return vm_region_find_overlap( as, vaddr, sz ) != NULL;
 }
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
@@ -183,17 +295,12 @@ as_overlaps_region( struct addrspace *as, size_t sz, vaddr_t vaddr ) {
  * moment, these are ignored. When you write the VM system, you may
  * want to implement them.
  */
+static
 int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 int readable, int writeable, int executable)
-{
+as_define_region_locked( struct addrspace *as, vaddr_t vaddr, size_t sz ) {
 	struct vm_region		*vmr;
 	int				res;
 
-	(void) readable;
-	(void) writeable;
-	(void) executable;
-
 	//align the virtual address.
 	vaddr &= PAGE_FRAME;	
 	
@@ -211,7 +318,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	vmr->vmr_base = vaddr;
 	//add it to the addresspace.
-	res = vm_region_array_add( as->as_regions, vmr, NULL );
+	res = vm_region_insert( as, vmr );
 	if( res ) {
 		vm_region_destroy( vmr );
 		return res;
@@ -224,6 +331,22 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return 0;
 }
 
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	int				res;
+
+	(void) readable;
+	(void) writeable;
+	(void) executable;
+
+	AS_LOCK( as );
+	res = as_define_region_locked( as, vaddr, sz );
+	AS_UNLOCK( as );
+	return res;
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
@@ -253,35 +376,350 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+static
 int
-as_fault( struct addrspace *as, int fault_type, vaddr_t fault_addr ) {
+as_fault_locked( struct addrspace *as, int fault_type, vaddr_t fault_addr ) {
 	struct vm_region		*vmr;
 	int				ix_page;
 	struct vm_page			*vmp;
 	int				res;
-
-	KASSERT( as != NULL );
+	bool				major;
 
 	//find the responsible vm_region for the faulty address.
 	vmr = vm_region_find_responsible( as, fault_addr );
 	if( vmr == NULL )
 		return EFAULT;
 
+	//make sure the region allows this kind of access.
+	if( vmr->vmr_prot == PROT_NONE )
+		return EFAULT;
+	if( fault_type != VM_FAULT_READ && (vmr->vmr_prot & PROT_WRITE) == 0 )
+		return EFAULT;
+
 	//find the responsible vm_page.
 	ix_page = (fault_addr - vmr->vmr_base) / PAGE_SIZE;
+
+	//pages of a shared region may be faulted on by other address spaces.
+	if( vmr->vmr_share != NULL )
+		lock_acquire( vmr->vmr_share->vms_lk );
 	
-	//get the virtual page.
-	vmp = vm_page_array_get( vmr->vmr_pages, ix_page );
-	
-	//if the virtual page is null, it means we have to zero-fill it.
-	if( vmp == NULL ) {
-		//create  a new blank page
-		res = vm_page_new_blank( &vmp );
-		if( res ) 
+	//the first touch of a file page has to read it in.
+	major = vmr->vmr_type == VMR_FILE && vm_pagetable_get( vmr->vmr_pages, ix_page ) == NULL;
+
+	//get the virtual page, filling it in if this is the first touch.
+	res = vm_region_get_page( vmr, ix_page, &vmp );
+
+	//a merged page is never written to, the writer gets a copy instead.
+	if( res == 0 && fault_type != VM_FAULT_READ && VM_PAGE_MERGED( vmp ) )
+		res = vm_region_unmerge( vmr, ix_page, &vmp );
+
+	if( res == 0 )
+		res = vm_page_fault( vmp, as, fault_type, fault_addr, &major );
+
+	if( vmr->vmr_share != NULL )
+		lock_release( vmr->vmr_share->vms_lk );
+
+	if( res == 0 )
+		vmstat_fault( major );
+
+	//streaming access: get ahead of the reader, and forget what it left behind.
+	if( res == 0 && vmr->vmr_advice == MADV_SEQUENTIAL ) {
+		vm_region_prefetch( vmr, ix_page + 1, VMR_READAHEAD );
+		if( ix_page >= VMR_DROPBEHIND )
+			vm_region_deactivate( vmr, ix_page - VMR_DROPBEHIND, 1 );
+	}
+
+	return res;
+}
+
+int
+as_fault( struct addrspace *as, int fault_type, vaddr_t fault_addr ) {
+	int				res;
+
+	KASSERT( as != NULL );
+
+	AS_LOCK( as );
+	res = as_fault_locked( as, fault_type, fault_addr );
+	AS_UNLOCK( as );
+	return res;
+}
+
+/**
+ * find sz bytes of unused address space for a mapping.
+ * we go top-down from the stack, staying clear of the area
+ * reserved for the heap to grow into.
+ */
+static
+vaddr_t
+as_find_free_range( struct addrspace *as, size_t sz ) {
+	vaddr_t			floor;
+	vaddr_t			vaddr;
+	struct vm_region	*vmr;
+
+	floor = as->as_heap_start + PROC_MAX_HEAP_PAGES * PAGE_SIZE;
+	if( sz > USERSTACKBASE || USERSTACKBASE - sz < floor )
+		return 0;
+
+	vaddr = USERSTACKBASE - sz;
+	while( vaddr >= floor ) {
+		vmr = vm_region_find_overlap( as, vaddr, sz );
+		if( vmr == NULL )
+			return vaddr;
+
+		//skip below whatever region is in our way.
+		if( vmr->vmr_base < sz + floor )
+			return 0;
+		vaddr = vmr->vmr_base - sz;
+	}
+
+	return 0;
+}
+
+/**
+ * create a region for mmap().
+ * vaddr is only a hint; if it is unusable we pick the address ourselves.
+ * the region is backed by vn starting at offset, or anonymous if vn is NULL.
+ */
+static
+int
+as_define_mapping_locked( struct addrspace *as, vaddr_t vaddr, size_t sz, int prot, int flags,
+			  struct vnode *vn, off_t offset, vaddr_t *ret ) {
+	struct vm_region		*vmr;
+	int				res;
+
+	KASSERT( sz > 0 );
+	sz = ROUNDUP( sz, PAGE_SIZE );
+
+	//honor the hint only if it is sane.
+	if( vaddr == 0 || (vaddr & PAGE_FRAME) != vaddr || vaddr + sz < vaddr ||
+	    vaddr + sz > USERSTACKBASE || as_overlaps_region( as, sz, vaddr ) ) {
+		vaddr = as_find_free_range( as, sz );
+		if( vaddr == 0 )
+			return ENOMEM;
+	}
+
+	vmr = vm_region_create( sz / PAGE_SIZE );
+	if( vmr == NULL )
+		return ENOMEM;
+
+	vmr->vmr_base = vaddr;
+	vmr->vmr_prot = prot;
+	vmr->vmr_flags = flags;
+	vmr->vmr_offset = offset;
+	if( vn != NULL ) {
+		vmr->vmr_type = VMR_FILE;
+		vmr->vmr_vnode = vn;
+		VOP_INCREF( vn );
+	}
+
+	if( flags & MAP_SHARED ) {
+		res = vm_region_share( vmr );
+		if( res ) {
+			vm_region_destroy( vmr );
 			return res;
+		}
+	}
+
+	res = vm_region_insert( as, vmr );
+	if( res ) {
+		vm_region_destroy( vmr );
+		return res;
+	}
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_define_mapping( struct addrspace *as, vaddr_t vaddr, size_t sz, int prot, int flags,
+		   struct vnode *vn, off_t offset, vaddr_t *ret ) {
+	int				res;
+
+	AS_LOCK( as );
+	res = as_define_mapping_locked( as, vaddr, sz, prot, flags, vn, offset, ret );
+	AS_UNLOCK( as );
+	return res;
+}
+
+/**
+ * remove the mapping that starts at vaddr and spans len bytes.
+ * only whole mappings created by as_define_mapping can be removed.
+ */
+static
+int
+as_remove_mapping_locked( struct addrspace *as, vaddr_t vaddr, size_t len ) {
+	struct vm_region		*vmr;
+	unsigned			i;
+
+	len = ROUNDUP( len, PAGE_SIZE );
+	for( i = 0; i < vm_region_array_num( as->as_regions ); ++i ) {
+		vmr = vm_region_array_get( as->as_regions, i );
+		if( vmr->vmr_base != vaddr )
+			continue;
 		
-		//append to to the region.
-		vm_page_array_set( vmr->vmr_pages, ix_page, vmp );
+		//must be a whole mapping.
+		if( vmr->vmr_flags == 0 || vm_pagetable_num( vmr->vmr_pages ) * PAGE_SIZE != len )
+			return EINVAL;
+
+		//whatever was pinned is released with it.
+		as->as_nlocked -= vm_region_munlock( vmr, 0, vm_pagetable_num( vmr->vmr_pages ) );
+
+		vm_region_remove( as, i );
+		vm_region_destroy( vmr );
+		return 0;
+	}
+
+	return EINVAL;
+}
+
+int
+as_remove_mapping( struct addrspace *as, vaddr_t vaddr, size_t len ) {
+	int				res;
+
+	AS_LOCK( as );
+	res = as_remove_mapping_locked( as, vaddr, len );
+	AS_UNLOCK( as );
+	return res;
+}
+
+/**
+ * write back every shared mapping of vn in the given addrspace.
+ */
+int
+as_sync_vnode( struct addrspace *as, struct vnode *vn ) {
+	struct vm_region		*vmr;
+	unsigned			i;
+	int				res;
+
+	for( i = 0; i < vm_region_array_num( as->as_regions ); ++i ) {
+		vmr = vm_region_array_get( as->as_regions, i );
+		if( vmr->vmr_vnode != vn || vmr->vmr_share == NULL )
+			continue;
+
+		res = vm_region_writeback( vmr );
+		if( res )
+			return res;
+	}
+
+	return 0;
+}
+
+/**
+ * find the region that holds all of [vaddr, vaddr + len),
+ * and the index of the page vaddr falls into.
+ */
+static
+int
+as_find_range( struct addrspace *as, vaddr_t vaddr, size_t len, struct vm_region **ret, unsigned *ix ) {
+	struct vm_region		*vmr;
+	vaddr_t				top;
+
+	if( (vaddr & PAGE_FRAME) != vaddr || len == 0 || vaddr + len < vaddr )
+		return EINVAL;
+
+	vmr = vm_region_find_responsible( as, vaddr );
+	if( vmr == NULL )
+		return ENOMEM;
+
+	top = vmr->vmr_base + vm_pagetable_num( vmr->vmr_pages ) * PAGE_SIZE;
+	if( vaddr + len > top )
+		return ENOMEM;
+
+	*ret = vmr;
+	*ix = (vaddr - vmr->vmr_base) / PAGE_SIZE;
+	return 0;
+}
+
+/**
+ * madvise() for the given range.
+ * access pattern advice is kept for the whole region.
+ */
+static
+int
+as_advise_locked( struct addrspace *as, vaddr_t vaddr, size_t len, int advice ) {
+	struct vm_region		*vmr;
+	unsigned			ix;
+	unsigned			npages;
+	int				res;
+
+	res = as_find_range( as, vaddr, len, &vmr, &ix );
+	if( res )
+		return res;
+
+	npages = DIVROUNDUP( len, PAGE_SIZE );
+	switch( advice ) {
+		case MADV_NORMAL:
+		case MADV_RANDOM:
+		case MADV_SEQUENTIAL:
+			vmr->vmr_advice = advice;
+			return 0;
+
+		case MADV_WILLNEED:
+			vm_region_prefetch( vmr, ix, npages );
+			return 0;
+
+		case MADV_DONTNEED:
+			return vm_region_discard( vmr, ix, npages );
 	}
-	return vm_page_fault( vmp, as, fault_type, fault_addr );
+
+	return EINVAL;
+}
+
+int
+as_advise( struct addrspace *as, vaddr_t vaddr, size_t len, int advice ) {
+	int				res;
+
+	AS_LOCK( as );
+	res = as_advise_locked( as, vaddr, len, advice );
+	AS_UNLOCK( as );
+	return res;
+}
+
+/**
+ * mlock() or munlock() the given range.
+ */
+static
+int
+as_mlock_locked( struct addrspace *as, vaddr_t vaddr, size_t len, bool lock ) {
+	struct vm_region		*vmr;
+	unsigned			ix;
+	unsigned			npages;
+	unsigned			nlocked;
+	int				res;
+
+	//round the range out to whole pages.
+	len += vaddr & ~PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	res = as_find_range( as, vaddr, len, &vmr, &ix );
+	if( res )
+		return res;
+
+	npages = DIVROUNDUP( len, PAGE_SIZE );
+	if( !lock ) {
+		//only counts what we pinned ourselves, not what we share.
+		nlocked = vm_region_munlock( vmr, ix, npages );
+		KASSERT( nlocked <= as->as_nlocked );
+		as->as_nlocked -= nlocked;
+		return 0;
+	}
+
+	//we may not know which are pinned already, so be pessimistic.
+	if( as->as_nlocked + npages > PROC_MAX_LOCKED_PAGES )
+		return ENOMEM;
+
+	nlocked = 0;
+	res = vm_region_mlock( vmr, ix, npages, &nlocked );
+	as->as_nlocked += nlocked;
+	return res;
+}
+
+int
+as_mlock( struct addrspace *as, vaddr_t vaddr, size_t len, bool lock ) {
+	int				res;
+
+	AS_LOCK( as );
+	res = as_mlock_locked( as, vaddr, len, lock );
+	AS_UNLOCK( as );
+	return res;
 }
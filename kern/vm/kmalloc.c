@@ -28,9 +28,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include "opt-kmprof.h"
 
 /*
  * Kernel malloc.
@@ -89,6 +94,9 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+#define NBIGSIZES 16		/* whole-page blocks of up to 64k */
+#define BIGCACHE_PAGES 64	/* most pages kept in freed blocks */
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
@@ -111,74 +119,185 @@ struct pageref {
 
 #define INVALID_OFFSET   (0xffff)
 
+/*
+ * Blocktype of a pageref that stands for a whole-page block of up to
+ * NBIGSIZES pages, rather than a page of subpage blocks. nfree holds
+ * the number of pages instead.
+ */
+#define BIGBLOCK         NSIZES
+
 #define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+/*
+ * Use one spinlock for the whole thing. Making parts of the kmalloc
+ * logic per-cpu is worthwhile for scalability; however, for the time
+ * being at least we won't, because it adds a lot of complexity and in
+ * OS/161 performance and scalability aren't super-critical.
+ */
+
+static struct spinlock kmalloc_spinlock =
+	SPINLOCK_INITIALIZER_NAMED("kmalloc_spinlock");
+
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs come from a pool that grows a page at a time, so the
+ * heap can use as much memory as the machine has. The first page
+ * of them lives in the kernel BSS, so that allocations made before
+ * the VM system is up do not need to allocate pagerefs as well.
+ * Pages of pagerefs are never given back; free pagerefs are kept
+ * on a list, linked through next_samesize.
  */
 
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+static struct pageref bootpagerefs[NPAGEREFS];
+static bool bootpagerefs_used = false;
+
+static struct pageref *freepagerefs;
+static unsigned npagerefs;		/* in the pool, used or free */
+
+static
+void
+addpagerefs(struct pageref *prs, unsigned n)
+{
+	unsigned i;
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+	for (i=0; i<n; i++) {
+		prs[i].next_samesize = freepagerefs;
+		freepagerefs = &prs[i];
+	}
+	npagerefs += n;
+}
 
+/*
+ * Get a pageref, growing the pool if it has run dry. Called with
+ * kmalloc_spinlock held, which is dropped while we get a page.
+ */
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
+	vaddr_t page;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (freepagerefs == NULL && !bootpagerefs_used) {
+		bootpagerefs_used = true;
+		addpagerefs(bootpagerefs, NPAGEREFS);
+	}
+
+	while (freepagerefs == NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		page = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (page == 0) {
+			/* ran out */
+			return NULL;
 		}
-		KASSERT(0);
+		addpagerefs((struct pageref *)page, NPAGEREFS);
 	}
 
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	freepagerefs = pr->next_samesize;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
+}
+
+////////////////////////////////////////
+
+/*
+ * Pagerefs in use are also entered in a table by page number, so
+ * kfree can find the page a pointer belongs to without walking
+ * every page of the heap. The table has two levels: a leaf covers
+ * KPT_LEAFPAGES pages, and is allocated the first time one of its
+ * pages joins the heap. Leaves are never freed, and a page's entry
+ * does not change while any block of it is allocated, so the owner
+ * of a block may look it up without holding kmalloc_spinlock.
+ */
+
+#define KPT_LEAFPAGES (PAGE_SIZE / sizeof(struct pageref *))
+#define KPT_NLEAVES ((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE / KPT_LEAFPAGES)
+#define KPT_PAGENO(va) (((va) - MIPS_KSEG0) / PAGE_SIZE)
+
+static struct pageref **kpagetable[KPT_NLEAVES];
+
+/*
+ * Make sure the table has a leaf for page va. Must be called
+ * without kmalloc_spinlock, as we may need to get a page.
+ */
+static
+int
+kpt_prepare(vaddr_t va)
+{
+	struct pageref **leaf;
+	unsigned ix, i;
+
+	KASSERT(va >= MIPS_KSEG0 && va < MIPS_KSEG1);
+	ix = KPT_PAGENO(va) / KPT_LEAFPAGES;
+	if (kpagetable[ix] != NULL) {
+		return 0;
+	}
+
+	leaf = (struct pageref **)alloc_kpages(1);
+	if (leaf == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<KPT_LEAFPAGES; i++) {
+		leaf[i] = NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (kpagetable[ix] == NULL) {
+		kpagetable[ix] = leaf;
+		leaf = NULL;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Somebody beat us to it. */
+	if (leaf != NULL) {
+		free_kpages((vaddr_t)leaf);
+	}
+	return 0;
+}
+
+static
+void
+setpageref(vaddr_t va, struct pageref *pr)
+{
+	unsigned pn;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	pn = KPT_PAGENO(va);
+	KASSERT(kpagetable[pn / KPT_LEAFPAGES] != NULL);
+	kpagetable[pn / KPT_LEAFPAGES][pn % KPT_LEAFPAGES] = pr;
+}
+
+static
+struct pageref *
+findpageref(vaddr_t va)
+{
+	struct pageref **leaf;
+	unsigned pn;
+
+	if (va < MIPS_KSEG0 || va >= MIPS_KSEG1) {
+		return NULL;
+	}
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	pn = KPT_PAGENO(va);
+	leaf = kpagetable[pn / KPT_LEAFPAGES];
+	return (leaf == NULL) ? NULL : leaf[pn % KPT_LEAFPAGES];
 }
 
 ////////////////////////////////////////
@@ -186,16 +305,23 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
-////////////////////////////////////////
+/* freed whole-page blocks, by size in pages; see bigblock_kfree */
+static struct pageref *bigcache[NBIGSIZES];
+static unsigned bigcache_pages;
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Per-cpu magazines of free subpage blocks; see below.
  */
+#define KMAG_SIZE 16
+#define KMAG_BATCH 8
+#define KMALLOC_MAXCPUS 32
+
+struct kmagazine {
+	unsigned km_count;
+	void *km_blocks[KMAG_SIZE];
+};
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct kmagazine kmagazines[KMALLOC_MAXCPUS][NSIZES];
 
 ////////////////////////////////////////
 
@@ -260,14 +386,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
@@ -334,6 +460,7 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i, j, n;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -344,6 +471,31 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+	kprintf("%u pagerefs in the pool\n", npagerefs);
+	kprintf("Whole-page block cache: %u/%u pages\n",
+		bigcache_pages, BIGCACHE_PAGES);
+	for (i=0; i<NBIGSIZES; i++) {
+		n = 0;
+		for (pr = bigcache[i]; pr != NULL; pr = pr->next_samesize) {
+			n++;
+		}
+		if (n > 0) {
+			kprintf("   %2u pages: %u cached\n", i+1, n);
+		}
+	}
+
+	/* Other cpus may be changing these; it's only a snapshot. */
+	kprintf("Per-cpu magazines:\n");
+	for (i=0; i<KMALLOC_MAXCPUS; i++) {
+		n = 0;
+		for (j=0; j<NSIZES; j++) {
+			n += kmagazines[i][j].km_count;
+		}
+		if (n > 0) {
+			kprintf("   cpu %u: %u blocks\n", i, n);
+		}
+	}
+
 	spinlock_release(&kmalloc_spinlock);
 }
 
@@ -372,6 +524,8 @@ remove_lists(struct pageref *pr, int blktype)
 			break;
 		}
 	}
+
+	setpageref(PR_PAGEADDR(pr), NULL);
 }
 
 static
@@ -392,6 +546,224 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of a page that has one.
+ */
+static
+void *
+takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Put the block at ptraddr back on the freelist of its page. If
+ * that frees the whole page, the page is taken out of the heap, and
+ * its address is returned so that the caller can call free_kpages
+ * once it has let go of kmalloc_spinlock. Returns 0 otherwise.
+ */
+static
+vaddr_t
+giveblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)ptraddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Each cpu keeps up to KMAG_SIZE free blocks of each size, and
+// serves kmalloc and kfree from there with only interrupts off,
+// which keeps us on the cpu. An empty magazine is refilled with
+// KMAG_BATCH blocks from the pages of that size, and a full one
+// gives KMAG_BATCH blocks back, each under a single acquisition of
+// kmalloc_spinlock. Blocks sitting in a magazine count as allocated
+// as far as their pages are concerned.
+//
+
+/*
+ * The magazines of the current cpu, or NULL if there is no current
+ * cpu yet, early in boot. Called with interrupts off.
+ */
+static
+struct kmagazine *
+mymagazines(void)
+{
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	KASSERT(curcpu->c_number < KMALLOC_MAXCPUS);
+	return kmagazines[curcpu->c_number];
+}
+
+/*
+ * Fill an empty magazine from pages that have free blocks. We never
+ * get a fresh page here, since that may sleep; subpage_kmalloc does.
+ */
+static
+void
+magazine_refill(struct kmagazine *km, unsigned blktype)
+{
+	struct pageref *pr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = sizebases[blktype];
+	     pr != NULL && km->km_count < KMAG_BATCH;
+	     pr = pr->next_samesize) {
+		while (pr->nfree > 0 && km->km_count < KMAG_BATCH) {
+			km->km_blocks[km->km_count++] = takeblock(pr);
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Give KMAG_BATCH blocks of a full magazine back to their pages.
+ * Pages that became free are stored in pages[], for the caller to
+ * release once interrupts are back on. Returns how many there are.
+ */
+static
+unsigned
+magazine_drain(struct kmagazine *km, vaddr_t *pages)
+{
+	vaddr_t ptraddr, page;
+	unsigned n;
+
+	n = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	while (km->km_count > KMAG_SIZE - KMAG_BATCH) {
+		ptraddr = (vaddr_t)km->km_blocks[--km->km_count];
+		page = giveblock(findpageref(ptraddr), ptraddr);
+		if (page != 0) {
+			pages[n++] = page;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return n;
+}
+
+static
+void *
+magazine_kmalloc(unsigned blktype)
+{
+	struct kmagazine *km;
+	void *ptr;
+	int spl;
+
+	ptr = NULL;
+	spl = splhigh();
+	km = mymagazines();
+	if (km != NULL) {
+		km += blktype;
+		if (km->km_count == 0) {
+			magazine_refill(km, blktype);
+		}
+		if (km->km_count > 0) {
+			ptr = km->km_blocks[--km->km_count];
+		}
+	}
+	splx(spl);
+	return ptr;
+}
+
+static
+int
+magazine_kfree(void *ptr, unsigned blktype)
+{
+	struct kmagazine *km;
+	vaddr_t pages[KMAG_BATCH];
+	unsigned i, npages;
+	int spl;
+
+	npages = 0;
+	spl = splhigh();
+	km = mymagazines();
+	if (km == NULL) {
+		splx(spl);
+		return -1;
+	}
+
+	km += blktype;
+	if (km->km_count == KMAG_SIZE) {
+		npages = magazine_drain(km, pages);
+	}
+	km->km_blocks[km->km_count++] = ptr;
+	splx(spl);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<npages; i++) {
+		free_kpages(pages[i]);
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -409,6 +781,12 @@ subpage_kmalloc(size_t sz)
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
 
+	/* The common case: this cpu has one handy. */
+	retptr = magazine_kmalloc(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -423,25 +801,7 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = takeblock(pr);
 
 			checksubpages();
 
@@ -466,6 +826,11 @@ subpage_kmalloc(size_t sz)
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
 	}
+	if (kpt_prepare(prpage)) {
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't track a page\n"); 
+		return NULL;
+	}
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
@@ -504,6 +869,8 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	setpageref(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -516,35 +883,24 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
 	ptraddr = (vaddr_t)ptr;
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
-	if (pr==NULL) {
+	/*
+	 * The page cannot leave the heap while ptr is allocated,
+	 * so this needs no lock.
+	 */
+	pr = findpageref(ptraddr);
+	if (pr==NULL || PR_BLOCKTYPE(pr) == BIGBLOCK) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -558,33 +914,20 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	/* The common case: keep it on this cpu. */
+	if (magazine_kfree(ptr, blktype) == 0) {
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	prpage = giveblock(pr, ptraddr);
+	spinlock_release(&kmalloc_spinlock);
+
+	if (prpage != 0) {
 		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -598,8 +941,401 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Whole-page blocks of 4k to 64k.
+//
+// These are common (thread stacks, tables that outgrew a page),
+// and going to the coremap for every one of them is slow. Each
+// block gets a pageref, entered in the page table like the subpage
+// ones, which remembers its size. Freed blocks are kept on a list
+// per size, up to BIGCACHE_PAGES pages in all, and handed out again
+// from there.
+// Anything larger goes straight to alloc_kpages and free_kpages.
+//
+
+/*
+ * Give every cached block back to the coremap.
+ */
+static
+void
+bigcache_drain(void)
+{
+	struct pageref *pr;
+	vaddr_t page;
+	unsigned i;
+
+	for (i=0; i<NBIGSIZES; i++) {
+		spinlock_acquire(&kmalloc_spinlock);
+		while ((pr = bigcache[i]) != NULL) {
+			bigcache[i] = pr->next_samesize;
+			bigcache_pages -= i+1;
+			page = PR_PAGEADDR(pr);
+			freepageref(pr);
+
+			/* Call free_kpages without kmalloc_spinlock. */
+			spinlock_release(&kmalloc_spinlock);
+			free_kpages(page);
+			spinlock_acquire(&kmalloc_spinlock);
+		}
+		spinlock_release(&kmalloc_spinlock);
+	}
+}
+
+static
 void *
-kmalloc(size_t sz)
+bigblock_kmalloc(unsigned npages)
+{
+	struct pageref *pr;
+	vaddr_t page;
+
+	KASSERT(npages >= 1 && npages <= NBIGSIZES);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	pr = bigcache[npages-1];
+	if (pr != NULL) {
+		bigcache[npages-1] = pr->next_samesize;
+		bigcache_pages -= npages;
+		setpageref(PR_PAGEADDR(pr), pr);
+		spinlock_release(&kmalloc_spinlock);
+		return (void *)PR_PAGEADDR(pr);
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	page = alloc_kpages(npages);
+	if (page == 0) {
+		/* What we cache may be just what the coremap is missing. */
+		bigcache_drain();
+		page = alloc_kpages(npages);
+		if (page == 0) {
+			return NULL;
+		}
+	}
+
+	if (kpt_prepare(page)) {
+		free_kpages(page);
+		return NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	pr = allocpageref();
+	if (pr == NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(page);
+		kprintf("kmalloc: couldn't get pageref for a %u-page block\n",
+			npages);
+		return NULL;
+	}
+
+	pr->pageaddr_and_blocktype = MKPAB(page, BIGBLOCK);
+	pr->freelist_offset = INVALID_OFFSET;
+	pr->nfree = npages;
+	setpageref(page, pr);
+	spinlock_release(&kmalloc_spinlock);
+
+	return (void *)page;
+}
+
+static
+int
+bigblock_kfree(void *ptr)
+{
+	struct pageref *pr;
+	vaddr_t page;
+	unsigned npages;
+
+	page = (vaddr_t)ptr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	pr = findpageref(page);
+	if (pr == NULL) {
+		/* Not one of ours - a larger allocation */
+		spinlock_release(&kmalloc_spinlock);
+		return -1;
+	}
+
+	KASSERT(PR_BLOCKTYPE(pr) == BIGBLOCK);
+	if (PR_PAGEADDR(pr) != page) {
+		panic("kfree: free of invalid addr %p\n", ptr);
+	}
+
+	setpageref(page, NULL);
+	npages = pr->nfree;
+	KASSERT(npages >= 1 && npages <= NBIGSIZES);
+
+	if (bigcache_pages + npages <= BIGCACHE_PAGES) {
+		pr->next_samesize = bigcache[npages-1];
+		bigcache[npages-1] = pr;
+		bigcache_pages += npages;
+		spinlock_release(&kmalloc_spinlock);
+		return 0;
+	}
+
+	freepageref(pr);
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	free_kpages(page);
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+#if OPT_KMPROF
+////////////////////////////////////////
+//
+// Allocation profiling.
+//
+// While enabled, every kmalloc is charged to its call site (the
+// return address) and the block is entered in a hash table, so that
+// kfree can credit the same site. All of it lives in fixed pools, so
+// profiling never calls back into the allocator; allocations it has
+// no room for are counted and otherwise ignored, as are frees of
+// blocks that were allocated while profiling was off.
+//
+// When profiling is off, kmalloc tests one flag and kfree tests
+// whether any blocks are still being tracked.
+//
+
+#define KMPROF_NSITES   512	/* must be a power of 2 */
+#define KMPROF_NBLOCKS  4096
+#define KMPROF_NHASH    1024	/* must be a power of 2 */
+
+struct kmprof_site {
+	vaddr_t ks_site;	/* return address; 0 if the slot is unused */
+	size_t ks_livebytes;
+	unsigned ks_liveobjs;
+	size_t ks_peakbytes;
+	uint64_t ks_nallocs;
+};
+
+struct kmprof_block {
+	struct kmprof_block *kb_next;
+	vaddr_t kb_addr;
+	size_t kb_size;
+	struct kmprof_site *kb_site;
+};
+
+static struct spinlock kmprof_spinlock = SPINLOCK_INITIALIZER;
+static volatile bool kmprof_enabled;
+static volatile unsigned kmprof_nblocks;	/* blocks in the table */
+static unsigned kmprof_dropped;
+static struct kmprof_site kmprof_sites[KMPROF_NSITES];
+static struct kmprof_block kmprof_pool[KMPROF_NBLOCKS];
+static struct kmprof_block *kmprof_freeblocks;
+static struct kmprof_block *kmprof_hash[KMPROF_NHASH];
+
+/* for sorting, in kheap_profile_print */
+static struct kmprof_site kmprof_sorted[KMPROF_NSITES];
+
+#define KMPROF_HASH(a, n) ((((a) >> 3) * 2654435761U >> 12) & ((n) - 1))
+
+/*
+ * Forget everything. Called with kmprof_spinlock held.
+ */
+static
+void
+kmprof_clear(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmprof_spinlock));
+
+	kmprof_freeblocks = NULL;
+	for (i=0; i<KMPROF_NBLOCKS; i++) {
+		kmprof_pool[i].kb_next = kmprof_freeblocks;
+		kmprof_freeblocks = &kmprof_pool[i];
+	}
+	for (i=0; i<KMPROF_NHASH; i++) {
+		kmprof_hash[i] = NULL;
+	}
+	for (i=0; i<KMPROF_NSITES; i++) {
+		kmprof_sites[i].ks_site = 0;
+	}
+	kmprof_nblocks = 0;
+	kmprof_dropped = 0;
+}
+
+/*
+ * Find the slot for a call site, taking a fresh one if need be.
+ * Returns NULL if the table is full.
+ */
+static
+struct kmprof_site *
+kmprof_getsite(vaddr_t site)
+{
+	struct kmprof_site *ks;
+	unsigned i, ix;
+
+	ix = KMPROF_HASH(site, KMPROF_NSITES);
+	for (i=0; i<KMPROF_NSITES; i++) {
+		ks = &kmprof_sites[(ix + i) & (KMPROF_NSITES - 1)];
+		if (ks->ks_site == site) {
+			return ks;
+		}
+		if (ks->ks_site == 0) {
+			ks->ks_site = site;
+			ks->ks_livebytes = 0;
+			ks->ks_liveobjs = 0;
+			ks->ks_peakbytes = 0;
+			ks->ks_nallocs = 0;
+			return ks;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+kmprof_alloc(void *ptr, size_t sz, vaddr_t site)
+{
+	struct kmprof_site *ks;
+	struct kmprof_block *kb;
+	unsigned ix;
+
+	spinlock_acquire(&kmprof_spinlock);
+	if (!kmprof_enabled) {
+		/* Turned off meanwhile. */
+		spinlock_release(&kmprof_spinlock);
+		return;
+	}
+
+	ks = kmprof_getsite(site);
+	kb = kmprof_freeblocks;
+	if (ks == NULL || kb == NULL) {
+		kmprof_dropped++;
+		spinlock_release(&kmprof_spinlock);
+		return;
+	}
+	kmprof_freeblocks = kb->kb_next;
+
+	kb->kb_addr = (vaddr_t)ptr;
+	kb->kb_size = sz;
+	kb->kb_site = ks;
+	ix = KMPROF_HASH(kb->kb_addr, KMPROF_NHASH);
+	kb->kb_next = kmprof_hash[ix];
+	kmprof_hash[ix] = kb;
+	kmprof_nblocks++;
+
+	ks->ks_livebytes += sz;
+	ks->ks_liveobjs++;
+	ks->ks_nallocs++;
+	if (ks->ks_livebytes > ks->ks_peakbytes) {
+		ks->ks_peakbytes = ks->ks_livebytes;
+	}
+
+	spinlock_release(&kmprof_spinlock);
+}
+
+static
+void
+kmprof_free(void *ptr)
+{
+	struct kmprof_block **kbp, *kb;
+	struct kmprof_site *ks;
+
+	spinlock_acquire(&kmprof_spinlock);
+	kbp = &kmprof_hash[KMPROF_HASH((vaddr_t)ptr, KMPROF_NHASH)];
+	for (kb = *kbp; kb != NULL; kbp = &kb->kb_next, kb = *kbp) {
+		if (kb->kb_addr == (vaddr_t)ptr) {
+			*kbp = kb->kb_next;
+			ks = kb->kb_site;
+			KASSERT(ks->ks_livebytes >= kb->kb_size);
+			KASSERT(ks->ks_liveobjs > 0);
+			ks->ks_livebytes -= kb->kb_size;
+			ks->ks_liveobjs--;
+
+			kb->kb_next = kmprof_freeblocks;
+			kmprof_freeblocks = kb;
+			kmprof_nblocks--;
+			break;
+		}
+	}
+	spinlock_release(&kmprof_spinlock);
+}
+
+/*
+ * Turn profiling on or off. Blocks already tracked stay tracked
+ * until they're freed, so turning it back on continues the counts.
+ */
+void
+kheap_profile_enable(bool enable)
+{
+	static bool initialized;
+
+	spinlock_acquire(&kmprof_spinlock);
+	if (!initialized) {
+		kmprof_clear();
+		initialized = true;
+	}
+	kmprof_enabled = enable;
+	spinlock_release(&kmprof_spinlock);
+}
+
+/*
+ * Start over.
+ */
+void
+kheap_profile_reset(void)
+{
+	spinlock_acquire(&kmprof_spinlock);
+	kmprof_clear();
+	spinlock_release(&kmprof_spinlock);
+}
+
+/*
+ * Print the top call sites, by live bytes. Look up the addresses
+ * with addr2line or in the output of nm.
+ */
+void
+kheap_profile_print(unsigned max)
+{
+	struct kmprof_site tmp;
+	unsigned i, j, n, nblocks, dropped;
+	bool enabled;
+
+	n = 0;
+	spinlock_acquire(&kmprof_spinlock);
+	for (i=0; i<KMPROF_NSITES; i++) {
+		if (kmprof_sites[i].ks_site != 0) {
+			kmprof_sorted[n++] = kmprof_sites[i];
+		}
+	}
+	enabled = kmprof_enabled;
+	nblocks = kmprof_nblocks;
+	dropped = kmprof_dropped;
+	spinlock_release(&kmprof_spinlock);
+
+	/* Insertion sort; there aren't many. */
+	for (i=1; i<n; i++) {
+		tmp = kmprof_sorted[i];
+		for (j=i; j>0 && kmprof_sorted[j-1].ks_livebytes <
+			     tmp.ks_livebytes; j--) {
+			kmprof_sorted[j] = kmprof_sorted[j-1];
+		}
+		kmprof_sorted[j] = tmp;
+	}
+
+	kprintf("kmalloc profiling %s: %u blocks tracked, "
+		"%u allocations not tracked, %u call sites\n",
+		enabled ? "on" : "off", nblocks, dropped, n);
+	kprintf("call site   live bytes  live objs   peak bytes     allocs\n");
+	for (i=0; i<n && i<max; i++) {
+		kprintf("0x%08lx %11lu %10u %12lu %10llu\n",
+			(unsigned long)kmprof_sorted[i].ks_site,
+			(unsigned long)kmprof_sorted[i].ks_livebytes,
+			kmprof_sorted[i].ks_liveobjs,
+			(unsigned long)kmprof_sorted[i].ks_peakbytes,
+			kmprof_sorted[i].ks_nallocs);
+	}
+}
+#endif /* OPT_KMPROF */
+
+////////////////////////////////////////
+
+static
+void *
+kmalloc_internal(size_t sz)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -607,6 +1343,10 @@ kmalloc(size_t sz)
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+		if (npages <= NBIGSIZES) {
+			return bigblock_kmalloc(npages);
+		}
+
 		address = alloc_kpages(npages);
 		if (address==0) {
 			return NULL;
@@ -618,17 +1358,49 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+void *
+kmalloc(size_t sz)
+{
+	void *ptr;
+
+	ptr = kmalloc_internal(sz);
+#if OPT_KMPROF
+	if (kmprof_enabled && ptr != NULL) {
+		kmprof_alloc(ptr, sz, (vaddr_t)__builtin_return_address(0));
+	}
+#endif
+	return ptr;
+}
+
 void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try subpage first, then the cached whole-page blocks;
+	 * if both fail, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#if OPT_KMPROF
+	if (kmprof_nblocks > 0) {
+		kmprof_free(ptr);
+	}
+#endif
+	if (subpage_kfree(ptr) && bigblock_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
 
+
+/*
+ * Tell whether ptr, a block smaller than a page, came from kmalloc
+ * rather than from a page of someone's own. Only the owner of the
+ * block may ask, as with findpageref.
+ */
+bool
+kheap_owns(const void *ptr)
+{
+	return findpageref((vaddr_t)ptr) != NULL;
+}
@@ -0,0 +1,403 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <array.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vm/page.h>
+#include <vm/region.h>
+#include <vm/vmstat.h>
+#include <vm/ksm.h>
+
+/**
+ * a page we checksummed, and may merge others into later.
+ * the addrspace may be gone by the time we look again, so it is
+ * only used after finding it in ksm_spaces, and the contents are
+ * always compared before anything is merged.
+ */
+struct ksm_slot {
+	uint32_t			ks_sum;
+	struct addrspace		*ks_as;
+	vaddr_t				ks_vaddr;
+};
+
+/* pages checksummed per hold of an addrspace lock */
+#define KSM_BATCH 32
+
+struct ksm_cand {
+	uint32_t			kc_sum;
+	vaddr_t				kc_vaddr;
+};
+
+static struct lock		*ksm_lk;		/* protects the registry and the settings */
+static struct cv		*ksm_cv;		/* the scanner waits here while disabled */
+static struct array		*ksm_spaces;		/* every live addrspace */
+static bool			ksm_enabled = false;
+static bool			ksm_started = false;
+static unsigned			ksm_pages = KSM_DEFAULT_PAGES;
+static unsigned			ksm_secs = KSM_DEFAULT_SECS;
+
+//only the scanner touches these.
+static struct ksm_slot		ksm_slots[KSM_NSLOTS];
+static unsigned			ksm_cur_as = 0;
+static unsigned			ksm_cur_region = 0;
+static unsigned			ksm_cur_page = 0;
+
+void
+ksm_bootstrap( void ) {
+	ksm_lk = lock_create( "ksm_lk" );
+	if( ksm_lk == NULL )
+		panic( "ksm_bootstrap: could not create ksm_lk." );
+
+	ksm_cv = cv_create( "ksm_cv" );
+	if( ksm_cv == NULL )
+		panic( "ksm_bootstrap: could not create ksm_cv." );
+
+	ksm_spaces = array_create();
+	if( ksm_spaces == NULL )
+		panic( "ksm_bootstrap: could not create the addrspace registry." );
+}
+
+/**
+ * make a new addrspace known to the scanner.
+ */
+int
+ksm_register( struct addrspace *as ) {
+	int			res;
+
+	lock_acquire( ksm_lk );
+	res = array_add( ksm_spaces, as, NULL );
+	lock_release( ksm_lk );
+	return res;
+}
+
+/**
+ * forget about an addrspace that is going away.
+ * the scanner may still be working on it; as_destroy() waits for
+ * that by taking the addrspace lock once more.
+ */
+void
+ksm_unregister( struct addrspace *as ) {
+	unsigned		i;
+
+	lock_acquire( ksm_lk );
+	for( i = 0; i < array_num( ksm_spaces ); ++i ) {
+		if( array_get( ksm_spaces, i ) == as ) {
+			array_remove( ksm_spaces, i );
+			break;
+		}
+	}
+	lock_release( ksm_lk );
+}
+
+/**
+ * lock as, if it is still around.
+ */
+static
+bool
+ksm_lock_space( struct addrspace *as ) {
+	unsigned		i;
+	bool			found;
+
+	found = false;
+	lock_acquire( ksm_lk );
+	for( i = 0; i < array_num( ksm_spaces ); ++i ) {
+		if( array_get( ksm_spaces, i ) == as ) {
+			AS_LOCK( as );
+			found = true;
+			break;
+		}
+	}
+	lock_release( ksm_lk );
+	return found;
+}
+
+/**
+ * only pages that nobody else can see are merged.
+ */
+static
+bool
+ksm_mergeable( struct vm_region *vmr ) {
+	return vmr->vmr_type == VMR_ANON && vmr->vmr_share == NULL;
+}
+
+/**
+ * find the mergeable page at vaddr in the locked addrspace as.
+ */
+static
+struct vm_page *
+ksm_find_page( struct addrspace *as, vaddr_t vaddr, struct vm_region **vmr_ret, unsigned *ix_ret ) {
+	struct vm_region	*vmr;
+	unsigned		ix;
+
+	KASSERT( lock_do_i_hold( as->as_lk ) );
+
+	vmr = vm_region_find_responsible( as, vaddr );
+	if( vmr == NULL || !ksm_mergeable( vmr ) )
+		return NULL;
+
+	ix = ( vaddr - vmr->vmr_base ) / PAGE_SIZE;
+	if( ix >= vm_pagetable_num( vmr->vmr_pages ) )
+		return NULL;
+
+	*vmr_ret = vmr;
+	*ix_ret = ix;
+	return vm_pagetable_get( vmr->vmr_pages, ix );
+}
+
+/**
+ * replace the page at vaddr in as by keep, if they are identical.
+ * keep is held by the caller, and that reference goes to as on success.
+ */
+static
+int
+ksm_replace( struct addrspace *as, vaddr_t vaddr, struct vm_page *keep ) {
+	struct vm_region	*vmr;
+	struct vm_page		*dup;
+	unsigned		ix;
+	int			res;
+
+	if( !ksm_lock_space( as ) )
+		return ENOENT;
+
+	dup = ksm_find_page( as, vaddr, &vmr, &ix );
+	if( dup == NULL )
+		res = ENOENT;
+	else if( dup == keep )
+		res = EEXIST;
+	else
+		res = vm_page_ksm_same( keep, dup );
+
+	if( res == 0 ) {
+		//the slot is taken, so this needs no new leaf.
+		res = vm_pagetable_set( vmr->vmr_pages, ix, keep );
+		KASSERT( res == 0 );
+
+		vm_page_destroy( dup );
+		vmstat_inc( VMSTAT_KSM_MERGES );
+	}
+
+	AS_UNLOCK( as );
+	return res;
+}
+
+/**
+ * merge the page at dvaddr in das into the one at kvaddr in kas.
+ * we never hold two addrspace locks at once: the page to keep is
+ * held by reference instead, which also freezes its contents.
+ */
+static
+int
+ksm_merge( struct addrspace *kas, vaddr_t kvaddr, struct addrspace *das, vaddr_t dvaddr ) {
+	struct vm_region	*vmr;
+	struct vm_page		*keep;
+	unsigned		ix;
+	int			res;
+
+	if( !ksm_lock_space( kas ) )
+		return ENOENT;
+
+	keep = ksm_find_page( kas, kvaddr, &vmr, &ix );
+	res = ( keep == NULL ) ? ENOENT : vm_page_ksm_hold( keep );
+	AS_UNLOCK( kas );
+	if( res )
+		return res;
+
+	res = ksm_replace( das, dvaddr, keep );
+	if( res )
+		vm_page_destroy( keep );
+
+	return res;
+}
+
+/**
+ * match a freshly checksummed page of as against what we have seen.
+ */
+static
+void
+ksm_consider( struct addrspace *as, const struct ksm_cand *kc ) {
+	struct ksm_slot		*ks;
+	int			res;
+
+	ks = &ksm_slots[kc->kc_sum & (KSM_NSLOTS - 1)];
+	if( ks->ks_as != NULL && ks->ks_sum == kc->kc_sum &&
+	    ( ks->ks_as != as || ks->ks_vaddr != kc->kc_vaddr ) ) {
+		//keep the slot as it is, more may merge into it.
+		res = ksm_merge( ks->ks_as, ks->ks_vaddr, as, kc->kc_vaddr );
+		if( res == 0 || res == EEXIST )
+			return;
+	}
+
+	ks->ks_sum = kc->kc_sum;
+	ks->ks_as = as;
+	ks->ks_vaddr = kc->kc_vaddr;
+}
+
+/**
+ * checksum up to max resident pages of the locked as, from where we
+ * left off. returns how many we got; fewer than max means that we
+ * are done with as, and the cursor has moved on to the next one.
+ */
+static
+unsigned
+ksm_collect( struct addrspace *as, struct ksm_cand *batch, unsigned max ) {
+	struct vm_region	*vmr;
+	struct vm_page		*vmp;
+	unsigned		ix;
+	unsigned		n;
+
+	KASSERT( lock_do_i_hold( as->as_lk ) );
+
+	n = 0;
+	while( n < max && ksm_cur_region < vm_region_array_num( as->as_regions ) ) {
+		vmr = vm_region_array_get( as->as_regions, ksm_cur_region );
+		if( !ksm_mergeable( vmr ) || ksm_cur_page >= vm_pagetable_num( vmr->vmr_pages ) ) {
+			++ksm_cur_region;
+			ksm_cur_page = 0;
+			continue;
+		}
+
+		ix = ksm_cur_page++;
+		vmp = vm_pagetable_get( vmr->vmr_pages, ix );
+		if( vmp == NULL || vm_page_checksum( vmp, &batch[n].kc_sum ) )
+			continue;
+
+		batch[n].kc_vaddr = vmr->vmr_base + ix * PAGE_SIZE;
+		++n;
+		vmstat_inc( VMSTAT_KSM_SCANNED );
+	}
+
+	if( n < max ) {
+		++ksm_cur_as;
+		ksm_cur_region = 0;
+		ksm_cur_page = 0;
+	}
+
+	return n;
+}
+
+/**
+ * one pass of the scanner, over the next npages resident pages.
+ */
+static
+void
+ksm_scan( unsigned npages ) {
+	struct ksm_cand		batch[KSM_BATCH];
+	struct addrspace	*as;
+	unsigned		nempty;
+	unsigned		n;
+	unsigned		i;
+
+	nempty = 0;
+	while( npages > 0 ) {
+		lock_acquire( ksm_lk );
+
+		//give up once a whole round turned up nothing.
+		if( nempty > array_num( ksm_spaces ) ) {
+			lock_release( ksm_lk );
+			return;
+		}
+
+		if( ksm_cur_as >= array_num( ksm_spaces ) ) {
+			ksm_cur_as = 0;
+			ksm_cur_region = 0;
+			ksm_cur_page = 0;
+			if( array_num( ksm_spaces ) == 0 ) {
+				lock_release( ksm_lk );
+				return;
+			}
+		}
+
+		as = array_get( ksm_spaces, ksm_cur_as );
+		AS_LOCK( as );
+		lock_release( ksm_lk );
+
+		n = ksm_collect( as, batch, ( npages < KSM_BATCH ) ? npages : KSM_BATCH );
+		AS_UNLOCK( as );
+
+		nempty = ( n == 0 ) ? nempty + 1 : 0;
+		npages -= n;
+		for( i = 0; i < n; ++i )
+			ksm_consider( as, &batch[i] );
+	}
+}
+
+static
+void
+ksm_thread( void *unused1, unsigned long unused2 ) {
+	unsigned		npages;
+	unsigned		secs;
+
+	(void)unused1;
+	(void)unused2;
+
+	for( ;; ) {
+		lock_acquire( ksm_lk );
+		while( !ksm_enabled )
+			cv_wait( ksm_cv, ksm_lk );
+		npages = ksm_pages;
+		secs = ksm_secs;
+		lock_release( ksm_lk );
+
+		ksm_scan( npages );
+		clocksleep( secs );
+	}
+}
+
+/**
+ * turn the scanner on or off. it is started the first time it is needed.
+ * pages that are already merged stay merged when it is turned off.
+ */
+int
+ksm_set_enabled( bool enabled ) {
+	int			res;
+
+	lock_acquire( ksm_lk );
+	if( enabled && !ksm_started ) {
+		res = thread_fork( "ksm", ksm_thread, NULL, 0, NULL );
+		if( res ) {
+			lock_release( ksm_lk );
+			return res;
+		}
+		ksm_started = true;
+	}
+
+	ksm_enabled = enabled;
+	cv_signal( ksm_cv, ksm_lk );
+	lock_release( ksm_lk );
+	return 0;
+}
+
+/**
+ * scan npages pages every secs seconds.
+ */
+int
+ksm_set_rate( unsigned npages, unsigned secs ) {
+	if( npages == 0 || npages > KSM_MAX_PAGES || secs == 0 || secs > KSM_MAX_SECS )
+		return EINVAL;
+
+	lock_acquire( ksm_lk );
+	ksm_pages = npages;
+	ksm_secs = secs;
+	lock_release( ksm_lk );
+	return 0;
+}
+
+void
+ksm_print( void ) {
+	struct vmstat		vs;
+
+	vmstat_snapshot( &vs );
+
+	lock_acquire( ksm_lk );
+	kprintf( "ksm: %s, %u pages every %u seconds, %u address spaces\n",
+		ksm_enabled ? "on" : "off", ksm_pages, ksm_secs, array_num( ksm_spaces ) );
+	lock_release( ksm_lk );
+
+	kprintf( "scanned %llu, merged %llu, broken %llu, frames saved %llu\n",
+		vs.vs_counters[VMSTAT_KSM_SCANNED], vs.vs_counters[VMSTAT_KSM_MERGES],
+		vs.vs_counters[VMSTAT_KSM_BREAKS], vs.vs_counters[VMSTAT_KSM_SHARING] );
+}
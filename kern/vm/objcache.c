@@ -0,0 +1,355 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <vm/objcache.h>
+
+/**
+ * every page of a cache starts with this header, followed by the
+ * stack of free object indices and then the objects themselves.
+ * so the page of an object, and with it its slab, is found by
+ * rounding the address down.
+ */
+struct objslab {
+	struct objslab			*os_next;
+	struct objslab			*os_prev;
+	unsigned			os_nfree;	/* objects on os_free */
+	uint16_t			os_free[];	/* indices of the free objects */
+};
+
+struct objcache {
+	const char			*oc_name;
+	size_t				oc_size;	/* object size, rounded up */
+	unsigned			oc_perslab;	/* objects per page */
+	size_t				oc_offset;	/* of the first object within the page */
+	objcache_ctor_t			oc_ctor;
+	objcache_dtor_t			oc_dtor;
+
+	struct spinlock			oc_lk;		/* protects the rest */
+	struct objslab			*oc_partial;	/* pages with some objects free */
+	struct objslab			*oc_full;	/* pages with none free */
+	struct objslab			*oc_empty;	/* pages with all of them free */
+	unsigned			oc_nempty;
+	unsigned			oc_nslabs;
+	unsigned			oc_ninuse;
+
+	/* statistics */
+	uint64_t			oc_nallocs;	/* objects handed out */
+	uint64_t			oc_nctors;	/* constructor calls */
+	uint64_t			oc_nreaped;	/* pages given back under pressure */
+};
+
+bool				objcache_bypass = false;
+
+static struct spinlock		objcache_lk = SPINLOCK_INITIALIZER_NAMED( "objcache_lk" );	/* protects the registry */
+static struct objcache		*objcaches[OBJCACHE_MAXCACHES];
+static unsigned			nobjcaches = 0;
+
+#define OBJSLAB_OF(obj) ((struct objslab *)((vaddr_t)(obj) & PAGE_FRAME))
+#define OBJSLAB_OBJ(oc, os, ix) ((void *)((vaddr_t)(os) + (oc)->oc_offset + (ix) * (oc)->oc_size))
+#define OBJSLAB_IX(oc, os, obj) (((vaddr_t)(obj) - (vaddr_t)(os) - (oc)->oc_offset) / (oc)->oc_size)
+
+static
+void
+objslab_push( struct objslab **head, struct objslab *os ) {
+	os->os_prev = NULL;
+	os->os_next = *head;
+	if( *head != NULL )
+		(*head)->os_prev = os;
+	*head = os;
+}
+
+static
+void
+objslab_remove( struct objslab **head, struct objslab *os ) {
+	if( os->os_prev != NULL )
+		os->os_prev->os_next = os->os_next;
+	else
+		*head = os->os_next;
+
+	if( os->os_next != NULL )
+		os->os_next->os_prev = os->os_prev;
+}
+
+/**
+ * destruct the first n objects of os, and give its page back.
+ * destructors may sleep, so this is called without oc_lk.
+ */
+static
+void
+objslab_destroy( struct objcache *oc, struct objslab *os, unsigned n ) {
+	unsigned		i;
+
+	if( oc->oc_dtor != NULL )
+		for( i = 0; i < n; ++i )
+			oc->oc_dtor( OBJSLAB_OBJ( oc, os, i ) );
+
+	free_kpages( (vaddr_t)os );
+}
+
+/**
+ * get a page and construct all of its objects.
+ * constructors may sleep, so this is called without oc_lk.
+ */
+static
+struct objslab *
+objslab_create( struct objcache *oc ) {
+	struct objslab		*os;
+	unsigned		i;
+
+	os = (struct objslab *)alloc_kpages( 1 );
+	if( os == NULL )
+		return NULL;
+
+	for( i = 0; i < oc->oc_perslab; ++i ) {
+		if( oc->oc_ctor != NULL && oc->oc_ctor( OBJSLAB_OBJ( oc, os, i ) ) ) {
+			objslab_destroy( oc, os, i );
+			return NULL;
+		}
+
+		//hand out the lowest ones first.
+		os->os_free[i] = oc->oc_perslab - 1 - i;
+	}
+
+	os->os_nfree = oc->oc_perslab;
+	return os;
+}
+
+/**
+ * create a cache of objects of the given size.
+ * ctor prepares a fresh object and returns an errno on failure, dtor
+ * undoes it; either may be NULL. name is not copied.
+ */
+struct objcache *
+objcache_create( const char *name, size_t size, objcache_ctor_t ctor, objcache_dtor_t dtor ) {
+	struct objcache		*oc;
+	unsigned		n;
+
+	KASSERT( size > 0 && size <= OBJCACHE_MAXSIZE );
+
+	oc = kmalloc( sizeof( struct objcache ) );
+	if( oc == NULL )
+		return NULL;
+
+	oc->oc_name = name;
+	oc->oc_size = ROUNDUP( size, 8 );
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+
+	//as many as fit behind the header and its stack of indices.
+	n = PAGE_SIZE / oc->oc_size;
+	while( ROUNDUP( sizeof( struct objslab ) + n * sizeof( uint16_t ), 8 ) + n * oc->oc_size > PAGE_SIZE )
+		--n;
+	oc->oc_perslab = n;
+	oc->oc_offset = ROUNDUP( sizeof( struct objslab ) + n * sizeof( uint16_t ), 8 );
+
+	spinlock_init( &oc->oc_lk );
+	spinlock_setname( &oc->oc_lk, name );
+	oc->oc_partial = NULL;
+	oc->oc_full = NULL;
+	oc->oc_empty = NULL;
+	oc->oc_nempty = 0;
+	oc->oc_nslabs = 0;
+	oc->oc_ninuse = 0;
+	oc->oc_nallocs = 0;
+	oc->oc_nctors = 0;
+	oc->oc_nreaped = 0;
+
+	spinlock_acquire( &objcache_lk );
+	if( nobjcaches == OBJCACHE_MAXCACHES ) {
+		spinlock_release( &objcache_lk );
+		spinlock_cleanup( &oc->oc_lk );
+		kfree( oc );
+		return NULL;
+	}
+	objcaches[nobjcaches++] = oc;
+	spinlock_release( &objcache_lk );
+
+	return oc;
+}
+
+/**
+ * get a constructed object from oc.
+ */
+void *
+objcache_alloc( struct objcache *oc ) {
+	struct objslab		*os;
+	unsigned		ix;
+	void			*obj;
+
+	if( objcache_bypass ) {
+		obj = kmalloc( oc->oc_size );
+		if( obj == NULL )
+			return NULL;
+		if( oc->oc_ctor != NULL && oc->oc_ctor( obj ) ) {
+			kfree( obj );
+			return NULL;
+		}
+
+		spinlock_acquire( &oc->oc_lk );
+		++oc->oc_ninuse;
+		++oc->oc_nallocs;
+		++oc->oc_nctors;
+		spinlock_release( &oc->oc_lk );
+		return obj;
+	}
+
+	spinlock_acquire( &oc->oc_lk );
+	if( oc->oc_partial == NULL && oc->oc_empty == NULL ) {
+		spinlock_release( &oc->oc_lk );
+		os = objslab_create( oc );
+		if( os == NULL )
+			return NULL;
+
+		//somebody else may have grown the cache meanwhile, that's fine.
+		spinlock_acquire( &oc->oc_lk );
+		objslab_push( &oc->oc_empty, os );
+		++oc->oc_nempty;
+		++oc->oc_nslabs;
+		oc->oc_nctors += oc->oc_perslab;
+	}
+
+	//fill up partial pages first, so that empty ones can be reaped.
+	os = oc->oc_partial;
+	if( os == NULL ) {
+		os = oc->oc_empty;
+		objslab_remove( &oc->oc_empty, os );
+		--oc->oc_nempty;
+		objslab_push( &oc->oc_partial, os );
+	}
+
+	KASSERT( os->os_nfree > 0 );
+	ix = os->os_free[--os->os_nfree];
+	if( os->os_nfree == 0 ) {
+		objslab_remove( &oc->oc_partial, os );
+		objslab_push( &oc->oc_full, os );
+	}
+
+	++oc->oc_ninuse;
+	++oc->oc_nallocs;
+	spinlock_release( &oc->oc_lk );
+
+	return OBJSLAB_OBJ( oc, os, ix );
+}
+
+/**
+ * give obj back to oc. it must be in the state its constructor left it in.
+ */
+void
+objcache_free( struct objcache *oc, void *obj ) {
+	struct objslab		*os;
+	struct objslab		*victim;
+	unsigned		ix;
+
+	//it came from kmalloc while we were bypassed.
+	if( kheap_owns( obj ) ) {
+		if( oc->oc_dtor != NULL )
+			oc->oc_dtor( obj );
+		kfree( obj );
+
+		spinlock_acquire( &oc->oc_lk );
+		--oc->oc_ninuse;
+		spinlock_release( &oc->oc_lk );
+		return;
+	}
+
+	os = OBJSLAB_OF( obj );
+	ix = OBJSLAB_IX( oc, os, obj );
+	KASSERT( ix < oc->oc_perslab && OBJSLAB_OBJ( oc, os, ix ) == obj );
+
+	victim = NULL;
+	spinlock_acquire( &oc->oc_lk );
+	KASSERT( os->os_nfree < oc->oc_perslab );
+	if( os->os_nfree == 0 ) {
+		objslab_remove( &oc->oc_full, os );
+		objslab_push( &oc->oc_partial, os );
+	}
+
+	os->os_free[os->os_nfree++] = ix;
+	--oc->oc_ninuse;
+
+	if( os->os_nfree == oc->oc_perslab ) {
+		objslab_remove( &oc->oc_partial, os );
+		if( oc->oc_nempty < OBJCACHE_MAXEMPTY ) {
+			objslab_push( &oc->oc_empty, os );
+			++oc->oc_nempty;
+		}
+		else {
+			victim = os;
+			--oc->oc_nslabs;
+		}
+	}
+	spinlock_release( &oc->oc_lk );
+
+	if( victim != NULL )
+		objslab_destroy( oc, victim, oc->oc_perslab );
+}
+
+/**
+ * give back the pages of every cache that have no objects in use.
+ * called when the coremap runs dry. returns how many pages were freed.
+ */
+unsigned
+objcache_reap( void ) {
+	struct objcache		*oc;
+	struct objslab		*os;
+	struct objslab		*list;
+	unsigned		ncaches;
+	unsigned		npages;
+	unsigned		i;
+
+	//caches are never destroyed, so the registry only grows.
+	spinlock_acquire( &objcache_lk );
+	ncaches = nobjcaches;
+	spinlock_release( &objcache_lk );
+
+	npages = 0;
+	for( i = 0; i < ncaches; ++i ) {
+		oc = objcaches[i];
+
+		spinlock_acquire( &oc->oc_lk );
+		list = oc->oc_empty;
+		oc->oc_empty = NULL;
+		oc->oc_nslabs -= oc->oc_nempty;
+		oc->oc_nreaped += oc->oc_nempty;
+		oc->oc_nempty = 0;
+		spinlock_release( &oc->oc_lk );
+
+		while( list != NULL ) {
+			os = list;
+			list = os->os_next;
+			objslab_destroy( oc, os, oc->oc_perslab );
+			++npages;
+		}
+	}
+
+	return npages;
+}
+
+void
+objcache_printstats( void ) {
+	struct objcache		*oc;
+	struct objcache		snap;
+	unsigned		ncaches;
+	unsigned		i;
+
+	spinlock_acquire( &objcache_lk );
+	ncaches = nobjcaches;
+	spinlock_release( &objcache_lk );
+
+	kprintf( "Object caches%s:\n", objcache_bypass ? " (bypassed)" : "" );
+	kprintf( "%-10s %5s %5s %6s %6s %10s %10s %7s\n",
+		"name", "size", "/page", "pages", "inuse", "allocs", "ctors", "reaped" );
+	for( i = 0; i < ncaches; ++i ) {
+		oc = objcaches[i];
+
+		spinlock_acquire( &oc->oc_lk );
+		snap = *oc;
+		spinlock_release( &oc->oc_lk );
+
+		kprintf( "%-10s %5u %5u %6u %6u %10llu %10llu %7llu\n",
+			snap.oc_name, (unsigned)snap.oc_size, snap.oc_perslab,
+			snap.oc_nslabs, snap.oc_ninuse, snap.oc_nallocs,
+			snap.oc_nctors, snap.oc_nreaped );
+	}
+}
@@ -0,0 +1,108 @@
+#include <types.h>
+#include <lib.h>
+#include <proc.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <addrspace.h>
+#include <vm/region.h>
+#include <vm/oom.h>
+#include <syscall.h>
+
+/**
+ * publish how many pages the current process uses,
+ * so the oom killer does not have to walk other address spaces.
+ */
+void
+vm_oom_update( void ) {
+	struct addrspace	*as;
+	struct vm_region	*vmr;
+	unsigned		npages;
+	unsigned		i;
+
+	if( curthread->td_proc == NULL || curthread->t_addrspace == NULL )
+		return;
+
+	as = curthread->t_addrspace;
+	npages = 0;
+	for( i = 0; i < vm_region_array_num( as->as_regions ); ++i ) {
+		vmr = vm_region_array_get( as->as_regions, i );
+		npages += vmr->vmr_nused;
+	}
+
+	curthread->td_proc->p_npages = npages;
+}
+
+/**
+ * we ran out of memory for real.
+ * pick the process using the most memory and tell it to exit.
+ * returns true if waiting for the victim is worthwhile, i.e.,
+ * someone else is about to free memory.
+ *
+ * a victim only exits once it leaves the kernel. one asleep in
+ * nanosleep() or futex_wait() is woken up for that, but one blocked
+ * anywhere else may take forever; after OOM_GRACE_NS it no longer
+ * counts, and the next largest process is chosen.
+ */
+bool
+vm_oom_kill( void ) {
+	struct proc		*victim;
+	struct proc		*p;
+	uint64_t		now;
+	bool			pending;
+	int			i;
+
+	//we were chosen ourselves: fail, and exit on the way out.
+	if( proc_killed() )
+		return false;
+
+	victim = NULL;
+	pending = false;
+	now = clock_now();
+	rwlock_acquire_write( lk_allproc );
+	for( i = 0; i < MAX_PROCESSES; ++i ) {
+		p = allproc[i];
+		if( p == NULL || p == (void *)PROC_RESERVED_SPOT || p->p_is_dead )
+			continue;
+
+		//somebody is already on the way out. wait for it, as long as
+		//it has something to give back and is not stuck.
+		if( p->p_killed ) {
+			if( p->p_npages > 0 && now - p->p_killtime < OOM_GRACE_NS )
+				pending = true;
+			continue;
+		}
+
+		if( victim == NULL || p->p_npages > victim->p_npages )
+			victim = p;
+	}
+
+	//killing more than one at a time is not needed.
+	if( pending || ( victim != NULL && victim->p_npages == 0 ) )
+		victim = NULL;
+
+	if( victim != NULL ) {
+		kprintf( "oom: killing pid %d (%u pages)\n", victim->p_pid, victim->p_npages );
+		victim->p_killed = true;
+		victim->p_killtime = now;
+	}
+	rwlock_release_write( lk_allproc );
+
+	//nobody is about to free anything.
+	if( !pending && victim == NULL )
+		return false;
+
+	//if it is us, the caller fails and we exit on the way out.
+	if( victim != NULL && victim == curthread->td_proc )
+		return false;
+
+	//get the victim out of the long sleeps, so it can exit.
+	if( victim != NULL ) {
+		thread_sleep_interrupt();
+		futex_interrupt();
+	}
+
+	//give the victim a chance to exit.
+	clocksleep( 1 );
+	return true;
+}
@@ -13,6 +13,8 @@
 #include <vm.h>
 #include <vm/swap.h>
 #include <vm/page.h>
+#include <vm/vmstat.h>
+#include <clock.h>
 #include <machine/coremap.h>
 #include <vfs.h>
 #include <vnode.h>
@@ -22,6 +24,7 @@ struct lock		*lk_sw;
 struct swap_stats	ss_sw;
 struct vnode		*vn_sw;
 struct lock 		*giant_paging_lock;
+int			swap_overcommit = SWAP_OVERCOMMIT_HEURISTIC;
 
 static
 bool
@@ -40,6 +43,10 @@ static
 void
 swap_init_stats( size_t swap_size ) {
 	ss_sw.ss_total = swap_size / PAGE_SIZE;
+
+	//a page only has room for so many slot numbers.
+	if( ss_sw.ss_total > VM_PAGE_MAXSLOTS )
+		ss_sw.ss_total = VM_PAGE_MAXSLOTS;
 	ss_sw.ss_free = ss_sw.ss_total;
 	ss_sw.ss_reserved = 0;
 }
@@ -52,6 +59,8 @@ swap_io( paddr_t paddr, off_t offset, enum uio_rw op ) {
 	struct uio		uio;
 	vaddr_t			vaddr;
 	int			res;
+	time_t			secs_before, secs_after;
+	uint32_t		nsecs_before, nsecs_after;
 	
 	KASSERT( lock_do_i_hold( giant_paging_lock ) );
 	KASSERT( curthread->t_vmp_count == 0 || curthread->t_clone );
@@ -62,12 +71,18 @@ swap_io( paddr_t paddr, off_t offset, enum uio_rw op ) {
 	//init the uio request.
 	uio_kinit( &iov, &uio, (char *)vaddr, PAGE_SIZE, offset, op );
 	
-	//perform the request.
+	//perform the request, timing it.
+	gettime( &secs_before, &nsecs_before );
 	res = (op == UIO_READ) ? VOP_READ( vn_sw, &uio ) : VOP_WRITE( vn_sw, &uio );
+	gettime( &secs_after, &nsecs_after );
 	
 	//if we have a problem ... bail.
 	if( res )
 		panic( "swap_io: failed to perform a VOP." );
+
+	vmstat_inc( (op == UIO_READ) ? VMSTAT_SWAPINS : VMSTAT_SWAPOUTS );
+	vmstat_add( VMSTAT_PAGING_USEC, 
+		(secs_after - secs_before) * 1000000 + nsecs_after / 1000 - nsecs_before / 1000 );
 }
 
 void
@@ -110,6 +125,9 @@ swap_bootstrap() {
 	--ss_sw.ss_free;
 }
 
+/**
+ * allocate a swap slot, consuming one reservation.
+ */
 off_t		
 swap_alloc() {
 	unsigned	ix;
@@ -122,6 +140,10 @@ swap_alloc() {
 		return INVALID_SWAPADDR;
 	}	
 
+	//the slot was promised by a reservation, which is now fulfilled.
+	KASSERT( ss_sw.ss_reserved > 0 );
+	--ss_sw.ss_reserved;
+
 	//update stats
 	--ss_sw.ss_free;
 
@@ -150,6 +172,24 @@ swap_dealloc( off_t offset ) {
 	UNLOCK_SWAP();
 }
 
+/**
+ * release nslots swap slots, taking the swap lock only once.
+ */
+void
+swap_dealloc_batch( const off_t *offsets, unsigned nslots ) {
+	unsigned	i;
+
+	if( nslots == 0 )
+		return;
+
+	LOCK_SWAP();
+	for( i = 0; i < nslots; ++i ) {
+		bitmap_unmark( bm_sw, offsets[i] / PAGE_SIZE );
+		++ss_sw.ss_free;
+	}
+	UNLOCK_SWAP();
+}
+
 void
 swap_in( paddr_t target, off_t source ) {
 	swap_io( target, source, UIO_READ );
@@ -165,12 +205,27 @@ swap_reserve( unsigned npages ) {
 	LOCK_SWAP();
 
 	KASSERT( ss_sw.ss_free <= ss_sw.ss_total );
-	KASSERT( ss_sw.ss_reserved <= ss_sw.ss_free );
-	
-	//if we don't have enough free pages
-	if( ss_sw.ss_free - ss_sw.ss_reserved < npages ) {
-		UNLOCK_SWAP();
-		return ENOSPC;
+
+	switch( swap_overcommit ) {
+		case SWAP_OVERCOMMIT_STRICT:
+			//if we don't have enough free pages
+			if( ss_sw.ss_free < ss_sw.ss_reserved + npages ) {
+				UNLOCK_SWAP();
+				return ENOSPC;
+			}
+			break;
+
+		case SWAP_OVERCOMMIT_HEURISTIC:
+			//refuse only a request that could not fit even if
+			//everything that is free right now went to it.
+			if( npages > ss_sw.ss_free + cm_stats.cms_free ) {
+				UNLOCK_SWAP();
+				return ENOSPC;
+			}
+			break;
+
+		default:
+			break;
 	}
 
 	//update the number of reserved pages.
@@ -185,7 +240,6 @@ swap_unreserve( unsigned npages ) {
 	LOCK_SWAP();
 	
 	KASSERT( ss_sw.ss_free <= ss_sw.ss_total );
-	KASSERT( ss_sw.ss_reserved <= ss_sw.ss_free );
 	
 	//make sure there are at lest npages that are reserved.
 	KASSERT( npages <= ss_sw.ss_reserved );
@@ -195,3 +249,31 @@ swap_unreserve( unsigned npages ) {
 
 	UNLOCK_SWAP();
 }
+
+/**
+ * take back reservations for slots that were just freed,
+ * i.e. a page went away but the region still wants it backed.
+ * this cannot fail, regardless of the overcommit policy.
+ */
+void
+swap_recommit( unsigned npages ) {
+	LOCK_SWAP();
+	ss_sw.ss_reserved += npages;
+	UNLOCK_SWAP();
+}
+
+/**
+ * change the overcommit policy.
+ */
+int
+swap_set_overcommit( int mode ) {
+	if( mode != SWAP_OVERCOMMIT_STRICT && 
+	    mode != SWAP_OVERCOMMIT_HEURISTIC && 
+	    mode != SWAP_OVERCOMMIT_ALWAYS )
+		return EINVAL;
+
+	LOCK_SWAP();
+	swap_overcommit = mode;
+	UNLOCK_SWAP();
+	return 0;
+}
@@ -6,37 +6,95 @@
 #include <thread.h>
 #include <addrspace.h>
 #include <synch.h>
-#include <wchan.h>
+#include <waitq.h>
 #include <vm.h>
 #include <vm/page.h>
 #include <vm/region.h>
 #include <vm/swap.h>
+#include <vm/oom.h>
+#include <vm/vmstat.h>
+#include <vm/objcache.h>
 #include <current.h>
 #include <machine/coremap.h>
+#include <kern/iovec.h>
+#include <uio.h>
+#include <vnode.h>
+
+struct waitq		*wq_transit;	/* keyed by page */
+
+//every struct vm_page comes from here.
+static struct objcache	*vm_page_cache;
+
+/**
+ * the page locks, shared out by hashing the address of the page.
+ * a thread holds at most one of them, so sharing cannot deadlock.
+ */
+static struct spinlock	vm_page_locks[VM_PAGE_NLOCKS];
+
+#define VM_PAGE_LOCK_FOR(vmp) \
+	(&vm_page_locks[((((vaddr_t)(vmp) >> 3) * 2654435761U) >> 16) & (VM_PAGE_NLOCKS - 1)])
+
+/**
+ * change the frame of the page, keeping its flags.
+ */
+static inline
+void
+vm_page_set_paddr( struct vm_page *vmp, paddr_t paddr ) {
+	KASSERT( (paddr & PAGE_FRAME) == paddr );
+	vmp->vmp_paddr = paddr | VM_PAGE_FLAGS( vmp );
+}
+
+void
+vm_page_bootstrap( void ) {
+	unsigned		i;
+
+	KASSERT( (VM_PAGE_NLOCKS & (VM_PAGE_NLOCKS - 1)) == 0 );
+	for( i = 0; i < VM_PAGE_NLOCKS; ++i ) {
+		spinlock_init( &vm_page_locks[i] );
+		spinlock_setname( &vm_page_locks[i], "vm_page_locks" );
+	}
+
+	vm_page_cache = objcache_create( "vm_page", sizeof( struct vm_page ), NULL, NULL );
+	if( vm_page_cache == NULL )
+		panic( "vm_page_bootstrap: could not create vm_page_cache." );
+}
 
-struct wchan		*wc_transit;
 static
 int
-vm_page_new( struct vm_page **vmp_ret, paddr_t *paddr_ret ) {
+vm_page_new( struct vm_page **vmp_ret, paddr_t *paddr_ret, unsigned flags ) {
 	struct vm_page		*vmp;
 	paddr_t			paddr;
+	off_t			swap_addr;
+	int			retries;
+
+	KASSERT( (flags & PAGE_FRAME) == 0 );
 
 	vmp = vm_page_create();
 	if( vmp == NULL )
 		return ENOMEM;
+
+	//the flags must be in place before coremap_alloc looks at them.
+	vmp->vmp_paddr = INVALID_PADDR | flags;
 	
 	//attempt to allocate swap space.
-	vmp->vmp_swapaddr = swap_alloc();
-	if( vmp->vmp_swapaddr == INVALID_SWAPADDR ) {
-		vm_page_destroy( vmp );
-		return ENOSPC;
+	//if we overcommitted, there may be none left; let the oom killer
+	//make some room instead of failing right away.
+	retries = 0;
+	while( (swap_addr = swap_alloc()) == INVALID_SWAPADDR ) {
+		if( retries++ == OOM_RETRIES || !vm_oom_kill() ) {
+			vm_page_destroy( vmp );
+			return ENOSPC;
+		}
 	}
+	KASSERT( swap_addr / PAGE_SIZE < VM_PAGE_MAXSLOTS );
+	vmp->vmp_swapslot = swap_addr / PAGE_SIZE;
 
 	//allocate a single coremap_entry 
-	paddr = coremap_alloc( vmp, true );
-	if( paddr == INVALID_PADDR ) {
-		vm_page_destroy( vmp );
-		return ENOSPC;
+	while( (paddr = coremap_alloc( vmp, true )) == INVALID_PADDR ) {
+		if( retries++ == OOM_RETRIES || !vm_oom_kill() ) {
+			vm_page_destroy( vmp );
+			return ENOSPC;
+		}
 	}
 
 	//page is already wired, now just lock it.
@@ -44,8 +102,8 @@ vm_page_new( struct vm_page **vmp_ret, paddr_t *paddr_ret ) {
 		
 	KASSERT( coremap_is_wired( paddr ) );
 
-	//adjust the physical address, and mark the page dirty.
-	vmp->vmp_paddr = paddr;
+	//adjust the physical address.
+	vm_page_set_paddr( vmp, paddr );
 
 	*vmp_ret = vmp;
 	*paddr_ret = paddr;
@@ -66,7 +124,7 @@ vm_page_acquire( struct vm_page *vmp ) {
 	
 	for( ;; ) {
 		//get the physical address
-		paddr = vmp->vmp_paddr & PAGE_FRAME;
+		paddr = VM_PAGE_PADDR( vmp );
 
 		//if the physcal address matches the wired address
 		//we are done.
@@ -84,7 +142,7 @@ vm_page_acquire( struct vm_page *vmp ) {
 		//check if the page has been paged out.
 		if( paddr == INVALID_PADDR ) {
 			vm_page_lock( vmp );
-			KASSERT( (vmp->vmp_paddr & PAGE_FRAME) == INVALID_PADDR );
+			KASSERT( VM_PAGE_PADDR( vmp ) == INVALID_PADDR );
 			break;
 		}
 		
@@ -96,123 +154,168 @@ vm_page_acquire( struct vm_page *vmp ) {
 	if( paddr != INVALID_PADDR )		
 		KASSERT( coremap_is_wired( paddr ) );
 
-	KASSERT( spinlock_do_i_hold( &vmp->vmp_lk ) );
+	KASSERT( spinlock_do_i_hold( VM_PAGE_LOCK_FOR( vmp ) ) );
 }
 
 void
-vm_page_destroy( struct vm_page *vmp ) {
+vm_page_batch_init( struct vm_page_batch *vpb ) {
+	vpb->vpb_nframes = 0;
+	vpb->vpb_nslots = 0;
+}
+
+/**
+ * free everything gathered in the batch.
+ */
+void
+vm_page_batch_flush( struct vm_page_batch *vpb ) {
+	coremap_free_batch( vpb->vpb_frames, vpb->vpb_nframes );
+	swap_dealloc_batch( vpb->vpb_slots, vpb->vpb_nslots );
+	vm_page_batch_init( vpb );
+}
+
+/**
+ * drop a reference to the page, and free it if that was the last one.
+ * the frame (still wired) and the swap slot it leaves behind are
+ * handed back for the caller to release, INVALID_* if there are none.
+ */
+static
+bool
+vm_page_put( struct vm_page *vmp, paddr_t *paddr_ret, off_t *swapaddr_ret ) {
 	paddr_t		paddr;
 
+	//a merged page is still used by somebody else.
+	vm_page_lock( vmp );
+	KASSERT( vmp->vmp_refcount > 0 );
+	if( VM_PAGE_MERGED( vmp ) ) {
+		--vmp->vmp_refcount;
+		vm_page_unlock( vmp );
+		vmstat_sub( VMSTAT_KSM_SHARING, 1 );
+		return false;
+	}
+	vm_page_unlock( vmp );
+
 	//lock and wire the page.
 	vm_page_acquire( vmp );
 
-	paddr = vmp->vmp_paddr & PAGE_FRAME;
-	//if the page is in core.
+	paddr = VM_PAGE_PADDR( vmp );
+	//if the page is in core, invalidate it.
 	if( paddr != INVALID_PADDR ) {
-		//invalidate it
-		vmp->vmp_paddr = INVALID_PADDR;
-		
+		vm_page_set_paddr( vmp, INVALID_PADDR );
 		KASSERT( coremap_is_wired( paddr ) );
+	}
+	vm_page_unlock( vmp );
 
-		//unlock and free the coremap entry associated
-		vm_page_unlock( vmp );
+	*paddr_ret = paddr;
+	*swapaddr_ret = VM_PAGE_IN_BACKING( vmp ) ? VM_PAGE_SWAPADDR( vmp ) : INVALID_SWAPADDR;
+
+	objcache_free( vm_page_cache, vmp );
+	vmstat_sub( VMSTAT_META_BYTES, sizeof( struct vm_page ) );
+	return true;
+}
+
+/**
+ * drop a reference to the page, freeing it along with its frame
+ * and swap slot once the last one is gone.
+ * returns whether that was the last reference.
+ */
+bool
+vm_page_destroy( struct vm_page *vmp ) {
+	paddr_t		paddr;
+	off_t		swapaddr;
+
+	if( !vm_page_put( vmp, &paddr, &swapaddr ) )
+		return false;
+
+	if( paddr != INVALID_PADDR )
 		coremap_free( paddr, false );
-	} 
-	else {
-		//the physical address is already invalid ...
-		//just unlock, so we can free the page.
-		vm_page_unlock( vmp );
-	}
 
 	//release the swap space if it exists.
-	if( vmp->vmp_swapaddr != INVALID_SWAPADDR ) 
-		swap_dealloc( vmp->vmp_swapaddr );
+	if( swapaddr != INVALID_SWAPADDR )
+		swap_dealloc( swapaddr );
 
-	spinlock_cleanup( &vmp->vmp_lk );
-	kfree( vmp );
+	return true;
+}
+
+/**
+ * like vm_page_destroy(), but the frame and swap slot are only
+ * gathered in the batch, to be freed with many others at once.
+ */
+void
+vm_page_release( struct vm_page *vmp, struct vm_page_batch *vpb ) {
+	paddr_t		paddr;
+	off_t		swapaddr;
+
+	//make room first, the frames are wired until the batch is flushed.
+	if( vpb->vpb_nframes == VM_PAGE_BATCH || vpb->vpb_nslots == VM_PAGE_BATCH )
+		vm_page_batch_flush( vpb );
+
+	if( !vm_page_put( vmp, &paddr, &swapaddr ) )
+		return;
+
+	if( paddr != INVALID_PADDR )
+		vpb->vpb_frames[vpb->vpb_nframes++] = paddr;
+
+	if( swapaddr != INVALID_SWAPADDR )
+		vpb->vpb_slots[vpb->vpb_nslots++] = swapaddr;
 }
 
 void
 vm_page_lock( struct vm_page *vmp ) {
-	KASSERT( !spinlock_do_i_hold( &vmp->vmp_lk ) );
-	KASSERT( curthread->t_vmp_count == 0 || curthread->t_clone );
+	KASSERT( curthread->t_vmp_count == 0 );
 
-	spinlock_acquire( &vmp->vmp_lk );
+	spinlock_acquire( VM_PAGE_LOCK_FOR( vmp ) );
 	++curthread->t_vmp_count;
 }
 
 void
 vm_page_unlock( struct vm_page *vmp ) {
-	KASSERT( spinlock_do_i_hold( &vmp->vmp_lk ) );
-	KASSERT( curthread->t_vmp_count == 1 || curthread->t_clone );
+	KASSERT( spinlock_do_i_hold( VM_PAGE_LOCK_FOR( vmp ) ) );
+	KASSERT( curthread->t_vmp_count == 1 );
 
-	spinlock_release( &vmp->vmp_lk );
+	spinlock_release( VM_PAGE_LOCK_FOR( vmp ) );
 	--curthread->t_vmp_count;
 }
 
+static int vm_page_acquire_in_core( struct vm_page *, paddr_t *, bool * );
+
 int
 vm_page_clone( struct vm_page *source, struct vm_page **target ) {
 	struct vm_page		*vmp;
 	int			res;
 	paddr_t			paddr;
 	paddr_t			source_paddr;
-	off_t			swap_addr;
 
 	//we are in clone
 	curthread->t_clone = 1;
 
 	//create a new vm_page
-	res = vm_page_new( &vmp, &paddr );
+	res = vm_page_new( &vmp, &paddr, 0 );
 	if( res ) {
 		curthread->t_clone = 0;
 		return res;
 	}
 
 	KASSERT( coremap_is_wired( paddr ) );
-	KASSERT( spinlock_do_i_hold( &vmp->vmp_lk ) );
 	KASSERT( curthread->t_vmp_count == 1 );
 
-	//acquire the source page.
-	vm_page_acquire( source );
-
-	source_paddr = source->vmp_paddr & PAGE_FRAME;
-	//if the source page is not in core, swap it in.
-	if( source_paddr == INVALID_PADDR ) {
-		//get the swap offset of the source page.
-		swap_addr = source->vmp_swapaddr;
-		
-		//unlock the source page.
-		vm_page_unlock( source );
-
-		//alocate memory for the source page.
-		source_paddr = coremap_alloc( source, true );
-		if( source_paddr == INVALID_PADDR ) {
-			//unwire the page, since it was wired by vm_page_new.
-			coremap_unwire( paddr );
-
-			//unlock and destroy the new page.
-			vm_page_unlock( vmp );
-			vm_page_destroy( vmp );
-			
-			//not in clone anymore
-			curthread->t_clone = 0;
-			return ENOMEM;
-		}
-		LOCK_PAGING_GIANT();
-		//swap in the contents located ins swap_addr into source_paddr.
-		swap_in( source_paddr, swap_addr );
-		
-		//lock the source.
-		vm_page_lock( source );
+	//nobody else knows about the new page, and its frame stays wired,
+	//so we can let go of it. the source may share its lock.
+	vm_page_unlock( vmp );
 
-		UNLOCK_PAGING_GIANT();
+	//bring the source page into core, locked and wired.
+	//a merged source may be swapped in by one of its other sharers
+	//at the same time, so this must not go to swap on its own.
+	res = vm_page_acquire_in_core( source, &source_paddr, NULL );
+	if( res ) {
+		//unwire the page, since it was wired by vm_page_new.
+		coremap_unwire( paddr );
 
-		//make sure nobody paged-in this page.
-		KASSERT( (source->vmp_paddr & PAGE_FRAME) == INVALID_PADDR );
+		//destroy the new page.
+		vm_page_destroy( vmp );
 
-		//adjust the physical address to reflect the 
-		//address that currently stores the swapped in content.
-		source->vmp_paddr = source_paddr;
+		//not in clone anymore
+		curthread->t_clone = 0;
+		return res;
 	}
 
 	KASSERT( coremap_is_wired( source_paddr ) );
@@ -221,9 +324,8 @@ vm_page_clone( struct vm_page *source, struct vm_page **target ) {
 	//clone from source to the new address.
 	coremap_clone( source_paddr, paddr );
 
-	//unlock both source and target.
+	//unlock the source.
 	vm_page_unlock( source );
-	vm_page_unlock( vmp );
 
 	//unwire both pages.
 	coremap_unwire( source_paddr );
@@ -241,28 +343,27 @@ struct vm_page *
 vm_page_create( ) {
 	struct vm_page		*vmp;
 
-	vmp = kmalloc( sizeof( struct vm_page ) );
+	vmp = objcache_alloc( vm_page_cache );
 	if( vmp == NULL )
 		return NULL;
-	
-	spinlock_init( &vmp->vmp_lk );
+	vmstat_add( VMSTAT_META_BYTES, sizeof( struct vm_page ) );
 
 	//initialize both the physical address
-	//and swap address to be invalid.
+	//and swap address to be invalid, with no flags.
 	vmp->vmp_paddr = INVALID_PADDR;
-	vmp->vmp_swapaddr = INVALID_SWAPADDR;
-	vmp->vmp_in_transit = false;
+	vmp->vmp_swapslot = INVALID_SWAPADDR;
+	vmp->vmp_refcount = 1;
 
 	return vmp;
 }
 
 int
-vm_page_new_blank( struct vm_page **ret ) {
+vm_page_new_blank( struct vm_page **ret, unsigned flags ) {
 	struct vm_page		*vmp;
 	paddr_t			paddr;
 	int			res;
 	
-	res = vm_page_new( &vmp, &paddr );
+	res = vm_page_new( &vmp, &paddr, flags );
 	if( res )
 		return res;
 	
@@ -275,73 +376,133 @@ vm_page_new_blank( struct vm_page **ret ) {
 	//zero the paddr and unwire it
 	coremap_zero( paddr );
 	coremap_unwire( paddr );
+	vmstat_inc( VMSTAT_ZEROFILLS );
 
 	*ret = vmp;
 	return 0;
 }
 
+/**
+ * create a new page and fill it with the contents of vn at offset.
+ * whatever lies beyond the end of the file reads as zeros.
+ */
+int
+vm_page_new_from_vnode( struct vm_page **ret, unsigned flags, struct vnode *vn, off_t offset ) {
+	struct vm_page		*vmp;
+	paddr_t			paddr;
+	struct iovec		iov;
+	struct uio		ku;
+	int			res;
+
+	res = vm_page_new( &vmp, &paddr, flags );
+	if( res )
+		return res;
+
+	KASSERT( coremap_is_wired( paddr ) );
+
+	//no spinlocks may be held across I/O.
+	vm_page_unlock( vmp );
+
+	//zero it first, so a short read leaves the tail zero-filled.
+	coremap_zero( paddr );
+
+	//read the page straight into the frame.
+	uio_kinit( &iov, &ku, (void *)PADDR_TO_KVADDR( paddr ), PAGE_SIZE, offset, UIO_READ );
+	res = VOP_READ( vn, &ku );
+
+	coremap_unwire( paddr );
+	if( res ) {
+		vm_page_destroy( vmp );
+		return res;
+	}
+
+	vmstat_inc( VMSTAT_FILEFILLS );
+	*ret = vmp;
+	return 0;
+}
+
+/**
+ * the page, which we have locked, has arrived in or left core.
+ * wake up whoever waited for it.
+ */
+static
+void
+vm_page_end_transit( struct vm_page *vmp ) {
+	KASSERT( vmp->vmp_paddr & VM_PAGE_TRANSIT );
+	vmp->vmp_paddr &= ~VM_PAGE_TRANSIT;
+	waitq_wakeall( wq_transit, vmp );
+}
+
+/**
+ * wait until vmp, which we have locked, is no longer in transit.
+ */
 static
 void
 vm_page_wait_for_transit( struct vm_page *vmp ) {
-	wchan_lock( wc_transit );
-	vm_page_unlock( vmp );
-	KASSERT( curthread->t_vmp_count == 0 );
-	wchan_sleep( wc_transit );
-	vm_page_lock( vmp );
+	while( vmp->vmp_paddr & VM_PAGE_TRANSIT ) {
+		waitq_lock( wq_transit, vmp );
+		vm_page_unlock( vmp );
+		KASSERT( curthread->t_vmp_count == 0 );
+		waitq_sleep( wq_transit, vmp );
+		vm_page_lock( vmp );
+		vmstat_wakeup( vmp->vmp_paddr & VM_PAGE_TRANSIT );
+	}
 }
 
+/**
+ * lock and wire the page, swapping it in if it is not in core.
+ * on success the page is returned locked, with its frame wired.
+ * swapped, if not NULL, tells whether we had to go to swap for it.
+ */
+static
 int
-vm_page_fault( struct vm_page *vmp, struct addrspace *as, int fault_type, vaddr_t fault_vaddr ) {
+vm_page_acquire_in_core( struct vm_page *vmp, paddr_t *paddr_ret, bool *swapped ) {
 	paddr_t		paddr;
-	int		writeable;
 	off_t		swap_addr;
 	bool		success;
-	(void) as;
 
-	//which fault happened?
-	switch( fault_type ) {
-		case VM_FAULT_READ:	
-			writeable = 0;
-			break;
-		case VM_FAULT_WRITE:
-		case VM_FAULT_READONLY:
-			writeable = 1;
-			break;
-		default:
-			return EINVAL;
-		
-	}
-	
+	if( swapped != NULL )
+		*swapped = false;
+
 	do {
 		success = true;
 		vm_page_lock( vmp );
-		while( vmp->vmp_in_transit == true )
-			vm_page_wait_for_transit( vmp );
+		vm_page_wait_for_transit( vmp );
 		
 		vm_page_unlock( vmp );
 		vm_page_acquire( vmp );
-		if( vmp->vmp_in_transit ) {
+		if( vmp->vmp_paddr & VM_PAGE_TRANSIT ) {
 			success = false;
-			coremap_unwire( (vmp->vmp_paddr & PAGE_FRAME ) );
+			if( VM_PAGE_PADDR( vmp ) != INVALID_PADDR )
+				coremap_unwire( VM_PAGE_PADDR( vmp ) );
 			vm_page_unlock( vmp );
 		}
 	} while( !success );
 
 	//get the physical address.
-	paddr = vmp->vmp_paddr & PAGE_FRAME;
+	paddr = VM_PAGE_PADDR( vmp );
 
 	//if the page is out of core
 	if( paddr == INVALID_PADDR ) {
-		swap_addr = vmp->vmp_swapaddr;
-		KASSERT( vmp->vmp_swapaddr != INVALID_SWAPADDR );
+		KASSERT( VM_PAGE_IN_BACKING( vmp ) );
+		swap_addr = VM_PAGE_SWAPADDR( vmp );
+
+		//a merged page is faulted on by every address space sharing
+		//it, each under its own lock. whoever comes after us waits
+		//for the page to arrive instead of reading it in again.
+		vmp->vmp_paddr |= VM_PAGE_TRANSIT;
 		
 		//unlock the page while allocating.
 		vm_page_unlock( vmp );
 
 		//allocate memory.
 		paddr = coremap_alloc( vmp, true );
-		if( paddr == INVALID_PADDR ) 
+		if( paddr == INVALID_PADDR ) {
+			vm_page_lock( vmp );
+			vm_page_end_transit( vmp );
+			vm_page_unlock( vmp );
 			return ENOMEM;
+		}
 		
 		KASSERT( coremap_is_wired( paddr ) );
 
@@ -352,14 +513,65 @@ vm_page_fault( struct vm_page *vmp, struct addrspace *as, int fault_type, vaddr_
 		UNLOCK_PAGING_GIANT();
 
 		//make sure the page address is still invalid.
-		KASSERT( vmp->vmp_paddr == INVALID_PADDR );
-		KASSERT( vmp->vmp_swapaddr == swap_addr );
+		KASSERT( VM_PAGE_PADDR( vmp ) == INVALID_PADDR );
+		KASSERT( VM_PAGE_SWAPADDR( vmp ) == swap_addr );
 		KASSERT( coremap_is_wired( paddr ) );
 
 		//update the physical address.
-		vmp->vmp_paddr = paddr;
+		vm_page_set_paddr( vmp, paddr );
+		vm_page_end_transit( vmp );
+		if( swapped != NULL )
+			*swapped = true;
+	}
+
+	*paddr_ret = paddr;
+	return 0;
+}
+
+/**
+ * map the page at fault_vaddr, bringing it into core if needed.
+ * major is set if that meant waiting for swap, and left alone otherwise.
+ */
+int
+vm_page_fault( struct vm_page *vmp, struct addrspace *as, int fault_type, vaddr_t fault_vaddr, bool *major ) {
+	bool		swapped;
+	paddr_t		paddr;
+	int		writeable;
+	int		res;
+	(void) as;
+
+	//which fault happened?
+	switch( fault_type ) {
+		case VM_FAULT_READ:	
+			writeable = 0;
+			break;
+		case VM_FAULT_WRITE:
+		case VM_FAULT_READONLY:
+			writeable = 1;
+			break;
+		default:
+			return EINVAL;
+		
 	}
 
+	//bring the page into core, locked and wired.
+	res = vm_page_acquire_in_core( vmp, &paddr, &swapped );
+	if( res )
+		return res;
+
+	if( swapped )
+		*major = true;
+
+	//merged pages are never written to in place. as_fault() gives the
+	//writer a copy of its own first, so this only happens when we raced
+	//with the merge; the write will fault again.
+	if( VM_PAGE_MERGED( vmp ) )
+		writeable = 0;
+
+	//a writeable mapping means the page may be dirtied from now on.
+	if( writeable )
+		vmp->vmp_paddr |= VM_PAGE_DIRTY;
+
 	//map fault_vaddr into paddr with writeable flags.
 	vm_map( fault_vaddr, paddr, writeable );
 
@@ -371,6 +583,128 @@ vm_page_fault( struct vm_page *vmp, struct addrspace *as, int fault_type, vaddr_
 	return 0;
 }
 
+/**
+ * write the first len bytes of a dirty page back to vn at offset.
+ * every writeable mapping of the page is revoked first, so that a later
+ * store faults again and marks the page dirty anew.
+ */
+int
+vm_page_writeback( struct vm_page *vmp, struct vnode *vn, off_t offset, size_t len ) {
+	paddr_t			paddr;
+	struct iovec		iov;
+	struct uio		ku;
+	int			res;
+
+	KASSERT( len <= PAGE_SIZE );
+
+	//clean pages have nothing to write.
+	vm_page_lock( vmp );
+	if( (vmp->vmp_paddr & VM_PAGE_DIRTY) == 0 ) {
+		vm_page_unlock( vmp );
+		return 0;
+	}
+	vm_page_unlock( vmp );
+
+	//bring the page into core, locked and wired.
+	res = vm_page_acquire_in_core( vmp, &paddr, NULL );
+	if( res )
+		return res;
+
+	//it is clean as of now.
+	vmp->vmp_paddr &= ~VM_PAGE_DIRTY;
+	vm_page_unlock( vmp );
+
+	//make every mapping of the frame fault again.
+	coremap_shootdown( paddr );
+
+	uio_kinit( &iov, &ku, (void *)PADDR_TO_KVADDR( paddr ), len, offset, UIO_WRITE );
+	res = VOP_WRITE( vn, &ku );
+	if( res ) {
+		//still dirty.
+		vm_page_lock( vmp );
+		vmp->vmp_paddr |= VM_PAGE_DIRTY;
+		vm_page_unlock( vmp );
+	}
+
+	coremap_unwire( paddr );
+	return res;
+}
+
+/**
+ * bring the page into core without mapping it anywhere.
+ */
+int
+vm_page_prefetch( struct vm_page *vmp ) {
+	paddr_t			paddr;
+	int			res;
+
+	res = vm_page_acquire_in_core( vmp, &paddr, NULL );
+	if( res )
+		return res;
+
+	vm_page_unlock( vmp );
+	coremap_unwire( paddr );
+	return 0;
+}
+
+/**
+ * hint that the page will not be used again soon.
+ */
+void
+vm_page_deactivate( struct vm_page *vmp ) {
+	paddr_t			paddr;
+
+	vm_page_lock( vmp );
+	paddr = VM_PAGE_PADDR( vmp );
+	if( paddr != INVALID_PADDR && (vmp->vmp_paddr & VM_PAGE_TRANSIT) == 0 )
+		coremap_deactivate( paddr );
+	vm_page_unlock( vmp );
+}
+
+/**
+ * pin the page in core for mlock().
+ * changed tells whether the page was not pinned before.
+ */
+int
+vm_page_mlock( struct vm_page *vmp, bool *changed ) {
+	paddr_t			paddr;
+	int			res;
+
+	res = vm_page_acquire_in_core( vmp, &paddr, NULL );
+	if( res )
+		return res;
+
+	*changed = ( vmp->vmp_paddr & VM_PAGE_LOCKED ) == 0;
+	if( *changed ) {
+		vmp->vmp_paddr |= VM_PAGE_LOCKED;
+		coremap_mlock( paddr, true );
+	}
+
+	vm_page_unlock( vmp );
+	coremap_unwire( paddr );
+	return 0;
+}
+
+/**
+ * undo vm_page_mlock().
+ * a pinned page is never evicted, so it must still be in core.
+ */
+void
+vm_page_munlock( struct vm_page *vmp, bool *changed ) {
+	paddr_t			paddr;
+
+	vm_page_lock( vmp );
+	*changed = ( vmp->vmp_paddr & VM_PAGE_LOCKED ) != 0;
+	if( *changed ) {
+		paddr = VM_PAGE_PADDR( vmp );
+		KASSERT( paddr != INVALID_PADDR );
+
+		vmp->vmp_paddr &= ~VM_PAGE_LOCKED;
+		coremap_mlock( paddr, false );
+	}
+	vm_page_unlock( vmp );
+}
+
 /**
  * evict the page from core.
  */
@@ -384,16 +718,16 @@ vm_page_evict( struct vm_page *victim ) {
 	//lock the page while evicting.
 	vm_page_lock( victim );
 	
-	paddr = victim->vmp_paddr & PAGE_FRAME;
-	swap_addr = victim->vmp_swapaddr;
+	paddr = VM_PAGE_PADDR( victim );
+	swap_addr = VM_PAGE_SWAPADDR( victim );
 
 	KASSERT( paddr != INVALID_PADDR );
 	KASSERT( swap_addr != INVALID_SWAPADDR );
 	KASSERT( coremap_is_wired( paddr ) );
 	
 	//mark it as being in transit.
-	KASSERT( victim->vmp_in_transit == false );
-	victim->vmp_in_transit = true;
+	KASSERT( (victim->vmp_paddr & VM_PAGE_TRANSIT) == 0 );
+	victim->vmp_paddr |= VM_PAGE_TRANSIT;
 	
 	//unlock it
 	vm_page_unlock( victim );
@@ -405,15 +739,150 @@ vm_page_evict( struct vm_page *victim ) {
 	vm_page_lock( victim );
 
 	//update the page information.
-	KASSERT( victim->vmp_in_transit == true );
-	KASSERT( (victim->vmp_paddr & PAGE_FRAME) == paddr );
+	KASSERT( victim->vmp_paddr & VM_PAGE_TRANSIT );
+	KASSERT( VM_PAGE_PADDR( victim ) == paddr );
 	KASSERT( coremap_is_wired( paddr ) );
 
-	victim->vmp_in_transit = false;
-	victim->vmp_paddr = INVALID_PADDR;
-
-	wchan_wakeall( wc_transit );
+	vm_page_set_paddr( victim, INVALID_PADDR );
+	vm_page_end_transit( victim );
 	vm_page_unlock( victim );
 
 }
 	
+
+/**
+ * move the page from frame src to frame dst, both wired by the caller.
+ * src must have no mappings left, so nobody writes to it as we copy.
+ * whoever wants the page in the meantime waits for src to be unwired,
+ * and then finds it at dst.
+ */
+void
+vm_page_migrate( struct vm_page *vmp, paddr_t src, paddr_t dst ) {
+	KASSERT( coremap_is_wired( src ) );
+	KASSERT( coremap_is_wired( dst ) );
+
+	coremap_clone( src, dst );
+
+	vm_page_lock( vmp );
+	KASSERT( VM_PAGE_PADDR( vmp ) == src );
+	KASSERT( (vmp->vmp_paddr & VM_PAGE_TRANSIT) == 0 );
+	vm_page_set_paddr( vmp, dst );
+	vm_page_unlock( vmp );
+}
+
+/**
+ * lock and wire the page, but only if it is in core and not on its
+ * way out. unlike vm_page_acquire_in_core(), we never go to swap.
+ * returns false, with the page unlocked, if it is not resident.
+ */
+static
+bool
+vm_page_acquire_resident( struct vm_page *vmp, paddr_t *paddr_ret ) {
+	paddr_t			paddr;
+
+	vm_page_acquire( vmp );
+	paddr = VM_PAGE_PADDR( vmp );
+	if( paddr == INVALID_PADDR ) {
+		vm_page_unlock( vmp );
+		return false;
+	}
+
+	if( vmp->vmp_paddr & VM_PAGE_TRANSIT ) {
+		coremap_unwire( paddr );
+		vm_page_unlock( vmp );
+		return false;
+	}
+
+	*paddr_ret = paddr;
+	return true;
+}
+
+/**
+ * checksum the contents of a resident page.
+ * fails with ENOENT if the page is not in core.
+ */
+int
+vm_page_checksum( struct vm_page *vmp, uint32_t *sum ) {
+	paddr_t			paddr;
+
+	if( !vm_page_acquire_resident( vmp, &paddr ) )
+		return ENOENT;
+
+	//the frame is wired, so it stays put while we read it.
+	vm_page_unlock( vmp );
+	*sum = coremap_checksum( paddr );
+	coremap_unwire( paddr );
+	return 0;
+}
+
+/**
+ * take an extra reference to a resident page, so that identical pages
+ * can be merged into it. from here on the page is mapped read-only
+ * everywhere, so its contents stay the same for as long as it is shared.
+ * vm_page_destroy() drops the reference again.
+ */
+int
+vm_page_ksm_hold( struct vm_page *vmp ) {
+	paddr_t			paddr;
+
+	if( !vm_page_acquire_resident( vmp, &paddr ) )
+		return ENOENT;
+
+	//pinned pages stay private, and the count has to fit.
+	if( (vmp->vmp_paddr & VM_PAGE_LOCKED) || vmp->vmp_refcount == VM_PAGE_MAXREFS ) {
+		coremap_unwire( paddr );
+		vm_page_unlock( vmp );
+		return EBUSY;
+	}
+
+	++vmp->vmp_refcount;
+	vmp->vmp_paddr |= VM_PAGE_SHARED;
+	vm_page_unlock( vmp );
+	vmstat_inc( VMSTAT_KSM_SHARING );
+
+	//revoke the writeable mappings, and track every mapping from now on.
+	coremap_share( paddr );
+	coremap_unwire( paddr );
+	return 0;
+}
+
+/**
+ * compare dup against keep, which the caller holds through
+ * vm_page_ksm_hold(). returns 0 if they are identical, in which case
+ * dup has no mappings left, and may be replaced by keep. the caller must
+ * keep the owner of dup from faulting it back in until then.
+ */
+int
+vm_page_ksm_same( struct vm_page *keep, struct vm_page *dup ) {
+	paddr_t			keep_paddr;
+	paddr_t			dup_paddr;
+	int			res;
+
+	KASSERT( keep != dup );
+
+	if( !vm_page_acquire_resident( keep, &keep_paddr ) )
+		return ENOENT;
+	vm_page_unlock( keep );
+
+	if( !vm_page_acquire_resident( dup, &dup_paddr ) ) {
+		coremap_unwire( keep_paddr );
+		return ENOENT;
+	}
+
+	//only private pages that are not pinned can go.
+	if( (dup->vmp_paddr & VM_PAGE_LOCKED) || VM_PAGE_MERGED( dup ) ) {
+		coremap_unwire( dup_paddr );
+		vm_page_unlock( dup );
+		coremap_unwire( keep_paddr );
+		return EBUSY;
+	}
+	vm_page_unlock( dup );
+
+	//nobody may write to dup behind our back while we compare.
+	coremap_shootdown( dup_paddr );
+	res = coremap_compare( keep_paddr, dup_paddr ) ? 0 : EINVAL;
+
+	coremap_unwire( dup_paddr );
+	coremap_unwire( keep_paddr );
+	return res;
+}
@@ -0,0 +1,141 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm/pagetable.h>
+#include <vm/vmstat.h>
+
+#define VM_PT_NDIRENTS(npages) DIVROUNDUP( (npages), VM_PT_LEAF_PAGES )
+#define VM_PT_LEAF_BYTES (VM_PT_LEAF_PAGES * sizeof( struct vm_page * ))
+
+struct vm_pagetable *
+vm_pagetable_create( void ) {
+	struct vm_pagetable		*vpt;
+
+	vpt = kmalloc( sizeof( struct vm_pagetable ) );
+	if( vpt == NULL )
+		return NULL;
+
+	vpt->vpt_dir = NULL;
+	vpt->vpt_ndir = 0;
+	vpt->vpt_npages = 0;
+	vmstat_add( VMSTAT_META_BYTES, sizeof( struct vm_pagetable ) );
+	return vpt;
+}
+
+void
+vm_pagetable_destroy( struct vm_pagetable *vpt ) {
+	//the pages must be gone already.
+	KASSERT( vpt->vpt_npages == 0 );
+	KASSERT( vpt->vpt_dir == NULL );
+
+	kfree( vpt );
+	vmstat_sub( VMSTAT_META_BYTES, sizeof( struct vm_pagetable ) );
+}
+
+/**
+ * grow or shrink the table to cover npages.
+ * when shrinking, the pages that fall off must have been cleared already.
+ * the directory only shrinks when the table becomes empty, so that
+ * shrinking never has to allocate, and thus never fails.
+ */
+int
+vm_pagetable_setsize( struct vm_pagetable *vpt, unsigned npages ) {
+	struct vm_pt_dirent		*dir;
+	unsigned			nents;
+	unsigned			i;
+
+	//make sure nothing is left behind in the part we cut off.
+	for( i = npages; i < vpt->vpt_npages; ++i )
+		KASSERT( vm_pagetable_get( vpt, i ) == NULL );
+
+	nents = VM_PT_NDIRENTS( npages );
+
+	//empty tables need no directory at all.
+	if( nents == 0 ) {
+		if( vpt->vpt_dir != NULL ) {
+			kfree( vpt->vpt_dir );
+			vmstat_sub( VMSTAT_META_BYTES, vpt->vpt_ndir * sizeof( struct vm_pt_dirent ) );
+		}
+		vpt->vpt_dir = NULL;
+		vpt->vpt_ndir = 0;
+		vpt->vpt_npages = 0;
+		return 0;
+	}
+
+	//the directory is large enough as it is.
+	if( nents <= vpt->vpt_ndir ) {
+		vpt->vpt_npages = npages;
+		return 0;
+	}
+
+	dir = kmalloc( nents * sizeof( struct vm_pt_dirent ) );
+	if( dir == NULL )
+		return ENOMEM;
+
+	//carry over what we have, and start the rest out empty.
+	for( i = 0; i < nents; ++i ) {
+		if( i < vpt->vpt_ndir ) {
+			dir[i] = vpt->vpt_dir[i];
+			continue;
+		}
+		dir[i].vpd_leaf = NULL;
+		dir[i].vpd_nused = 0;
+	}
+
+	if( vpt->vpt_dir != NULL )
+		kfree( vpt->vpt_dir );
+
+	vmstat_add( VMSTAT_META_BYTES, nents * sizeof( struct vm_pt_dirent ) );
+	vmstat_sub( VMSTAT_META_BYTES, vpt->vpt_ndir * sizeof( struct vm_pt_dirent ) );
+
+	vpt->vpt_dir = dir;
+	vpt->vpt_ndir = nents;
+	vpt->vpt_npages = npages;
+	return 0;
+}
+
+/**
+ * store vmp (which may be NULL) as the ix-th page.
+ * storing into an untouched leaf allocates it, which may fail;
+ * clearing the last page of a leaf frees it, which never does.
+ */
+int
+vm_pagetable_set( struct vm_pagetable *vpt, unsigned ix, struct vm_page *vmp ) {
+	struct vm_pt_dirent		*ent;
+	struct vm_page			*old;
+	unsigned			i;
+
+	KASSERT( ix < vpt->vpt_npages );
+	ent = &vpt->vpt_dir[ix >> VM_PT_LEAF_SHIFT];
+
+	if( ent->vpd_leaf == NULL ) {
+		//nothing to clear.
+		if( vmp == NULL )
+			return 0;
+
+		ent->vpd_leaf = kmalloc( VM_PT_LEAF_BYTES );
+		if( ent->vpd_leaf == NULL )
+			return ENOMEM;
+
+		for( i = 0; i < VM_PT_LEAF_PAGES; ++i )
+			ent->vpd_leaf[i] = NULL;
+		vmstat_add( VMSTAT_META_BYTES, VM_PT_LEAF_BYTES );
+	}
+
+	old = ent->vpd_leaf[ix & VM_PT_LEAF_MASK];
+	ent->vpd_leaf[ix & VM_PT_LEAF_MASK] = vmp;
+
+	if( old == NULL && vmp != NULL )
+		++ent->vpd_nused;
+	else if( old != NULL && vmp == NULL )
+		--ent->vpd_nused;
+
+	//the leaf is empty again, give it back.
+	if( ent->vpd_nused == 0 ) {
+		kfree( ent->vpd_leaf );
+		ent->vpd_leaf = NULL;
+		vmstat_sub( VMSTAT_META_BYTES, VM_PT_LEAF_BYTES );
+	}
+
+	return 0;
+}
@@ -7,15 +7,18 @@
 #include <vm/region.h>
 #include <vm/swap.h>
 #include <vm/page.h>
+#include <vm/vmstat.h>
 #include <machine/coremap.h>
-
-DEFARRAY_BYTYPE( vm_page_array, struct vm_page, /* no inline */ );
+#include <kern/mman.h>
+#include <synch.h>
+#include <vnode.h>
+#include <stat.h>
+#include <bitmap.h>
 
 struct vm_region *
 vm_region_create( size_t npages ) {
 	int 			res;
 	struct vm_region	*vmr;
-	unsigned		i;
 	int			err;
 
 	//see if we can reserve npages of swap first.
@@ -25,11 +28,13 @@ vm_region_create( size_t npages ) {
 
 	//attempt to create the vm_region
 	vmr = kmalloc( sizeof( struct vm_region ) );
-	if( vmr == NULL )
+	if( vmr == NULL ) {
+		swap_unreserve( npages );
 		return NULL;
+	}
 
-	//create the vm_pages.
-	vmr->vmr_pages = vm_page_array_create();
+	//create the table of vm_pages.
+	vmr->vmr_pages = vm_pagetable_create();
 	if( vmr->vmr_pages == NULL ) {
 		kfree( vmr );
 		swap_unreserve( npages );
@@ -39,55 +44,579 @@ vm_region_create( size_t npages ) {
 	//set the base address to point to an invalid virtual address.
 	vmr->vmr_base = 0xdeadbeef;
 
-	//adjust the array to hold npages.
-	res = vm_page_array_setsize( vmr->vmr_pages, npages );
+	//by default, an anonymous region that can be used for anything.
+	vmr->vmr_type = VMR_ANON;
+	vmr->vmr_prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+	vmr->vmr_flags = 0;
+	vmr->vmr_vnode = NULL;
+	vmr->vmr_offset = 0;
+	vmr->vmr_share = NULL;
+	vmr->vmr_advice = MADV_NORMAL;
+	vmr->vmr_nused = 0;
+	vmr->vmr_pinned = NULL;
+
+	//adjust the table to cover npages, all of them empty.
+	res = vm_pagetable_setsize( vmr->vmr_pages, npages );
 	if( res ) {
-		vm_page_array_destroy( vmr->vmr_pages );
+		vm_pagetable_destroy( vmr->vmr_pages );
 		kfree( vmr );
 		swap_unreserve( npages );
 		return NULL;
 	}
 
-	//initialize all the pages to NULL.
-	for( i = 0; i < npages; ++i )
-		vm_page_array_set( vmr->vmr_pages, i, NULL );
-
 	return vmr;
 }
 
+/**
+ * destroy every page from npages on, leaving their slots empty.
+ * the frames and swap slots are given back in batches. unless unmap is
+ * set, the caller guarantees that no tlb maps the pages anymore.
+ */
+static
 void
-vm_region_destroy( struct vm_region *vmr ) {
-	//resize the vm region to 0.
-	KASSERT( vm_region_resize( vmr, 0 ) == 0 );
+vm_region_drop_pages( struct vm_region *vmr, unsigned npages, bool unmap ) {
+	struct vm_page_batch	vpb;
+	struct vm_page		*vmp;
+	unsigned		nempty;
+	unsigned		i;
+
+	nempty = 0;
+	vm_page_batch_init( &vpb );
+	for( i = npages; i < vm_pagetable_num( vmr->vmr_pages ); ++i ) {
+		vmp = vm_pagetable_get( vmr->vmr_pages, i );
+		if( vmp == NULL ) {
+			++nempty;
+			continue;
+		}
+
+		//unmap tlb entries.
+		if( unmap )
+			vm_unmap( vmr->vmr_base + PAGE_SIZE * i );
+
+		//destroy the page, its swap slot fulfilled its reservation.
+		vm_pagetable_set( vmr->vmr_pages, i, NULL );
+		vm_page_release( vmp, &vpb );
+		--vmr->vmr_nused;
+	}
+	vm_page_batch_flush( &vpb );
+
+	//the empty slots were only promised.
+	if( nempty > 0 )
+		swap_unreserve( nempty );
+}
+
+/**
+ * give up this region's mlock() of the ix-th shared page. the page
+ * stays pinned as long as another region of the share pins it too.
+ * the share must be locked. returns false if we had not pinned it.
+ */
+static
+bool
+vm_region_unpin_shared( struct vm_region *vmr, unsigned ix ) {
+	struct vm_share		*vms;
+	struct vm_page		*vmp;
+	bool			changed;
+
+	vms = vmr->vmr_share;
+	KASSERT( lock_do_i_hold( vms->vms_lk ) );
+
+	if( vmr->vmr_pinned == NULL || !bitmap_isset( vmr->vmr_pinned, ix ) )
+		return false;
+
+	bitmap_unmark( vmr->vmr_pinned, ix );
+	KASSERT( vms->vms_pins[ix] > 0 );
+	if( --vms->vms_pins[ix] == 0 ) {
+		vmp = vm_pagetable_get( vmr->vmr_pages, ix );
+		KASSERT( vmp != NULL );
+		vm_page_munlock( vmp, &changed );
+		KASSERT( changed );
+	}
+
+	return true;
+}
+
+static
+void
+vm_region_teardown( struct vm_region *vmr, bool unmap ) {
+	struct vm_share		*vms;
+	unsigned		i;
+	bool			last;
+
+	vms = vmr->vmr_share;
+	if( vms != NULL ) {
+		//push the contents back to the file before dropping them.
+		if( vmr->vmr_type == VMR_FILE )
+			vm_region_writeback( vmr );
+
+		lock_acquire( vms->vms_lk );
+		//whatever we pinned, others may still want pinned.
+		if( vmr->vmr_pinned != NULL ) {
+			for( i = 0; i < vm_pagetable_num( vmr->vmr_pages ); ++i )
+				vm_region_unpin_shared( vmr, i );
+			bitmap_destroy( vmr->vmr_pinned );
+			vmr->vmr_pinned = NULL;
+		}
+
+		KASSERT( vms->vms_refcount > 0 );
+		last = ( --vms->vms_refcount == 0 );
+		lock_release( vms->vms_lk );
+
+		//somebody else still maps the pages, so just drop our mappings.
+		if( !last ) {
+			for( i = 0; unmap && i < vm_pagetable_num( vmr->vmr_pages ); ++i )
+				vm_unmap( vmr->vmr_base + PAGE_SIZE * i );
+
+			if( vmr->vmr_vnode != NULL )
+				VOP_DECREF( vmr->vmr_vnode );
+			kfree( vmr );
+			return;
+		}
+
+		lock_destroy( vms->vms_lk );
+		if( vms->vms_pins != NULL )
+			kfree( vms->vms_pins );
+		kfree( vms );
+	}
+
+	//resize the vm region to 0, which never fails.
+	vm_region_drop_pages( vmr, 0, unmap );
+	vm_pagetable_setsize( vmr->vmr_pages, 0 );
 
 	//destroy the pages associated with the region.
-	vm_page_array_destroy( vmr->vmr_pages );
+	vm_pagetable_destroy( vmr->vmr_pages );
+
+	//release the backing file.
+	if( vmr->vmr_vnode != NULL )
+		VOP_DECREF( vmr->vmr_vnode );
 
 	//free the memory
 	kfree( vmr );
 }
 
-static
+void
+vm_region_destroy( struct vm_region *vmr ) {
+	vm_region_teardown( vmr, true );
+}
+
+/**
+ * destroy a region of an addrspace that is gone for good, after
+ * every tlb has been flushed (see coremap_flush_tlbs()). this skips
+ * unmapping each page on its own.
+ */
+void
+vm_region_reap( struct vm_region *vmr ) {
+	vm_region_teardown( vmr, false );
+}
+
+/**
+ * make the pages of the region shared, so that clones of the
+ * region see the very same pages instead of copies.
+ * must be called before any page of the region is instantiated.
+ */
 int
-vm_region_shrink( struct vm_region *vmr, unsigned npages ) {
-	unsigned		i;
+vm_region_share( struct vm_region *vmr ) {
+	struct vm_share		*vms;
+
+	KASSERT( vmr->vmr_share == NULL );
+
+	vms = kmalloc( sizeof( struct vm_share ) );
+	if( vms == NULL )
+		return ENOMEM;
+
+	vms->vms_lk = lock_create( "vms_lk" );
+	if( vms->vms_lk == NULL ) {
+		kfree( vms );
+		return ENOMEM;
+	}
+
+	vms->vms_pages = vmr->vmr_pages;
+	vms->vms_refcount = 1;
+	vms->vms_pins = NULL;
+	vmr->vmr_share = vms;
+	return 0;
+}
+
+/**
+ * instantiate the ix-th page of the region, either blank
+ * or with the contents of the backing file.
+ */
+int
+vm_region_new_page( struct vm_region *vmr, unsigned ix, struct vm_page **ret ) {
+	unsigned		flags;
+
+	flags = ( vmr->vmr_share != NULL ) ? VM_PAGE_SHARED : 0;
+	if( vmr->vmr_type == VMR_FILE )
+		return vm_page_new_from_vnode( 
+			ret, 
+			flags, 
+			vmr->vmr_vnode, 
+			vmr->vmr_offset + (off_t)ix * PAGE_SIZE 
+		);
+
+	return vm_page_new_blank( ret, flags );
+}
+
+/**
+ * get the ix-th page of the region, instantiating it if needed.
+ * for shared regions, the caller must hold the share's lock.
+ */
+int
+vm_region_get_page( struct vm_region *vmr, unsigned ix, struct vm_page **ret ) {
 	struct vm_page		*vmp;
+	int			res;
 
-	for( i = npages; i < vm_page_array_num( vmr->vmr_pages ); ++i ) {
-		vmp = vm_page_array_get( vmr->vmr_pages, i );
+	KASSERT( ix < vm_pagetable_num( vmr->vmr_pages ) );
+	KASSERT( vmr->vmr_share == NULL || lock_do_i_hold( vmr->vmr_share->vms_lk ) );
+
+	vmp = vm_pagetable_get( vmr->vmr_pages, ix );
+	if( vmp == NULL ) {
+		res = vm_region_new_page( vmr, ix, &vmp );
+		if( res )
+			return res;
+
+		//this may need a new leaf of the table.
+		res = vm_pagetable_set( vmr->vmr_pages, ix, vmp );
+		if( res ) {
+			vm_page_destroy( vmp );
+			return res;
+		}
+		++vmr->vmr_nused;
+	}
+
+	*ret = vmp;
+	return 0;
+}
+
+/**
+ * give the ix-th page of a private region a copy of its own,
+ * so that it may be written to. the merged page loses a reference.
+ * merging gave back the swap our page was backed by, so the copy
+ * needs a new reservation, which may fail.
+ */
+int
+vm_region_unmerge( struct vm_region *vmr, unsigned ix, struct vm_page **ret ) {
+	struct vm_page		*vmp;
+	struct vm_page		*copy;
+	int			res;
+
+	KASSERT( vmr->vmr_share == NULL );
+
+	vmp = vm_pagetable_get( vmr->vmr_pages, ix );
+	KASSERT( vmp != NULL );
+
+	res = swap_reserve( 1 );
+	if( res )
+		return res;
+
+	res = vm_page_clone( vmp, &copy );
+	if( res ) {
+		swap_unreserve( 1 );
+		return res;
+	}
+
+	//the slot is taken, so this needs no new leaf.
+	res = vm_pagetable_set( vmr->vmr_pages, ix, copy );
+	KASSERT( res == 0 );
+
+	//the tlb may still point at the merged frame.
+	vm_unmap( vmr->vmr_base + PAGE_SIZE * ix );
+	vm_page_destroy( vmp );
+	vmstat_inc( VMSTAT_KSM_BREAKS );
+
+	*ret = copy;
+	return 0;
+}
+
+static
+void
+vm_region_lock( struct vm_region *vmr ) {
+	if( vmr->vmr_share != NULL )
+		lock_acquire( vmr->vmr_share->vms_lk );
+}
+
+static
+void
+vm_region_unlock( struct vm_region *vmr ) {
+	if( vmr->vmr_share != NULL )
+		lock_release( vmr->vmr_share->vms_lk );
+}
+
+/**
+ * bring npages starting at ix into core, without mapping them.
+ * this is only a hint, so we stop quietly at the first failure.
+ */
+void
+vm_region_prefetch( struct vm_region *vmr, unsigned ix, unsigned npages ) {
+	struct vm_page		*vmp;
+	unsigned		i;
+
+	vm_region_lock( vmr );
+	for( i = ix; i < ix + npages && i < vm_pagetable_num( vmr->vmr_pages ); ++i ) {
+		vmp = vm_pagetable_get( vmr->vmr_pages, i );
+
+		//new pages come into core when instantiated.
 		if( vmp == NULL ) {
-			swap_unreserve( 1 );
+			if( vm_region_get_page( vmr, i, &vmp ) )
+				break;
 			continue;
 		}
 
-		//unmap tlb entries.
+		if( vm_page_prefetch( vmp ) )
+			break;
+	}
+	vm_region_unlock( vmr );
+}
+
+/**
+ * mark npages starting at ix as the first to go when memory runs out.
+ */
+void
+vm_region_deactivate( struct vm_region *vmr, unsigned ix, unsigned npages ) {
+	struct vm_page		*vmp;
+	unsigned		i;
+
+	vm_region_lock( vmr );
+	for( i = ix; i < ix + npages && i < vm_pagetable_num( vmr->vmr_pages ); ++i ) {
+		vmp = vm_pagetable_get( vmr->vmr_pages, i );
+		if( vmp != NULL )
+			vm_page_deactivate( vmp );
+	}
+	vm_region_unlock( vmr );
+}
+
+/**
+ * throw away npages starting at ix, releasing their frames and swap.
+ * the next touch of a private page sees it zero-filled, or freshly
+ * read from the file. shared pages are still in use by others,
+ * so they only lose their mappings.
+ */
+int
+vm_region_discard( struct vm_region *vmr, unsigned ix, unsigned npages ) {
+	struct vm_page		*vmp;
+	unsigned		nmerged;
+	unsigned		i;
+	int			res;
+
+	KASSERT( ix + npages <= vm_pagetable_num( vmr->vmr_pages ) );
+
+	//locked pages must stay.
+	nmerged = 0;
+	for( i = ix; i < ix + npages; ++i ) {
+		vmp = vm_pagetable_get( vmr->vmr_pages, i );
+		if( vmp == NULL )
+			continue;
+		if( VM_PAGE_FLAGS( vmp ) & VM_PAGE_LOCKED )
+			return EINVAL;
+		if( vmr->vmr_share == NULL && VM_PAGE_MERGED( vmp ) )
+			++nmerged;
+	}
+
+	//a merged page keeps its swap slot for the other sharers, so
+	//the slots we empty need reservations of their own. merges only
+	//happen under our lock, so no more pages can become merged, but
+	//some may stop being so; the reservations left over go back.
+	if( nmerged > 0 ) {
+		res = swap_reserve( nmerged );
+		if( res )
+			return res;
+	}
+
+	for( i = ix; i < ix + npages; ++i ) {
+		vmp = vm_pagetable_get( vmr->vmr_pages, i );
+		if( vmp == NULL )
+			continue;
+
 		vm_unmap( vmr->vmr_base + PAGE_SIZE * i );
+		if( vmr->vmr_share != NULL )
+			continue;
+
+		vm_pagetable_set( vmr->vmr_pages, i, NULL );
+		--vmr->vmr_nused;
 
-		//destroy the page.
-		vm_page_destroy( vmp );	
+		//the empty slot must still be backed.
+		if( vm_page_destroy( vmp ) ) {
+			swap_recommit( 1 );
+		}
+		else {
+			KASSERT( nmerged > 0 );
+			--nmerged;
+		}
 	}
 
-	return vm_page_array_setsize( vmr->vmr_pages, npages );
+	if( nmerged > 0 )
+		swap_unreserve( nmerged );
+
+	return 0;
+}
+
+/**
+ * set up the bookkeeping of which shared pages are pinned by whom.
+ * the share must be locked.
+ */
+static
+int
+vm_region_pinned_init( struct vm_region *vmr ) {
+	struct vm_share		*vms;
+	unsigned		npages;
+	unsigned		i;
+
+	vms = vmr->vmr_share;
+	npages = vm_pagetable_num( vmr->vmr_pages );
+
+	if( vms->vms_pins == NULL ) {
+		vms->vms_pins = kmalloc( npages * sizeof( unsigned ) );
+		if( vms->vms_pins == NULL )
+			return ENOMEM;
+		for( i = 0; i < npages; ++i )
+			vms->vms_pins[i] = 0;
+	}
+
+	if( vmr->vmr_pinned == NULL ) {
+		vmr->vmr_pinned = bitmap_create( npages );
+		if( vmr->vmr_pinned == NULL )
+			return ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * pin npages starting at ix in core.
+ * nlocked is incremented for every page that was not pinned before
+ * by this region, even if we fail halfway. a shared page is pinned
+ * once for each region that asks; see vm_region_munlock().
+ */
+int
+vm_region_mlock( struct vm_region *vmr, unsigned ix, unsigned npages, unsigned *nlocked ) {
+	struct vm_page		*vmp;
+	unsigned		i;
+	bool			changed;
+	int			res;
+
+	KASSERT( ix + npages <= vm_pagetable_num( vmr->vmr_pages ) );
+
+	vm_region_lock( vmr );
+	res = 0;
+	if( vmr->vmr_share != NULL )
+		res = vm_region_pinned_init( vmr );
+
+	for( i = ix; !res && i < ix + npages; ++i ) {
+		if( vmr->vmr_share != NULL && bitmap_isset( vmr->vmr_pinned, i ) )
+			continue;
+
+		res = vm_region_get_page( vmr, i, &vmp );
+		if( res )
+			break;
+
+		//pinned pages are private.
+		if( VM_PAGE_MERGED( vmp ) ) {
+			res = vm_region_unmerge( vmr, i, &vmp );
+			if( res )
+				break;
+		}
+
+		res = vm_page_mlock( vmp, &changed );
+		if( res )
+			break;
+
+		if( vmr->vmr_share != NULL ) {
+			bitmap_mark( vmr->vmr_pinned, i );
+			vmr->vmr_share->vms_pins[i]++;
+			changed = true;
+		}
+
+		if( changed )
+			++*nlocked;
+	}
+	vm_region_unlock( vmr );
+
+	return res;
+}
+
+/**
+ * unpin npages starting at ix.
+ * returns how many of them this region had pinned. shared pages
+ * pinned by other regions too stay pinned for them.
+ */
+unsigned
+vm_region_munlock( struct vm_region *vmr, unsigned ix, unsigned npages ) {
+	struct vm_page		*vmp;
+	unsigned		i;
+	unsigned		count;
+	bool			changed;
+
+	KASSERT( ix + npages <= vm_pagetable_num( vmr->vmr_pages ) );
+
+	count = 0;
+	vm_region_lock( vmr );
+	for( i = ix; i < ix + npages; ++i ) {
+		if( vmr->vmr_share != NULL ) {
+			if( vm_region_unpin_shared( vmr, i ) )
+				++count;
+			continue;
+		}
+
+		vmp = vm_pagetable_get( vmr->vmr_pages, i );
+		if( vmp == NULL )
+			continue;
+
+		vm_page_munlock( vmp, &changed );
+		if( changed )
+			++count;
+	}
+	vm_region_unlock( vmr );
+
+	return count;
+}
+
+/**
+ * write every dirty page of a shared file mapping back to its file.
+ * nothing is written past the current end of the file.
+ */
+int
+vm_region_writeback( struct vm_region *vmr ) {
+	struct stat		st;
+	struct vm_page		*vmp;
+	unsigned		i;
+	off_t			off;
+	off_t			len;
+	int			res;
+
+	KASSERT( vmr->vmr_share != NULL );
+	KASSERT( vmr->vmr_type == VMR_FILE );
+
+	res = VOP_STAT( vmr->vmr_vnode, &st );
+	if( res )
+		return res;
+
+	lock_acquire( vmr->vmr_share->vms_lk );
+	for( i = 0; i < vm_pagetable_num( vmr->vmr_pages ); ++i ) {
+		vmp = vm_pagetable_get( vmr->vmr_pages, i );
+		if( vmp == NULL )
+			continue;
+
+		//figure out how much of the page is inside the file.
+		off = vmr->vmr_offset + (off_t)i * PAGE_SIZE;
+		if( off >= st.st_size )
+			break;
+		len = st.st_size - off;
+		if( len > PAGE_SIZE )
+			len = PAGE_SIZE;
+
+		res = vm_page_writeback( vmp, vmr->vmr_vnode, off, len );
+		if( res )
+			break;
+	}
+	lock_release( vmr->vmr_share->vms_lk );
+
+	return res;
+}
+
+static
+int
+vm_region_shrink( struct vm_region *vmr, unsigned npages ) {
+	vm_region_drop_pages( vmr, npages, true );
+	return vm_pagetable_setsize( vmr->vmr_pages, npages );
 }
 
 static
@@ -95,10 +624,9 @@ int
 vm_region_expand( struct vm_region *vmr, unsigned npages ) {
 	unsigned		new_pages;
 	int			res;
-	unsigned		i;
 	unsigned		old_pages;
 
-	old_pages = vm_page_array_num( vmr->vmr_pages );
+	old_pages = vm_pagetable_num( vmr->vmr_pages );
 	new_pages = npages - old_pages;
 
 	//trivial case, nothing to do.
@@ -110,17 +638,12 @@ vm_region_expand( struct vm_region *vmr, unsigned npages ) {
 	if( res )
 		return res;
 
-	//attempt to rezize the vmr_pages array.
-	res = vm_page_array_setsize( vmr->vmr_pages, npages );
+	//attempt to rezize the vmr_pages table, the new pages start out empty.
+	res = vm_pagetable_setsize( vmr->vmr_pages, npages );
 	if( res ) {
 		swap_unreserve( new_pages );
 		return res;
 	}
-
-
-	//initialize each of the newly created vm_pages to NULL.
-	for( i = old_pages; i < npages; ++i )
-		vm_page_array_set( vmr->vmr_pages, i, NULL );
 	
 	return 0;
 }
@@ -130,7 +653,7 @@ vm_region_resize( struct vm_region *vmr, unsigned npages ) {
 	KASSERT( vmr != NULL );
 	KASSERT( vmr->vmr_pages != NULL );
 
-	if( npages < vm_page_array_num( vmr->vmr_pages ) )
+	if( npages < vm_pagetable_num( vmr->vmr_pages ) )
 		return vm_region_shrink( vmr, npages );
 	return vm_region_expand( vmr, npages );
 }
@@ -143,19 +666,47 @@ vm_region_clone( struct vm_region *source, struct vm_region **target ) {
 	struct vm_page			*vmp_clone;
 	int				res;
 
+	//shared regions hand out the very same pages.
+	if( source->vmr_share != NULL ) {
+		vmr = kmalloc( sizeof( struct vm_region ) );
+		if( vmr == NULL )
+			return ENOMEM;
+
+		*vmr = *source;
+		//pins are not inherited.
+		vmr->vmr_pinned = NULL;
+		if( vmr->vmr_vnode != NULL )
+			VOP_INCREF( vmr->vmr_vnode );
+
+		lock_acquire( source->vmr_share->vms_lk );
+		++source->vmr_share->vms_refcount;
+		lock_release( source->vmr_share->vms_lk );
+
+		*target = vmr;
+		return 0;
+	}
+
 	//create a new vm_region with the same amount of pages
 	//as the previous one.
-	vmr = vm_region_create( vm_page_array_num( source->vmr_pages ) );
+	vmr = vm_region_create( vm_pagetable_num( source->vmr_pages ) );
 	if( vmr == NULL )
 		return ENOMEM;
 
-	//copy the base.
+	//copy the base and what backs it.
 	vmr->vmr_base = source->vmr_base;
+	vmr->vmr_type = source->vmr_type;
+	vmr->vmr_prot = source->vmr_prot;
+	vmr->vmr_flags = source->vmr_flags;
+	vmr->vmr_advice = source->vmr_advice;
+	vmr->vmr_offset = source->vmr_offset;
+	vmr->vmr_vnode = source->vmr_vnode;
+	if( vmr->vmr_vnode != NULL )
+		VOP_INCREF( vmr->vmr_vnode );
 
 	//loop over each of the pages
-	for( i = 0; i < vm_page_array_num( source->vmr_pages ); ++i ) {
-		vmp = vm_page_array_get( source->vmr_pages, i );
-		vmp_clone = vm_page_array_get( vmr->vmr_pages, i );
+	for( i = 0; i < vm_pagetable_num( source->vmr_pages ); ++i ) {
+		vmp = vm_pagetable_get( source->vmr_pages, i );
+		vmp_clone = vm_pagetable_get( vmr->vmr_pages, i );
 
 		//if the page from the old addrspace is null, we dont
 		//have anything to do.
@@ -170,8 +721,14 @@ vm_region_clone( struct vm_region *source, struct vm_region **target ) {
 		}	
 
 		//now that we have the cloned page, add it to
-		//the addrspace array
-		vm_page_array_set( vmr->vmr_pages, i, vmp_clone );
+		//the region's table.
+		res = vm_pagetable_set( vmr->vmr_pages, i, vmp_clone );
+		if( res ) {
+			vm_page_destroy( vmp_clone );
+			vm_region_destroy( vmr );
+			return res;
+		}
+		++vmr->vmr_nused;
 	}
 	
 	//copy to the given pointer
@@ -179,27 +736,132 @@ vm_region_clone( struct vm_region *source, struct vm_region **target ) {
 	return 0;
 }
 
-struct vm_region *
-vm_region_find_responsible( struct addrspace *as, vaddr_t vaddr ) {
+/**
+ * does vmr hold vaddr? an empty region only holds its base, so that
+ * the heap can be found before it has grown.
+ */
+static
+bool
+vm_region_contains( const struct vm_region *vmr, vaddr_t vaddr ) {
+	vaddr_t			top;
+
+	top = vmr->vmr_base + vm_pagetable_num( vmr->vmr_pages ) * PAGE_SIZE;
+	return ( vaddr >= vmr->vmr_base && vaddr < top ) || ( vaddr == vmr->vmr_base && vaddr == top );
+}
+
+/**
+ * binary search for the last region of as that starts at or below
+ * vaddr. returns how many regions start at or below vaddr, so the
+ * region is at the returned index minus one, if there is one.
+ */
+static
+unsigned
+vm_region_search( struct addrspace *as, vaddr_t vaddr ) {
+	struct vm_region	*vmr;
+	unsigned		lo;
+	unsigned		hi;
+	unsigned		mid;
+
+	lo = 0;
+	hi = vm_region_array_num( as->as_regions );
+	while( lo < hi ) {
+		mid = lo + ( hi - lo ) / 2;
+		vmr = vm_region_array_get( as->as_regions, mid );
+		if( vmr->vmr_base <= vaddr )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * add vmr to the regions of as, keeping them sorted by base.
+ */
+int
+vm_region_insert( struct addrspace *as, struct vm_region *vmr ) {
 	unsigned		ix;
+	unsigned		i;
+	int			res;
+
+	ix = vm_region_search( as, vmr->vmr_base );
+
+	//make room at the end, then shift everything above ix up by one.
+	res = vm_region_array_add( as->as_regions, vmr, NULL );
+	if( res )
+		return res;
+
+	for( i = vm_region_array_num( as->as_regions ) - 1; i > ix; --i )
+		vm_region_array_set( as->as_regions, i, vm_region_array_get( as->as_regions, i - 1 ) );
+	vm_region_array_set( as->as_regions, ix, vmr );
+
+	return 0;
+}
+
+/**
+ * take the ix-th region out of as, without destroying it.
+ */
+void
+vm_region_remove( struct addrspace *as, unsigned ix ) {
+	if( as->as_last_hit == vm_region_array_get( as->as_regions, ix ) )
+		as->as_last_hit = NULL;
+
+	//this keeps the rest in order.
+	vm_region_array_remove( as->as_regions, ix );
+}
+
+/**
+ * find the highest region of as that overlaps [vaddr, vaddr + sz).
+ */
+struct vm_region *
+vm_region_find_overlap( struct addrspace *as, vaddr_t vaddr, size_t sz ) {
 	struct vm_region	*vmr;
+	unsigned		n;
 	vaddr_t			top;
-	vaddr_t			bottom;
-
-	//loop over all possible regions.
-	for( ix = 0; ix < vm_region_array_num( as->as_regions ); ++ix ) {
-		//get the vm_region
-		vmr = vm_region_array_get( as->as_regions, ix );
-		
-		//calculate top and bottom
-		bottom = vmr->vmr_base;	
-		top = vmr->vmr_base + vm_page_array_num( vmr->vmr_pages ) * PAGE_SIZE;
-		
-		//if the virtual address is between bottom and top
-		//thats the vm_region we are looking for.
-		if( (vaddr >= bottom && vaddr < top) || ((vaddr == bottom) && (vaddr == top)))
+
+	if( vaddr + sz == 0 )
+		return NULL;
+
+	//regions never overlap each other, so only the last one that
+	//starts below our end can reach into us. empty ones are skipped,
+	//as they may sit right at the base of another.
+	for( n = vm_region_search( as, vaddr + sz - 1 ); n > 0; --n ) {
+		vmr = vm_region_array_get( as->as_regions, n - 1 );
+		top = vmr->vmr_base + vm_pagetable_num( vmr->vmr_pages ) * PAGE_SIZE;
+		if( vaddr < top )
 			return vmr;
+		if( top != vmr->vmr_base )
+			break;
 	}
+
 	return NULL;
 }
 
+/**
+ * find the region holding vaddr.
+ * faults tend to come in runs within the same region, so the last
+ * hit is tried first, before searching the sorted regions.
+ * the caller must hold the addrspace lock.
+ */
+struct vm_region *
+vm_region_find_responsible( struct addrspace *as, vaddr_t vaddr ) {
+	struct vm_region	*vmr;
+	unsigned		n;
+
+	vmr = as->as_last_hit;
+	if( vmr != NULL && vm_region_contains( vmr, vaddr ) )
+		return vmr;
+
+	for( n = vm_region_search( as, vaddr ); n > 0; --n ) {
+		vmr = vm_region_array_get( as->as_regions, n - 1 );
+		if( vm_region_contains( vmr, vaddr ) ) {
+			as->as_last_hit = vmr;
+			return vmr;
+		}
+		if( vm_pagetable_num( vmr->vmr_pages ) != 0 )
+			break;
+	}
+
+	return NULL;
+}
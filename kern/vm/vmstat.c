@@ -0,0 +1,200 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <current.h>
+#include <proc.h>
+#include <vm/vmstat.h>
+#include <machine/coremap.h>
+
+struct vmstat_cpu		vmstat_cpus[VMSTAT_MAXCPUS];
+
+static const char *vmstat_names[VMSTAT_NCOUNTERS] = {
+	"faults",
+	"minor faults",
+	"major faults",
+	"zero fills",
+	"file fills",
+	"evictions",
+	"swap ins",
+	"swap outs",
+	"tlb refills",
+	"tlb evictions",
+	"shootdowns",
+	"paging usec",
+	"metadata bytes",
+	"ksm scanned",
+	"ksm merges",
+	"ksm breaks",
+	"ksm sharing",
+	"migrations",
+	"wakeups",
+	"spurious wakeups",
+};
+
+/**
+ * add n to counter ix of the current cpu.
+ * interrupts are off only long enough to keep us on this cpu.
+ */
+void
+vmstat_add( unsigned ix, uint64_t n ) {
+	int		spl;
+
+	KASSERT( ix < VMSTAT_NCOUNTERS );
+
+	spl = splhigh();
+	KASSERT( curcpu->c_number < VMSTAT_MAXCPUS );
+	vmstat_cpus[curcpu->c_number].vc_counters[ix] += n;
+	splx( spl );
+}
+
+/**
+ * account for a fault that was resolved, globally and
+ * against the current process.
+ */
+void
+vmstat_fault( bool major ) {
+	struct proc		*p;
+
+	vmstat_inc( major ? VMSTAT_FAULTS_MAJOR : VMSTAT_FAULTS_MINOR );
+
+	//only the process itself updates these, so no locking is needed.
+	p = curthread->td_proc;
+	if( p == NULL )
+		return;
+
+	if( major )
+		++p->p_majflt;
+	else
+		++p->p_minflt;
+}
+
+/**
+ * sum the per-cpu counters into vs, along with the
+ * fault counts of the current process.
+ * the sum is not atomic with respect to concurrent updates.
+ */
+void
+vmstat_snapshot( struct vmstat *vs ) {
+	unsigned		i;
+	unsigned		j;
+	struct proc		*p;
+
+	bzero( vs, sizeof( *vs ) );
+	for( i = 0; i < VMSTAT_MAXCPUS; ++i )
+		for( j = 0; j < VMSTAT_NCOUNTERS; ++j )
+			vs->vs_counters[j] += vmstat_cpus[i].vc_counters[j];
+
+	p = curthread->td_proc;
+	if( p != NULL ) {
+		vs->vs_minflt = p->p_minflt;
+		vs->vs_majflt = p->p_majflt;
+	}
+}
+
+/**
+ * clear the counters; the levels are kept, on the first cpu.
+ */
+void
+vmstat_reset( void ) {
+	struct vmstat		vs;
+	int			spl;
+
+	spl = splhigh();
+	vmstat_snapshot( &vs );
+	bzero( vmstat_cpus, sizeof( vmstat_cpus ) );
+	vmstat_cpus[0].vc_counters[VMSTAT_META_BYTES] = vs.vs_counters[VMSTAT_META_BYTES];
+	vmstat_cpus[0].vc_counters[VMSTAT_KSM_SHARING] = vs.vs_counters[VMSTAT_KSM_SHARING];
+	splx( spl );
+}
+
+void
+vmstat_print( void ) {
+	struct vmstat		vs;
+	unsigned		i;
+
+	vmstat_snapshot( &vs );
+	for( i = 0; i < VMSTAT_NCOUNTERS; ++i )
+		kprintf( "%-16s %llu\n", vmstat_names[i], vs.vs_counters[i] );
+
+	//what the vm system costs in kernel heap, per page it manages.
+	if( cm_stats.cms_upages > 0 )
+		kprintf( "%-16s %llu\n", "bytes per upage", 
+			vs.vs_counters[VMSTAT_META_BYTES] / cm_stats.cms_upages );
+}
+
+static
+int
+vmstat_dev_open( struct device *dev, int openflags ) {
+	(void)dev;
+
+	//the statistics are read-only.
+	if( (openflags & O_ACCMODE) != O_RDONLY )
+		return EACCES;
+
+	return 0;
+}
+
+static
+int
+vmstat_dev_close( struct device *dev ) {
+	(void)dev;
+	return 0;
+}
+
+/**
+ * every read returns a fresh snapshot, from its first byte.
+ */
+static
+int
+vmstat_dev_io( struct device *dev, struct uio *uio ) {
+	struct vmstat		vs;
+	(void)dev;
+
+	KASSERT( uio->uio_rw == UIO_READ );
+
+	vmstat_snapshot( &vs );
+	return uiomove( &vs, sizeof( vs ), uio );
+}
+
+static
+int
+vmstat_dev_ioctl( struct device *dev, int op, userptr_t data ) {
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+/**
+ * attach the "vmstat:" device, through which userland reads
+ * the counters. the vfs must be up already.
+ */
+void
+vmstat_bootstrap( void ) {
+	struct device		*dev;
+	int			res;
+
+	dev = kmalloc( sizeof( *dev ) );
+	if( dev == NULL )
+		panic( "vmstat_bootstrap: could not create the vmstat device.\n" );
+
+	dev->d_open = vmstat_dev_open;
+	dev->d_close = vmstat_dev_close;
+	dev->d_io = vmstat_dev_io;
+	dev->d_ioctl = vmstat_dev_ioctl;
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+	dev->d_devnumber = 0;
+	dev->d_data = NULL;
+
+	res = vfs_adddev( "vmstat", dev, 0 );
+	if( res )
+		panic( "vmstat_bootstrap: could not add the vmstat device: %s\n", strerror( res ) );
+}
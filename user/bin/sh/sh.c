@@ -48,6 +48,8 @@
 
 #ifdef HOST
 #include "hostcompat.h"
+#else
+#include <spawn.h>
 #endif
 
 #ifndef NARG_MAX
@@ -354,6 +356,7 @@ docommand(char *buf)
 		__time(&startsecs, &startnsecs);
 	}
 
+#ifdef HOST
 	pid = fork();
 	switch (pid) {
 		case -1:
@@ -375,6 +378,18 @@ docommand(char *buf)
 		default:
 			break;
 	}
+#else
+	/*
+	 * Start the command without forking: spawn builds the child
+	 * straight from the program, so our address space is never
+	 * copied just to be thrown away by execv.
+	 */
+	pid = spawn(args[0], args, NULL, 0);
+	if (pid < 0) {
+		warn("%s", args[0]);
+		return _MKWAIT_EXIT(255);
+	}
+#endif
 
 	/* parent */
 	if (bg) {
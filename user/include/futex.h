@@ -0,0 +1,18 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+/*
+ * futex_wait sleeps as long as the int at ADDR holds VAL, until
+ * somebody calls futex_wake on it; if it does not hold VAL to begin
+ * with, it fails at once with EAGAIN. It may also come back for no
+ * reason, so callers look at the int again either way. futex_wake
+ * wakes up to N sleepers and returns how many it woke.
+ *
+ * ADDR must be int-aligned. Processes meet on the same futex through
+ * MAP_SHARED memory they inherited across fork. These are building
+ * blocks; see <umutex.h> for locks built on them.
+ */
+int futex_wait(volatile int *addr, int val);
+int futex_wake(volatile int *addr, int n);
+
+#endif /* _FUTEX_H_ */
@@ -0,0 +1,16 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <sys/types.h>
+
+/*
+ * sched_setaffinity restricts process PID (0 for the caller) to the
+ * CPUs in MASK, bit N standing for CPU N; bits past the last CPU are
+ * ignored, but at least one must name a CPU that exists. The caller
+ * is restricted at once, any other process on its next system call.
+ * sched_getaffinity stores the mask of process PID in *MASK.
+ */
+int sched_setaffinity(pid_t pid, unsigned mask);
+int sched_getaffinity(pid_t pid, unsigned *mask);
+
+#endif /* _SCHED_H_ */
@@ -0,0 +1,21 @@
+#ifndef _SPAWN_H_
+#define _SPAWN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get struct spawn_action and the SPAWN_* constants from the kernel.
+ */
+#include <kern/spawn.h>
+
+/*
+ * spawn runs the program PROG with arguments ARGS in a new child
+ * process, as fork() followed by execv() in the child would, but
+ * without copying the caller's address space. The NACTIONS entries
+ * of ACTIONS are applied to the child's descriptors first. Returns
+ * the pid of the child, or -1 if the program could not be started.
+ */
+pid_t spawn(const char *prog, char *const *args,
+	    const struct spawn_action *actions, int nactions);
+
+#endif /* _SPAWN_H_ */
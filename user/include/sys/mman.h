@@ -0,0 +1,37 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_* and MAP_* constants from the kernel.
+ */
+#include <kern/mman.h>
+
+/* Returned by mmap() on failure. */
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * mmap maps LEN bytes of the file open on FD, starting at OFFSET
+ * (which must be page-aligned), into the address space. With
+ * MAP_ANON, FD and OFFSET are ignored and the mapping is zero-filled.
+ * ADDR is only a hint. Shared mappings of a file are written back to
+ * it by munmap() and fsync().
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+
+/*
+ * madvise tells the VM system how the range will be used. The
+ * pattern advice (NORMAL, RANDOM, SEQUENTIAL) applies to the whole
+ * mapping containing ADDR. With MADV_DONTNEED, private pages read
+ * back zero-filled (or from the file) afterwards.
+ *
+ * mlock keeps the pages of the range in memory until munlock or
+ * munmap. A process may lock only a limited number of pages.
+ */
+int madvise(void *addr, size_t len, int advice);
+int mlock(const void *addr, size_t len);
+int munlock(const void *addr, size_t len);
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,14 @@
+#ifndef _SYS_VMSTAT_H_
+#define _SYS_VMSTAT_H_
+
+#include <sys/types.h>
+
+/*
+ * Get struct vmstat and the VMSTAT_* counter indexes from the kernel.
+ * Reading "vmstat:" from offset 0 returns one struct vmstat.
+ */
+#include <kern/vmstat.h>
+
+#define VMSTAT_DEVICE "vmstat:"
+
+#endif /* _SYS_VMSTAT_H_ */
@@ -0,0 +1,39 @@
+#ifndef _UMUTEX_H_
+#define _UMUTEX_H_
+
+/*
+ * User-level mutexes and condition variables, on top of futexes.
+ * Taking a free mutex and releasing one nobody waits for are done
+ * in user space, with no system call; only waiting and waking up
+ * waiters go into the kernel. To be shared between processes, they
+ * must live in MAP_SHARED memory.
+ *
+ * umutex_trylock returns 0 if it got the mutex, or -1 with errno
+ * set to EBUSY. ucond_wait must be called holding the mutex, which
+ * it releases while waiting and takes again before returning; like
+ * cv_wait in the kernel, wakeups may be spurious, so wait in a loop.
+ * Signalling a condition nobody waits for makes no system call.
+ */
+struct umutex {
+	volatile int um_state;	/* 0 free, 1 held, 2 held and waited for */
+};
+
+struct ucond {
+	volatile int uc_seq;	/* bumped by every signal */
+	volatile int uc_waiters;	/* changed holding the mutex */
+};
+
+#define UMUTEX_INITIALIZER	{ 0 }
+#define UCOND_INITIALIZER	{ 0, 0 }
+
+void umutex_init(struct umutex *m);
+void umutex_lock(struct umutex *m);
+int umutex_trylock(struct umutex *m);
+void umutex_unlock(struct umutex *m);
+
+void ucond_init(struct ucond *c);
+void ucond_wait(struct ucond *c, struct umutex *m);
+void ucond_signal(struct ucond *c);
+void ucond_broadcast(struct ucond *c);
+
+#endif /* _UMUTEX_H_ */
@@ -118,6 +118,12 @@
 __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
 pid_t fork(void);
+/*
+ * vfork is fork without the address space copy: the child runs in the
+ * parent's address space, and the parent is suspended until the child
+ * calls execv or _exit. The child must do nothing else.
+ */
+pid_t vfork(void);
 int waitpid(pid_t pid, int *returncode, int flags);
 /* 
  * Open actually takes either two or three args: the optional third
@@ -153,6 +159,7 @@ int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -74,12 +74,16 @@ system(const char *cmd)
 
 	argv[nargs] = NULL;
 
-	pid = fork();
+	/*
+	 * The child only execs, so don't make the kernel copy our
+	 * address space for it.
+	 */
+	pid = vfork();
 	switch (pid) {
 	    case -1:
 		return -1;
 	    case 0:
-		/* child */
+		/* child: may do nothing but execv or _exit */
 		execv(argv[0], argv);
 		/* exec only returns if it fails */
 		_exit(255);
@@ -0,0 +1,163 @@
+/*
+ * umutex.c
+ *
+ *	Mutexes and condition variables on futexes; see <umutex.h>.
+ *	The mutex is Drepper's: 0 is free, 1 held, and 2 held with
+ *	somebody (maybe) asleep in the kernel, so that only unlocking
+ *	from 2 needs a futex_wake. A waiter always sets 2, as it cannot
+ *	tell whether there are others behind it.
+ */
+
+#include <umutex.h>
+#include <futex.h>
+#include <errno.h>
+
+//failed attempts at a held mutex before sleeping in the kernel.
+#define UMUTEX_SPINS	100
+
+//wake everybody.
+#define UCOND_ALL	0x7fffffff
+
+/**
+ * compare-and-swap: if *p holds old, store new.
+ * returns what *p held; the store happened if that is old.
+ */
+static
+int
+atomic_cas( volatile int *p, int old, int new ) {
+	int		cur;
+	int		ok;
+
+	do {
+		ok = 1;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set noreorder;"	/* we fill the delay slot */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   cur = *p */
+			"bne %0, %3, 1f;"	/*   if cur != old, done */
+			"nop;"
+			"move %1, %4;"
+			"sc %1, 0(%2);"		/*   *p = new; ok = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (cur), "+&r" (ok)
+			: "r" (p), "r" (old), "r" (new)
+			: "memory" );
+	} while( !ok );
+
+	return cur;
+}
+
+static
+int
+atomic_swap( volatile int *p, int new ) {
+	int		cur;
+
+	do {
+		cur = *p;
+	} while( atomic_cas( p, cur, new ) != cur );
+
+	return cur;
+}
+
+static
+void
+atomic_inc( volatile int *p ) {
+	int		cur;
+
+	do {
+		cur = *p;
+	} while( atomic_cas( p, cur, cur + 1 ) != cur );
+}
+
+void
+umutex_init( struct umutex *m ) {
+	m->um_state = 0;
+}
+
+int
+umutex_trylock( struct umutex *m ) {
+	if( atomic_cas( &m->um_state, 0, 1 ) == 0 )
+		return 0;
+
+	errno = EBUSY;
+	return -1;
+}
+
+/**
+ * take the mutex once it is free, as contended: we may have been
+ * woken up by an unlock meant for others too.
+ */
+static
+void
+umutex_lock_contended( struct umutex *m ) {
+	while( atomic_swap( &m->um_state, 2 ) != 0 )
+		futex_wait( &m->um_state, 2 );
+}
+
+void
+umutex_lock( struct umutex *m ) {
+	unsigned	i;
+
+	//the uncontended case: no system call.
+	if( atomic_cas( &m->um_state, 0, 1 ) == 0 )
+		return;
+
+	//held; on another cpu it may be let go shortly.
+	for( i = 0; i < UMUTEX_SPINS; ++i )
+		if( m->um_state == 0 && atomic_cas( &m->um_state, 0, 1 ) == 0 )
+			return;
+
+	umutex_lock_contended( m );
+}
+
+void
+umutex_unlock( struct umutex *m ) {
+	if( atomic_swap( &m->um_state, 0 ) == 2 )
+		futex_wake( &m->um_state, 1 );
+}
+
+void
+ucond_init( struct ucond *c ) {
+	c->uc_seq = 0;
+	c->uc_waiters = 0;
+}
+
+/**
+ * a signal between reading uc_seq and sleeping changes it, so
+ * futex_wait does not sleep through it.
+ */
+void
+ucond_wait( struct ucond *c, struct umutex *m ) {
+	int		seq;
+
+	c->uc_waiters++;
+	seq = c->uc_seq;
+	umutex_unlock( m );
+
+	futex_wait( &c->uc_seq, seq );
+
+	umutex_lock_contended( m );
+	c->uc_waiters--;
+}
+
+/**
+ * uc_seq is bumped before uc_waiters is looked at, and a waiter counts
+ * itself in before reading uc_seq, so a waiter we miss here has read
+ * the new uc_seq and will not sleep.
+ */
+void
+ucond_signal( struct ucond *c ) {
+	atomic_inc( &c->uc_seq );
+	if( c->uc_waiters > 0 )
+		futex_wake( &c->uc_seq, 1 );
+}
+
+void
+ucond_broadcast( struct ucond *c ) {
+	atomic_inc( &c->uc_seq );
+	if( c->uc_waiters > 0 )
+		futex_wake( &c->uc_seq, UCOND_ALL );
+}
@@ -0,0 +1,116 @@
+/*
+ * affinitytest.c
+ *
+ *	Exercises sched_setaffinity and sched_getaffinity: the
+ *	initial mask, rejection of a mask with no cpus, pinning
+ *	ourselves, inheritance by fork, and changing the mask of
+ *	another process. Then runs a few hogs pinned to the first
+ *	cpu; the "cpu" kernel menu command shows how often each
+ *	process moved.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+
+#define ALL		0xffffffffU
+#define NHOGS		4
+#define SPINS		2000000UL
+
+static
+unsigned
+getmask( pid_t pid ) {
+	unsigned	mask;
+
+	if( sched_getaffinity( pid, &mask ) )
+		err( 1, "sched_getaffinity %d", (int)pid );
+	return mask;
+}
+
+static
+void
+expect( pid_t pid, unsigned want, const char *what ) {
+	unsigned	mask;
+
+	mask = getmask( pid );
+	if( mask != want )
+		errx( 1, "%s: mask 0x%x, expected 0x%x", what, mask, want );
+	printf( "%s: 0x%x\n", what, mask );
+}
+
+static
+void
+reap( pid_t pid ) {
+	int		status;
+
+	if( waitpid( pid, &status, 0 ) < 0 )
+		err( 1, "waitpid" );
+	if( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+		errx( 1, "child %d failed", (int)pid );
+}
+
+int
+main( void ) {
+	volatile unsigned long	spin;
+	pid_t			pid;
+	pid_t			hogs[NHOGS];
+	int			i;
+
+	expect( 0, ALL, "initial" );
+
+	if( sched_setaffinity( 0, 0 ) == 0 || errno != EINVAL )
+		errx( 1, "empty mask was not rejected" );
+	printf( "empty mask: rejected\n" );
+
+	if( sched_setaffinity( 0, 1 ) )
+		err( 1, "sched_setaffinity" );
+	expect( 0, 1, "pinned to cpu 0" );
+	expect( getpid(), 1, "same, by pid" );
+
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+	if( pid == 0 ) {
+		//a pinned parent has pinned children.
+		_exit( getmask( 0 ) == 1 ? 0 : 1 );
+	}
+	reap( pid );
+	printf( "inherited by fork: ok\n" );
+
+	//now set somebody else's mask.
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+	if( pid == 0 ) {
+		for( spin = 0; spin < SPINS; ++spin )
+			;
+		_exit( 0 );
+	}
+	if( sched_setaffinity( pid, ALL ) )
+		err( 1, "sched_setaffinity %d", (int)pid );
+	expect( pid, ALL, "child unpinned" );
+	reap( pid );
+
+	//the hogs all share cpu 0, whatever else is idle.
+	printf( "running %d hogs pinned to cpu 0\n", NHOGS );
+	for( i = 0; i < NHOGS; ++i ) {
+		hogs[i] = fork();
+		if( hogs[i] < 0 )
+			err( 1, "fork" );
+		if( hogs[i] == 0 ) {
+			for( spin = 0; spin < SPINS; ++spin )
+				;
+			_exit( 0 );
+		}
+	}
+	for( i = 0; i < NHOGS; ++i )
+		reap( hogs[i] );
+
+	printf( "affinitytest: passed\n" );
+	return 0;
+}
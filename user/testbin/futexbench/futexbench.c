@@ -0,0 +1,276 @@
+/*
+ * futexbench.c
+ *
+ *	Compares the futex-based mutexes and condition variables of
+ *	<umutex.h> with the same done with semaphores, where, as with
+ *	the kernel's, every V is a system call. Processes share the
+ *	locks and a counter through MAP_SHARED memory; each takes the
+ *	lock, bumps the counter and lets go, first one process alone,
+ *	which never waits, and then several at once. Then two processes
+ *	take turns, with a condition variable or a pair of semaphores.
+ *
+ *	Usage: futexbench [nprocs]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+#include <futex.h>
+#include <umutex.h>
+
+#define PAGE		4096
+#define ITERS		2000
+#define ROUNDS		500
+#define DEFAULT_PROCS	4
+#define MAX_PROCS	32
+
+/**
+ * a semaphore in user space, made like the kernel's: its count is
+ * guarded by a mutex, as sem_count is by sem_lock, and the sleepers
+ * wait on sem_seq. V always wakes somebody up, waiting or not.
+ */
+struct sem {
+	struct umutex	sem_lock;
+	volatile int	sem_count;
+	volatile int	sem_seq;
+};
+
+struct shared {
+	struct umutex	mutex;
+	struct ucond	cond;
+	struct sem	sem;
+	struct sem	ping;
+	struct sem	pong;
+	volatile int	turn;
+	volatile int	counter;
+};
+
+static struct shared	*sh;
+
+static
+void
+sem_init( struct sem *s, int count ) {
+	umutex_init( &s->sem_lock );
+	s->sem_count = count;
+	s->sem_seq = 0;
+}
+
+static
+void
+P( struct sem *s ) {
+	int		seq;
+
+	umutex_lock( &s->sem_lock );
+	while( s->sem_count == 0 ) {
+		seq = s->sem_seq;
+		umutex_unlock( &s->sem_lock );
+		futex_wait( &s->sem_seq, seq );
+		umutex_lock( &s->sem_lock );
+	}
+	s->sem_count--;
+	umutex_unlock( &s->sem_lock );
+}
+
+static
+void
+V( struct sem *s ) {
+	umutex_lock( &s->sem_lock );
+	s->sem_count++;
+	s->sem_seq++;
+	umutex_unlock( &s->sem_lock );
+	futex_wake( &s->sem_seq, 1 );
+}
+
+static
+long long
+now( void ) {
+	time_t		secs;
+	unsigned long	nsecs;
+
+	__time( &secs, &nsecs );
+	return (long long)secs * 1000000000LL + nsecs;
+}
+
+static
+void
+reap( pid_t pid ) {
+	int		status;
+
+	if( waitpid( pid, &status, 0 ) < 0 )
+		err( 1, "waitpid" );
+	if( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+		errx( 1, "child %d failed", (int)pid );
+}
+
+static
+void
+count_mutex( void ) {
+	int		i;
+
+	for( i = 0; i < ITERS; ++i ) {
+		umutex_lock( &sh->mutex );
+		sh->counter++;
+		umutex_unlock( &sh->mutex );
+	}
+}
+
+static
+void
+count_sem( void ) {
+	int		i;
+
+	for( i = 0; i < ITERS; ++i ) {
+		P( &sh->sem );
+		sh->counter++;
+		V( &sh->sem );
+	}
+}
+
+/**
+ * run fn in nprocs processes at once; check no increment got lost.
+ */
+static
+void
+bench( const char *label, void (*fn)( void ), int nprocs ) {
+	pid_t		pids[MAX_PROCS];
+	long long	start, ns;
+	int		i;
+
+	sh->counter = 0;
+	start = now();
+	for( i = 0; i < nprocs; ++i ) {
+		pids[i] = fork();
+		if( pids[i] < 0 )
+			err( 1, "fork" );
+		if( pids[i] == 0 ) {
+			fn();
+			_exit( 0 );
+		}
+	}
+	for( i = 0; i < nprocs; ++i )
+		reap( pids[i] );
+	ns = now() - start;
+
+	if( sh->counter != nprocs * ITERS )
+		errx( 1, "%s: counted %d, expected %d", label, sh->counter, nprocs * ITERS );
+
+	printf( "%-10s %2d procs: %8lld usec, %6lld nsec per lock\n",
+		label, nprocs, ns / 1000, ns / ( nprocs * ITERS ) );
+}
+
+static
+void
+pingpong_cond( int me ) {
+	int		i;
+
+	umutex_lock( &sh->mutex );
+	for( i = 0; i < ROUNDS; ++i ) {
+		while( sh->turn != me )
+			ucond_wait( &sh->cond, &sh->mutex );
+		sh->turn = !me;
+		ucond_signal( &sh->cond );
+	}
+	umutex_unlock( &sh->mutex );
+}
+
+static
+void
+pingpong_sem( int me ) {
+	int		i;
+
+	for( i = 0; i < ROUNDS; ++i ) {
+		P( me ? &sh->pong : &sh->ping );
+		V( me ? &sh->ping : &sh->pong );
+	}
+}
+
+/**
+ * two processes hand the turn back and forth ROUNDS times each.
+ */
+static
+void
+pingpong( const char *label, void (*fn)( int ) ) {
+	long long	start, ns;
+	pid_t		pid;
+
+	sh->turn = 0;
+	start = now();
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+	if( pid == 0 ) {
+		fn( 1 );
+		_exit( 0 );
+	}
+	fn( 0 );
+	reap( pid );
+	ns = now() - start;
+
+	printf( "%-10s ping-pong: %8lld usec, %6lld nsec per handoff\n",
+		label, ns / 1000, ns / ( 2 * ROUNDS ) );
+}
+
+/**
+ * the futex calls themselves, before relying on them.
+ */
+static
+void
+check_futex( void ) {
+	volatile int	*p;
+
+	p = &sh->turn;
+	*p = 1;
+	if( futex_wait( p, 0 ) == 0 || errno != EAGAIN )
+		errx( 1, "futex_wait on a changed value did not fail with EAGAIN" );
+	if( futex_wait( (volatile int *)( (char *)p + 1 ), 1 ) == 0 || errno != EINVAL )
+		errx( 1, "futex_wait on a misaligned address did not fail with EINVAL" );
+	if( futex_wake( p, 1 ) != 0 )
+		errx( 1, "futex_wake woke somebody up with nobody waiting" );
+
+	umutex_lock( &sh->mutex );
+	if( umutex_trylock( &sh->mutex ) == 0 || errno != EBUSY )
+		errx( 1, "umutex_trylock took a held mutex" );
+	umutex_unlock( &sh->mutex );
+	if( umutex_trylock( &sh->mutex ) != 0 )
+		errx( 1, "umutex_trylock failed on a free mutex" );
+	umutex_unlock( &sh->mutex );
+}
+
+int
+main( int argc, char **argv ) {
+	int		nprocs;
+
+	nprocs = ( argc > 1 ) ? atoi( argv[1] ) : DEFAULT_PROCS;
+	if( nprocs < 1 || nprocs > MAX_PROCS )
+		errx( 1, "Usage: futexbench [nprocs], 1 to %d processes", MAX_PROCS );
+
+	sh = mmap( NULL, PAGE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0 );
+	if( sh == MAP_FAILED )
+		err( 1, "mmap" );
+
+	umutex_init( &sh->mutex );
+	ucond_init( &sh->cond );
+	sem_init( &sh->sem, 1 );
+	sem_init( &sh->ping, 1 );
+	sem_init( &sh->pong, 0 );
+
+	check_futex();
+
+	printf( "%d lock/unlock pairs per process\n", ITERS );
+	bench( "umutex", count_mutex, 1 );
+	bench( "semaphore", count_sem, 1 );
+	bench( "umutex", count_mutex, nprocs );
+	bench( "semaphore", count_sem, nprocs );
+
+	printf( "%d handoffs each way\n", ROUNDS );
+	pingpong( "ucond", pingpong_cond );
+	pingpong( "semaphore", pingpong_sem );
+
+	printf( "futexbench: passed\n" );
+	return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * ksmtest.c
+ *
+ *	Checks same-page merging. A parent and a child fill the same
+ *	pages with the same few patterns, and wait for the scanner to
+ *	merge them. Then both write to the merged pages, and make sure
+ *	they each got a copy of their own.
+ *
+ *	Turn the scanner on from the kernel menu (ksm on) first.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/vmstat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define PAGE		4096
+#define NPAGES		64
+#define NPATTERNS	4
+#define TIMEOUT		30		/* seconds to wait for merging */
+
+static char pages[NPAGES][PAGE];
+
+static
+unsigned long
+saved_frames( int fd ) {
+	struct vmstat	vs;
+
+	if( read( fd, &vs, sizeof( vs ) ) != sizeof( vs ) )
+		err( 1, "%s: read", VMSTAT_DEVICE );
+	return (unsigned long)vs.vs_counters[VMSTAT_KSM_SHARING];
+}
+
+static
+void
+fill( void ) {
+	int		i;
+
+	for( i = 0; i < NPAGES; ++i )
+		memset( pages[i], 'a' + i % NPATTERNS, PAGE );
+}
+
+/**
+ * write our mark on every page, then make sure nobody else's showed up.
+ */
+static
+void
+scribble( char mark ) {
+	int		i;
+	int		j;
+
+	for( i = 0; i < NPAGES; ++i )
+		pages[i][i] = mark;
+
+	for( i = 0; i < NPAGES; ++i ) {
+		for( j = 0; j < PAGE; ++j ) {
+			if( pages[i][j] != ( j == i ? mark : 'a' + i % NPATTERNS ) )
+				errx( 1, "page %d, byte %d: found %c", i, j, pages[i][j] );
+		}
+	}
+}
+
+int
+main( void ) {
+	unsigned long	before;
+	unsigned long	after;
+	time_t		s0, s1;
+	unsigned long	ns;
+	pid_t		pid;
+	int		status;
+	int		fd;
+
+	fd = open( VMSTAT_DEVICE, O_RDONLY );
+	if( fd < 0 )
+		err( 1, "%s: open", VMSTAT_DEVICE );
+
+	before = saved_frames( fd );
+	fill();
+
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+
+	//the child has copies of our pages, which are candidates too.
+	if( pid == 0 ) {
+		__time( &s0, &ns );
+		do {
+			__time( &s1, &ns );
+		} while( s1 - s0 < TIMEOUT && saved_frames( fd ) - before < NPAGES );
+
+		scribble( 'c' );
+		_exit( 0 );
+	}
+
+	__time( &s0, &ns );
+	do {
+		__time( &s1, &ns );
+		after = saved_frames( fd );
+	} while( s1 - s0 < TIMEOUT && after - before < NPAGES );
+
+	printf( "ksmtest: %lu frames saved after %lu seconds\n", 
+		after - before, (unsigned long)( s1 - s0 ) );
+	if( after == before )
+		printf( "ksmtest: nothing merged, is the scanner on?\n" );
+
+	scribble( 'p' );
+
+	if( waitpid( pid, &status, 0 ) < 0 )
+		err( 1, "waitpid" );
+	if( WIFEXITED( status ) == 0 || WEXITSTATUS( status ) != 0 )
+		errx( 1, "child failed" );
+
+	close( fd );
+	printf( "ksmtest: passed\n" );
+	return 0;
+}
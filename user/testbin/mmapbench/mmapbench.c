@@ -0,0 +1,157 @@
+/*
+ * mmapbench.c
+ *
+ *	Compares reading a file with read() against touching it
+ *	through a private mmap() of the same file, and reports
+ *	the paging work the mmap() runs caused.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/vmstat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define PAGE		4096
+#define NPAGES		256
+#define ROUNDS		4
+#define TESTFILE	"mmapbench.dat"
+
+static char buf[PAGE];
+
+static
+unsigned long
+elapsed_usec( time_t s0, unsigned long ns0, time_t s1, unsigned long ns1 ) {
+	return ( s1 - s0 ) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+static
+void
+snapshot( int fd, struct vmstat *vs ) {
+	if( read( fd, vs, sizeof( *vs ) ) != sizeof( *vs ) )
+		err( 1, "%s: read", VMSTAT_DEVICE );
+}
+
+static
+void
+make_file( void ) {
+	int		fd;
+	int		i;
+
+	fd = open( TESTFILE, O_WRONLY | O_CREAT | O_TRUNC, 0664 );
+	if( fd < 0 )
+		err( 1, "%s: open", TESTFILE );
+
+	memset( buf, 'm', sizeof( buf ) );
+	for( i = 0; i < NPAGES; ++i )
+		if( write( fd, buf, sizeof( buf ) ) != sizeof( buf ) )
+			err( 1, "%s: write", TESTFILE );
+	close( fd );
+}
+
+static
+unsigned long
+bench_read( int fd ) {
+	unsigned long	sum;
+	int		i;
+	int		j;
+
+	sum = 0;
+	lseek( fd, 0, SEEK_SET );
+	for( i = 0; i < NPAGES; ++i ) {
+		if( read( fd, buf, sizeof( buf ) ) != sizeof( buf ) )
+			err( 1, "read" );
+		for( j = 0; j < PAGE; j += 64 )
+			sum += buf[j];
+	}
+	return sum;
+}
+
+static
+unsigned long
+bench_mmap( int fd ) {
+	unsigned long	sum;
+	char		*p;
+	int		i;
+
+	p = mmap( NULL, NPAGES * PAGE, PROT_READ, MAP_PRIVATE, fd, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "mmap" );
+
+	sum = 0;
+	for( i = 0; i < NPAGES * PAGE; i += 64 )
+		sum += p[i];
+
+	if( munmap( p, NPAGES * PAGE ) )
+		err( 1, "munmap" );
+	return sum;
+}
+
+int
+main( void ) {
+	time_t		s0, s1;
+	unsigned long	ns0, ns1;
+	unsigned long	t_read, t_mmap;
+	unsigned long	sum_read, sum_mmap;
+	struct vmstat	vs0, vs1, vs_mmap;
+	int		fd;
+	int		fd_vs;
+	int		r;
+	int		i;
+
+	make_file();
+
+	fd = open( TESTFILE, O_RDONLY );
+	if( fd < 0 )
+		err( 1, "%s: open", TESTFILE );
+
+	fd_vs = open( VMSTAT_DEVICE, O_RDONLY );
+	if( fd_vs < 0 )
+		err( 1, "%s: open", VMSTAT_DEVICE );
+
+	t_read = t_mmap = 0;
+	sum_read = sum_mmap = 0;
+	memset( &vs_mmap, 0, sizeof( vs_mmap ) );
+	for( r = 0; r < ROUNDS; ++r ) {
+		__time( &s0, &ns0 );
+		sum_read = bench_read( fd );
+		__time( &s1, &ns1 );
+		t_read += elapsed_usec( s0, ns0, s1, ns1 );
+
+		snapshot( fd_vs, &vs0 );
+		__time( &s0, &ns0 );
+		sum_mmap = bench_mmap( fd );
+		__time( &s1, &ns1 );
+		snapshot( fd_vs, &vs1 );
+		t_mmap += elapsed_usec( s0, ns0, s1, ns1 );
+
+		for( i = 0; i < VMSTAT_NCOUNTERS; ++i )
+			vs_mmap.vs_counters[i] += vs1.vs_counters[i] - vs0.vs_counters[i];
+		vs_mmap.vs_minflt += vs1.vs_minflt - vs0.vs_minflt;
+		vs_mmap.vs_majflt += vs1.vs_majflt - vs0.vs_majflt;
+	}
+
+	if( sum_read != sum_mmap )
+		errx( 1, "checksums differ: read %lu, mmap %lu", sum_read, sum_mmap );
+
+	printf( "%d rounds of %d KB\n", ROUNDS, NPAGES * PAGE / 1024 );
+	printf( "read: %lu usec (%lu KB/s)\n", t_read, 
+		t_read ? ROUNDS * NPAGES * PAGE / 1024 * 1000000UL / t_read : 0 );
+	printf( "mmap: %lu usec (%lu KB/s)\n", t_mmap, 
+		t_mmap ? ROUNDS * NPAGES * PAGE / 1024 * 1000000UL / t_mmap : 0 );
+	printf( "mmap faults: %lu minor, %lu major (ours); %lu file fills, "
+		"%lu tlb refills, %lu usec paging (system)\n",
+		(unsigned long)vs_mmap.vs_minflt, (unsigned long)vs_mmap.vs_majflt,
+		(unsigned long)vs_mmap.vs_counters[VMSTAT_FILEFILLS],
+		(unsigned long)vs_mmap.vs_counters[VMSTAT_TLB_REFILLS],
+		(unsigned long)vs_mmap.vs_counters[VMSTAT_PAGING_USEC] );
+
+	close( fd_vs );
+	close( fd );
+	remove( TESTFILE );
+	return 0;
+}
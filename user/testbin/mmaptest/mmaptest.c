@@ -0,0 +1,330 @@
+/*
+ * mmaptest.c
+ *
+ *	Tests mmap() and munmap(): anonymous and file-backed mappings,
+ *	private and shared, and sharing across fork(). Also exercises
+ *	madvise(), mlock() and munlock() on them.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define PAGE		4096
+#define NPAGES		8
+#define TESTFILE	"mmaptest.dat"
+
+static
+void
+make_file( void ) {
+	char		buf[PAGE];
+	int		fd;
+	int		i;
+
+	fd = open( TESTFILE, O_WRONLY | O_CREAT | O_TRUNC, 0664 );
+	if( fd < 0 )
+		err( 1, "%s: open", TESTFILE );
+
+	//page i is filled with the byte 'a'+i.
+	for( i = 0; i < NPAGES; ++i ) {
+		memset( buf, 'a' + i, sizeof( buf ) );
+		if( write( fd, buf, sizeof( buf ) ) != sizeof( buf ) )
+			err( 1, "%s: write", TESTFILE );
+	}
+	close( fd );
+}
+
+static
+void
+test_anon( void ) {
+	char		*p;
+	int		i;
+
+	p = mmap( NULL, NPAGES * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "anon: mmap" );
+
+	//must come back zero-filled.
+	for( i = 0; i < NPAGES * PAGE; ++i )
+		if( p[i] != 0 )
+			errx( 1, "anon: byte %d is not zero", i );
+
+	for( i = 0; i < NPAGES * PAGE; ++i )
+		p[i] = (char)i;
+	for( i = 0; i < NPAGES * PAGE; ++i )
+		if( p[i] != (char)i )
+			errx( 1, "anon: byte %d lost its value", i );
+
+	if( munmap( p, NPAGES * PAGE ) )
+		err( 1, "anon: munmap" );
+
+	printf( "anonymous private mapping: passed\n" );
+}
+
+static
+void
+test_file_private( void ) {
+	char		*p;
+	char		c;
+	int		fd;
+	int		i;
+
+	fd = open( TESTFILE, O_RDONLY );
+	if( fd < 0 )
+		err( 1, "%s: open", TESTFILE );
+
+	p = mmap( NULL, NPAGES * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "private: mmap" );
+
+	for( i = 0; i < NPAGES; ++i )
+		if( p[i * PAGE] != 'a' + i || p[i * PAGE + PAGE - 1] != 'a' + i )
+			errx( 1, "private: page %d has the wrong contents", i );
+
+	//private changes must not reach the file.
+	p[0] = 'X';
+	if( munmap( p, NPAGES * PAGE ) )
+		err( 1, "private: munmap" );
+
+	lseek( fd, 0, SEEK_SET );
+	if( read( fd, &c, 1 ) != 1 )
+		err( 1, "private: read" );
+	if( c != 'a' )
+		errx( 1, "private: change leaked into the file" );
+
+	close( fd );
+	printf( "file private mapping: passed\n" );
+}
+
+static
+void
+test_file_shared( void ) {
+	char		*p;
+	char		c;
+	int		fd;
+
+	fd = open( TESTFILE, O_RDWR );
+	if( fd < 0 )
+		err( 1, "%s: open", TESTFILE );
+
+	//map from the second page on.
+	p = mmap( NULL, 2 * PAGE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, PAGE );
+	if( p == MAP_FAILED )
+		err( 1, "shared: mmap" );
+
+	if( p[0] != 'b' || p[PAGE] != 'c' )
+		errx( 1, "shared: offset mapping has the wrong contents" );
+
+	p[0] = 'Y';
+	p[PAGE + 1] = 'Z';
+
+	//fsync must push the change out ...
+	if( fsync( fd ) )
+		err( 1, "shared: fsync" );
+
+	lseek( fd, PAGE, SEEK_SET );
+	if( read( fd, &c, 1 ) != 1 || c != 'Y' )
+		errx( 1, "shared: fsync did not write the page back" );
+
+	// ... and so must munmap.
+	if( munmap( p, 2 * PAGE ) )
+		err( 1, "shared: munmap" );
+
+	lseek( fd, 2 * PAGE + 1, SEEK_SET );
+	if( read( fd, &c, 1 ) != 1 || c != 'Z' )
+		errx( 1, "shared: munmap did not write the page back" );
+
+	close( fd );
+	printf( "file shared mapping: passed\n" );
+}
+
+static
+void
+test_fork_shared( void ) {
+	volatile int	*p;
+	pid_t		pid;
+	int		status;
+
+	p = mmap( NULL, PAGE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "fork: mmap" );
+
+	p[0] = 1;
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+
+	if( pid == 0 ) {
+		//the child sees the parent's value, and the parent sees ours.
+		if( p[0] != 1 )
+			_exit( 1 );
+		p[0] = 2;
+		_exit( 0 );
+	}
+
+	if( waitpid( pid, &status, 0 ) < 0 )
+		err( 1, "waitpid" );
+	if( status != 0 )
+		errx( 1, "fork: the child did not see the shared page" );
+	if( p[0] != 2 )
+		errx( 1, "fork: the parent did not see the child's store" );
+
+	if( munmap( (void *)p, PAGE ) )
+		err( 1, "fork: munmap" );
+
+	printf( "shared anonymous mapping across fork: passed\n" );
+}
+
+static
+void
+test_errors( void ) {
+	char		*p;
+
+	if( mmap( NULL, PAGE, PROT_READ, MAP_ANON, -1, 0 ) != MAP_FAILED )
+		errx( 1, "errors: mmap without SHARED or PRIVATE succeeded" );
+	if( mmap( NULL, 0, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0 ) != MAP_FAILED )
+		errx( 1, "errors: zero-length mmap succeeded" );
+	if( mmap( NULL, PAGE, PROT_READ, MAP_PRIVATE, 99, 0 ) != MAP_FAILED )
+		errx( 1, "errors: mmap of a bad fd succeeded" );
+
+	p = mmap( NULL, 2 * PAGE, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "errors: mmap" );
+	if( munmap( p, PAGE ) == 0 )
+		errx( 1, "errors: partial munmap succeeded" );
+	if( munmap( p, 2 * PAGE ) )
+		err( 1, "errors: munmap" );
+
+	printf( "error cases: passed\n" );
+}
+
+static
+void
+test_advice( void ) {
+	char		*p;
+	int		fd;
+	int		i;
+
+	fd = open( TESTFILE, O_RDONLY );
+	if( fd < 0 )
+		err( 1, "%s: open", TESTFILE );
+
+	//streaming through a sequential mapping must still read right.
+	p = mmap( NULL, NPAGES * PAGE, PROT_READ, MAP_PRIVATE, fd, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "advice: mmap" );
+	if( madvise( p, NPAGES * PAGE, MADV_SEQUENTIAL ) )
+		err( 1, "advice: MADV_SEQUENTIAL" );
+	for( i = 0; i < NPAGES; ++i )
+		if( p[i * PAGE] != 'a' + i )
+			errx( 1, "advice: sequential page %d has the wrong contents", i );
+	if( madvise( p, NPAGES * PAGE, MADV_WILLNEED ) )
+		err( 1, "advice: MADV_WILLNEED" );
+	if( munmap( p, NPAGES * PAGE ) )
+		err( 1, "advice: munmap" );
+	close( fd );
+
+	//discarded private anonymous pages come back zero-filled.
+	p = mmap( NULL, 2 * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "advice: mmap" );
+	p[0] = 1;
+	p[PAGE] = 1;
+	if( madvise( p, PAGE, MADV_DONTNEED ) )
+		err( 1, "advice: MADV_DONTNEED" );
+	if( p[0] != 0 || p[PAGE] != 1 )
+		errx( 1, "advice: MADV_DONTNEED discarded the wrong pages" );
+
+	//locked pages stay put, and cannot be discarded.
+	if( mlock( p, 2 * PAGE ) )
+		err( 1, "advice: mlock" );
+	if( madvise( p, PAGE, MADV_DONTNEED ) == 0 )
+		errx( 1, "advice: MADV_DONTNEED on a locked page succeeded" );
+	if( munlock( p, 2 * PAGE ) )
+		err( 1, "advice: munlock" );
+	if( madvise( p, 4 * PAGE, MADV_NORMAL ) == 0 )
+		errx( 1, "advice: madvise past the mapping succeeded" );
+	if( munmap( p, 2 * PAGE ) )
+		err( 1, "advice: munmap" );
+
+	printf( "madvise and mlock: passed\n" );
+}
+
+/**
+ * pins belong to the address space that made them: a child sharing
+ * pinned pages neither inherits the pins nor can undo the parent's.
+ */
+static
+void
+test_fork_mlock( void ) {
+	char		*p;
+	pid_t		pid;
+	int		status;
+
+	p = mmap( NULL, 2 * PAGE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "fork mlock: mmap" );
+	if( mlock( p, 2 * PAGE ) )
+		err( 1, "fork mlock: mlock" );
+
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+
+	if( pid == 0 ) {
+		//we never pinned them, so this unpins nothing.
+		if( munlock( p, 2 * PAGE ) )
+			_exit( 1 );
+		if( madvise( p, PAGE, MADV_DONTNEED ) == 0 )
+			_exit( 2 );
+
+		//the count of our pins must not have gone wrong.
+		if( mlock( p, PAGE ) || munlock( p, PAGE ) )
+			_exit( 3 );
+		if( mlock( p, 2 * PAGE ) )
+			_exit( 4 );
+		if( munmap( p, 2 * PAGE ) )
+			_exit( 5 );
+		_exit( 0 );
+	}
+
+	if( waitpid( pid, &status, 0 ) < 0 )
+		err( 1, "waitpid" );
+	if( status != 0 )
+		errx( 1, "fork mlock: the child failed with %d", WEXITSTATUS( status ) );
+
+	//still pinned by us, whatever the child did.
+	if( madvise( p, PAGE, MADV_DONTNEED ) == 0 )
+		errx( 1, "fork mlock: the child unpinned the parent's pages" );
+	if( munlock( p, 2 * PAGE ) )
+		err( 1, "fork mlock: munlock" );
+	if( madvise( p, PAGE, MADV_DONTNEED ) )
+		err( 1, "fork mlock: MADV_DONTNEED after munlock" );
+	if( munmap( p, 2 * PAGE ) )
+		err( 1, "fork mlock: munmap" );
+
+	printf( "mlock across fork: passed\n" );
+}
+
+int
+main( void ) {
+	make_file();
+
+	test_anon();
+	test_file_private();
+	test_file_shared();
+	test_fork_shared();
+	test_errors();
+	test_advice();
+	test_fork_mlock();
+
+	remove( TESTFILE );
+	printf( "mmaptest: all passed\n" );
+	return 0;
+}
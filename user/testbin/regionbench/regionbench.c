@@ -0,0 +1,99 @@
+/*
+ * regionbench.c
+ *
+ *	Spreads the same number of pages over more and more
+ *	mmap() regions, and touches them round-robin across the
+ *	regions, so that every access misses the tlb and faults
+ *	in a different region than the last one. The time per
+ *	fault should stay flat as the region count grows.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/vmstat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define PAGE		4096
+#define NPAGES		256		/* well past what the tlb holds */
+#define MAXREGIONS	128
+#define ROUNDS		8
+
+static char *regions[MAXREGIONS];
+
+static
+unsigned long
+elapsed_usec( time_t s0, unsigned long ns0, time_t s1, unsigned long ns1 ) {
+	return ( s1 - s0 ) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+static
+void
+snapshot( int fd, struct vmstat *vs ) {
+	if( read( fd, vs, sizeof( *vs ) ) != sizeof( *vs ) )
+		err( 1, "%s: read", VMSTAT_DEVICE );
+}
+
+static
+void
+bench( int fd_vs, int nregions ) {
+	struct vmstat	vs0, vs1;
+	time_t		s0, s1;
+	unsigned long	ns0, ns1;
+	unsigned long	usec;
+	unsigned long	faults;
+	unsigned long	sum;
+	int		per;
+	int		r, p, i;
+
+	per = NPAGES / nregions;
+	for( i = 0; i < nregions; ++i ) {
+		regions[i] = mmap( NULL, per * PAGE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANON, -1, 0 );
+		if( regions[i] == MAP_FAILED )
+			err( 1, "mmap" );
+
+		//instantiate the pages, so that we only time lookups.
+		for( p = 0; p < per; ++p )
+			regions[i][p * PAGE] = (char)p;
+	}
+
+	sum = 0;
+	snapshot( fd_vs, &vs0 );
+	__time( &s0, &ns0 );
+	for( r = 0; r < ROUNDS; ++r )
+		for( p = 0; p < per; ++p )
+			for( i = 0; i < nregions; ++i )
+				sum += regions[i][p * PAGE];
+	__time( &s1, &ns1 );
+	snapshot( fd_vs, &vs1 );
+
+	usec = elapsed_usec( s0, ns0, s1, ns1 );
+	faults = vs1.vs_counters[VMSTAT_FAULTS] - vs0.vs_counters[VMSTAT_FAULTS];
+	printf( "%3d regions: %lu faults in %lu usec, %lu nsec per fault (sum %lu)\n",
+		nregions, faults, usec, faults ? usec * 1000UL / faults : 0, sum );
+
+	for( i = 0; i < nregions; ++i )
+		if( munmap( regions[i], per * PAGE ) )
+			err( 1, "munmap" );
+}
+
+int
+main( void ) {
+	int		fd_vs;
+	int		n;
+
+	fd_vs = open( VMSTAT_DEVICE, O_RDONLY );
+	if( fd_vs < 0 )
+		err( 1, "%s: open", VMSTAT_DEVICE );
+
+	printf( "%d pages, %d rounds\n", NPAGES, ROUNDS );
+	for( n = 1; n <= MAXREGIONS; n *= 2 )
+		bench( fd_vs, n );
+
+	close( fd_vs );
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * schedbench.c
+ *
+ *	Measures how quickly a process that keeps blocking gets the
+ *	cpu back, first on an idle system and then with CPU-bound hogs
+ *	running. Each round forks a child that exits at once and waits
+ *	for it, which is what a shell does for every command; the time
+ *	for a round is its response time. A scheduler that favours
+ *	threads that sleep should keep it close to the idle figure.
+ *
+ *	Usage: schedbench [nhogs]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define PAGE		4096
+#define ROUNDS		32
+#define DEFAULT_HOGS	4
+
+static volatile int *stop;
+
+static
+unsigned long
+elapsed_usec( time_t s0, unsigned long ns0, time_t s1, unsigned long ns1 ) {
+	return ( s1 - s0 ) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+static
+void
+reap( pid_t pid ) {
+	int		status;
+
+	if( waitpid( pid, &status, 0 ) < 0 )
+		err( 1, "waitpid" );
+}
+
+static
+pid_t
+start_hog( void ) {
+	volatile unsigned long	spin;
+	pid_t			pid;
+
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+	if( pid == 0 ) {
+		spin = 0;
+		while( !*stop )
+			++spin;
+		_exit( 0 );
+	}
+	return pid;
+}
+
+static
+void
+measure( const char *label ) {
+	time_t		s0, s1;
+	unsigned long	ns0, ns1;
+	unsigned long	usec, total, worst;
+	pid_t		pid;
+	int		r;
+
+	total = worst = 0;
+	for( r = 0; r < ROUNDS; ++r ) {
+		__time( &s0, &ns0 );
+		pid = fork();
+		if( pid < 0 )
+			err( 1, "fork" );
+		if( pid == 0 )
+			_exit( 0 );
+		reap( pid );
+		__time( &s1, &ns1 );
+
+		usec = elapsed_usec( s0, ns0, s1, ns1 );
+		total += usec;
+		if( usec > worst )
+			worst = usec;
+	}
+
+	printf( "%-16s avg %7lu usec, worst %7lu usec per round\n",
+		label, total / ROUNDS, worst );
+}
+
+int
+main( int argc, char **argv ) {
+	pid_t		hogs[64];
+	char		label[32];
+	int		nhogs;
+	int		i;
+
+	nhogs = ( argc > 1 ) ? atoi( argv[1] ) : DEFAULT_HOGS;
+	if( nhogs < 1 || nhogs > 64 )
+		errx( 1, "Usage: schedbench [nhogs], 1 to 64 hogs" );
+
+	//the hogs spin until this page says otherwise.
+	stop = mmap( NULL, PAGE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0 );
+	if( stop == MAP_FAILED )
+		err( 1, "mmap" );
+	*stop = 0;
+
+	printf( "%d rounds of fork, exit and wait\n", ROUNDS );
+	measure( "idle:" );
+
+	for( i = 0; i < nhogs; ++i )
+		hogs[i] = start_hog();
+
+	snprintf( label, sizeof( label ), "%d hogs:", nhogs );
+	measure( label );
+
+	*stop = 1;
+	for( i = 0; i < nhogs; ++i )
+		reap( hogs[i] );
+
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * slabbench.c
+ *
+ *	Times the two paths the kernel object caches were made for:
+ *	faulting in fresh anonymous pages, each of which gets a new
+ *	struct vm_page, and a fork/exit loop, which makes and tears
+ *	down a proc, a thread and their open files every time.
+ *
+ *	Run it once with the caches and once without, from the menu:
+ *
+ *		kh objcache off; p /testbin/slabbench; kh objcache on; p /testbin/slabbench
+ *
+ *	"kh" afterwards shows how many constructor calls stood behind
+ *	the allocations.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/vmstat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGE		4096
+#define NPAGES		128
+#define ROUNDS		16
+#define FORKS		64
+
+static
+unsigned long
+elapsed_usec( time_t s0, unsigned long ns0, time_t s1, unsigned long ns1 ) {
+	return ( s1 - s0 ) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+static
+void
+snapshot( int fd, struct vmstat *vs ) {
+	if( read( fd, vs, sizeof( *vs ) ) != sizeof( *vs ) )
+		err( 1, "%s: read", VMSTAT_DEVICE );
+}
+
+/*
+ * map NPAGES fresh pages, write to each of them once, and unmap them.
+ */
+static
+void
+fault_round( void ) {
+	char		*p;
+	int		i;
+
+	p = mmap( NULL, NPAGES * PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0 );
+	if( p == MAP_FAILED )
+		err( 1, "mmap" );
+
+	for( i = 0; i < NPAGES; ++i )
+		p[i * PAGE] = (char)i;
+
+	if( munmap( p, NPAGES * PAGE ) )
+		err( 1, "munmap" );
+}
+
+static
+void
+fork_exit( void ) {
+	pid_t		pid;
+	int		status;
+
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+	if( pid == 0 )
+		_exit( 0 );
+
+	if( waitpid( pid, &status, 0 ) < 0 )
+		err( 1, "waitpid" );
+	if( status != 0 )
+		errx( 1, "child exited with %d", status );
+}
+
+int
+main( void ) {
+	time_t		s0, s1;
+	unsigned long	ns0, ns1;
+	unsigned long	t_fault, t_fork;
+	unsigned long	faults;
+	struct vmstat	vs0, vs1;
+	int		fd_vs;
+	int		i;
+
+	fd_vs = open( VMSTAT_DEVICE, O_RDONLY );
+	if( fd_vs < 0 )
+		err( 1, "%s: open", VMSTAT_DEVICE );
+
+	//once to warm up, so that neither run pays for growing the caches.
+	fault_round();
+	fork_exit();
+
+	snapshot( fd_vs, &vs0 );
+	__time( &s0, &ns0 );
+	for( i = 0; i < ROUNDS; ++i )
+		fault_round();
+	__time( &s1, &ns1 );
+	snapshot( fd_vs, &vs1 );
+	t_fault = elapsed_usec( s0, ns0, s1, ns1 );
+	faults = (unsigned long)( vs1.vs_minflt - vs0.vs_minflt + vs1.vs_majflt - vs0.vs_majflt );
+
+	__time( &s0, &ns0 );
+	for( i = 0; i < FORKS; ++i )
+		fork_exit();
+	__time( &s1, &ns1 );
+	t_fork = elapsed_usec( s0, ns0, s1, ns1 );
+
+	printf( "page faults: %lu in %lu usec, %lu nsec per fault\n",
+		faults, t_fault, faults ? t_fault * 1000 / faults : 0 );
+	printf( "fork/exit: %d in %lu usec, %lu usec each\n",
+		FORKS, t_fork, t_fork / FORKS );
+
+	close( fd_vs );
+	return 0;
+}
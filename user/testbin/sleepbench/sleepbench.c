@@ -0,0 +1,113 @@
+/*
+ * sleepbench.c
+ *
+ *	Measures how late nanosleep wakes up, for sleeps of various
+ *	lengths, first alone and then with several processes sleeping
+ *	at once. A sleep should never end early, and should be late by
+ *	at most about a hardclock. Run "cpu reset" in the kernel menu
+ *	beforehand and "cpu" afterwards to see how few clock interrupts
+ *	the idle cpus took meanwhile.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+
+#define NSLEEPS		10
+#define NSLEEPERS	4
+
+//sleep lengths, in usec.
+static const long lengths[] = { 500, 2000, 10000, 25000, 100000 };
+
+static
+long long
+now( void ) {
+	time_t		secs;
+	unsigned long	nsecs;
+
+	__time( &secs, &nsecs );
+	return (long long)secs * 1000000000LL + nsecs;
+}
+
+/**
+ * sleep NSLEEPS times for usecs each; report the mean and worst
+ * lateness, in usec.
+ */
+static
+void
+bench( long usecs, const char *who ) {
+	struct timespec	ts;
+	long long	start, late, total, worst;
+	int		i;
+
+	ts.tv_sec = usecs / 1000000;
+	ts.tv_nsec = ( usecs % 1000000 ) * 1000;
+
+	total = worst = 0;
+	for( i = 0; i < NSLEEPS; ++i ) {
+		start = now();
+		if( nanosleep( &ts, NULL ) )
+			err( 1, "nanosleep" );
+		late = now() - start - usecs * 1000LL;
+		if( late < 0 )
+			errx( 1, "%s: %ld usec sleep ended %lld nsec early", who, usecs, -late );
+		total += late;
+		if( late > worst )
+			worst = late;
+	}
+
+	printf( "%s: %6ld usec: %6lld usec late on average, %6lld at worst\n",
+		who, usecs, total / NSLEEPS / 1000, worst / 1000 );
+}
+
+static
+void
+benchall( const char *who ) {
+	unsigned	i;
+
+	for( i = 0; i < sizeof( lengths ) / sizeof( lengths[0] ); ++i )
+		bench( lengths[i], who );
+}
+
+int
+main( void ) {
+	struct timespec	ts;
+	char		who[16];
+	pid_t		pids[NSLEEPERS];
+	int		i, status, failed;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000000;
+	if( nanosleep( &ts, NULL ) == 0 || errno != EINVAL )
+		errx( 1, "bad tv_nsec was not rejected" );
+
+	benchall( "alone" );
+
+	for( i = 0; i < NSLEEPERS; ++i ) {
+		pids[i] = fork();
+		if( pids[i] < 0 )
+			err( 1, "fork" );
+		if( pids[i] == 0 ) {
+			snprintf( who, sizeof( who ), "sleeper %d", i );
+			benchall( who );
+			_exit( 0 );
+		}
+	}
+
+	failed = 0;
+	for( i = 0; i < NSLEEPERS; ++i ) {
+		if( waitpid( pids[i], &status, 0 ) < 0 )
+			err( 1, "waitpid" );
+		if( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+			failed = 1;
+	}
+	if( failed )
+		errx( 1, "a sleeper failed" );
+
+	printf( "sleepbench: passed\n" );
+	return 0;
+}
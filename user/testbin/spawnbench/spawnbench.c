@@ -0,0 +1,115 @@
+/*
+ * spawnbench.c
+ *
+ *	Measures how long it takes to launch a trivial program with
+ *	fork()+execv(), vfork()+execv() and spawn(). The parent dirties
+ *	some heap first, so that fork() has something to copy.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define PROG		"/bin/true"
+#define LAUNCHES	16
+#define HEAPSIZE	(512 * 1024)
+
+static char *const prog_args[] = { (char *)PROG, NULL };
+
+static
+unsigned long
+elapsed_usec( time_t s0, unsigned long ns0, time_t s1, unsigned long ns1 ) {
+	return ( s1 - s0 ) * 1000000UL + ns1 / 1000 - ns0 / 1000;
+}
+
+static
+void
+reap( pid_t pid ) {
+	int		status;
+
+	if( waitpid( pid, &status, 0 ) < 0 )
+		err( 1, "waitpid" );
+	if( status != 0 )
+		errx( 1, "%s exited with %d", PROG, status );
+}
+
+static
+pid_t
+launch_fork( void ) {
+	pid_t		pid;
+
+	pid = fork();
+	if( pid < 0 )
+		err( 1, "fork" );
+	if( pid == 0 ) {
+		execv( PROG, prog_args );
+		_exit( 255 );
+	}
+	return pid;
+}
+
+static
+pid_t
+launch_vfork( void ) {
+	pid_t		pid;
+
+	pid = vfork();
+	if( pid < 0 )
+		err( 1, "vfork" );
+	if( pid == 0 ) {
+		execv( PROG, prog_args );
+		_exit( 255 );
+	}
+	return pid;
+}
+
+static
+pid_t
+launch_spawn( void ) {
+	pid_t		pid;
+
+	pid = spawn( PROG, prog_args, NULL, 0 );
+	if( pid < 0 )
+		err( 1, "spawn" );
+	return pid;
+}
+
+static
+void
+bench( const char *name, pid_t (*launch)( void ) ) {
+	time_t		s0, s1;
+	unsigned long	ns0, ns1;
+	unsigned long	usec;
+	int		i;
+
+	__time( &s0, &ns0 );
+	for( i = 0; i < LAUNCHES; ++i )
+		reap( launch() );
+	__time( &s1, &ns1 );
+
+	usec = elapsed_usec( s0, ns0, s1, ns1 );
+	printf( "%-12s %lu usec per launch\n", name, usec / LAUNCHES );
+}
+
+int
+main( void ) {
+	char		*heap;
+
+	heap = malloc( HEAPSIZE );
+	if( heap == NULL )
+		errx( 1, "malloc failed" );
+	memset( heap, 'h', HEAPSIZE );
+
+	printf( "%d launches of %s, %d KB of dirty heap\n", LAUNCHES, PROG, HEAPSIZE / 1024 );
+	bench( "fork+execv", launch_fork );
+	bench( "vfork+execv", launch_vfork );
+	bench( "spawn", launch_spawn );
+
+	free( heap );
+	return 0;
+}